@@ -0,0 +1,451 @@
+#ifndef _HIDDESCRIPTORTABLE_H_
+#define _HIDDESCRIPTORTABLE_H_
+
+/*
+ * The report descriptor parser of usb_hid_parser.c again, as C++11 constexpr
+ * functions, so that a descriptor known at compile time is laid out by the
+ * compiler into tables in flash, the same tables usb_hid_parse_report_descriptor()
+ * fills in at run time:
+ *
+ *   constexpr uint8 descriptor[] = { HID_JOYSTICK_REPORT_DESCRIPTOR() };
+ *   typedef HIDDescriptorTable<descriptor, sizeof(descriptor)> Table;
+ *   ... Table::reports[0].size, Table::fields[i].bitOffset ...
+ *
+ * HIDDescriptorParser::status() checks a descriptor; a table of one that
+ * doesn't parse won't compile.
+ *
+ * A C++11 constexpr function is one return statement, so the parser is a
+ * chain of recursive functions, each taking the state before an item and
+ * giving the state after it. The state holds the globals, the push stack and
+ * where the local items of the next main item start, but no usage list: the
+ * usages of a main item are found by going over its local items again, and
+ * the offset of a field by adding up the main items before it. That costs
+ * compile time, not run time. The recursion goes about three deep per item, so
+ * descriptors of more than about 150 items need a larger -fconstexpr-depth.
+ */
+
+#include "usb_hid_parser.h"
+#include "usb_hid.h"
+
+class HIDDescriptorParser {
+public:
+    struct Globals {
+        uint16 usagePage;
+        uint8 reportID;
+        uint8 logicalMaxSize;
+        int32 logicalMin;
+        int32 logicalMax;
+        uint32 reportSize;
+        uint32 reportCount;
+    };
+
+    // before the item at pos
+    struct State {
+        uint32 pos;
+        uint8 status;
+        Globals g;
+        Globals stack0, stack1, stack2, stack3; // HID_PARSE_MAX_PUSH, the last pushed first
+        uint8 pushDepth;
+        uint8 collectionDepth;
+        uint32 localStart; // the first item after the last main item or collection
+        uint8 numUsages;
+        uint8 haveUsageMin;
+        uint32 usageMin; // usage page in the top 16 bits
+    };
+
+    static constexpr State start() {
+        return state(0, HID_PARSE_OK, globals(0, 0, 0, 0, 0, 0, 0), globals(0, 0, 0, 0, 0, 0, 0),
+            globals(0, 0, 0, 0, 0, 0, 0), globals(0, 0, 0, 0, 0, 0, 0), globals(0, 0, 0, 0, 0, 0, 0), 0, 0, 0, 0, 0, 0);
+    }
+
+    static constexpr State walk(const uint8* d, uint32 n, State s, uint32 end) {
+        return s.status != HID_PARSE_OK || s.pos >= end ? s : walk(d, n, step(d, n, s), end);
+    }
+
+    // what usb_hid_parse_report_descriptor() returns, given room enough
+    static constexpr uint8 status(const uint8* d, uint32 n) {
+        return statusFrom(d, n, start());
+    }
+
+    static constexpr uint8 numReports(const uint8* d, uint32 n) {
+        return countReports(d, n, start());
+    }
+
+    static constexpr uint16 numFields(const uint8* d, uint32 n) {
+        return countFields(d, n, start(), start());
+    }
+
+    static constexpr HIDReportInfo_t report(const uint8* d, uint32 n, uint32 k) {
+        return reportAt(d, n, start(), k);
+    }
+
+    static constexpr HIDField_t field(const uint8* d, uint32 n, uint32 k) {
+        return mainField(d, n, findField(d, n, start(), start(), k));
+    }
+
+private:
+    enum {
+        ITEM_MASK = 0xFC,
+        ITEM_INPUT = 0x80,
+        ITEM_OUTPUT = 0x90,
+        ITEM_FEATURE = 0xB0,
+        ITEM_COLLECTION = 0xA0,
+        ITEM_END_COLLECTION = 0xC0,
+        ITEM_USAGE_PAGE = 0x04,
+        ITEM_LOGICAL_MINIMUM = 0x14,
+        ITEM_LOGICAL_MAXIMUM = 0x24,
+        ITEM_REPORT_SIZE = 0x74,
+        ITEM_REPORT_ID = 0x84,
+        ITEM_REPORT_COUNT = 0x94,
+        ITEM_PUSH = 0xA4,
+        ITEM_POP = 0xB4,
+        ITEM_USAGE = 0x08,
+        ITEM_USAGE_MINIMUM = 0x18,
+        ITEM_USAGE_MAXIMUM = 0x28,
+        LONG_ITEM = 0xFE,
+        MAX_COLLECTION_DEPTH = 16
+    };
+
+    // the elements of one main item from start to end share a run of consecutive usages
+    struct Run {
+        uint32 end;
+        uint32 max;
+    };
+
+    // a main item, the state where its local items start, and which of its fields
+    struct MainItem {
+        State s;
+        State locals;
+        uint32 k;
+    };
+
+    static constexpr Globals globals(uint16 usagePage, uint8 reportID, uint8 logicalMaxSize, int32 logicalMin,
+            int32 logicalMax, uint32 reportSize, uint32 reportCount) {
+        return Globals{ usagePage, reportID, logicalMaxSize, logicalMin, logicalMax, reportSize, reportCount };
+    }
+
+    static constexpr State state(uint32 pos, uint8 status, Globals g, Globals stack0, Globals stack1, Globals stack2,
+            Globals stack3, uint8 pushDepth, uint8 collectionDepth, uint32 localStart, uint8 numUsages,
+            uint8 haveUsageMin, uint32 usageMin) {
+        return State{ pos, status, g, stack0, stack1, stack2, stack3, pushDepth, collectionDepth, localStart,
+            numUsages, haveUsageMin, usageMin };
+    }
+
+    static constexpr HIDReportInfo_t reportInfo(uint8 reportID, uint8 type, uint16 size, uint16 bits) {
+        return HIDReportInfo_t{ reportID, type, size, bits };
+    }
+
+    static constexpr HIDField_t fieldInfo(uint8 report, uint8 flags, uint16 bitSize, uint16 count, uint16 bitOffset,
+            uint16 usagePage, uint16 usageMin, uint16 usageMax, int32 logicalMin, int32 logicalMax) {
+        return HIDField_t{ report, flags, bitSize, count, bitOffset, usagePage, usageMin, usageMax, logicalMin, logicalMax };
+    }
+
+    // usb_hid_item_length()
+    static constexpr uint32 rawLength(const uint8* d, uint32 n, uint32 p) {
+        return d[p] == LONG_ITEM ? (n - p < 2 ? 0 : 3 + d[p+1]) : (d[p] & 3) == 3 ? 5 : 1 + (d[p] & 3);
+    }
+
+    static constexpr uint32 itemLength(const uint8* d, uint32 n, uint32 p) {
+        return p >= n ? 0 : rawLength(d, n, p) <= n - p ? rawLength(d, n, p) : 0;
+    }
+
+    static constexpr uint32 dataSize(const uint8* d, uint32 p) {
+        return (d[p] & 3) == 3 ? 4 : d[p] & 3;
+    }
+
+    static constexpr uint32 littleEndian(const uint8* d, uint32 p, uint32 size) {
+        return size == 0 ? 0 : d[p] | littleEndian(d, p+1, size-1) << 8;
+    }
+
+    static constexpr uint32 value(const uint8* d, uint32 p) {
+        return littleEndian(d, p+1, dataSize(d, p));
+    }
+
+    static constexpr int32 signedValue(const uint8* d, uint32 p) {
+        return dataSize(d, p) > 0 && dataSize(d, p) < 4 && (value(d, p) >> (8*dataSize(d, p)-1) & 1) ?
+            (int32)value(d, p) - (int32)(1l << (8*dataSize(d, p))) : (int32)value(d, p);
+    }
+
+    static constexpr uint32 tag(const uint8* d, uint32 p) {
+        return d[p] == LONG_ITEM ? LONG_ITEM : d[p] & ITEM_MASK;
+    }
+
+    static constexpr bool isMain(const uint8* d, uint32 p) {
+        return tag(d, p) == ITEM_INPUT || tag(d, p) == ITEM_OUTPUT || tag(d, p) == ITEM_FEATURE;
+    }
+
+    static constexpr uint8 mainType(const uint8* d, uint32 p) {
+        return tag(d, p) == ITEM_INPUT ? HID_REPORT_TYPE_INPUT :
+            tag(d, p) == ITEM_OUTPUT ? HID_REPORT_TYPE_OUTPUT : HID_REPORT_TYPE_FEATURE;
+    }
+
+    static constexpr uint32 usage(const uint8* d, uint32 p, uint16 usagePage) {
+        return dataSize(d, p) < 4 ? value(d, p) | (uint32)usagePage << 16 : value(d, p);
+    }
+
+    static constexpr Globals setGlobal(Globals g, const uint8* d, uint32 p) {
+        return tag(d, p) == ITEM_USAGE_PAGE ? globals(value(d, p), g.reportID, g.logicalMaxSize, g.logicalMin,
+                g.logicalMax, g.reportSize, g.reportCount) :
+            tag(d, p) == ITEM_LOGICAL_MINIMUM ? globals(g.usagePage, g.reportID, g.logicalMaxSize, signedValue(d, p),
+                g.logicalMax, g.reportSize, g.reportCount) :
+            tag(d, p) == ITEM_LOGICAL_MAXIMUM ? globals(g.usagePage, g.reportID, dataSize(d, p), g.logicalMin,
+                signedValue(d, p), g.reportSize, g.reportCount) :
+            tag(d, p) == ITEM_REPORT_SIZE ? globals(g.usagePage, g.reportID, g.logicalMaxSize, g.logicalMin,
+                g.logicalMax, value(d, p), g.reportCount) :
+            tag(d, p) == ITEM_REPORT_ID ? globals(g.usagePage, value(d, p), g.logicalMaxSize, g.logicalMin,
+                g.logicalMax, g.reportSize, g.reportCount) :
+            tag(d, p) == ITEM_REPORT_COUNT ? globals(g.usagePage, g.reportID, g.logicalMaxSize, g.logicalMin,
+                g.logicalMax, g.reportSize, value(d, p)) :
+            g;
+    }
+
+    static constexpr State fail(State s, uint8 status) {
+        return state(s.pos, status, s.g, s.stack0, s.stack1, s.stack2, s.stack3, s.pushDepth, s.collectionDepth,
+            s.localStart, s.numUsages, s.haveUsageMin, s.usageMin);
+    }
+
+    static constexpr State withGlobals(State s, uint32 next, Globals g) {
+        return state(next, s.status, g, s.stack0, s.stack1, s.stack2, s.stack3, s.pushDepth, s.collectionDepth,
+            s.localStart, s.numUsages, s.haveUsageMin, s.usageMin);
+    }
+
+    static constexpr State withLocals(State s, uint32 next, uint8 numUsages, uint8 haveUsageMin, uint32 usageMin) {
+        return state(next, s.status, s.g, s.stack0, s.stack1, s.stack2, s.stack3, s.pushDepth, s.collectionDepth,
+            s.localStart, numUsages, haveUsageMin, usageMin);
+    }
+
+    static constexpr State clearLocals(State s, uint32 next, uint8 collectionDepth) {
+        return state(next, s.status, s.g, s.stack0, s.stack1, s.stack2, s.stack3, s.pushDepth, collectionDepth,
+            next, 0, 0, 0);
+    }
+
+    static constexpr State pushed(State s, uint32 next) {
+        return state(next, s.status, s.g, s.g, s.stack0, s.stack1, s.stack2, s.pushDepth+1, s.collectionDepth,
+            s.localStart, s.numUsages, s.haveUsageMin, s.usageMin);
+    }
+
+    static constexpr State popped(State s, uint32 next) {
+        return state(next, s.status, s.stack0, s.stack1, s.stack2, s.stack3, s.stack3, s.pushDepth-1,
+            s.collectionDepth, s.localStart, s.numUsages, s.haveUsageMin, s.usageMin);
+    }
+
+    static constexpr State stepUsage(State s, const uint8* d, uint32 next) {
+        return tag(d, s.pos) == ITEM_USAGE_MINIMUM ? withLocals(s, next, s.numUsages, 1, usage(d, s.pos, s.g.usagePage)) :
+            s.numUsages >= HID_PARSE_MAX_USAGE_RANGES ? fail(s, HID_PARSE_BAD_ITEM) :
+            tag(d, s.pos) == ITEM_USAGE ? withLocals(s, next, s.numUsages+1, s.haveUsageMin, s.usageMin) :
+            ! s.haveUsageMin || usage(d, s.pos, s.g.usagePage) < s.usageMin ? fail(s, HID_PARSE_BAD_ITEM) :
+            withLocals(s, next, s.numUsages+1, 0, s.usageMin);
+    }
+
+    static constexpr State stepItem(State s, const uint8* d, uint32 next) {
+        return tag(d, s.pos) == LONG_ITEM ? withGlobals(s, next, s.g) :
+            isMain(d, s.pos) ? clearLocals(s, next, s.collectionDepth) :
+            tag(d, s.pos) == ITEM_COLLECTION ? (s.collectionDepth >= MAX_COLLECTION_DEPTH ?
+                fail(s, HID_PARSE_BAD_NESTING) : clearLocals(s, next, s.collectionDepth+1)) :
+            tag(d, s.pos) == ITEM_END_COLLECTION ? (s.collectionDepth == 0 ?
+                fail(s, HID_PARSE_BAD_NESTING) : clearLocals(s, next, s.collectionDepth-1)) :
+            tag(d, s.pos) == ITEM_PUSH ? (s.pushDepth >= HID_PARSE_MAX_PUSH ? fail(s, HID_PARSE_BAD_NESTING) : pushed(s, next)) :
+            tag(d, s.pos) == ITEM_POP ? (s.pushDepth == 0 ? fail(s, HID_PARSE_BAD_NESTING) : popped(s, next)) :
+            tag(d, s.pos) == ITEM_USAGE || tag(d, s.pos) == ITEM_USAGE_MINIMUM || tag(d, s.pos) == ITEM_USAGE_MAXIMUM ?
+                stepUsage(s, d, next) :
+            withGlobals(s, next, setGlobal(s.g, d, s.pos));
+    }
+
+    static constexpr State step(const uint8* d, uint32 n, State s) {
+        return itemLength(d, n, s.pos) == 0 ? fail(s, HID_PARSE_TRUNCATED) : stepItem(s, d, s.pos + itemLength(d, n, s.pos));
+    }
+
+    // bits of the main items of the report (reportID, type) from s up to end
+    static constexpr uint32 bitsBefore(const uint8* d, uint32 n, State s, uint32 end, uint8 reportID, uint8 type) {
+        return s.status != HID_PARSE_OK || s.pos >= end ? 0 :
+            (isMain(d, s.pos) && s.g.reportID == reportID && mainType(d, s.pos) == type ? s.g.reportSize * s.g.reportCount : 0) +
+            bitsBefore(d, n, step(d, n, s), end, reportID, type);
+    }
+
+    static constexpr uint32 offsetOf(const uint8* d, uint32 n, State s) {
+        return bitsBefore(d, n, start(), s.pos, s.g.reportID, mainType(d, s.pos));
+    }
+
+    static constexpr bool tooBig(const uint8* d, uint32 n, State s) {
+        return s.g.reportSize > 0xFFFF || s.g.reportCount > 0xFFFF || offsetOf(d, n, s) + s.g.reportSize * s.g.reportCount > 0xFFFF;
+    }
+
+    static constexpr uint8 statusFrom(const uint8* d, uint32 n, State s) {
+        return s.status != HID_PARSE_OK ? s.status :
+            s.pos >= n ? (s.collectionDepth != 0 ? HID_PARSE_BAD_NESTING : HID_PARSE_OK) :
+            itemLength(d, n, s.pos) != 0 && isMain(d, s.pos) && tooBig(d, n, s) ? HID_PARSE_BAD_ITEM :
+            statusFrom(d, n, step(d, n, s));
+    }
+
+    static constexpr bool seenBefore(const uint8* d, uint32 n, State s, uint32 end, uint8 reportID, uint8 type) {
+        return s.status == HID_PARSE_OK && s.pos < end &&
+            ((isMain(d, s.pos) && s.g.reportID == reportID && mainType(d, s.pos) == type) ||
+             seenBefore(d, n, step(d, n, s), end, reportID, type));
+    }
+
+    // the main item at s is the first of its report: reports are listed in that order
+    static constexpr bool firstOfReport(const uint8* d, uint32 n, State s) {
+        return isMain(d, s.pos) && ! seenBefore(d, n, start(), s.pos, s.g.reportID, mainType(d, s.pos));
+    }
+
+    static constexpr uint8 countReports(const uint8* d, uint32 n, State s) {
+        return s.status != HID_PARSE_OK || s.pos >= n ? 0 :
+            (firstOfReport(d, n, s) ? 1 : 0) + countReports(d, n, step(d, n, s));
+    }
+
+    static constexpr HIDReportInfo_t reportAt(const uint8* d, uint32 n, State s, uint32 k) {
+        return s.status != HID_PARSE_OK || s.pos >= n ? reportInfo(0, 0, 0, 0) :
+            ! firstOfReport(d, n, s) ? reportAt(d, n, step(d, n, s), k) :
+            k > 0 ? reportAt(d, n, step(d, n, s), k-1) :
+            reportOf(s.g.reportID, mainType(d, s.pos), bitsBefore(d, n, start(), n, s.g.reportID, mainType(d, s.pos)));
+    }
+
+    static constexpr HIDReportInfo_t reportOf(uint8 reportID, uint8 type, uint32 bits) {
+        return reportInfo(reportID, type, (bits + 7) / 8, bits);
+    }
+
+    static constexpr uint8 reportIndex(const uint8* d, uint32 n, State s, uint8 reportID, uint8 type) {
+        return s.status != HID_PARSE_OK || s.pos >= n ? 0 :
+            firstOfReport(d, n, s) && s.g.reportID == reportID && mainType(d, s.pos) == type ? 0 :
+            (firstOfReport(d, n, s) ? 1 : 0) + reportIndex(d, n, step(d, n, s), reportID, type);
+    }
+
+    // usage_at(), going over the local items from s up to the main item at end
+    static constexpr uint32 usageAt(const uint8* d, uint32 n, State s, uint32 end, uint32 i, uint32 last) {
+        return s.status != HID_PARSE_OK || s.pos >= end ? last :
+            tag(d, s.pos) == ITEM_USAGE ? (i == 0 ? usage(d, s.pos, s.g.usagePage) :
+                usageAt(d, n, step(d, n, s), end, i-1, usage(d, s.pos, s.g.usagePage))) :
+            tag(d, s.pos) == ITEM_USAGE_MAXIMUM ? (i <= usage(d, s.pos, s.g.usagePage) - s.usageMin ? s.usageMin + i :
+                usageAt(d, n, step(d, n, s), end, i - (usage(d, s.pos, s.g.usagePage) - s.usageMin + 1),
+                    usage(d, s.pos, s.g.usagePage))) :
+            usageAt(d, n, step(d, n, s), end, i, last);
+    }
+
+    // locals is the state at s.localStart, carried along so that the local items needn't be found again
+    static constexpr uint32 usageOf(const uint8* d, uint32 n, State s, State locals, uint32 i) {
+        return usageAt(d, n, locals, s.pos, i, 0);
+    }
+
+    static constexpr State localsAfter(State next, State locals) {
+        return next.localStart == next.pos ? next : locals;
+    }
+
+    static constexpr Run extendRun(const uint8* d, uint32 n, State s, State locals, uint32 min, uint32 max, uint32 j,
+            bool repeating) {
+        return j >= s.g.reportCount ? Run{ j, max } :
+            extendRunWith(d, n, s, locals, min, max, j, repeating, usageOf(d, n, s, locals, j));
+    }
+
+    static constexpr Run extendRunWith(const uint8* d, uint32 n, State s, State locals, uint32 min, uint32 max, uint32 j,
+            bool repeating, uint32 u) {
+        return u == max ? extendRun(d, n, s, locals, min, max, j+1, true) :
+            u == max + 1 && ! repeating && (u >> 16) == (min >> 16) ? extendRun(d, n, s, locals, min, u, j+1, repeating) :
+            Run{ j, max };
+    }
+
+    static constexpr Run runFrom(const uint8* d, uint32 n, State s, State locals, uint32 i, uint32 min) {
+        return extendRun(d, n, s, locals, min, min, i+1, false);
+    }
+
+    static constexpr Run run(const uint8* d, uint32 n, State s, State locals, uint32 i) {
+        return runFrom(d, n, s, locals, i, usageOf(d, n, s, locals, i));
+    }
+
+    static constexpr uint32 countRuns(const uint8* d, uint32 n, State s, State locals, uint32 i) {
+        return i >= s.g.reportCount ? 0 : 1 + countRuns(d, n, s, locals, run(d, n, s, locals, i).end);
+    }
+
+    static constexpr uint32 runStart(const uint8* d, uint32 n, State s, State locals, uint32 i, uint32 k) {
+        return k == 0 ? i : runStart(d, n, s, locals, run(d, n, s, locals, i).end, k-1);
+    }
+
+    static constexpr uint32 fieldsOf(const uint8* d, uint32 n, State s, State locals) {
+        return (value(d, s.pos) & HID_FIELD_CONSTANT) || s.g.reportSize * s.g.reportCount == 0 ? 0 :
+            ! (value(d, s.pos) & HID_FIELD_VARIABLE) ? 1 : countRuns(d, n, s, locals, 0);
+    }
+
+    static constexpr uint16 countFields(const uint8* d, uint32 n, State s, State locals) {
+        return s.status != HID_PARSE_OK || s.pos >= n ? 0 :
+            (isMain(d, s.pos) ? fieldsOf(d, n, s, locals) : 0) + countFieldsAfter(d, n, step(d, n, s), locals);
+    }
+
+    static constexpr uint16 countFieldsAfter(const uint8* d, uint32 n, State next, State locals) {
+        return countFields(d, n, next, localsAfter(next, locals));
+    }
+
+    static constexpr MainItem findField(const uint8* d, uint32 n, State s, State locals, uint32 k) {
+        return s.status != HID_PARSE_OK || s.pos >= n ? MainItem{ s, locals, k } :
+            findFieldWith(d, n, s, locals, k, isMain(d, s.pos) ? fieldsOf(d, n, s, locals) : 0);
+    }
+
+    static constexpr MainItem findFieldWith(const uint8* d, uint32 n, State s, State locals, uint32 k, uint32 fields) {
+        return k < fields ? MainItem{ s, locals, k } : findFieldAfter(d, n, step(d, n, s), locals, k - fields);
+    }
+
+    static constexpr MainItem findFieldAfter(const uint8* d, uint32 n, State next, State locals, uint32 k) {
+        return findField(d, n, next, localsAfter(next, locals), k);
+    }
+
+    static constexpr int32 logicalMax(Globals g) {
+        return g.logicalMin >= 0 && g.logicalMax < 0 && g.logicalMaxSize < 4 ?
+            (int32)(g.logicalMax & ((1ul << (8*g.logicalMaxSize)) - 1)) : g.logicalMax;
+    }
+
+    static constexpr HIDField_t makeField(const uint8* d, uint32 n, State s, uint32 bitOffset, uint32 count, uint32 min, uint32 max) {
+        return fieldInfo(reportIndex(d, n, start(), s.g.reportID, mainType(d, s.pos)), value(d, s.pos), s.g.reportSize,
+            count, bitOffset, min >> 16, min, max, s.g.logicalMin, logicalMax(s.g));
+    }
+
+    static constexpr HIDField_t variableField(const uint8* d, uint32 n, State s, uint32 i, uint32 min, Run r) {
+        return makeField(d, n, s, offsetOf(d, n, s) + i * s.g.reportSize, r.end - i, min, r.max);
+    }
+
+    static constexpr HIDField_t variableFieldFrom(const uint8* d, uint32 n, State s, State locals, uint32 i, uint32 min) {
+        return variableField(d, n, s, i, min, runFrom(d, n, s, locals, i, min));
+    }
+
+    static constexpr HIDField_t mainField(const uint8* d, uint32 n, MainItem m) {
+        return m.s.status != HID_PARSE_OK || m.s.pos >= n ? fieldInfo(0, 0, 0, 0, 0, 0, 0, 0, 0, 0) :
+            ! (value(d, m.s.pos) & HID_FIELD_VARIABLE) ?
+                makeField(d, n, m.s, offsetOf(d, n, m.s), m.s.g.reportCount, usageOf(d, n, m.s, m.locals, 0),
+                    usageOf(d, n, m.s, m.locals, 0xFFFFFFFF)) :
+            variableFieldFrom(d, n, m.s, m.locals, runStart(d, n, m.s, m.locals, 0, m.k),
+                usageOf(d, n, m.s, m.locals, runStart(d, n, m.s, m.locals, 0, m.k)));
+    }
+};
+
+template<unsigned...> struct HIDIndices {};
+template<unsigned n, unsigned... i> struct HIDMakeIndices : HIDMakeIndices<n-1, n-1, i...> {};
+template<unsigned... i> struct HIDMakeIndices<0, i...> {
+    typedef HIDIndices<i...> type;
+};
+
+template<const uint8* descriptor, uint32 length, class reportIndices, class fieldIndices> class HIDDescriptorTableBase;
+
+template<const uint8* descriptor, uint32 length, unsigned... r, unsigned... f>
+class HIDDescriptorTableBase<descriptor, length, HIDIndices<r...>, HIDIndices<f...> > {
+public:
+    static constexpr HIDReportInfo_t reports[sizeof...(r) > 0 ? sizeof...(r) : 1] = {
+        HIDDescriptorParser::report(descriptor, length, r)...
+    };
+    static constexpr HIDField_t fields[sizeof...(f) > 0 ? sizeof...(f) : 1] = {
+        HIDDescriptorParser::field(descriptor, length, f)...
+    };
+};
+
+template<const uint8* descriptor, uint32 length, unsigned... r, unsigned... f>
+constexpr HIDReportInfo_t HIDDescriptorTableBase<descriptor, length, HIDIndices<r...>, HIDIndices<f...> >::reports[];
+template<const uint8* descriptor, uint32 length, unsigned... r, unsigned... f>
+constexpr HIDField_t HIDDescriptorTableBase<descriptor, length, HIDIndices<r...>, HIDIndices<f...> >::fields[];
+
+// the reports and fields of a descriptor, laid out by the compiler
+template<const uint8* descriptor, uint32 length> class HIDDescriptorTable : public HIDDescriptorTableBase<descriptor, length,
+        typename HIDMakeIndices<HIDDescriptorParser::numReports(descriptor, length)>::type,
+        typename HIDMakeIndices<HIDDescriptorParser::numFields(descriptor, length)>::type> {
+public:
+    static_assert(HIDDescriptorParser::status(descriptor, length) == HID_PARSE_OK, "the report descriptor doesn't parse");
+    static constexpr uint8 numReports = HIDDescriptorParser::numReports(descriptor, length);
+    static constexpr uint16 numFields = HIDDescriptorParser::numFields(descriptor, length);
+};
+
+#endif
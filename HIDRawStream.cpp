@@ -0,0 +1,278 @@
+#include "USBComposite.h" 
+
+#include <string.h>
+#include <Arduino.h>
+
+HIDRawStreamBase::HIDRawStreamBase(USBHID& HID, uint8* messageBuffer, uint32 messageBufferSize,
+    uint8 (*heldBuffer)[HID_RAW_STREAM_REPORT_SIZE], uint8 heldReports) : HIDRaw(HID) {
+    message = messageBuffer;
+    maxMessageSize = messageBufferSize;
+    held = heldBuffer;
+    heldCapacity = heldReports;
+}
+
+void HIDRawStreamBase::begin(void) {
+    // HID IN reports are all sent from one endpoint, so this speeds up every report of the interface
+    usb_hid_setTXInterval(1);
+    HIDRaw::begin();
+}
+
+void HIDRawStreamBase::setWindow(uint8 reports) {
+    if (reports < 1)
+        reports = 1;
+    else if (reports > 127)
+        reports = 127;
+    window = reports;
+}
+
+uint8 HIDRawStreamBase::sendWindow(void) {
+    return window < peerReceiveWindow ? window : peerReceiveWindow;
+}
+
+uint8 HIDRawStreamBase::ackThreshold(void) {
+    uint8 peerWindow = peerSendWindow < heldCapacity ? peerSendWindow : heldCapacity;
+    return (peerWindow+1)/2;
+}
+
+void HIDRawStreamBase::transmit(uint8 flags, const uint8* payload, uint32 length) {
+    uint8 report[HID_RAW_STREAM_REPORT_SIZE];
+
+    report[0] = txSeq;
+    report[1] = rxExpected;
+    report[2] = flags;
+    report[3] = length;
+    memcpy(report+HID_RAW_STREAM_HEADER_SIZE, payload, length);
+    memset(report+HID_RAW_STREAM_HEADER_SIZE+length, 0, HID_RAW_STREAM_PAYLOAD_SIZE-length);
+    if (! (flags & HID_RAW_STREAM_CONTROL) && (length > 0 || (flags & HID_RAW_STREAM_LAST)))
+        txSeq++;
+    rxUnacked = 0;
+    send(report, sizeof(report));
+}
+
+static bool isData(const uint8* report) {
+    return ! (report[2] & HID_RAW_STREAM_CONTROL) && (report[3] > 0 || (report[2] & HID_RAW_STREAM_LAST));
+}
+
+static uint8 clampWindow(uint8 reports) {
+    if (reports < 1)
+        return 1;
+    return reports > 127 ? 127 : reports;
+}
+
+void HIDRawStreamBase::handleAck(const uint8* report) {
+    if (! synced)
+        return;
+    uint8 ack = report[1];
+    // ignore anything that doesn't fall between what was acked and what was sent
+    if ((uint8)(ack - txAcked) <= (uint8)(txSeq - txAcked))
+        txAcked = ack;
+}
+
+void HIDRawStreamBase::handleControl(const uint8* report) {
+    uint8 code = report[2] & HID_RAW_STREAM_FRAGMENT_MASK;
+    const uint8* payload = report+HID_RAW_STREAM_HEADER_SIZE;
+
+    switch (code) {
+    case HID_RAW_STREAM_SYNC_REQUEST:
+    case HID_RAW_STREAM_SYNC_REPLY:
+        if (code == HID_RAW_STREAM_SYNC_REQUEST) {
+            messageReady = false;
+            syncReplyNeeded = true;
+        }
+        txAcked = txSeq; // the other side has forgotten whatever was in flight
+        rxExpected = report[0];
+        rxUnacked = 0;
+        messageLength = 0;
+        nextFragment = 0;
+        discarding = false;
+        heldStart = 0;
+        heldCount = 0;
+        ackRequested = false;
+        ackReplyNeeded = false;
+        if (report[3] >= 2) {
+            peerReceiveWindow = clampWindow(payload[0]);
+            peerSendWindow = clampWindow(payload[1]);
+        }
+        else {
+            peerReceiveWindow = HID_RAW_STREAM_DEFAULT_WINDOW;
+            peerSendWindow = HID_RAW_STREAM_DEFAULT_WINDOW;
+        }
+        synced = true;
+        break;
+    case HID_RAW_STREAM_ACK_REQUEST:
+        handleAck(report);
+        // everything sent before the request has been read by now: it was either taken in or is held
+        ackReplyNeeded = synced;
+        ackReplyHeld = heldCount;
+        break;
+    case HID_RAW_STREAM_ACK_REPLY:
+        handleAck(report);
+        if (synced && ackRequested && report[3] >= 1) {
+            ackRequested = false;
+            // what was sent before the request and is neither acked nor held was lost
+            uint8 inFlight = ackRequestSeq - payload[0];
+            if ((uint8)(inFlight - txAcked) <= (uint8)(ackRequestSeq - txAcked))
+                txAcked = inFlight;
+        }
+        break;
+    }
+}
+
+void HIDRawStreamBase::takeIn(const uint8* report) {
+    uint8 seq = report[0];
+    uint8 flags = report[2];
+    uint32 length = report[3];
+    uint8 fragment = flags & HID_RAW_STREAM_FRAGMENT_MASK;
+
+    if (! synced)
+        return;
+
+    if (seq != rxExpected) {
+        lostReports += (uint8)(seq - rxExpected);
+        if (nextFragment != 0 && ! discarding) {
+            droppedMessages++;
+            discarding = true;
+        }
+    }
+    rxExpected = seq + 1;
+    rxUnacked++;
+
+    if (fragment == 0) {
+        if (nextFragment != 0 && ! discarding)
+            droppedMessages++; // the end of the last message was lost
+        messageLength = 0;
+        nextFragment = 0;
+        discarding = false;
+    }
+    else if (discarding || fragment != nextFragment) {
+        if (! discarding)
+            droppedMessages++;
+        discarding = ! (flags & HID_RAW_STREAM_LAST);
+        nextFragment = 0;
+        return;
+    }
+
+    if (length > HID_RAW_STREAM_PAYLOAD_SIZE || messageLength + length > maxMessageSize) {
+        droppedMessages++;
+        discarding = ! (flags & HID_RAW_STREAM_LAST);
+        nextFragment = 0;
+        return;
+    }
+
+    memcpy(message+messageLength, report+HID_RAW_STREAM_HEADER_SIZE, length);
+    messageLength += length;
+    nextFragment++;
+    if (flags & HID_RAW_STREAM_LAST) {
+        messageReady = true;
+        nextFragment = 0;
+    }
+}
+
+void HIDRawStreamBase::poll(void) {
+    while (true) {
+        while (heldCount > 0 && ! messageReady) {
+            takeIn(held[heldStart]);
+            heldStart = heldStart + 1 < heldCapacity ? heldStart + 1 : 0;
+            heldCount--;
+        }
+        if (! havePending) {
+            if (receive(pending) == 0)
+                break;
+            if (pending[2] & HID_RAW_STREAM_CONTROL) {
+                handleControl(pending);
+                continue;
+            }
+            // acks are taken right away, even if the data has to wait
+            handleAck(pending);
+            if (! isData(pending))
+                continue;
+            havePending = true;
+        }
+        if (! messageReady && heldCount == 0) {
+            takeIn(pending);
+        }
+        else if (heldCount < heldCapacity) {
+            uint8 slot = heldStart + heldCount;
+            if (slot >= heldCapacity)
+                slot -= heldCapacity;
+            memcpy(held[slot], pending, HID_RAW_STREAM_REPORT_SIZE);
+            heldCount++;
+        }
+        else {
+            // more than the window came in: this report, and anything behind it, waits in the queue
+            break;
+        }
+        havePending = false;
+    }
+
+    if (syncReplyNeeded) {
+        uint8 windows[2] = { heldCapacity, window };
+        syncReplyNeeded = false;
+        transmit(HID_RAW_STREAM_CONTROL | HID_RAW_STREAM_SYNC_REPLY, windows, 2);
+    }
+    if (ackReplyNeeded) {
+        ackReplyNeeded = false;
+        transmit(HID_RAW_STREAM_CONTROL | HID_RAW_STREAM_ACK_REPLY, &ackReplyHeld, 1);
+    }
+    if (synced && rxUnacked >= ackThreshold()) {
+        transmit(0, NULL, 0);
+    }
+}
+
+bool HIDRawStreamBase::sendMessage(const uint8* data, uint32 length) {
+    if (length > HID_RAW_STREAM_MAX_MESSAGE_SIZE)
+        return false;
+
+    poll();
+    if (! synced)
+        return false;
+
+    uint8 fragment = 0;
+    do {
+        uint32 start = millis();
+        uint32 progress = start;
+        uint8 acked = txAcked;
+        while ((uint8)(txSeq - txAcked) >= sendWindow()) {
+            poll();
+            uint32 now = millis();
+            if (txAcked != acked) {
+                acked = txAcked;
+                progress = now;
+            }
+            else if (now - progress >= HID_RAW_STREAM_ACK_TIMEOUT) {
+                // an ack may have been lost, or the other side is holding the reports: ask which
+                ackRequested = true;
+                ackRequestSeq = txSeq;
+                ackRequests++;
+                transmit(HID_RAW_STREAM_CONTROL | HID_RAW_STREAM_ACK_REQUEST, NULL, 0);
+                progress = now;
+            }
+            if (now - start >= timeout)
+                return false;
+        }
+        uint32 n = length < HID_RAW_STREAM_PAYLOAD_SIZE ? length : HID_RAW_STREAM_PAYLOAD_SIZE;
+        transmit(fragment | (n == length ? HID_RAW_STREAM_LAST : 0), data, n);
+        data += n;
+        length -= n;
+        fragment++;
+    } while (length > 0);
+
+    return true;
+}
+
+int HIDRawStreamBase::messageAvailable(void) {
+    poll();
+    return messageReady ? (int)messageLength : -1;
+}
+
+int HIDRawStreamBase::receiveMessage(uint8* out, uint32 maxLength) {
+    poll();
+    if (! messageReady)
+        return -1;
+    uint32 n = messageLength < maxLength ? messageLength : maxLength;
+    memcpy(out, message, n);
+    messageReady = false;
+    messageLength = 0;
+    poll(); // take in the reports that were held while the message waited
+    return n;
+}
@@ -0,0 +1,149 @@
+#ifndef _HIDRAWSTREAM_H_
+#define _HIDRAWSTREAM_H_
+
+#include "USBHID.h"
+
+/*
+ * Messages of up to HID_RAW_STREAM_MAX_MESSAGE_SIZE bytes, cut into 64-byte
+ * raw HID reports in each direction (report ID 0, so the report descriptor
+ * is HID_RAW_REPORT_DESCRIPTOR(64,64)). Each report starts with a header:
+ *
+ *   0 seq      sequence number of this data report
+ *   1 ack      sequence number of the next data report the sender will take in
+ *   2 flags    fragment index within the message (bits 0-5), HID_RAW_STREAM_LAST
+ *              on the last fragment; or, with HID_RAW_STREAM_CONTROL, a control code
+ *   3 length   of the payload that follows, up to HID_RAW_STREAM_PAYLOAD_SIZE
+ *
+ * A report with no payload that is not the LAST fragment of an empty
+ * message only carries an ack, and doesn't use up a sequence number; nor do
+ * control reports. A side acks the data reports it has taken into its message
+ * buffer. Reports that arrive while the last message hasn't been read yet
+ * are held, unacked, in a buffer of a few reports, so acks that come in behind
+ * them are still seen. Each side sends no more than its window of data reports
+ * beyond what the other has acked, so that the other side's buffers (the
+ * device's held reports, the host's report queue) never overflow, and acks,
+ * with an ack-only report if it has nothing else to send, once it has taken in
+ * half of the other side's window. A gap in the sequence numbers means lost
+ * reports, and the message they were part of is dropped. Nothing is sent again.
+ *
+ * Control codes:
+ *   SYNC_REQUEST  sent by the host first; the device forgets any reports in
+ *                 flight and any partial message, and answers with
+ *   SYNC_REPLY    Both carry the sender's receive window (how many unacked data
+ *                 reports it can hold) and send window as their two payload
+ *                 bytes, and their seq is that of the sender's next data report.
+ *   ACK_REQUEST   sent when the window has been full for HID_RAW_STREAM_ACK_TIMEOUT
+ *                 without any acks; answered right away with
+ *   ACK_REPLY     whose one payload byte is the number of data reports the sender
+ *                 holds but hasn't taken in yet. Reports sent before the request
+ *                 that are neither acked nor held were lost, and no longer count
+ *                 against the window.
+ *
+ * scripts/hidrawstream.py is a host-side implementation.
+ */
+
+#define HID_RAW_STREAM_REPORT_SIZE 64
+#define HID_RAW_STREAM_HEADER_SIZE 4
+#define HID_RAW_STREAM_PAYLOAD_SIZE (HID_RAW_STREAM_REPORT_SIZE-HID_RAW_STREAM_HEADER_SIZE)
+#define HID_RAW_STREAM_MAX_FRAGMENTS 64
+#define HID_RAW_STREAM_MAX_MESSAGE_SIZE (HID_RAW_STREAM_MAX_FRAGMENTS*HID_RAW_STREAM_PAYLOAD_SIZE)
+#define HID_RAW_STREAM_DEFAULT_MESSAGE_SIZE 1024
+#define HID_RAW_STREAM_DEFAULT_WINDOW 16 // at most 127; also the default number of held reports, 64 bytes each
+#define HID_RAW_STREAM_RX_SLOTS 8 // OUT packets queued in the device
+#define HID_RAW_STREAM_ACK_TIMEOUT 250 // milliseconds the window can stay full without acks before an ACK_REQUEST
+
+#define HID_RAW_STREAM_FRAGMENT_MASK 0x3F
+#define HID_RAW_STREAM_CONTROL 0x40
+#define HID_RAW_STREAM_LAST 0x80
+
+#define HID_RAW_STREAM_SYNC_REQUEST 0
+#define HID_RAW_STREAM_SYNC_REPLY 1
+#define HID_RAW_STREAM_ACK_REQUEST 2
+#define HID_RAW_STREAM_ACK_REPLY 3
+
+class HIDRawStreamBase : public HIDRaw<HID_RAW_STREAM_REPORT_SIZE,HID_RAW_STREAM_REPORT_SIZE,HID_RAW_STREAM_RX_SLOTS> {
+private:
+    uint8* message;
+    uint32 maxMessageSize;
+    uint32 messageLength = 0;
+    uint8 nextFragment = 0;
+    bool messageReady = false;
+    bool discarding = false; // skipping the rest of a message whose beginning was lost
+    uint8 (*held)[HID_RAW_STREAM_REPORT_SIZE]; // data reports waiting for the message to be read, oldest first
+    uint8 heldCapacity;
+    uint8 heldStart = 0;
+    uint8 heldCount = 0;
+    uint8 pending[HID_RAW_STREAM_REPORT_SIZE]; // taken from the queue with nowhere to go; reading stops until it's taken in
+    bool havePending = false;
+    bool synced = false;
+    bool syncReplyNeeded = false;
+    bool ackReplyNeeded = false;
+    uint8 ackReplyHeld = 0;
+    bool ackRequested = false;
+    uint8 ackRequestSeq = 0; // txSeq when the ACK_REQUEST went out
+    uint8 txSeq = 0;
+    uint8 txAcked = 0; // oldest data report the other side hasn't acked
+    uint8 rxExpected = 0;
+    uint8 rxUnacked = 0;
+    uint8 window = HID_RAW_STREAM_DEFAULT_WINDOW;
+    uint8 peerReceiveWindow = HID_RAW_STREAM_DEFAULT_WINDOW;
+    uint8 peerSendWindow = HID_RAW_STREAM_DEFAULT_WINDOW;
+    uint32 timeout = 1000;
+    uint32 lostReports = 0;
+    uint32 droppedMessages = 0;
+    uint32 ackRequests = 0;
+    void transmit(uint8 flags, const uint8* payload, uint32 length);
+    void handleAck(const uint8* report);
+    void handleControl(const uint8* report);
+    void takeIn(const uint8* report);
+    uint8 sendWindow(void);
+    uint8 ackThreshold(void);
+
+public:
+    HIDRawStreamBase(USBHID& HID, uint8* messageBuffer, uint32 messageBufferSize, uint8 (*heldBuffer)[HID_RAW_STREAM_REPORT_SIZE], uint8 heldReports);
+    // call before HID.begin(): adds the OUT endpoint and sets the HID interface's IN endpoint, which all of
+    // its reports share, to be polled every frame
+    void begin(void);
+    // takes the reports that have come in and sends any acks that are due; call it often
+    void poll(void);
+    // waits, up to the timeout, whenever the window is full; false if the host hasn't sent a SYNC, the message is too
+    // long or the timeout ran out
+    bool sendMessage(const uint8* data, uint32 length);
+    // copies the next complete message to out (cut off at maxLength) and returns its length, or -1 if there is none yet
+    int receiveMessage(uint8* out, uint32 maxLength);
+    // length of the next complete message, or -1 if there is none yet
+    int messageAvailable(void);
+    void setWindow(uint8 reports);
+    void setTimeout(uint32 milliseconds) {
+        timeout = milliseconds;
+    }
+    // true once the host has sent a SYNC
+    bool isSynced(void) {
+        return synced;
+    }
+    // data reports missing from the sequence numbers
+    uint32 getLostReports(void) {
+        return lostReports;
+    }
+    // messages given up because a part was lost or they were too long
+    uint32 getDroppedMessages(void) {
+        return droppedMessages;
+    }
+    // times the window stayed full for HID_RAW_STREAM_ACK_TIMEOUT
+    uint32 getAckRequests(void) {
+        return ackRequests;
+    }
+};
+
+// heldReports is how many reports can come in while a message waits to be read (the receive window)
+template<const uint32 messageSize=HID_RAW_STREAM_DEFAULT_MESSAGE_SIZE, const uint8 heldReports=HID_RAW_STREAM_DEFAULT_WINDOW>class HIDRawStream : public HIDRawStreamBase {
+private:
+    static_assert(messageSize <= HID_RAW_STREAM_MAX_MESSAGE_SIZE, "messages can be at most HID_RAW_STREAM_MAX_MESSAGE_SIZE bytes");
+    static_assert(heldReports >= 1 && heldReports <= 127, "the receive window must be 1 to 127 reports");
+    uint8 messageBuffer[messageSize];
+    uint8 heldBuffer[heldReports][HID_RAW_STREAM_REPORT_SIZE];
+public:
+    HIDRawStream(USBHID& HID) : HIDRawStreamBase(HID, messageBuffer, messageSize, heldBuffer, heldReports) {}
+};
+
+#endif
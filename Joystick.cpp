@@ -26,80 +26,99 @@ void HIDJoystick::safeSendReport() {
     }
 }
 
-void HIDJoystick::button(uint8_t button, bool val){
-	uint32_t mask = ((uint32_t)1 << (button-1));
+// the field holding usage in the joystick's input report; the fields were laid out at compile time,
+// and the report is looked up under whatever report ID USBHID has handed out
+const HIDField_t* HIDJoystick::findField(uint16_t usagePage, uint16_t usage, uint16_t* index) {
+    HIDReportInfo_t report = HIDTableJoystick::reports[0];
+    report.reportID = getReportID();
+    HIDLayout_t layout = { &report, const_cast<HIDField_t*>(HIDTableJoystick::fields), 1, 1,
+        HIDTableJoystick::numFields, HIDTableJoystick::numFields };
+    return findUsage(&layout, usagePage, usage, index);
+}
 
-	if (val) {
-        joyReport.buttons |= mask;
-	} else {
-        joyReport.buttons &= ~mask;
-	}
+// sets the repeat-th element after the one holding a Generic Desktop usage, clamped to its logical range
+void HIDJoystick::setAxis(uint16_t usage, uint16_t repeat, int32_t value) {
+    uint16_t index;
+    const HIDField_t* field = findField(0x01, usage, &index);
+    if (field == NULL)
+        return;
+    if (value < field->logicalMin) value = field->logicalMin;
+    if (value > field->logicalMax) value = field->logicalMax;
+    usb_hid_set_field(getReportData(), field, index + repeat, value);
+}
+
+void HIDJoystick::button(uint8_t button, bool val){
+    uint16_t index;
+    const HIDField_t* field = findField(0x09, button, &index);
+    if (field != NULL)
+        usb_hid_set_field(getReportData(), field, index, val);
 	
     safeSendReport();
 }
 
+void HIDJoystick::buttons(uint32_t b){
+    uint16_t index;
+    const HIDField_t* field = findField(0x09, 1, &index);
+    if (field == NULL)
+        return;
+    for (uint16_t i = 0; i < field->count && i < 32; i++)
+        usb_hid_set_field(getReportData(), field, i, (b >> i) & 1);
+}
+
 void HIDJoystick::X(uint16_t val){
-	if (val > 1023) val = 1023;
-    joyReport.x = val;
+    setAxis(0x30, 0, val);
 		
     safeSendReport();
 }
 
 void HIDJoystick::Y(uint16_t val){
-	if (val > 1023) val = 1023;
-    joyReport.y = val;
+    setAxis(0x31, 0, val);
 			
     safeSendReport();
 }
 
 void HIDJoystick::position(uint16_t x, uint16_t y){
-	if (x > 1023) x = 1023;
-	if (y > 1023) y = 1023;
-    joyReport.x = x;
-    joyReport.y = y;
+    setAxis(0x30, 0, x);
+    setAxis(0x31, 0, y);
 	
     safeSendReport();
 }
 
 void HIDJoystick::Xrotate(uint16_t val){
-	if (val > 1023) val = 1023;
-    joyReport.rx = val;
+    setAxis(0x33, 0, val);
 	
     safeSendReport();
 }
 
 void HIDJoystick::Yrotate(uint16_t val){
-	if (val > 1023) val = 1023;
-    joyReport.ry = val;
+    setAxis(0x34, 0, val);
 	
     safeSendReport();
 }
 
+// the descriptor has two Slider usages in a row
 void HIDJoystick::sliderLeft(uint16_t val){
-	if (val > 1023) val = 1023;
-    joyReport.sliderLeft = val;	
+    setAxis(0x36, 0, val);
 	
     safeSendReport();
 }
 
 void HIDJoystick::sliderRight(uint16_t val){
-	if (val > 1023) val = 1023;
-    joyReport.sliderRight = val;	
+    setAxis(0x36, 1, val);
 	
     safeSendReport();
 }
 
 void HIDJoystick::slider(uint16_t val){
-	if (val > 1023) val = 1023;
-    joyReport.sliderLeft = val;	
-    joyReport.sliderRight = val;	
+    setAxis(0x36, 0, val);
+    setAxis(0x36, 1, val);
 	
     safeSendReport();
 }
 
 void HIDJoystick::hat(int16_t dir){
-	uint8_t val;
-	if (dir < 0) val = 15;
+	int32_t val;
+	if (dir < 0) val = -1;
 	else if (dir < 23) val = 0;
 	else if (dir < 68) val = 1;
 	else if (dir < 113) val = 2;
@@ -108,10 +127,16 @@ void HIDJoystick::hat(int16_t dir){
 	else if (dir < 245) val = 5;
 	else if (dir < 293) val = 6;
 	else if (dir < 338) val = 7;
-    else val = 15;
-    
-    joyReport.hat = val;
+    else val = -1;
+
+    uint16_t index;
+    const HIDField_t* field = findField(0x01, 0x39, &index);
+    if (field != NULL) {
+        // centered is the null state: all ones, outside the logical range
+        if (val < 0)
+            val = (1 << field->bitSize) - 1;
+        usb_hid_set_field(getReportData(), field, index, val);
+    }
 	
     safeSendReport();
 }
-
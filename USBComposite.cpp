@@ -81,17 +81,82 @@ bool USBCompositeDevice::begin() {
     if (! usb_generic_set_parts(parts, numParts))
         return false;
     usb_generic_enable();
+    saveActiveParts();
     enabled = true;  
     return true;
 }
 
+void USBCompositeDevice::saveActiveParts() {
+    for (uint32 i = 0 ; i < numParts ; i++) {
+        activeParts[i] = parts[i];
+        activeStop[i] = stop[i];
+        activePlugin[i] = plugin[i];
+    }
+    numActiveParts = numParts;
+}
+
+bool USBCompositeDevice::isActive(uint32 i) {
+    for (uint32 j = 0 ; j < numActiveParts ; j++)
+        if (parts[i] == activeParts[j] && plugin[i] == activePlugin[j])
+            return true;
+    return false;
+}
+
+// after reconfigure() fails, with USB already off: stops the parts that stayed and the new ones before started
+void USBCompositeDevice::abandonParts(uint32 started) {
+    for (uint32 i = 0 ; i < numParts ; i++) {
+        if (i < started || isActive(i)) {
+            if (parts[i]->clear != NULL)
+                parts[i]->clear();
+            if (stop[i] != NULL)
+                stop[i](plugin[i]);
+        }
+    }
+    numActiveParts = 0;
+    enabled = false;
+}
+
+bool USBCompositeDevice::reconfigure() {
+    if (!enabled)
+        return begin();
+    
+    for (uint32 i = 0 ; i < numActiveParts ; i++) {
+        uint32 j;
+        for (j = 0 ; j < numParts ; j++)
+            if (parts[j] == activeParts[i] && plugin[j] == activePlugin[i])
+                break;
+        if (j >= numParts) {
+            if (activeParts[i]->clear != NULL)
+                activeParts[i]->clear();
+            if (activeStop[i] != NULL)
+                activeStop[i](activePlugin[i]);
+        }
+    }
+    for (uint32 i = 0 ; i < numParts ; i++) {
+        if (!isActive(i) && init[i] != NULL && !init[i](plugin[i])) {
+            // the parts that went were cleared above, and abandonParts() clears the rest, each once
+            usb_generic_disconnect();
+            abandonParts(i);
+            return false;
+        }
+    }
+    
+    if (! usb_generic_reconfigure(parts, numParts)) {
+        abandonParts(numParts);
+        return false;
+    }
+    saveActiveParts();
+    return true;
+}
+
 void USBCompositeDevice::end() {
     if (!enabled)
         return;
     usb_generic_disable();
-    for (uint32 i = 0 ; i < numParts ; i++)
-		if (stop[i] != NULL)
-			stop[i](plugin[i]);
+    for (uint32 i = 0 ; i < numActiveParts ; i++)
+		if (activeStop[i] != NULL)
+			activeStop[i](activePlugin[i]);
+    numActiveParts = 0;
     enabled = false;
 }
 
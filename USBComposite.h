@@ -31,7 +31,15 @@ private:
     USBPartStopper stop[USB_COMPOSITE_MAX_PARTS];
     void* plugin[USB_COMPOSITE_MAX_PARTS];
     uint32 numParts;
+    // what begin() or reconfigure() last set up, so reconfigure() can tell what changed
+    USBCompositePart* activeParts[USB_COMPOSITE_MAX_PARTS];
+    USBPartStopper activeStop[USB_COMPOSITE_MAX_PARTS];
+    void* activePlugin[USB_COMPOSITE_MAX_PARTS];
+    uint32 numActiveParts = 0;
     bool enabled = false;
+    void saveActiveParts();
+    bool isActive(uint32 i);
+    void abandonParts(uint32 started);
 public:
     USBCompositeDevice(void); 
     void setVendorId(uint16 vendor=0);
@@ -42,9 +50,41 @@ public:
     bool begin(void);
     void end(void);
     void clear();
+    bool reconfigure(void); // switch to the parts added since clear() without restarting the ones that stay
+    uint32 getReconfigureMillis() { // time the last reconfigure() took to get configured by the host, 0 if not yet
+        return usb_generic_get_reconfigure_millis();
+    }
     void setDisconnectDelay(uint32 delay=500) { // in microseconds
         usb_generic_set_disconnect_delay(delay);
     }
+    void setEP0PacketSize(uint8 size=64) { // 8, 16, 32 or 64
+        usb_generic_set_ep0_size(size);
+    }
+    const USBPMALayout* getPMALayout() { // valid after begin(), including a failed one
+        return usb_generic_get_pma_layout();
+    }
+    // callback(frame, data) runs in the USB interrupt at the start of every period-th frame
+    bool addFrameCallback(void (*callback)(uint32 frame, void* data), void* data=NULL, uint16 period=1, uint16 phase=0) {
+        return usb_generic_add_frame_callback(callback, data, period, phase);
+    }
+    void removeFrameCallback(void (*callback)(uint32 frame, void* data), void* data=NULL) {
+        usb_generic_remove_frame_callback(callback, data);
+    }
+    uint16 getFrameNumber() { // as sent by the host, 0 to 2047
+        return usb_generic_get_frame_number();
+    }
+    uint32 getBusMicros() { // microseconds of USB bus time
+        return usb_generic_get_bus_micros();
+    }
+    // USB_GENERIC_DEFER_NONE (default), USB_GENERIC_DEFER_POLL or USB_GENERIC_DEFER_PENDSV; work still queued
+    // runs before the switch. USB_GENERIC_DEFER_PENDSV takes over the PendSV handler, so don't use it with
+    // FreeRTOS or any other RTOS that schedules from PendSV. false if the RAM vector table couldn't be allocated.
+    bool setDeferMode(uint8 mode) {
+        return usb_generic_set_defer_mode(mode);
+    }
+    void poll() { // runs the driver work deferred in USB_GENERIC_DEFER_POLL mode
+        usb_generic_run_deferred();
+    }
     bool isReady() {
         return enabled && usb_is_connected(USBLIB) && usb_is_configured(USBLIB);    
     }   
@@ -58,10 +98,13 @@ extern USBCompositeDevice USBComposite;
 
 #include <USBCompositeSerial.h>
 #include <USBHID.h>
+#include <HIDRawStream.h>
 #include <USBMassStorage.h>
 #include <USBMIDI.h>
 #include <USBAudio.h>
 #include <USBMultiSerial.h>
 #include <USBXBox360.h>
+#include <USBMux.h>
+#include <USBVendorBulk.h>
 #endif
         
\ No newline at end of file
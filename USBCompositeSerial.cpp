@@ -33,11 +33,26 @@ static void rxHook(unsigned, void*);
 static void ifaceSetupHook(unsigned, void*);
 #endif
 
+static void (*txDoneCallback)(void) = NULL;
+
+static void txDoneHook(unsigned hook, void* ignored) {
+    (void)hook;
+    (void)ignored;
+    if (txDoneCallback != NULL)
+        txDoneCallback();
+}
+
+void USBCompositeSerial::setTXDoneCallback(void (*callback)(void)) {
+    txDoneCallback = callback;
+	composite_cdcacm_set_hooks(USBHID_CDCACM_HOOK_TX_DONE, txDoneHook);
+}
+
 bool USBCompositeSerial::init(USBCompositeSerial* me) {
 #if defined(SERIAL_USB)
 	composite_cdcacm_set_hooks(USBHID_CDCACM_HOOK_RX, rxHook);
 	composite_cdcacm_set_hooks(USBHID_CDCACM_HOOK_IFACE_SETUP, ifaceSetupHook);
 #endif
+    composite_cdcacm_setDoubleBuffered(me->doubleBuffered);
     composite_cdcacm_setTXEPSize(me->txPacketSize);
     composite_cdcacm_setRXEPSize(me->rxPacketSize);
 	return true;
@@ -151,6 +166,10 @@ uint8 USBCompositeSerial::pending(void) {
     return composite_cdcacm_get_pending();
 }
 
+bool USBCompositeSerial::isTransmitting(void) {
+    return composite_cdcacm_is_transmitting();
+}
+
 uint8 USBCompositeSerial::isConnected(void) {
     return usb_is_connected(USBLIB) && usb_is_configured(USBLIB) && composite_cdcacm_get_dtr();
 }
@@ -8,6 +8,7 @@ private:
 	bool enabled = false;
     uint32 txPacketSize = 64;
     uint32 rxPacketSize = 64;
+    bool doubleBuffered = false;
 public:
 	void begin(long speed=9600);
 	void end();
@@ -35,6 +36,10 @@ public:
     uint8 getDTR();
     uint8 isConnected();
     uint8 pending();
+    // write() only queues data; this is true until the host has taken all of it
+    bool isTransmitting();
+    // called from the USB interrupt whenever everything queued has been taken
+    void setTXDoneCallback(void (*callback)(void));
     
     void setRXPacketSize(uint32 size=64) {
         rxPacketSize = size;
@@ -43,6 +48,10 @@ public:
     void setTXPacketSize(uint32 size=64) {
         txPacketSize = size;
     }
+
+    void setDoubleBuffered(bool state=true) {
+        doubleBuffered = state;
+    }
 };
 
 extern USBCompositeSerial CompositeSerial;
@@ -199,6 +199,9 @@ void HIDReporter::sendReport() {
     unsigned toSend = bufferSize;
     uint8* b = reportBuffer;
     
+    if (mailbox.slot != NULL && usb_hid_post_mailbox(&mailbox, b))
+        return;
+    
     while (toSend) {
         unsigned delta = usb_hid_tx(b, toSend);
         toSend -= delta;
@@ -210,6 +213,15 @@ void HIDReporter::sendReport() {
     usb_hid_tx(NULL, 0);
 }
 
+void HIDReporter::setMailbox(uint8_t* slot) {
+    if (mailbox.slot != NULL)
+        usb_hid_remove_mailbox(&mailbox);
+    mailbox.slot = slot;
+    mailbox.length = bufferSize;
+    if (slot != NULL)
+        usb_hid_add_mailbox(&mailbox);
+}
+
 void HIDReporter::registerProfile(bool always) {
     for (uint32 i=0; i<3; i++) {
         reportChunks[i].data = NULL;
@@ -218,23 +230,8 @@ void HIDReporter::registerProfile(bool always) {
     if (reportDescriptor.descriptor != NULL) {
         int32_t reportIDOffset = -1;
         if (! forceUserSuppliedReportID) {
-            uint32_t i = 0;
-            
-            /*
-             * parse bits of beginning of report looking for a single-byte report ID (0x85 ID)
-             */
-            while (i < reportDescriptor.length && reportIDOffset < 0) {
-                if (reportDescriptor.descriptor[i]==0x85) {
-                    if (i+1 < reportDescriptor.length)
-                        reportIDOffset = i+1;
-                }
-                // the lowest 2 bit determine the data length of the tag
-                if ((reportDescriptor.descriptor[i] & 3) == 3)
-                    i += 5;
-                else 
-                    i += 1 + (reportDescriptor.descriptor[i] & 3);
-            }
-            if (i >= reportDescriptor.length) {
+            reportIDOffset = usb_hid_find_report_id(reportDescriptor.descriptor, reportDescriptor.length);
+            if (reportIDOffset < 0) {
                 forceUserSuppliedReportID = true;
             }
         }
@@ -274,6 +271,7 @@ HIDReporter::HIDReporter(USBHID& _HID, const HIDReportDescriptor* r, uint8_t* _b
     }
     memset(reportBuffer, 0, bufferSize);
     userSuppliedReportID = _reportID;
+    mailbox.slot = NULL;
 
     if (_size > 0 && _reportID != 0 && ! forceReportID) {
         reportBuffer[0] = _reportID;
@@ -300,10 +298,47 @@ HIDReporter::HIDReporter(USBHID& _HID, const HIDReportDescriptor* r, uint8_t* _b
     memset(_buffer, 0, _size);
     userSuppliedReportID = 0;
     forceUserSuppliedReportID = true;
+    mailbox.slot = NULL;
 
     registerProfile(false);
 }
 
+uint8_t HIDReporter::getLayout(HIDLayout_t* layout) {
+    if (reportChunks[0].data == NULL) {
+        layout->numReports = 0;
+        layout->numFields = 0;
+        return HID_PARSE_OK;
+    }
+    // reportChunks are linked on to the other reporters' chunks, so parse copies of just these
+    struct usb_chunk chunks[3];
+    for (uint32 i=0; i<3; i++) {
+        chunks[i].dataLength = reportChunks[i].dataLength;
+        chunks[i].data = reportChunks[i].data;
+        chunks[i].next = i < 2 ? chunks+i+1 : NULL;
+    }
+    return usb_hid_parse_report_chunks(chunks, layout);
+}
+
+const HIDField_t* HIDReporter::findUsage(const HIDLayout_t* layout, uint16_t usagePage, uint16_t usage, uint16_t* index) {
+    return usb_hid_find_field(layout, reportID, HID_REPORT_TYPE_INPUT, usagePage, usage, index);
+}
+
+bool HIDReporter::setUsage(const HIDLayout_t* layout, uint16_t usagePage, uint16_t usage, int32_t value) {
+    uint16_t index;
+    const HIDField_t* field = findUsage(layout, usagePage, usage, &index);
+    if (field == NULL)
+        return false;
+    return 0 != usb_hid_set_field(getReportData(), field, index, value);
+}
+
+int32_t HIDReporter::getUsage(const HIDLayout_t* layout, uint16_t usagePage, uint16_t usage) {
+    uint16_t index;
+    const HIDField_t* field = findUsage(layout, usagePage, usage, &index);
+    if (field == NULL)
+        return 0;
+    return usb_hid_get_field(getReportData(), field, index);
+}
+
 void HIDReporter::setFeature(uint8_t* in) {
     return usb_hid_set_feature(reportID, in);
 }
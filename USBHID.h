@@ -17,10 +17,13 @@
 #ifndef _USBHID_H_
 #define _USBHID_H_
 
+#include <string.h>
 #include <Print.h>
 #include <boards.h>
 #include "Stream.h"
 #include "usb_hid.h"
+#include "usb_hid_parser.h"
+#include "HIDDescriptorTable.h"
 
 #define HID_MAX_REPORT_CHUNKS 24
 
@@ -422,6 +425,47 @@ extern const HIDReportDescriptor* hidReportSwitchController;
 #define HID_KEYBOARD_MOUSE_JOYSTICK hidReportKeyboardMouseJoystick
 #define HID_BOOT_KEYBOARD           hidReportBootKeyboard
 
+// the built-in profiles' descriptors, and their layouts worked out at compile time (see HIDDescriptorTable.h)
+#define HID_DESCRIPTOR_TABLE(name, ...) \
+    constexpr uint8 hidDescriptor ## name[] = { __VA_ARGS__ }; \
+    typedef HIDDescriptorTable<hidDescriptor ## name, sizeof(hidDescriptor ## name)> HIDTable ## name;
+
+HID_DESCRIPTOR_TABLE(KeyboardMouseJoystick, HID_MOUSE_REPORT_DESCRIPTOR(), HID_KEYBOARD_REPORT_DESCRIPTOR(), HID_JOYSTICK_REPORT_DESCRIPTOR());
+HID_DESCRIPTOR_TABLE(KeyboardMouse, HID_MOUSE_REPORT_DESCRIPTOR(), HID_KEYBOARD_REPORT_DESCRIPTOR());
+HID_DESCRIPTOR_TABLE(Keyboard, HID_KEYBOARD_REPORT_DESCRIPTOR());
+HID_DESCRIPTOR_TABLE(Mouse, HID_MOUSE_REPORT_DESCRIPTOR());
+HID_DESCRIPTOR_TABLE(AbsMouse, HID_ABS_MOUSE_REPORT_DESCRIPTOR());
+HID_DESCRIPTOR_TABLE(KeyboardJoystick, HID_KEYBOARD_REPORT_DESCRIPTOR(), HID_JOYSTICK_REPORT_DESCRIPTOR());
+HID_DESCRIPTOR_TABLE(Joystick, HID_JOYSTICK_REPORT_DESCRIPTOR());
+HID_DESCRIPTOR_TABLE(BootKeyboard, HID_BOOT_KEYBOARD_REPORT_DESCRIPTOR());
+HID_DESCRIPTOR_TABLE(Consumer, HID_CONSUMER_REPORT_DESCRIPTOR());
+HID_DESCRIPTOR_TABLE(Desktop, HID_DESKTOP_REPORT_DESCRIPTOR());
+HID_DESCRIPTOR_TABLE(Digitizer, HID_DIGITIZER_REPORT_DESCRIPTOR());
+HID_DESCRIPTOR_TABLE(SwitchController, HID_SWITCH_CONTROLLER_REPORT_DESCRIPTOR());
+
+// a table of the reports and fields in a report descriptor; see usb_hid_parser.h
+template<unsigned reportCapacity=4, unsigned fieldCapacity=16>class HIDLayout : public HIDLayout_t {
+private:
+    HIDReportInfo_t reportTable[reportCapacity];
+    HIDField_t fieldTable[fieldCapacity];
+public:
+    HIDLayout() {
+        reports = reportTable;
+        fields = fieldTable;
+        maxReports = reportCapacity;
+        maxFields = fieldCapacity;
+        numReports = 0;
+        numFields = 0;
+    }
+    // returns HID_PARSE_OK or an error
+    uint8_t parse(const uint8_t* descriptor, uint16_t length) {
+        return usb_hid_parse_report_descriptor(descriptor, length, this);
+    }
+    uint8_t parse(const HIDReportDescriptor* descriptor) {
+        return parse(descriptor->descriptor, descriptor->length);
+    }
+};
+
 class HIDReporter;
 
 class USBHID {
@@ -476,6 +520,14 @@ public:
     void setRXInterval(uint8 t) {
         usb_hid_setRXInterval(t);
     }
+    // reports are only queued; this is true until the host has taken all of them
+    bool isTransmitting() {
+        return usb_hid_is_transmitting();
+    }
+    // called from the USB interrupt whenever everything queued has been taken
+    void setTXDoneCallback(void (*callback)(void)) {
+        usb_hid_set_tx_done_callback(callback);
+    }
 };
 
 class HIDReporter {
@@ -487,6 +539,7 @@ class HIDReporter {
         uint16_t bufferSize;
         HIDReportDescriptor reportDescriptor;
         struct usb_chunk reportChunks[3];
+        HIDMailbox_t mailbox;
         class HIDReporter* next;
         friend class USBHID;
 
@@ -495,12 +548,20 @@ class HIDReporter {
         
     public:
         void sendReport(); 
+        // With a mailbox, sendReport() overwrites a single pending copy of the report instead of
+        // queuing it, and the host gets the newest state the next time it polls. slot must hold
+        // getReportSize() bytes; NULL goes back to queuing every report.
+        void setMailbox(uint8_t* slot);
         uint8_t* getReport() {
             return reportBuffer;
         }
         uint16_t getReportSize() {
             return bufferSize;
         }
+        // the report ID USBHID has handed out, or 0 for none
+        uint8_t getReportID() {
+            return reportID;
+        }
         // if you use this init function, the buffer starts with a reportID, even if the reportID is zero,
         // and bufferSize includes the reportID; if reportID is zero, sendReport() will skip the initial
         // reportID byte
@@ -514,6 +575,18 @@ class HIDReporter {
         uint16_t getData(uint8_t type, uint8_t* out, uint8_t poll=1); // type = HID_REPORT_TYPE_FEATURE or HID_REPORT_TYPE_OUTPUT
         void setFeature(uint8_t* feature);
         void registerProfile(bool always=true);
+        // parses this reporter's report descriptor, with the report ID it was given, into layout
+        uint8_t getLayout(HIDLayout_t* layout);
+        // read and write the input report by usage, through a layout from getLayout(); setUsage() fails
+        // if the usage is not in the report or value is out of its logical range
+        bool setUsage(const HIDLayout_t* layout, uint16_t usagePage, uint16_t usage, int32_t value);
+        int32_t getUsage(const HIDLayout_t* layout, uint16_t usagePage, uint16_t usage);
+        // the field of the input report holding usage, and which of its elements does
+        const HIDField_t* findUsage(const HIDLayout_t* layout, uint16_t usagePage, uint16_t usage, uint16_t* index);
+        // the input report's data, after any report ID byte, for usb_hid_set_field() and usb_hid_get_field()
+        uint8_t* getReportData() {
+            return reportID != 0 ? reportBuffer+1 : reportBuffer;
+        }
 };
 
 //================================================================================
@@ -776,8 +849,9 @@ public:
 //================================================================================
 //	Joystick
 
-// only works for little-endian machines, but makes the code so much more
-// readable
+// the report HID_JOYSTICK_REPORT_DESCRIPTOR describes, for code that fills it in
+// directly; HIDJoystick itself packs it through the parsed descriptor. Only
+// works for little-endian machines.
 typedef struct {
     uint8_t reportID;
     uint32_t buttons;
@@ -797,6 +871,8 @@ protected:
 	JoystickReport_t joyReport; 
     bool manualReport = false;
 	void safeSendReport(void);
+    const HIDField_t* findField(uint16_t usagePage, uint16_t usage, uint16_t* index);
+    void setAxis(uint16_t usage, uint16_t repeat, int32_t value);
 public:
 	inline void send(void) {
         sendReport();
@@ -806,9 +882,7 @@ public:
 	void begin(void);
 	void end(void);
 	void button(uint8_t button, bool val);
-    void buttons(uint32_t b) {
-        joyReport.buttons = b;
-    }
+    void buttons(uint32_t b);
 	void X(uint16_t val);
 	void Y(uint16_t val);
 	void position(uint16_t x, uint16_t y);
@@ -962,18 +1036,43 @@ public:
     }
 };
 
-template<unsigned txSize,unsigned rxSize>class HIDRaw : public HIDReporter {
+// With rxQueueSlots > 0, output reports come in over a dedicated OUT endpoint polled every frame and wait in a
+// queue of that many packets for receive(), instead of arriving over the control endpoint for getOutput(). 
+// The endpoint NAKs while the queue is full, so nothing is lost if the sketch is slow.
+template<unsigned txSize,unsigned rxSize,unsigned rxQueueSlots=0>class HIDRaw : public HIDReporter {
 private:
+    static const unsigned rxPackets = (rxSize+63)/64; // per report
+    static_assert(rxQueueSlots == 0 || rxQueueSlots >= rxPackets, "the queue must hold a whole report");
     uint8_t txBuffer[txSize];
     uint8_t rxBuffer[HID_BUFFER_ALLOCATE_SIZE(rxSize,0)];
+    uint32_t rxQueue[rxQueueSlots ? HID_RX_QUEUE_BUFFER_SIZE(64,rxQueueSlots)/4 : 1];
     HIDBuffer_t buf;
 public:
 	HIDRaw(USBHID& HID) : HIDReporter(HID, txBuffer, sizeof(txBuffer)) {}
+    // in queued mode, this adds the OUT endpoint (polled every frame), so it must come before HID.begin()
 	void begin(void) {
+        if (rxQueueSlots) {
+            usb_hid_setDedicatedRXQueue(rxQueue, 64, rxQueueSlots);
+            usb_hid_setRXInterval(1);
+            return;
+        }
         buf.buffer = rxBuffer;
         buf.bufferSize = HID_BUFFER_SIZE(rxSize,0);
         buf.reportID = 0;
         HID.addOutputBuffer(&buf);
+    }
+    // number of whole output reports waiting in the queue
+    unsigned available(void) {
+        return usb_hid_rx_packets_available() / rxPackets;
+    }
+    // copies the oldest queued output report (rxSize bytes) to out and returns its length, or 0 if there is none
+    unsigned receive(uint8_t* out) {
+        if (available() == 0)
+            return 0;
+        unsigned n = 0;
+        for (unsigned i=0; i<rxPackets; i++)
+            n += usb_hid_rx_packet(out+n, rxSize-n);
+        return n;
     }
 	void end(void);
 	void send(const uint8_t* data, unsigned n=sizeof(txBuffer)) {
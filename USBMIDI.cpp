@@ -101,26 +101,15 @@ void USBMIDI::writePackets(const void *buf, uint32 len) {
     }
 
     uint32 txed = 0;
-    uint32 old_txed = 0;
     uint32 start = millis();
 
-    uint32 sent = 0;
-
+    /* packets are queued and sent from the USB interrupt, so this only waits if the queue is full */
     while (txed < len && (millis() - start < USB_TIMEOUT)) {
-        sent = usb_midi_tx((const uint32*)buf + txed, len - txed);
+        uint32 sent = usb_midi_tx((const uint32*)buf + txed, len - txed);
         txed += sent;
-        if (old_txed != txed) {
+        if (sent) {
             start = millis();
         }
-        old_txed = txed;
-    }
-
-
-    if (sent == usb_midi_txEPSize) {
-        while (usb_midi_is_transmitting() != 0) {
-        }
-        /* flush out to avoid having the pc wait for more data */
-        usb_midi_tx(NULL, 0);
     }
 }
 
@@ -152,6 +141,14 @@ uint8 USBMIDI::pending(void) {
     return usb_midi_get_pending();
 }
 
+bool USBMIDI::isTransmitting(void) {
+    return usb_midi_is_transmitting();
+}
+
+void USBMIDI::setTXDoneCallback(void (*callback)(void)) {
+    usb_midi_set_tx_done_callback(callback);
+}
+
 uint8 USBMIDI::isConnected(void) {
     return usb_is_connected(USBLIB) && usb_is_configured(USBLIB);
 }
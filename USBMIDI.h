@@ -147,6 +147,10 @@ public:
     
     uint8 isConnected();
     uint8 pending();
+    // packets are only queued; this is true until the host has taken all of them
+    bool isTransmitting();
+    // called from the USB interrupt whenever everything queued has been taken
+    void setTXDoneCallback(void (*callback)(void));
 
     // poll() should be called every time through loop() IF dealing with incoming MIDI
     //  (if you're only SENDING MIDI events from the Arduino, you don't need to call
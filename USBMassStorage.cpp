@@ -19,7 +19,9 @@ void USBMassStorage::end() {
 }
 
 void USBMassStorage::loop() {
-	usb_mass_loop();
+	// with PendSV deferral the commands are already handled there, and running them here could interrupt that
+	if (usb_generic_get_defer_mode() != USB_GENERIC_DEFER_PENDSV)
+		usb_mass_loop();
 }
 
 bool USBMassStorage::registerComponent() {
@@ -112,6 +112,10 @@ uint8 USBSerialPort::pending(void) {
     return multi_serial_get_pending(port);
 }
 
+bool USBSerialPort::isTransmitting(void) {
+    return multi_serial_is_transmitting(port);
+}
+
 uint8 USBSerialPort::isConnected(void) {
     return usb_is_connected(USBLIB) && usb_is_configured(USBLIB) && multi_serial_get_dtr(port);
 }
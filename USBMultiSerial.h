@@ -14,6 +14,7 @@ public:
     uint32 txPacketSize = USB_MULTI_SERIAL_DEFAULT_TX_SIZE;
     uint32 rxPacketSize = USB_MULTI_SERIAL_DEFAULT_RX_SIZE; 
     uint32 port;
+    const char* name = NULL;
     virtual int available(void);// Changed to virtual
 
     uint32 read(uint8 * buf, uint32 len);
@@ -33,6 +34,7 @@ public:
     uint8 getDTR();
     uint8 isConnected();
     uint8 pending();
+    bool isTransmitting();
     
     void setRXPacketSize(uint32 size=USB_MULTI_SERIAL_DEFAULT_RX_SIZE) {
         rxPacketSize = size;
@@ -42,6 +44,11 @@ public:
         txPacketSize = size;
     }
     
+    // shown by the host for this port, e.g., in the Windows device manager; call before begin()
+    void setName(const char* _name) {
+        name = _name;
+    }
+
     void setPort(uint8 _port) {
         port = _port;
     }
@@ -82,6 +89,7 @@ public:
         for (uint8 i=0; i<numPorts; i++) {
             multi_serial_setTXEPSize(i, txPacketSize);
             multi_serial_setRXEPSize(i, rxPacketSize);
+            multi_serial_set_port_name(i, me->ports[i].name);
         }
         multi_serial_initialize_port_data(numPorts, me->buffers);
 #if defined(SERIAL_USB)
@@ -0,0 +1,65 @@
+#include "USBComposite.h" 
+
+#include <string.h>
+#include <libmaple/usb.h>
+
+#include "usb_mux.h"
+
+size_t USBMuxChannel::write(uint8 ch) {
+    return this->write(&ch, 1);
+}
+
+size_t USBMuxChannel::write(const char *str) {
+    return this->write((const uint8*)str, strlen(str));
+}
+
+// blocks until everything is queued, which needs the host to be reading the channel
+size_t USBMuxChannel::write(const uint8 *buf, uint32 len) {
+    if (!this->isConnected() || !buf) {
+        return 0;
+    }
+    
+    uint32 txed = 0;
+    while (txed < len && this->isConnected()) {
+        txed += usb_mux_tx(channel, buf + txed, len - txed);
+    }
+
+    return txed;
+}
+
+int USBMuxChannel::available(void) {
+    return usb_mux_data_available(channel);
+}
+
+int USBMuxChannel::availableForWrite(void) {
+    return usb_mux_tx_free(channel);
+}
+
+int USBMuxChannel::peek(void) {
+    return usb_mux_peek_char(channel);
+}
+
+int USBMuxChannel::read(void) {
+    uint8 b;
+    if (usb_mux_rx(channel, &b, 1) == 0)
+        return -1;
+    return b;
+}
+
+uint32 USBMuxChannel::read(uint8* buf, uint32 len) {
+    return usb_mux_rx(channel, buf, len);
+}
+
+// waits until the host has taken everything written
+void USBMuxChannel::flush(void) {
+    while (usb_mux_get_pending(channel) > 0 && this->isConnected())
+        ;
+}
+
+uint8 USBMuxChannel::isConnected(void) {
+    return usb_is_connected(USBLIB) && usb_is_configured(USBLIB) && usb_mux_is_open();
+}
+
+uint32 USBMuxChannel::pending(void) {
+    return usb_mux_get_pending(channel);
+}
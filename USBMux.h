@@ -0,0 +1,87 @@
+#ifndef _USB_MUX_H
+#define _USB_MUX_H
+
+#include <USBComposite.h>
+#include "usb_mux.h"
+
+class USBMuxChannel : public Stream {
+public:
+    uint32 channel;
+
+    virtual int available(void);
+    virtual int peek(void);
+    virtual int read(void);
+    uint32 read(uint8* buf, uint32 len);
+    int availableForWrite(void);
+    virtual void flush(void);
+
+    size_t write(uint8);
+    size_t write(const char *str);
+    size_t write(const uint8*, uint32);
+
+    // true once a host program has opened the multiplexer
+    uint8 isConnected();
+    // bytes queued and not yet taken by the host
+    uint32 pending();
+
+    void setChannel(uint32 _channel) {
+        channel = _channel;
+    }
+
+    uint32 getChannel(void) {
+        return channel;
+    }
+};
+
+template<const uint32 numChannels=4,const uint32 bufferSize=USB_MUX_DEFAULT_BUFFER_SIZE>class USBMux {
+private:
+    static_assert(numChannels <= USB_MUX_MAX_CHANNELS, "too many channels");
+    static_assert((bufferSize & (bufferSize-1)) == 0, "bufferSize must be a power of 2");
+    bool enabled = false;
+    const char* name = NULL;
+    uint8 buffers[USB_MUX_BUFFERS_SIZE(numChannels, bufferSize)];
+public:
+    bool begin() {
+        if (!enabled) {
+            USBComposite.clear();
+            if (!registerComponent())
+                return false;
+            USBComposite.begin();
+            enabled = true;
+        }
+        return true;
+    };
+
+    void end() {
+        if (enabled) {
+            USBComposite.end();
+            enabled = false;
+        }
+    }
+
+    bool registerComponent() {
+        return USBComposite.add(&usbMuxPart, this, (USBPartInitializer)&USBMux<numChannels,bufferSize>::init);
+    }
+
+    static bool init(USBMux<numChannels,bufferSize>* me) {
+        usb_mux_initialize(numChannels, me->buffers, bufferSize);
+        if (me->name != NULL)
+            usb_mux_set_name(me->name);
+        return true;
+    };
+
+    // interface name shown by the host, which host programs can look for; call before begin()
+    void setName(const char* _name) {
+        name = _name;
+    }
+
+    operator bool() { return USBComposite.isReady() && usb_mux_is_open(); } 
+
+    USBMuxChannel channels[numChannels];
+
+    USBMux() {
+        for (uint32 i=0;i<numChannels;i++) channels[i].setChannel(i);
+    }
+};
+
+#endif
@@ -0,0 +1,95 @@
+#include "USBComposite.h" 
+
+#include <string.h>
+#include <libmaple/usb.h>
+
+#include "usb_vendor_bulk.h"
+
+bool USBVendorBulkPipe::init(USBVendorBulkPipe* me) {
+    vendor_bulk_set_buffers(me->rxBuffer, me->rxSize, me->txBuffer, me->txSize);
+    vendor_bulk_set_name(me->name);
+    vendor_bulk_set_guid(me->guid);
+    return true;
+}
+
+bool USBVendorBulkPipe::registerComponent() {
+    return USBComposite.add(&usbVendorBulkPart, this, (USBPartInitializer)&USBVendorBulkPipe::init);
+}
+
+bool USBVendorBulkPipe::begin() {
+    if (!enabled) {
+        USBComposite.clear();
+        if (!registerComponent())
+            return false;
+        if (!USBComposite.begin())
+            return false;
+        enabled = true;
+    }
+    return true;
+}
+
+void USBVendorBulkPipe::end() {
+    if (enabled) {
+        USBComposite.end();
+        enabled = false;
+    }
+}
+
+size_t USBVendorBulkPipe::write(uint8 ch) {
+    return this->write(&ch, 1);
+}
+
+size_t USBVendorBulkPipe::write(const char *str) {
+    return this->write((const uint8*)str, strlen(str));
+}
+
+// blocks until everything is queued, as long as the device stays configured
+size_t USBVendorBulkPipe::write(const uint8 *buf, uint32 len) {
+    if (!buf)
+        return 0;
+
+    uint32 txed = 0;
+    while (txed < len && USBComposite.isReady()) {
+        txed += vendor_bulk_tx(buf + txed, len - txed);
+    }
+
+    return txed;
+}
+
+int USBVendorBulkPipe::available(void) {
+    return vendor_bulk_data_available();
+}
+
+int USBVendorBulkPipe::availableForWrite(void) {
+    return vendor_bulk_tx_free();
+}
+
+int USBVendorBulkPipe::peek(void) {
+    return vendor_bulk_peek_char();
+}
+
+int USBVendorBulkPipe::read(void) {
+    uint8 b;
+    if (vendor_bulk_rx(&b, 1) == 0)
+        return -1;
+    return b;
+}
+
+// non-blocking: returns what is there, up to len bytes
+uint32 USBVendorBulkPipe::read(uint8* buf, uint32 len) {
+    return vendor_bulk_rx(buf, len);
+}
+
+// waits until the host has taken everything written
+void USBVendorBulkPipe::flush(void) {
+    while (vendor_bulk_is_transmitting() && USBComposite.isReady())
+        ;
+}
+
+uint32 USBVendorBulkPipe::pending(void) {
+    return vendor_bulk_get_pending();
+}
+
+bool USBVendorBulkPipe::isTransmitting(void) {
+    return vendor_bulk_is_transmitting();
+}
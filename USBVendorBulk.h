@@ -0,0 +1,69 @@
+#ifndef _USB_VENDOR_BULK_H
+#define _USB_VENDOR_BULK_H
+
+#include <USBComposite.h>
+#include "usb_vendor_bulk.h"
+
+// the Stream side of USBVendorBulk, which only adds the buffers
+class USBVendorBulkPipe : public Stream {
+private:
+    bool enabled = false;
+    uint8* rxBuffer;
+    uint32 rxSize;
+    uint8* txBuffer;
+    uint32 txSize;
+    const char* name = NULL;
+    const char* guid = NULL;
+protected:
+    USBVendorBulkPipe(uint8* _rxBuffer, uint32 _rxSize, uint8* _txBuffer, uint32 _txSize) : 
+        rxBuffer(_rxBuffer), rxSize(_rxSize), txBuffer(_txBuffer), txSize(_txSize) {}
+public:
+    bool begin(void);
+    void end(void);
+    static bool init(USBVendorBulkPipe* me);
+    bool registerComponent();
+
+    operator bool() { return USBComposite.isReady(); }
+
+    virtual int available(void);
+    virtual int peek(void);
+    virtual int read(void);
+    uint32 read(uint8* buf, uint32 len);
+    int availableForWrite(void);
+    virtual void flush(void);
+
+    size_t write(uint8);
+    size_t write(const char *str);
+    size_t write(const uint8*, uint32);
+
+    uint32 pending();
+    // write() only queues data; this is true until the host has taken all of it
+    bool isTransmitting();
+    // called from the USB interrupt whenever everything queued has been taken
+    void setTXDoneCallback(void (*callback)(void)) {
+        vendor_bulk_set_tx_done_callback(callback);
+    }
+
+    // interface name shown by the host; call before begin()
+    void setName(const char* _name) {
+        name = _name;
+    }
+
+    // "{...}" interface GUID that host programs open the device by on Windows; call before begin()
+    void setGUID(const char* _guid) {
+        guid = _guid;
+    }
+};
+
+// buffer sizes must be powers of 2
+template<const uint32 rxBufferSize=USB_VENDOR_BULK_DEFAULT_BUFFER_SIZE,const uint32 txBufferSize=USB_VENDOR_BULK_DEFAULT_BUFFER_SIZE>class USBVendorBulk : public USBVendorBulkPipe {
+private:
+    static_assert((rxBufferSize & (rxBufferSize-1)) == 0 && rxBufferSize > 2*USB_VENDOR_BULK_PACKET_SIZE, "rxBufferSize must be a power of 2 above two packets");
+    static_assert((txBufferSize & (txBufferSize-1)) == 0 && txBufferSize > 1, "txBufferSize must be a power of 2");
+    uint8 rxBuffer[rxBufferSize];
+    uint8 txBuffer[txBufferSize];
+public:
+    USBVendorBulk() : USBVendorBulkPipe(rxBuffer, rxBufferSize, txBuffer, txBufferSize) {}
+};
+
+#endif
@@ -53,6 +53,10 @@ public:
     void setManualReportMode(bool manualReport);
     bool getManualReportMode();
     bool sendData(const void* data, uint32 length);
+    // sendData() only queues the report; this is true until the host has taken it
+    bool isTransmitting();
+    // called from the USB interrupt whenever everything queued has been taken
+    void setTXDoneCallback(void (*callback)(void));
     
     USBXBox360Reporter(uint32 _controller=0) {
         controller = _controller;
@@ -17,18 +17,19 @@
 #include <Arduino.h>
 #include "USBComposite.h" 
 
+// reports are queued and sent from the USB interrupt, so this only waits if the queue is full
 bool USBXBox360Reporter::wait() {
     uint32_t t=millis();
-	while (x360_is_transmitting(controller) != 0 && (millis()-t)<500) ;
-    return ! x360_is_transmitting(controller);
+	while (x360_tx_queue_full(controller) && (millis()-t)<500) ;
+    return ! x360_tx_queue_full(controller);
 }
 
 bool USBXBox360Reporter::sendData(const void* data, uint32 length){
     if (wait()) {
         x360_tx(controller, (uint8*)data, length);
 
-        if(wait()) {
-        /* flush out to avoid having the pc wait for more data */
+        /* a full packet needs a zero-size one after it so the pc doesn't wait for more data */
+        if(length % USB_X360_TX_EPSIZE == 0 && wait()) {
             x360_tx(controller, NULL, 0);
         }
         return true;
@@ -36,6 +37,14 @@ bool USBXBox360Reporter::sendData(const void* data, uint32 length){
     return false;
 }
 
+bool USBXBox360Reporter::isTransmitting() {
+    return x360_is_transmitting(controller);
+}
+
+void USBXBox360Reporter::setTXDoneCallback(void (*callback)(void)) {
+    x360_set_tx_done_callback(controller, callback);
+}
+
 void USBXBox360Reporter::setManualReportMode(bool mode) {
     manualReport = mode;
 }
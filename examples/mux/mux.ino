@@ -0,0 +1,23 @@
+#include <USBComposite.h>
+
+// run scripts/usbmux.py on the host and open the pseudo-terminals it lists
+
+USBMux<3> mux;
+
+void setup() {
+  mux.begin();
+  while (!USBComposite);
+}
+
+void loop() {
+  // echo channel 0, upper-case channel 1, count on channel 2
+  while (mux.channels[0].available())
+    mux.channels[0].write(mux.channels[0].read());
+  while (mux.channels[1].available())
+    mux.channels[1].write(toupper(mux.channels[1].read()));
+  static uint32 last = 0;
+  if (mux && millis() - last >= 1000) {
+    last = millis();
+    mux.channels[2].println(last / 1000);
+  }
+}
@@ -0,0 +1,25 @@
+#include <USBComposite.h>
+
+// sends every message back; scripts/hidrawstream.py bench measures the rate
+
+USBHID HID;
+HIDRawStream<> stream(HID);
+uint8 message[HID_RAW_STREAM_DEFAULT_MESSAGE_SIZE];
+
+const uint8_t reportDescription[] = {
+   HID_RAW_REPORT_DESCRIPTOR(HID_RAW_STREAM_REPORT_SIZE,HID_RAW_STREAM_REPORT_SIZE)
+};
+
+void setup() {
+  stream.begin(); // adds the OUT endpoint and speeds up the IN one, so it comes first
+  HID.begin(reportDescription, sizeof(reportDescription));
+  while (!USBComposite);
+}
+
+void loop() {
+  int len = stream.receiveMessage(message, sizeof(message));
+  if (len >= 0)
+    stream.sendMessage(message, len);
+  else
+    stream.poll();
+}
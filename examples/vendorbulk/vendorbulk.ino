@@ -0,0 +1,27 @@
+#include <USBComposite.h>
+
+// streams a counter as fast as the host takes it and echoes anything sent back;
+// scripts/bulkrate.py measures the rate
+
+USBVendorBulk<> bulk;
+
+void setup() {
+  bulk.setName("Sensor dump");
+  bulk.begin();
+  while (!USBComposite);
+}
+
+void loop() {
+  static uint8 data[256];
+  static uint8 n = 0;
+  uint8 in[64];
+  uint32 len = bulk.read(in, sizeof(in));
+  if (len > 0) {
+    bulk.write(in, len);
+  }
+  else if (bulk.availableForWrite() >= (int)sizeof(data)) {
+    for (unsigned i = 0 ; i < sizeof(data) ; i++)
+      data[i] = n++;
+    bulk.write(data, sizeof(data));
+  }
+}
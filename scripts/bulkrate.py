@@ -0,0 +1,45 @@
+#!/usr/bin/env python3
+#
+# Reads from a USBVendorBulk interface as fast as possible and reports the
+# rate, checking that the bytes form the counter sent by the vendorbulk
+# example.
+#
+# usage: bulkrate.py [seconds]
+#
+# Needs pyusb. On Windows, the device binds to WinUSB by itself.
+
+import sys
+import time
+import usb.core
+import usb.util
+
+def find():
+    for dev in usb.core.find(find_all=True):
+        for intf in dev.get_active_configuration():
+            if intf.bInterfaceClass == 0xFF and intf.bInterfaceSubClass == 0 and intf.bInterfaceProtocol == 0:
+                epIn = usb.util.find_descriptor(intf, custom_match=lambda e: usb.util.endpoint_direction(e.bEndpointAddress) == usb.util.ENDPOINT_IN)
+                if epIn is not None and usb.util.endpoint_type(epIn.bmAttributes) == usb.util.ENDPOINT_TYPE_BULK:
+                    return dev, intf, epIn
+    raise IOError("no vendor bulk interface found")
+
+def main():
+    seconds = float(sys.argv[1]) if len(sys.argv) > 1 else 10
+    dev, intf, epIn = find()
+    usb.util.claim_interface(dev, intf.bInterfaceNumber)
+    total = 0
+    errors = 0
+    expected = None
+    start = time.time()
+    while time.time() - start < seconds:
+        # large reads let the host controller schedule several packets per frame
+        data = epIn.read(16384, timeout=1000)
+        for b in data:
+            if expected is not None and b != expected:
+                errors += 1
+            expected = (b + 1) & 0xFF
+        total += len(data)
+    elapsed = time.time() - start
+    print("%d bytes in %.1f s: %.0f bytes/s, %d discontinuities" % (total, elapsed, total / elapsed, errors))
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,425 @@
+#!/usr/bin/env python3
+#
+# Host side of HIDRawStream (see HIDRawStream.h for the protocol).
+#
+# usage: hidrawstream.py bench [seconds] [message size]
+#        hidrawstream.py loopback [seconds] [message size] [loss] [work]
+#
+# bench talks to a device running the rawhidstream example, which sends
+# every message back, and reports the sustained rate in each direction.
+# loopback runs two Endpoints against each other in this process, one of them
+# working and echoing like the example on the device, optionally dropping a
+# fraction of the reports in each direction and spending work milliseconds
+# on each message before sending it back, which exercises the protocol
+# without a device. Without loss, it fails if any echo goes missing or either
+# side has to send an ACK_REQUEST.
+#
+# The Endpoint class only needs a transport with read() and write() of whole
+# 64-byte reports, so it can also be used as a library.
+# Needs hidapi (pip install hidapi) for the HID transport.
+
+import collections
+import os
+import random
+import sys
+import threading
+import time
+
+# must stay in sync with HIDRawStream.h
+REPORT_SIZE = 64
+HEADER_SIZE = 4
+PAYLOAD_SIZE = REPORT_SIZE - HEADER_SIZE
+MAX_FRAGMENTS = 64
+MAX_MESSAGE_SIZE = MAX_FRAGMENTS * PAYLOAD_SIZE
+DEFAULT_WINDOW = 16
+RX_SLOTS = 8
+ACK_TIMEOUT = 0.25
+FRAGMENT_MASK = 0x3F
+CONTROL = 0x40
+LAST = 0x80
+SYNC_REQUEST = 0
+SYNC_REPLY = 1
+ACK_REQUEST = 2
+ACK_REPLY = 3
+HOST_REPORT_BUFFER = 64 # reports hidraw keeps for a reader
+RAWHID_USAGE_PAGE = 0xFFC0
+RAWHID_USAGE = 0x0C00
+
+class HidTransport:
+    def __init__(self, vendor=None, product=None):
+        import hid
+        for d in hid.enumerate():
+            if d["usage_page"] == RAWHID_USAGE_PAGE and d["usage"] == RAWHID_USAGE and \
+                    (vendor is None or d["vendor_id"] == vendor) and (product is None or d["product_id"] == product):
+                self.dev = hid.device()
+                self.dev.open_path(d["path"])
+                return
+        raise IOError("no raw HID device found")
+
+    # one report, or b"" if none comes within timeout seconds
+    def read(self, timeout):
+        return bytes(self.dev.read(REPORT_SIZE, int(timeout * 1000)))
+
+    def write(self, report):
+        self.dev.write(b"\x00" + report) # report ID 0
+
+# Reports written to a LoopbackTransport go to its peer's inbox, one per millisecond frame
+# at most, as over an interrupt endpoint polled every frame. A device inbox is the device's
+# queue of RX_SLOTS packets: while it is full, the writer waits, as the host does while the
+# device NAKs. A host inbox is the kernel's report buffer, which drops reports when it is
+# full. Either way some reports can be lost at random on top.
+class LoopbackTransport:
+    FRAME = 0.001
+
+    def __init__(self, loss, rng, slots, blocking):
+        self.inbox = collections.deque() # (when it arrives, report)
+        self.slots = slots
+        self.blocking = blocking
+        self.ready = threading.Condition()
+        self.nextFrame = 0
+        self.peer = None
+        self.loss = loss
+        self.rng = rng
+        self.overflows = 0
+
+    def read(self, timeout):
+        deadline = time.time() + timeout
+        with self.ready:
+            while True:
+                now = time.time()
+                if self.inbox and self.inbox[0][0] <= now:
+                    report = self.inbox.popleft()[1]
+                    self.ready.notify_all()
+                    return report
+                if now >= deadline:
+                    return b""
+                wait = deadline - now
+                if self.inbox:
+                    wait = min(wait, self.inbox[0][0] - now)
+                self.ready.wait(wait)
+
+    def write(self, report):
+        peer = self.peer
+        with peer.ready:
+            deadline = time.time() + 1.0
+            while len(peer.inbox) >= peer.slots:
+                if not peer.blocking:
+                    peer.overflows += 1
+                    return
+                if time.time() >= deadline:
+                    raise IOError("device stopped reading")
+                peer.ready.wait(0.01)
+            when = max(time.time(), self.nextFrame)
+            self.nextFrame = when + self.FRAME
+            if self.rng.random() >= self.loss:
+                peer.inbox.append((when, bytes(report)))
+                peer.ready.notify_all()
+
+def loopbackPair(loss=0.0, seed=1):
+    rng = random.Random(seed)
+    host = LoopbackTransport(loss, rng, HOST_REPORT_BUFFER, False)
+    device = LoopbackTransport(loss, rng, RX_SLOTS, True)
+    host.peer = device
+    device.peer = host
+    return host, device
+
+# One side of the protocol. The defaults are the host's: every message that comes in is kept.
+# With maxMessages=1 and receiveWindow=heldReports it works as HIDRawStream<messageSize,heldReports>
+# does on the device: reports that come in while the message waits to be read are held, unacked,
+# and once they fill the held buffer it stops reading the transport.
+class Endpoint:
+    def __init__(self, transport, window=DEFAULT_WINDOW, receiveWindow=DEFAULT_WINDOW, maxMessages=None):
+        self.transport = transport
+        self.window = window
+        self.receiveWindow = receiveWindow
+        self.maxMessages = maxMessages
+        self.peerReceiveWindow = DEFAULT_WINDOW
+        self.peerSendWindow = DEFAULT_WINDOW
+        self.txSeq = 0
+        self.txAcked = 0
+        self.rxExpected = 0
+        self.rxUnacked = 0
+        self.synced = False
+        self.syncReplyNeeded = False
+        self.ackReplyNeeded = False
+        self.ackReplyHeld = 0
+        self.ackRequested = False
+        self.ackRequestSeq = 0
+        self.message = bytearray()
+        self.nextFragment = 0
+        self.discarding = False
+        self.messages = collections.deque()
+        self.held = collections.deque()
+        self.pending = None
+        self.lostReports = 0
+        self.droppedMessages = 0
+        self.ackRequests = 0
+
+    def transmit(self, flags, payload=b""):
+        report = bytes((self.txSeq, self.rxExpected, flags, len(payload))) + payload
+        report += bytes(REPORT_SIZE - len(report))
+        if not flags & CONTROL and (payload or flags & LAST):
+            self.txSeq = (self.txSeq + 1) & 0xFF
+        self.rxUnacked = 0
+        self.transport.write(report)
+
+    # what the host does first: makes the device start afresh, and waits for its reply
+    def sync(self, timeout=1.0):
+        self.synced = False
+        self.transmit(CONTROL | SYNC_REQUEST, bytes((self.receiveWindow, self.window)))
+        deadline = time.time() + timeout
+        while not self.synced:
+            if time.time() >= deadline:
+                raise IOError("no SYNC reply")
+            self.poll(0.01)
+
+    def sendWindow(self):
+        return min(self.window, self.peerReceiveWindow)
+
+    def ackThreshold(self):
+        return (min(self.peerSendWindow, self.receiveWindow) + 1) // 2
+
+    def messageWaiting(self):
+        return self.maxMessages is not None and len(self.messages) >= self.maxMessages
+
+    def handleAck(self, report):
+        ack = report[1]
+        if self.synced and ((ack - self.txAcked) & 0xFF) <= ((self.txSeq - self.txAcked) & 0xFF):
+            self.txAcked = ack
+
+    def handleControl(self, report):
+        code = report[2] & FRAGMENT_MASK
+        length = report[3]
+        payload = report[HEADER_SIZE:HEADER_SIZE+length]
+        if code in (SYNC_REQUEST, SYNC_REPLY):
+            if code == SYNC_REQUEST:
+                self.messages.clear()
+                self.syncReplyNeeded = True
+            self.txAcked = self.txSeq
+            self.rxExpected = report[0]
+            self.rxUnacked = 0
+            self.message = bytearray()
+            self.nextFragment = 0
+            self.discarding = False
+            self.held.clear()
+            self.ackRequested = False
+            self.ackReplyNeeded = False
+            if length >= 2:
+                self.peerReceiveWindow = min(max(payload[0], 1), 127)
+                self.peerSendWindow = min(max(payload[1], 1), 127)
+            else:
+                self.peerReceiveWindow = self.peerSendWindow = DEFAULT_WINDOW
+            self.synced = True
+        elif code == ACK_REQUEST:
+            self.handleAck(report)
+            self.ackReplyNeeded = self.synced
+            self.ackReplyHeld = len(self.held)
+        elif code == ACK_REPLY:
+            self.handleAck(report)
+            if self.synced and self.ackRequested and length >= 1:
+                self.ackRequested = False
+                inFlight = (self.ackRequestSeq - payload[0]) & 0xFF
+                if ((inFlight - self.txAcked) & 0xFF) <= ((self.ackRequestSeq - self.txAcked) & 0xFF):
+                    self.txAcked = inFlight
+
+    def takeIn(self, report):
+        seq, flags, length = report[0], report[2], report[3]
+        fragment = flags & FRAGMENT_MASK
+        if not self.synced:
+            return
+        if seq != self.rxExpected:
+            self.lostReports += (seq - self.rxExpected) & 0xFF
+            if self.nextFragment != 0 and not self.discarding:
+                self.droppedMessages += 1
+                self.discarding = True
+        self.rxExpected = (seq + 1) & 0xFF
+        self.rxUnacked += 1
+        if fragment == 0:
+            if self.nextFragment != 0 and not self.discarding:
+                self.droppedMessages += 1
+            self.message = bytearray()
+            self.nextFragment = 0
+            self.discarding = False
+        elif self.discarding or fragment != self.nextFragment:
+            if not self.discarding:
+                self.droppedMessages += 1
+            self.discarding = not flags & LAST
+            self.nextFragment = 0
+            return
+        if length > PAYLOAD_SIZE:
+            self.droppedMessages += 1
+            self.discarding = not flags & LAST
+            self.nextFragment = 0
+            return
+        self.message += report[HEADER_SIZE:HEADER_SIZE+length]
+        self.nextFragment += 1
+        if flags & LAST:
+            self.messages.append(bytes(self.message))
+            self.message = bytearray()
+            self.nextFragment = 0
+
+    # takes whatever reports come in, waiting up to timeout seconds for the first, and sends any acks due
+    def poll(self, timeout=0):
+        while True:
+            while self.held and not self.messageWaiting():
+                self.takeIn(self.held.popleft())
+            if self.pending is None:
+                report = self.transport.read(timeout)
+                timeout = 0
+                if not report:
+                    break
+                if report[2] & CONTROL:
+                    self.handleControl(report)
+                    continue
+                self.handleAck(report)
+                if report[3] == 0 and not report[2] & LAST:
+                    continue # ack only
+                self.pending = report
+            if not self.messageWaiting() and not self.held:
+                self.takeIn(self.pending)
+            elif len(self.held) < self.receiveWindow:
+                self.held.append(self.pending)
+            else:
+                break # more than the window came in: leave the rest unread
+            self.pending = None
+        if self.syncReplyNeeded:
+            self.syncReplyNeeded = False
+            self.transmit(CONTROL | SYNC_REPLY, bytes((self.receiveWindow, self.window)))
+        if self.ackReplyNeeded:
+            self.ackReplyNeeded = False
+            self.transmit(CONTROL | ACK_REPLY, bytes((self.ackReplyHeld,)))
+        if self.synced and self.rxUnacked >= self.ackThreshold():
+            self.transmit(0)
+
+    def sendMessage(self, data, timeout=1.0):
+        if len(data) > MAX_MESSAGE_SIZE:
+            raise ValueError("message too long")
+        fragment = 0
+        while True:
+            start = progress = time.time()
+            acked = self.txAcked
+            while ((self.txSeq - self.txAcked) & 0xFF) >= self.sendWindow():
+                self.poll(0.001)
+                now = time.time()
+                if self.txAcked != acked:
+                    acked = self.txAcked
+                    progress = now
+                elif now - progress >= ACK_TIMEOUT:
+                    # an ack may have been lost, or the other side is holding the reports: ask which
+                    self.ackRequested = True
+                    self.ackRequestSeq = self.txSeq
+                    self.ackRequests += 1
+                    self.transmit(CONTROL | ACK_REQUEST)
+                    progress = now
+                if now - start >= timeout:
+                    raise IOError("timed out")
+            n = min(len(data), PAYLOAD_SIZE)
+            self.transmit(fragment | (LAST if n == len(data) else 0), bytes(data[:n]))
+            data = data[n:]
+            fragment += 1
+            if not data:
+                return
+
+    # the next complete message, or None if none comes within timeout seconds
+    def receiveMessage(self, timeout=0):
+        deadline = time.time() + timeout
+        while not self.messages:
+            left = deadline - time.time()
+            self.poll(max(left, 0))
+            if left <= 0:
+                break
+        if not self.messages:
+            return None
+        message = self.messages.popleft()
+        self.poll() # take in the reports that were held while the message waited
+        return message
+
+# echoes come back in order, but some may be missing; returns how many were, and whether echo matched a message sent
+def check(sent, echo):
+    if echo not in sent:
+        return 0, False
+    missing = 0
+    while sent.popleft() != echo:
+        missing += 1
+    return missing, True
+
+# sends messages of the given size for the given time, checks the echoes and reports the rate
+def bench(endpoint, seconds, size):
+    sent = collections.deque()
+    txBytes = 0
+    rxBytes = 0
+    lost = 0
+    mismatches = 0
+    start = time.time()
+    while time.time() - start < seconds:
+        message = os.urandom(size)
+        endpoint.sendMessage(message)
+        sent.append(message)
+        txBytes += size
+        while endpoint.messages:
+            echo = endpoint.messages.popleft()
+            missing, ok = check(sent, echo)
+            lost += missing
+            mismatches += not ok
+            rxBytes += len(echo)
+        endpoint.poll()
+    # let the last echoes in
+    while sent:
+        echo = endpoint.receiveMessage(1.0)
+        if echo is None:
+            break
+        missing, ok = check(sent, echo)
+        lost += missing
+        mismatches += not ok
+        rxBytes += len(echo)
+    lost += len(sent)
+    elapsed = time.time() - start
+    print("sent %.0f bytes/s, received %.0f bytes/s in %d-byte messages over %.1f s" % (txBytes / elapsed, rxBytes / elapsed, size, elapsed))
+    print("%d lost reports, %d dropped messages, %d echoes missing, %d wrong, %d ack requests" %
+          (endpoint.lostReports, endpoint.droppedMessages, lost, mismatches, endpoint.ackRequests))
+    return lost, mismatches
+
+def echo(endpoint, stop, work=0):
+    while not stop.is_set():
+        message = endpoint.receiveMessage(0.01)
+        if message is not None:
+            time.sleep(work)
+            try:
+                endpoint.sendMessage(message)
+            except IOError:
+                pass
+
+def main():
+    if len(sys.argv) < 2 or sys.argv[1] not in ("bench", "loopback"):
+        print("usage: hidrawstream.py bench [seconds] [message size]\n"
+              "       hidrawstream.py loopback [seconds] [message size] [loss] [work]")
+        sys.exit(1)
+    seconds = float(sys.argv[2]) if len(sys.argv) > 2 else 10
+    size = int(sys.argv[3]) if len(sys.argv) > 3 else 1020
+    if sys.argv[1] == "bench":
+        host = Endpoint(HidTransport())
+        host.sync()
+        bench(host, seconds, size)
+    else:
+        loss = float(sys.argv[4]) if len(sys.argv) > 4 else 0.0
+        work = float(sys.argv[5]) / 1000 if len(sys.argv) > 5 else 0.0
+        a, b = loopbackPair(loss)
+        host = Endpoint(a)
+        device = Endpoint(b, maxMessages=1) # as HIDRawStream<> in the rawhidstream example
+        stop = threading.Event()
+        thread = threading.Thread(target=echo, args=(device, stop, work))
+        thread.start()
+        try:
+            host.sync()
+            lost, mismatches = bench(host, seconds, size)
+        finally:
+            stop.set()
+            thread.join()
+        print("device side: %d lost reports, %d dropped messages, %d ack requests; %d reports overflowed the host buffer" %
+              (device.lostReports, device.droppedMessages, device.ackRequests, a.overflows))
+        # without loss nothing may go missing, and neither side should ever have to wait out ACK_TIMEOUT
+        if loss == 0 and (lost or mismatches or host.ackRequests or device.ackRequests or a.overflows):
+            sys.exit(1)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,197 @@
+#!/usr/bin/env python3
+#
+# Host side of the USBMux channel multiplexer (see usb_mux.h for the framing).
+#
+# usage: usbmux.py [channels]
+#
+# Opens the first multiplexer interface found and makes each channel (4 by
+# default) available as a pseudo-terminal, printing their names, so that
+# ordinary serial terminal programs can be pointed at them.
+#
+# The Mux class only needs a transport with read() and write(), so it can
+# also be used as a library, or run against a loopback for testing.
+# Needs pyusb for the USB transport.
+
+import os
+import select
+import sys
+import tty
+
+# must stay in sync with usb_mux.h
+FRAME_DATA = 0x00
+FRAME_CREDIT = 0x40
+FRAME_RESET = 0xC0
+TYPE_MASK = 0xC0
+CHANNEL_MASK = 0x3F
+RESET_CHANNEL = 0x3F
+INTERFACE_SUBCLASS = 0x4D
+INTERFACE_PROTOCOL = 0x01
+PACKET_SIZE = 64
+
+class UsbTransport:
+    def __init__(self, vendor=None, product=None):
+        import usb.core
+        import usb.util
+        self.usb = usb
+        def match(d):
+            return (vendor is None or d.idVendor == vendor) and (product is None or d.idProduct == product)
+        for dev in usb.core.find(find_all=True, custom_match=match):
+            for intf in dev.get_active_configuration():
+                if intf.bInterfaceClass == 0xFF and intf.bInterfaceSubClass == INTERFACE_SUBCLASS and intf.bInterfaceProtocol == INTERFACE_PROTOCOL:
+                    self.dev = dev
+                    self.intf = intf
+                    self.epIn = usb.util.find_descriptor(intf, custom_match=lambda e: usb.util.endpoint_direction(e.bEndpointAddress) == usb.util.ENDPOINT_IN)
+                    self.epOut = usb.util.find_descriptor(intf, custom_match=lambda e: usb.util.endpoint_direction(e.bEndpointAddress) == usb.util.ENDPOINT_OUT)
+                    try:
+                        if dev.is_kernel_driver_active(intf.bInterfaceNumber):
+                            dev.detach_kernel_driver(intf.bInterfaceNumber)
+                    except (NotImplementedError, usb.core.USBError):
+                        pass
+                    usb.util.claim_interface(dev, intf.bInterfaceNumber)
+                    return
+        raise IOError("no USB multiplexer found")
+
+    # one packet at a time, so that a full packet never leaves the read waiting for more
+    def read(self, timeout):
+        try:
+            return bytes(self.epIn.read(self.epIn.wMaxPacketSize, timeout=timeout))
+        except self.usb.core.USBTimeoutError:
+            return b""
+
+    def write(self, data):
+        self.epOut.write(data)
+
+class Channel:
+    def __init__(self, mux, number, bufferSize):
+        self.mux = mux
+        self.number = number
+        self.bufferSize = bufferSize
+        self.rx = bytearray()
+        self.tx = bytearray()
+        self.txCredit = 0
+        self.rxOutstanding = 0
+
+    def write(self, data):
+        self.tx += data
+        self.mux.pump()
+
+    # returns whatever has arrived, up to n bytes
+    def read(self, n=None):
+        if n is None:
+            n = len(self.rx)
+        data = bytes(self.rx[:n])
+        del self.rx[:n]
+        if data:
+            self.mux.pump()
+        return data
+
+    def grant(self):
+        free = self.bufferSize - len(self.rx) - self.rxOutstanding
+        if free >= self.bufferSize // 4 or (free > 0 and self.rxOutstanding == 0):
+            free = min(free, 0xFFFF)
+            self.rxOutstanding += free
+            return free
+        return 0
+
+class Mux:
+    def __init__(self, transport, numChannels, bufferSize=4096, timeout=1000):
+        self.transport = transport
+        self.channels = [ Channel(self, i, bufferSize) for i in range(numChannels) ]
+        self.next = 0
+        self.inbuf = bytearray()
+        self.open = False
+        # drain anything left over from an earlier session, then resynchronize
+        self.transport.write(bytes((FRAME_RESET | RESET_CHANNEL, 0)))
+        waited = 0
+        while not self.open:
+            packet = self.transport.read(100)
+            if not packet:
+                waited += 100
+                if waited >= timeout:
+                    raise IOError("no RESET from the device")
+                continue
+            self.parse(packet)
+        self.pump()
+
+    def parse(self, packet):
+        # IN frames never straddle packets
+        i = 0
+        while i + 2 <= len(packet):
+            header, length = packet[i], packet[i+1]
+            payload = packet[i+2:i+2+length]
+            i += 2 + length
+            kind = header & TYPE_MASK
+            channel = header & CHANNEL_MASK
+            if kind == FRAME_RESET:
+                self.open = True
+                for c in self.channels:
+                    c.rx.clear()
+                    c.txCredit = 0
+                    c.rxOutstanding = 0
+            elif not self.open:
+                continue
+            elif channel >= len(self.channels):
+                continue
+            elif kind == FRAME_CREDIT and length == 2:
+                self.channels[channel].txCredit += payload[0] | (payload[1] << 8)
+            elif kind == FRAME_DATA:
+                c = self.channels[channel]
+                c.rx += payload
+                c.rxOutstanding = max(0, c.rxOutstanding - len(payload))
+
+    # sends credit grants and whatever data the device has credit for, round-robin
+    def pump(self):
+        out = bytearray()
+        for c in self.channels:
+            g = c.grant()
+            if g:
+                out += bytes((FRAME_CREDIT | c.number, 2, g & 0xFF, g >> 8))
+        while True:
+            sent = False
+            for k in range(len(self.channels)):
+                c = self.channels[(self.next + k) % len(self.channels)]
+                n = min(len(c.tx), c.txCredit, 255)
+                if n:
+                    out += bytes((FRAME_DATA | c.number, n)) + c.tx[:n]
+                    del c.tx[:n]
+                    c.txCredit -= n
+                    self.next = (c.number + 1) % len(self.channels)
+                    sent = True
+            if not sent:
+                break
+        if out:
+            self.transport.write(bytes(out))
+
+    # reads one packet from the device, if there is one within timeout milliseconds
+    def poll(self, timeout=10):
+        packet = self.transport.read(timeout)
+        if packet:
+            self.parse(packet)
+            self.pump()
+        return bool(packet)
+
+def main():
+    numChannels = int(sys.argv[1]) if len(sys.argv) > 1 else 4
+    mux = Mux(UsbTransport(), numChannels)
+    ptys = []
+    for c in mux.channels:
+        master, slave = os.openpty()
+        tty.setraw(slave)
+        ptys.append(master)
+        print("channel %d: %s" % (c.number, os.ttyname(slave)))
+    while True:
+        ready, _, _ = select.select(ptys, [], [], 0)
+        for master in ready:
+            c = mux.channels[ptys.index(master)]
+            try:
+                c.write(os.read(master, 4096))
+            except OSError:
+                pass # nobody has the terminal open
+        mux.poll(5)
+        for c, master in zip(mux.channels, ptys):
+            data = c.read()
+            if data:
+                os.write(master, data)
+
+if __name__ == "__main__":
+    main()
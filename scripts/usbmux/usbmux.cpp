@@ -0,0 +1,258 @@
+/*
+ * Host side of the USBMux channel multiplexer; see usbmux.h.
+ */
+
+#include "usbmux.h"
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace usbmux {
+
+int FdTransport::read(uint8_t* buf, size_t size, int timeoutMillis) {
+    struct pollfd p;
+    p.fd = readFd;
+    p.events = POLLIN;
+    int ready;
+    do {
+        ready = ::poll(&p, 1, timeoutMillis);
+    } while (ready < 0 && errno == EINTR);
+    if (ready <= 0)
+        return ready;
+    ssize_t n;
+    do {
+        n = ::read(readFd, buf, size);
+    } while (n < 0 && errno == EINTR);
+    return n == 0 ? -1 : (int)n; // end of file: the other side has gone
+}
+
+int FdTransport::write(const uint8_t* data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = ::write(writeFd, data + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return (int)len;
+}
+
+Mux::Mux(Transport& _transport, unsigned numChannels, size_t _bufferSize) :
+        transport(_transport), channels(numChannels < MAX_CHANNELS ? numChannels : MAX_CHANNELS),
+        bufferSize(_bufferSize), opened(false), nextChannel(0), dropped(0), rxPos(0), ioError(false) {
+    resetChannels();
+}
+
+void Mux::resetChannels() {
+    for (size_t i = 0 ; i < channels.size() ; i++) {
+        channels[i].rx.clear();
+        channels[i].tx.clear();
+        channels[i].txCredit = 0;
+        channels[i].rxOutstanding = 0;
+    }
+    nextChannel = 0;
+}
+
+bool Mux::open(int timeoutMillis) {
+    // whatever either side had buffered belongs to the old session
+    opened = false;
+    resetChannels();
+    const uint8_t reset[2] = { (uint8_t)(FRAME_RESET | RESET_CHANNEL), 0 };
+    if (transport.write(reset, sizeof(reset)) < 0) {
+        ioError = true;
+        return false;
+    }
+
+    uint8_t buf[4096];
+    int waited = 0;
+    const int step = 10;
+    while (!opened && waited < timeoutMillis) {
+        int n = transport.read(buf, sizeof(buf), step);
+        if (n < 0) {
+            ioError = true;
+            return false;
+        }
+        if (n == 0) {
+            waited += step;
+            continue;
+        }
+        // IN frames never straddle packets, so until the RESET every read starts afresh
+        rxPos = 0;
+        parse(buf, n);
+    }
+    if (opened)
+        pump();
+    return opened;
+}
+
+void Mux::endFrame() {
+    uint8_t type = rxHeader & FRAME_TYPE_MASK;
+    unsigned channel = rxHeader & CHANNEL_MASK;
+
+    rxPos = 0;
+    if (type == FRAME_RESET) {
+        resetChannels();
+        opened = true;
+    }
+    else if (type == FRAME_CREDIT && opened && channel < channels.size() && rxLength == 2) {
+        channels[channel].txCredit += rxCredit[0] | (rxCredit[1] << 8);
+    }
+}
+
+// the same state machine as the device's, so frames may straddle reads
+void Mux::parse(const uint8_t* p, size_t len) {
+    while (len > 0) {
+        if (rxPos == 0) {
+            rxHeader = *p++;
+            len--;
+            rxPos = 1;
+        }
+        else if (rxPos == 1) {
+            rxLength = *p++;
+            len--;
+            rxPos = 2;
+            if (rxLength == 0)
+                endFrame();
+        }
+        else {
+            size_t take = rxLength + 2 - rxPos;
+            if (take > len)
+                take = len;
+            unsigned channel = rxHeader & CHANNEL_MASK;
+            if ((rxHeader & FRAME_TYPE_MASK) == FRAME_DATA) {
+                if (opened && channel < channels.size()) {
+                    Channel& c = channels[channel];
+                    size_t room = bufferSize - c.rx.size();
+                    size_t pushed = take < room ? take : room;
+                    c.rx.insert(c.rx.end(), p, p + pushed);
+                    dropped += take - pushed;
+                    c.rxOutstanding = c.rxOutstanding > take ? c.rxOutstanding - take : 0;
+                }
+                else if (opened) {
+                    dropped += take;
+                }
+            }
+            else {
+                for (size_t i = 0 ; i < take ; i++)
+                    if (rxPos - 2 + i < sizeof(rxCredit))
+                        rxCredit[rxPos - 2 + i] = p[i];
+            }
+            p += take;
+            len -= take;
+            rxPos += take;
+            if (rxPos == rxLength + 2u)
+                endFrame();
+        }
+    }
+}
+
+uint32_t Mux::creditToGrant(const Channel& c) const {
+    size_t free = bufferSize - c.rx.size();
+    return free > c.rxOutstanding ? (uint32_t)(free - c.rxOutstanding) : 0;
+}
+
+bool Mux::pump() {
+    if (!opened)
+        return true;
+
+    std::vector<uint8_t> out;
+    for (size_t i = 0 ; i < channels.size() ; i++) {
+        Channel& c = channels[i];
+        uint32_t grant = creditToGrant(c);
+        // fewer, larger grants, without letting the device run dry
+        if (grant >= bufferSize / 4 || (grant > 0 && c.rxOutstanding == 0)) {
+            if (grant > 0xFFFF)
+                grant = 0xFFFF;
+            out.push_back(FRAME_CREDIT | i);
+            out.push_back(2);
+            out.push_back((uint8_t)grant);
+            out.push_back((uint8_t)(grant >> 8));
+            c.rxOutstanding += grant;
+        }
+    }
+
+    // one frame per channel at a time, until nothing has both data and credit
+    bool sent = true;
+    while (sent) {
+        sent = false;
+        unsigned channel = nextChannel;
+        for (size_t i = 0 ; i < channels.size() ; i++) {
+            Channel& c = channels[channel];
+            size_t amount = c.tx.size();
+            if (amount > c.txCredit)
+                amount = c.txCredit;
+            if (amount > MAX_FRAME_PAYLOAD)
+                amount = MAX_FRAME_PAYLOAD;
+            if (amount > 0) {
+                out.push_back(FRAME_DATA | channel);
+                out.push_back((uint8_t)amount);
+                out.insert(out.end(), c.tx.begin(), c.tx.begin() + amount);
+                c.tx.erase(c.tx.begin(), c.tx.begin() + amount);
+                c.txCredit -= amount;
+                nextChannel = channel + 1 < channels.size() ? channel + 1 : 0;
+                sent = true;
+            }
+            channel = channel + 1 < channels.size() ? channel + 1 : 0;
+        }
+    }
+
+    if (out.empty())
+        return true;
+    if (transport.write(&out[0], out.size()) < 0) {
+        ioError = true;
+        return false;
+    }
+    return true;
+}
+
+bool Mux::poll(int timeoutMillis) {
+    uint8_t buf[4096];
+    int n = transport.read(buf, sizeof(buf), timeoutMillis);
+    if (n < 0)
+        ioError = true;
+    if (n <= 0)
+        return false;
+    parse(buf, n);
+    return pump();
+}
+
+size_t Mux::write(unsigned channel, const uint8_t* data, size_t len) {
+    if (channel >= channels.size())
+        return 0;
+    Channel& c = channels[channel];
+    size_t room = bufferSize - c.tx.size();
+    if (len > room)
+        len = room;
+    c.tx.insert(c.tx.end(), data, data + len);
+    pump();
+    return len;
+}
+
+size_t Mux::read(unsigned channel, uint8_t* data, size_t len) {
+    if (channel >= channels.size())
+        return 0;
+    Channel& c = channels[channel];
+    if (len > c.rx.size())
+        len = c.rx.size();
+    std::copy(c.rx.begin(), c.rx.begin() + len, data);
+    c.rx.erase(c.rx.begin(), c.rx.begin() + len);
+    if (len > 0)
+        pump();
+    return len;
+}
+
+size_t Mux::available(unsigned channel) const {
+    return channel < channels.size() ? channels[channel].rx.size() : 0;
+}
+
+size_t Mux::pending(unsigned channel) const {
+    return channel < channels.size() ? channels[channel].tx.size() : 0;
+}
+
+uint32_t Mux::getTxCredit(unsigned channel) const {
+    return channel < channels.size() ? channels[channel].txCredit : 0;
+}
+
+}
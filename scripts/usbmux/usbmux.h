@@ -0,0 +1,112 @@
+/*
+ * Host side of the USBMux channel multiplexer (see usb_mux.h for the
+ * framing), in plain C++11 with nothing beyond POSIX.
+ *
+ * A Mux runs the protocol over any Transport that moves packets: FdTransport
+ * works on a pair of file descriptors (a socketpair or pipes, e.g., for a
+ * loopback, or a descriptor from a USB library), and a test can plug in its
+ * own, as tests/host/test_mux.cpp does to talk to usb_mux.c running on a
+ * simulated device. Nothing here is thread-safe; call a Mux from one thread.
+ */
+
+#ifndef _USBMUX_HOST_H_
+#define _USBMUX_HOST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+namespace usbmux {
+
+// must stay in sync with usb_mux.h
+const uint8_t FRAME_DATA = 0x00;
+const uint8_t FRAME_CREDIT = 0x40;
+const uint8_t FRAME_RESET = 0xC0;
+const uint8_t FRAME_TYPE_MASK = 0xC0;
+const uint8_t CHANNEL_MASK = 0x3F;
+const uint8_t RESET_CHANNEL = 0x3F;
+const uint8_t INTERFACE_SUBCLASS = 0x4D;
+const uint8_t INTERFACE_PROTOCOL = 0x01;
+const unsigned MAX_CHANNELS = 63;
+const unsigned MAX_FRAME_PAYLOAD = 255;
+
+class Transport {
+public:
+    virtual ~Transport() {}
+    // whatever arrives within timeoutMillis, at most size bytes: 0 on timeout, -1 on error
+    virtual int read(uint8_t* buf, size_t size, int timeoutMillis) = 0;
+    // all of len bytes, or -1 on error
+    virtual int write(const uint8_t* data, size_t len) = 0;
+};
+
+class FdTransport : public Transport {
+private:
+    int readFd;
+    int writeFd;
+public:
+    FdTransport(int _readFd, int _writeFd) : readFd(_readFd), writeFd(_writeFd) {}
+    int read(uint8_t* buf, size_t size, int timeoutMillis);
+    int write(const uint8_t* data, size_t len);
+};
+
+class Mux {
+private:
+    struct Channel {
+        std::deque<uint8_t> rx;
+        std::deque<uint8_t> tx;
+        uint32_t txCredit; // bytes the device will still take
+        uint32_t rxOutstanding; // credit given to the device and not yet used
+    };
+
+    Transport& transport;
+    std::vector<Channel> channels;
+    size_t bufferSize;
+    bool opened;
+    unsigned nextChannel; // where the round-robin resumes
+    uint32_t dropped;
+    // IN frame parser state, which carries over between reads
+    uint8_t rxHeader;
+    uint8_t rxLength;
+    unsigned rxPos; // 0: expecting a header, 1: expecting a length, 2+: in the payload
+    uint8_t rxCredit[2];
+    bool ioError;
+
+    void resetChannels();
+    void endFrame();
+    void parse(const uint8_t* data, size_t len);
+    uint32_t creditToGrant(const Channel& c) const;
+
+public:
+    // bufferSize: how much the host buffers per channel and direction
+    Mux(Transport& _transport, unsigned numChannels, size_t _bufferSize = 4096);
+
+    /*
+     * Sends a RESET and waits up to timeoutMillis for the device's, discarding
+     * whatever arrives before it. Can be called again at any time to start
+     * over, e.g., after the program on either side restarted.
+     */
+    bool open(int timeoutMillis = 1000);
+    bool isOpen() const { return opened; }
+
+    unsigned getNumChannels() const { return (unsigned)channels.size(); }
+
+    // queues as much of data as the channel's transmit buffer takes, and sends what the device has credit for
+    size_t write(unsigned channel, const uint8_t* data, size_t len);
+    // takes up to len received bytes, and lets the device know about the room
+    size_t read(unsigned channel, uint8_t* data, size_t len);
+    size_t available(unsigned channel) const;
+    size_t pending(unsigned channel) const; // queued, waiting for credit
+    uint32_t getTxCredit(unsigned channel) const;
+    uint32_t getDropped() const { return dropped; } // bytes the device sent beyond the credit given
+    bool hadError() const { return ioError; }
+
+    // sends credit grants and whatever data the device has credit for, round-robin
+    bool pump();
+    // reads from the device for up to timeoutMillis, then pumps; false on timeout or error
+    bool poll(int timeoutMillis = 10);
+};
+
+}
+
+#endif
@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+#
+# Decodes a USB trace dump (see usb_trace.h) into a timeline and latency
+# histograms.
+#
+# usage: usbtrace.py dump
+#
+# The dump is the output of usb_trace_serialize(), either as raw bytes or as
+# hex text (e.g., printed to a serial terminal and saved).
+
+import sys
+import struct
+import string
+
+# must stay in sync with usb_trace.h
+EVENTS = {
+    1: "reset",
+    2: "data setup",
+    3: "no-data setup",
+    4: "setup rejected",
+    5: "get descriptor",
+    6: "control tx",
+    7: "control rx",
+    8: "set configuration",
+    9: "IN complete",
+    10: "OUT received",
+    11: "tx queued",
+    12: "rx read",
+}
+DESCRIPTORS = { 1: "device", 2: "configuration", 3: "string", 6: "qualifier", 15: "BOS" }
+
+def load(path):
+    data = open(path, "rb").read()
+    text = data.decode("latin-1")
+    if text.strip() and all(c in string.hexdigits or c.isspace() for c in text):
+        data = bytes.fromhex("".join(text.split()))
+    if len(data) < 10 or data[0] != 1:
+        raise ValueError("not a version 1 USB trace dump")
+    ticksPerSecond, count = struct.unpack_from("<II", data, 1)
+    n = data[9]
+    entries = [ struct.unpack_from("<IBBH", data, 10 + 8 * i) for i in range(n) ]
+    return ticksPerSecond, count, entries
+
+def describe(event, endpoint, length):
+    if event == 1:
+        return ""
+    if event == 2:
+        return "bRequest=0x%02x wLength=%d" % (endpoint, length)
+    if event == 3:
+        return "bRequest=0x%02x wValue=0x%04x" % (endpoint, length)
+    if event == 4:
+        return "bRequest=0x%02x" % endpoint
+    if event == 5:
+        return "%s wLength=%d" % (DESCRIPTORS.get(endpoint, "type %d" % endpoint), length)
+    if event in (6, 7):
+        return "%d bytes" % length
+    if event == 8:
+        return "configuration %d" % length
+    if event in (9, 10):
+        return "endpoint %d" % endpoint
+    if event in (11, 12):
+        return "endpoint %d, %d bytes" % (endpoint, length)
+    return "endpoint %d length %d" % (endpoint, length)
+
+def histogram(title, values):
+    if not values:
+        return
+    print()
+    print("%s: %d samples, min %.1f us, max %.1f us, mean %.1f us" % (title, len(values), min(values), max(values), sum(values) / len(values)))
+    buckets = {}
+    for v in values:
+        b = 1
+        while b < v:
+            b *= 2
+        buckets[b] = buckets.get(b, 0) + 1
+    most = max(buckets.values())
+    for b in sorted(buckets):
+        print("  <= %8d us %6d %s" % (b, buckets[b], "#" * (1 + 50 * buckets[b] // most)))
+
+def main():
+    if len(sys.argv) != 2:
+        print("usage: usbtrace.py dump")
+        sys.exit(1)
+    ticksPerSecond, count, entries = load(sys.argv[1])
+    print("%d events recorded, %d in dump (%d lost)" % (count, len(entries), count - len(entries)))
+    if not entries:
+        return
+
+    # timestamps are free-running 32-bit counters, so work with differences
+    times = [0.0]
+    for previous, entry in zip(entries, entries[1:]):
+        times.append(times[-1] + ((entry[0] - previous[0]) & 0xFFFFFFFF) * 1e6 / ticksPerSecond)
+
+    print()
+    for t, (timestamp, event, endpoint, length) in zip(times, entries):
+        print("%12.1f us  %-18s %s" % (t, EVENTS.get(event, "user 0x%02x" % event), describe(event, endpoint, length)))
+
+    setupToData = []
+    dataPhase = []
+    queuedToIn = {}
+    outToRead = {}
+    setup = None
+    firstData = lastData = None
+    queued = {}
+    received = {}
+
+    def endControl():
+        if firstData is not None:
+            dataPhase.append(lastData - firstData)
+
+    for t, (timestamp, event, endpoint, length) in zip(times, entries):
+        if event in (1, 2, 3, 5):
+            endControl()
+            setup = t if event != 1 else None
+            firstData = lastData = None
+        elif event in (6, 7):
+            if firstData is None:
+                firstData = t
+                if setup is not None:
+                    setupToData.append(t - setup)
+            lastData = t
+        elif event == 11:
+            queued.setdefault(endpoint, t)
+        elif event == 9 and endpoint in queued:
+            queuedToIn.setdefault(endpoint, []).append(t - queued.pop(endpoint))
+        elif event == 10:
+            received[endpoint] = t
+        elif event == 12 and endpoint in received:
+            outToRead.setdefault(endpoint, []).append(t - received.pop(endpoint))
+    endControl()
+
+    # the status stage is handled by the core and isn't traced; the end of the data stage is the closest we get
+    histogram("setup -> first data packet", setupToData)
+    histogram("first -> last data packet", dataPhase)
+    for endpoint in sorted(queuedToIn):
+        histogram("endpoint %d: tx queued -> IN complete" % endpoint, queuedToIn[endpoint])
+    for endpoint in sorted(outToRead):
+        histogram("endpoint %d: OUT received -> read" % endpoint, outToRead[endpoint])
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,74 @@
+/*
+ * Host time per 64-byte packet for the PMA copy kernels, next to the
+ * halfword loops they replaced, at each RAM alignment. The numbers are for
+ * the development machine, not a Cortex-M3, so only the ratios between the
+ * rows mean anything, and then only roughly.
+ */
+
+#include <time.h>
+#include "test_util.h"
+#include "usb_generic.h"
+
+#define PACKET 64
+#define ROUNDS 2000000
+
+static uint8 ram[PACKET + 8] __attribute__((aligned(4)));
+static uint32 pma[PACKET/2];
+
+// the loops the kernels replaced, with memcpy standing in for their unaligned halfword accesses
+static void __attribute__((noinline)) old_copy_to_pma(volatile const uint8* buf, uint16 len, uint32* dst) {
+    uint16 n = len >> 1;
+    for (uint16 i = 0; i < n; i++) {
+        *(volatile uint32*)dst = (uint16)(buf[0] | buf[1] << 8);
+        buf += 2;
+        dst++;
+    }
+    if (len & 1)
+        *(volatile uint32*)dst = *buf;
+}
+
+static void __attribute__((noinline)) old_copy_from_pma(volatile uint8* buf, uint16 len, uint32* src) {
+    uint16 n = len >> 1;
+    for (uint16 i = 0; i < n; i++) {
+        uint16 w = *(volatile uint32*)src++;
+        memcpy((uint8*)buf, &w, 2);
+        buf += 2;
+    }
+    if (len & 1)
+        *buf = *src & 0xFF;
+}
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+typedef void (*copy_fn)(volatile uint8*, uint16, uint32*);
+
+static double time_copy(copy_fn f, unsigned align) {
+    double start = now();
+    for (unsigned i = 0; i < ROUNDS; i++) {
+        f(ram + align, PACKET, pma);
+        __asm__ volatile ("" ::: "memory");
+    }
+    return (now() - start) * 1e9 / ROUNDS;
+}
+
+static void to_pma(volatile uint8* buf, uint16 len, uint32* dst) {
+    usb_copy_to_pma_ptr(buf, len, dst);
+}
+
+static void old_to_pma(volatile uint8* buf, uint16 len, uint32* dst) {
+    old_copy_to_pma(buf, len, dst);
+}
+
+int main(void) {
+    printf("ns per %u-byte packet   to PMA (old)   from PMA (old)\n", PACKET);
+    for (unsigned align = 0; align < 4; align++) {
+        printf("alignment %u            %5.1f (%5.1f)   %5.1f (%5.1f)\n", align,
+            time_copy(to_pma, align), time_copy(old_to_pma, align),
+            time_copy(usb_copy_from_pma_ptr, align), time_copy(old_copy_from_pma, align));
+    }
+    return 0;
+}
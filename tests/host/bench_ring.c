@@ -0,0 +1,104 @@
+/*
+ * usb_ring throughput on the host: 64-byte packets through a 1024-byte ring,
+ * first with both sides in one thread, then with a producer and a consumer
+ * thread, each by copying and by the zero-copy spans.
+ */
+
+#define USB_RING_HOST
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "usb_ring.h"
+#include "test_util.h"
+
+#define PACKET 64
+#define BYTES (256u << 20)
+
+static volatile uint8 storage[1024];
+static usb_ring ring;
+static uint8 useSpans;
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static uint32 put(const uint8* data) {
+    if (!useSpans)
+        return usb_ring_push(&ring, data, PACKET);
+    uint32 n;
+    uint8* span = usb_ring_write_span(&ring, &n);
+    if (n > PACKET)
+        n = PACKET;
+    memcpy(span, data, n);
+    usb_ring_commit_write(&ring, n);
+    return n;
+}
+
+static uint32 get(uint8* data) {
+    if (!useSpans)
+        return usb_ring_pop(&ring, data, PACKET);
+    uint32 n;
+    const uint8* span = usb_ring_read_span(&ring, &n);
+    if (n > PACKET)
+        n = PACKET;
+    memcpy(data, span, n);
+    usb_ring_commit_read(&ring, n);
+    return n;
+}
+
+static void* producer(void* arg) {
+    uint8 data[PACKET] = { 0 };
+    for (uint32 sent = 0; sent < BYTES; ) {
+        uint32 n = put(data);
+        if (n == 0)
+            sched_yield(); // let the consumer run, even on a single core
+        sent += n;
+    }
+    return NULL;
+}
+
+static void* consumer(void* arg) {
+    uint8 data[PACKET];
+    for (uint32 received = 0; received < BYTES; ) {
+        uint32 n = get(data);
+        if (n == 0)
+            sched_yield();
+        received += n;
+    }
+    return NULL;
+}
+
+static double one_thread(void) {
+    uint8 data[PACKET] = { 0 };
+    usb_ring_init(&ring, storage, sizeof(storage));
+    double start = now();
+    for (uint32 moved = 0; moved < BYTES; ) {
+        put(data);
+        moved += get(data);
+    }
+    return BYTES / (now() - start) / 1e6;
+}
+
+static double two_threads(void) {
+    pthread_t p, c;
+    usb_ring_init(&ring, storage, sizeof(storage));
+    double start = now();
+    pthread_create(&p, NULL, producer, NULL);
+    pthread_create(&c, NULL, consumer, NULL);
+    pthread_join(p, NULL);
+    pthread_join(c, NULL);
+    return BYTES / (now() - start) / 1e6;
+}
+
+int main(void) {
+    printf("MB/s, %u-byte packets     push/pop   spans\n", PACKET);
+    useSpans = 0;
+    double copy1 = one_thread(), copy2 = two_threads();
+    useSpans = 1;
+    double span1 = one_thread(), span2 = two_threads();
+    printf("one thread               %8.0f  %6.0f\n", copy1, span1);
+    printf("producer and consumer    %8.0f  %6.0f\n", copy2, span2);
+    return 0;
+}
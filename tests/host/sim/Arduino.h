@@ -0,0 +1,20 @@
+/*
+ * The Arduino core's main header, for the library's C++ classes on the host.
+ */
+
+#ifndef _USB_SIM_ARDUINO_H_
+#define _USB_SIM_ARDUINO_H_
+
+#include <string.h>
+#include "boards.h"
+#include "Stream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+uint32 millis(void); // see usb_sim_set_wait_hook()
+#ifdef __cplusplus
+}
+#endif
+
+#endif
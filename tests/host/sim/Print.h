@@ -0,0 +1,24 @@
+/*
+ * Just enough of the Arduino core's Print for the library's C++ classes to
+ * build on the host.
+ */
+
+#ifndef _USB_SIM_PRINT_H_
+#define _USB_SIM_PRINT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t ch) = 0;
+    virtual size_t write(const uint8_t* buf, size_t size) {
+        size_t n = 0;
+        while (size-- > 0)
+            n += write(*buf++);
+        return n;
+    }
+};
+
+#endif
@@ -0,0 +1,19 @@
+/*
+ * Just enough of the Arduino core's Stream for the library's C++ classes to
+ * build on the host.
+ */
+
+#ifndef _USB_SIM_STREAM_H_
+#define _USB_SIM_STREAM_H_
+
+#include "Print.h"
+
+class Stream : public Print {
+public:
+    virtual int available(void) = 0;
+    virtual int read(void) = 0;
+    virtual int peek(void) = 0;
+    virtual void flush(void) {}
+};
+
+#endif
@@ -0,0 +1 @@
+#include "usb_sim_board.h"
@@ -0,0 +1,1377 @@
+/*
+ * A host-side model of the STM32F1 USB full-speed device peripheral and the
+ * parts of libmaple and ST's usb_lib that the library sits on, so the real
+ * class drivers and usb_generic.c can be run and timed on a PC.
+ *
+ * What is modelled:
+ *  - EPnR registers with their mixed write semantics (rc_w0 CTR bits, toggle-on-1
+ *    DTOG and STAT fields, read-only SETUP), written through libmaple's
+ *    accessors exactly as libmaple computes the values;
+ *  - ISTR, whose flags clear on writing 0 and whose CTR/DIR/EP_ID fields follow
+ *    the endpoint registers, CNTR interrupt masks, FNR and DADDR;
+ *  - 512 bytes of packet memory, one halfword per 32-bit slot, with the buffer
+ *    descriptor table and the RX block-count encoding;
+ *  - single-buffered, double-buffered bulk (DTOG vs SW_BUF ownership) and
+ *    isochronous endpoints, data toggles and NAK/STALL/disabled handshakes;
+ *  - libmaple's USB interrupt handler and ST's endpoint 0 state machine
+ *    (Setup0/In0/Out0, the data stages and the standard requests);
+ *  - the NVIC enable bit, PRIMASK, PendSV (with priorities, so USB preempts
+ *    PendSV but not itself), and a vector table reached through VTOR;
+ *  - a microsecond clock that the host advances a frame at a time.
+ *
+ * Timing inside a frame, suspend/resume and CRC/bit-level errors are not.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "usb_sim.h"
+
+usb_reg_map usb_sim_regs;
+uint32 usb_sim_pma[USB_PMA_WORDS];
+scb_reg_map usb_sim_scb;
+__io uint32 usb_sim_dwt_ctrl;
+__io uint32 usb_sim_scb_demcr;
+__io uint32 usb_sim_scb_shpr3;
+
+static uint64 now_micros;
+static __io uint32 dwt_cyccnt;
+static uint32 error_count;
+
+static void sim_error(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "usb_sim: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    error_count++;
+}
+
+uint32 usb_sim_errors(void) {
+    return error_count;
+}
+
+/*
+ * Clock
+ */
+
+uint64 usb_sim_micros(void) {
+    return now_micros;
+}
+
+uint32 usb_sim_millis(void) {
+    return (uint32)(now_micros / 1000);
+}
+
+__io uint32* usb_sim_cycle_counter(void) {
+    if (usb_sim_dwt_ctrl & 1)
+        dwt_cyccnt = (uint32)(now_micros * (F_CPU / 1000000));
+    return &dwt_cyccnt;
+}
+
+static void (*wait_hook)(void) = NULL;
+
+void usb_sim_set_wait_hook(void (*hook)(void)) {
+    wait_hook = hook;
+}
+
+uint32 millis(void) {
+    static uint8 waiting = 0;
+    if (wait_hook != NULL && !waiting) {
+        waiting = 1; // the hook may itself end up in code that reads the clock
+        wait_hook();
+        waiting = 0;
+    }
+    return usb_sim_millis();
+}
+
+uint32 systick_uptime(void) {
+    return usb_sim_millis();
+}
+
+/*
+ * NVIC and vector table
+ */
+
+#define SIM_VECTORS (16+68)
+#define SIM_PENDSV_VECTOR 14
+#define SIM_USB_LP_VECTOR (16+NVIC_USB_LP_CAN_RX0)
+#define SIM_ICSR_PENDSVSET (1u << 28)
+
+void __irq_usb_lp_can_rx0(void);
+
+static void (*flash_vectors[SIM_VECTORS])(void);
+static uint8 usb_irq_enabled;
+static uint8 irqs_masked; // PRIMASK
+static uint8 active_level; // 0 thread, 1 PendSV, 2 USB
+
+static void unexpected_vector(void) {
+    sim_error("exception with no handler installed");
+}
+
+static void istr_update(void);
+static uint32 istr_state;
+
+static void run_vector(unsigned n, uint8 level) {
+    void (**vectors)(void) = (void (**)(void))usb_sim_scb.VTOR;
+    uint8 saved = active_level;
+    active_level = level;
+    if (n == SIM_USB_LP_VECTOR)
+        istr_update();
+    vectors[n]();
+    active_level = saved;
+}
+
+// takes whatever interrupts are pending and allowed at the current level
+static void take_interrupts(void) {
+    if (irqs_masked)
+        return;
+    for (unsigned n = 0 ; ; n++) {
+        if (n == 10000) {
+            sim_error("interrupt keeps firing: ISTR %04x CNTR %04x", (unsigned)istr_state, (unsigned)usb_sim_regs.CNTR);
+            return;
+        }
+        istr_update();
+        if (active_level < 2 && usb_irq_enabled && (istr_state & usb_sim_regs.CNTR & 0xFF00) != 0) {
+            run_vector(SIM_USB_LP_VECTOR, 2);
+        }
+        else if (active_level < 1 && (usb_sim_scb.ICSR & SIM_ICSR_PENDSVSET)) {
+            usb_sim_scb.ICSR &= ~SIM_ICSR_PENDSVSET;
+            run_vector(SIM_PENDSV_VECTOR, 1);
+        }
+        else {
+            break;
+        }
+    }
+}
+
+void nvic_irq_enable(nvic_irq_num irq_num) {
+    if (irq_num == NVIC_USB_LP_CAN_RX0) {
+        usb_irq_enabled = 1;
+        take_interrupts();
+    }
+}
+
+void nvic_irq_disable(nvic_irq_num irq_num) {
+    if (irq_num == NVIC_USB_LP_CAN_RX0)
+        usb_irq_enabled = 0;
+}
+
+void nvic_globalirq_enable(void) {
+    irqs_masked = 0;
+    take_interrupts();
+}
+
+void nvic_globalirq_disable(void) {
+    irqs_masked = 1;
+}
+
+void nvic_sys_reset(void) {
+    sim_error("system reset requested");
+}
+
+void iwdg_init(iwdg_prescaler prescaler, uint16 reload) {
+    sim_error("watchdog started");
+}
+
+void bkp_init(void) {
+}
+
+void bkp_enable_writes(void) {
+}
+
+void bkp_disable_writes(void) {
+}
+
+void bkp_write(uint8 reg, uint16 val) {
+}
+
+void delay_us(uint32 us) {
+    now_micros += us;
+    take_interrupts();
+}
+
+void usb_sim_advance_micros(uint32 micros) {
+    now_micros += micros;
+}
+
+/*
+ * GPIO: only the USB disconnect pin matters
+ */
+
+struct gpio_dev {
+    uint8 bits[16];
+};
+
+static gpio_dev gpioa;
+static gpio_dev disc_port;
+gpio_dev* const GPIOA = &gpioa;
+gpio_dev* usb_sim_disc_port = &disc_port;
+
+void gpio_set_mode(gpio_dev* dev, uint8 pin, gpio_pin_mode mode) {
+    (void)dev;
+    (void)pin;
+    (void)mode;
+}
+
+void gpio_write_bit(gpio_dev* dev, uint8 pin, uint8 val) {
+    dev->bits[pin & 15] = val;
+}
+
+// writing 0 to the disconnect pin turns the D+ pull-up on
+uint8 usb_sim_pullup(void) {
+    return disc_port.bits[BOARD_USB_DISC_BIT] == 0;
+}
+
+/*
+ * Registers
+ */
+
+#define EP_CTR_NOP (USB_EP_CTR_RX | USB_EP_CTR_TX)
+#define EP_NONTOGGLE_MASK (USB_EP_CTR_RX | USB_EP_SETUP | USB_EP_EP_TYPE | USB_EP_EP_KIND | USB_EP_CTR_TX | USB_EP_EA)
+#define EP_TOGGLE_MASK (USB_EP_DTOG_RX | USB_EP_STAT_RX | USB_EP_DTOG_TX | USB_EP_STAT_TX)
+
+// what a store to EPnR does to it
+static void epr_write(uint8 ep, uint32 value) {
+    uint32 old = usb_sim_regs.EP[ep];
+    uint32 epr = old & value & EP_CTR_NOP;
+    epr |= (old ^ value) & EP_TOGGLE_MASK;
+    epr |= old & USB_EP_SETUP;
+    epr |= value & (USB_EP_EP_TYPE | USB_EP_EP_KIND | USB_EP_EA);
+    usb_sim_regs.EP[ep] = epr;
+}
+
+/*
+ * ISTR flags are cleared by writing 0, and the library writes the register
+ * directly, so a store is noticed by comparing with what the peripheral last
+ * put there: bits written as 0 are cleared, and nothing else changes.
+ */
+static void istr_update(void) {
+    uint32 written = usb_sim_regs.ISTR;
+    if (written != istr_state)
+        istr_state &= written;
+    istr_state &= ~(USB_ISTR_CTR | USB_ISTR_DIR | USB_ISTR_EP_ID);
+    for (unsigned ep = 0 ; ep < 8 ; ep++) {
+        uint32 epr = usb_sim_regs.EP[ep];
+        if (epr & (USB_EP_CTR_RX | USB_EP_CTR_TX)) {
+            istr_state |= USB_ISTR_CTR | ep | ((epr & USB_EP_CTR_RX) ? USB_ISTR_DIR : 0);
+            break;
+        }
+    }
+    usb_sim_regs.ISTR = istr_state;
+}
+
+static void istr_set(uint32 bits) {
+    istr_update();
+    istr_state |= bits;
+    usb_sim_regs.ISTR = istr_state;
+}
+
+static void istr_clear(uint32 bits) {
+    istr_update();
+    istr_state &= ~bits;
+    usb_sim_regs.ISTR = istr_state;
+}
+
+// libmaple's accessors, computing the written value the same way
+
+void usb_set_ep_type(uint8 ep, uint32 type) {
+    uint32 epr = usb_sim_regs.EP[ep] & EP_NONTOGGLE_MASK & ~USB_EP_EP_TYPE;
+    epr_write(ep, epr | type | EP_CTR_NOP);
+}
+
+void usb_set_ep_kind(uint8 ep, uint32 kind) {
+    uint32 epr = usb_sim_regs.EP[ep] & EP_NONTOGGLE_MASK & ~USB_EP_EP_KIND;
+    epr_write(ep, epr | kind | EP_CTR_NOP);
+}
+
+void usb_clear_status_out(uint8 ep) {
+    usb_set_ep_kind(ep, 0);
+}
+
+void usb_set_ep_rx_stat(uint8 ep, uint32 status) {
+    uint32 epr = usb_sim_regs.EP[ep];
+    epr &= ~(USB_EP_STAT_TX | USB_EP_DTOG_RX | USB_EP_DTOG_TX);
+    epr |= EP_CTR_NOP;
+    epr ^= status;
+    epr_write(ep, epr);
+}
+
+void usb_set_ep_tx_stat(uint8 ep, uint32 status) {
+    uint32 epr = usb_sim_regs.EP[ep];
+    epr &= ~(USB_EP_STAT_RX | USB_EP_DTOG_RX | USB_EP_DTOG_TX);
+    epr |= EP_CTR_NOP;
+    epr ^= status;
+    epr_write(ep, epr);
+}
+
+void usb_clear_ctr_rx(uint8 ep) {
+    epr_write(ep, usb_sim_regs.EP[ep] & EP_NONTOGGLE_MASK & ~USB_EP_CTR_RX);
+}
+
+void usb_clear_ctr_tx(uint8 ep) {
+    epr_write(ep, usb_sim_regs.EP[ep] & EP_NONTOGGLE_MASK & ~USB_EP_CTR_TX);
+}
+
+uint32 usb_get_ep_dtog_tx(uint8 ep) {
+    return usb_sim_regs.EP[ep] & USB_EP_DTOG_TX;
+}
+
+uint32 usb_get_ep_dtog_rx(uint8 ep) {
+    return usb_sim_regs.EP[ep] & USB_EP_DTOG_RX;
+}
+
+void usb_toggle_ep_dtog_tx(uint8 ep) {
+    epr_write(ep, (usb_sim_regs.EP[ep] & EP_NONTOGGLE_MASK) | EP_CTR_NOP | USB_EP_DTOG_TX);
+}
+
+void usb_toggle_ep_dtog_rx(uint8 ep) {
+    epr_write(ep, (usb_sim_regs.EP[ep] & EP_NONTOGGLE_MASK) | EP_CTR_NOP | USB_EP_DTOG_RX);
+}
+
+void usb_clear_ep_dtog_tx(uint8 ep) {
+    if (usb_get_ep_dtog_tx(ep))
+        usb_toggle_ep_dtog_tx(ep);
+}
+
+void usb_clear_ep_dtog_rx(uint8 ep) {
+    if (usb_get_ep_dtog_rx(ep))
+        usb_toggle_ep_dtog_rx(ep);
+}
+
+uint32 usb_get_ep_tx_sw_buf(uint8 ep) {
+    return usb_get_ep_dtog_rx(ep);
+}
+
+uint32 usb_get_ep_rx_sw_buf(uint8 ep) {
+    return usb_get_ep_dtog_tx(ep);
+}
+
+void usb_toggle_ep_tx_sw_buf(uint8 ep) {
+    usb_toggle_ep_dtog_rx(ep);
+}
+
+void usb_toggle_ep_rx_sw_buf(uint8 ep) {
+    usb_toggle_ep_dtog_tx(ep);
+}
+
+/*
+ * Packet memory and the buffer descriptor table
+ */
+
+#define PMA_BYTES (2*USB_PMA_WORDS)
+
+enum { ADDR_TX, COUNT_TX, ADDR_RX, COUNT_RX };
+
+static uint32* btable_entry(uint8 ep, unsigned field) {
+    return &usb_sim_pma[((usb_sim_regs.BTABLE & 0xFFF8) + ep*8 + field*2) / 2];
+}
+
+static uint16 btable_get(uint8 ep, unsigned field) {
+    return *btable_entry(ep, field) & 0xFFFF;
+}
+
+static void btable_set(uint8 ep, unsigned field, uint16 value) {
+    *btable_entry(ep, field) = value;
+}
+
+static uint16 rx_count_encoding(uint16 count) {
+    uint32 blocks;
+    if (count > 62) {
+        blocks = count >> 5;
+        if ((count & 0x1F) == 0)
+            blocks--;
+        return (blocks << 10) | 0x8000;
+    }
+    blocks = count >> 1;
+    if (count & 1)
+        blocks++;
+    return blocks << 10;
+}
+
+static uint32 rx_capacity(uint16 countField) {
+    uint32 blocks = (countField >> 10) & 0x1F;
+    return (countField & 0x8000) ? (blocks + 1) * 32 : blocks * 2;
+}
+
+uint16 usb_get_ep_tx_addr(uint8 ep) {
+    return btable_get(ep, ADDR_TX);
+}
+
+uint16 usb_get_ep_rx_addr(uint8 ep) {
+    return btable_get(ep, ADDR_RX);
+}
+
+void usb_set_ep_tx_addr(uint8 ep, uint16 addr) {
+    btable_set(ep, ADDR_TX, addr & ~1);
+}
+
+void usb_set_ep_rx_addr(uint8 ep, uint16 addr) {
+    btable_set(ep, ADDR_RX, addr & ~1);
+}
+
+uint16 usb_get_ep_tx_count(uint8 ep) {
+    return btable_get(ep, COUNT_TX) & 0x3FF;
+}
+
+uint16 usb_get_ep_rx_count(uint8 ep) {
+    return btable_get(ep, COUNT_RX) & 0x3FF;
+}
+
+void usb_set_ep_tx_count(uint8 ep, uint16 count) {
+    btable_set(ep, COUNT_TX, count & 0x3FF);
+}
+
+void usb_set_ep_rx_count(uint8 ep, uint16 count) {
+    btable_set(ep, COUNT_RX, rx_count_encoding(count));
+}
+
+// double buffering: buffer 0 uses the TX fields and buffer 1 the RX fields, in either direction
+
+void usb_set_ep_tx_buf0_addr(uint8 ep, uint16 addr) {
+    btable_set(ep, ADDR_TX, addr & ~1);
+}
+
+void usb_set_ep_tx_buf1_addr(uint8 ep, uint16 addr) {
+    btable_set(ep, ADDR_RX, addr & ~1);
+}
+
+void usb_set_ep_rx_buf0_addr(uint8 ep, uint16 addr) {
+    btable_set(ep, ADDR_TX, addr & ~1);
+}
+
+void usb_set_ep_rx_buf1_addr(uint8 ep, uint16 addr) {
+    btable_set(ep, ADDR_RX, addr & ~1);
+}
+
+void usb_set_ep_tx_buf0_count(uint8 ep, uint16 count) {
+    btable_set(ep, COUNT_TX, count & 0x3FF);
+}
+
+void usb_set_ep_tx_buf1_count(uint8 ep, uint16 count) {
+    btable_set(ep, COUNT_RX, count & 0x3FF);
+}
+
+void usb_set_ep_rx_buf0_count(uint8 ep, uint16 count) {
+    btable_set(ep, COUNT_TX, rx_count_encoding(count));
+}
+
+void usb_set_ep_rx_buf1_count(uint8 ep, uint16 count) {
+    btable_set(ep, COUNT_RX, rx_count_encoding(count));
+}
+
+uint16 usb_get_ep_rx_buf0_count(uint8 ep) {
+    return btable_get(ep, COUNT_TX) & 0x3FF;
+}
+
+uint16 usb_get_ep_rx_buf1_count(uint8 ep) {
+    return btable_get(ep, COUNT_RX) & 0x3FF;
+}
+
+void SetEPRxStatus(uint8 bEpNum, uint16 wState) {
+    usb_set_ep_rx_stat(bEpNum, wState);
+}
+
+uint16 GetEPTxAddr(uint8 bEpNum) {
+    return usb_get_ep_tx_addr(bEpNum);
+}
+
+static int pma_check(uint32 addr, uint32 length, const char* what) {
+    if (addr + length > PMA_BYTES) {
+        sim_error("%s: %u bytes at PMA offset %u run past the end of packet memory", what, (unsigned)length, (unsigned)addr);
+        return 0;
+    }
+    return 1;
+}
+
+// the peripheral's side of packet memory: bytes in the low halfword of each slot
+static void pma_put(uint32 addr, const uint8* data, uint32 length) {
+    for (uint32 i = 0 ; i < length ; i++) {
+        uint32 a = addr + i;
+        uint32 shift = (a & 1) * 8;
+        uint32* slot = &usb_sim_pma[a / 2];
+        *slot = (*slot & 0xFFFF & ~(0xFFu << shift)) | (uint32)data[i] << shift;
+    }
+}
+
+static void pma_get(uint32 addr, uint8* data, uint32 length) {
+    for (uint32 i = 0 ; i < length ; i++) {
+        uint32 a = addr + i;
+        data[i] = usb_sim_pma[a / 2] >> ((a & 1) * 8);
+    }
+}
+
+/*
+ * libmaple's USB interrupt handler and ST's control endpoint code
+ */
+
+static usblib_dev usblib;
+usblib_dev* USBLIB = &usblib;
+
+static DEVICE_INFO Device_Info;
+DEVICE_INFO* pInformation = &Device_Info;
+DEVICE_PROP* pProperty;
+USER_STANDARD_REQUESTS* pUser_Standard_Requests;
+
+static void default_init(void) {
+}
+
+static RESULT default_setup(uint8 request) {
+    (void)request;
+    return USB_UNSUPPORT;
+}
+
+static RESULT default_interface_setting(uint8 interface, uint8 alternateSetting) {
+    (void)interface;
+    (void)alternateSetting;
+    return USB_UNSUPPORT;
+}
+
+static uint8* default_descriptor(uint16 length) {
+    (void)length;
+    return NULL;
+}
+
+DEVICE Device_Table = { 1, 1 };
+
+DEVICE_PROP Device_Property = {
+    default_init,
+    default_init,
+    NOP_Process,
+    NOP_Process,
+    default_setup,
+    default_setup,
+    default_interface_setting,
+    default_descriptor,
+    default_descriptor,
+    default_descriptor,
+    NULL,
+    64
+};
+
+USER_STANDARD_REQUESTS User_Standard_Requests = {
+    NOP_Process, NOP_Process, NOP_Process, NOP_Process, NOP_Process,
+    NOP_Process, NOP_Process, NOP_Process, NOP_Process
+};
+
+void NOP_Process(void) {
+}
+
+void usb_init_usblib(usblib_dev* dev, void (**ep_int_in)(void), void (**ep_int_out)(void)) {
+    dev->ep_int_in = ep_int_in;
+    dev->ep_int_out = ep_int_out;
+    pInformation = &Device_Info;
+    pProperty = &Device_Property;
+    pUser_Standard_Requests = &User_Standard_Requests;
+    pInformation->ControlState = 2;
+    pProperty->Init();
+    nvic_irq_enable(NVIC_USB_LP_CAN_RX0);
+}
+
+static uint16 SaveRState;
+static uint16 SaveTState;
+static uint8 Data_Mul_MaxPacketSize;
+static uint16_uint8 StatusInfo;
+
+#define vSetEPRxStatus(st) (SaveRState = (st))
+#define vSetEPTxStatus(st) (SaveTState = (st))
+
+static void Send0LengthData(void) {
+    usb_set_ep_tx_count(USB_EP0, 0);
+    vSetEPTxStatus(USB_EP_STAT_TX_VALID);
+}
+
+uint8* Standard_GetDescriptorData(uint16 Length, ONE_DESCRIPTOR* pDesc) {
+    uint32 wOffset = pInformation->Ctrl_Info.Usb_wOffset;
+    if (Length == 0) {
+        pInformation->Ctrl_Info.Usb_wLength = pDesc->Descriptor_Size - wOffset;
+        return NULL;
+    }
+    return pDesc->Descriptor + wOffset;
+}
+
+void SetDeviceAddress(uint8 Val) {
+    for (uint32 i = 0 ; i < Device_Table.Total_Endpoint && i < 8 ; i++)
+        epr_write(i, (usb_sim_regs.EP[i] & EP_NONTOGGLE_MASK & ~USB_EP_EA) | EP_CTR_NOP | i);
+    usb_sim_regs.DADDR = Val | USB_DADDR_EF;
+}
+
+static uint8* Standard_GetConfiguration(uint16 Length) {
+    if (Length == 0) {
+        pInformation->Ctrl_Info.Usb_wLength = sizeof(pInformation->Current_Configuration);
+        return NULL;
+    }
+    pUser_Standard_Requests->User_GetConfiguration();
+    return &pInformation->Current_Configuration;
+}
+
+static RESULT Standard_SetConfiguration(void) {
+    if (pInformation->USBwValue0 <= Device_Table.Total_Configuration && pInformation->USBwValue1 == 0 &&
+            pInformation->USBwIndex == 0) {
+        pInformation->Current_Configuration = pInformation->USBwValue0;
+        pUser_Standard_Requests->User_SetConfiguration();
+        return USB_SUCCESS;
+    }
+    return USB_UNSUPPORT;
+}
+
+static uint8* Standard_GetInterface(uint16 Length) {
+    if (Length == 0) {
+        pInformation->Ctrl_Info.Usb_wLength = sizeof(pInformation->Current_AlternateSetting);
+        return NULL;
+    }
+    pUser_Standard_Requests->User_GetInterface();
+    return &pInformation->Current_AlternateSetting;
+}
+
+static RESULT Standard_SetInterface(void) {
+    RESULT Re = pProperty->Class_Get_Interface_Setting(pInformation->USBwIndex0, pInformation->USBwValue0);
+    if (pInformation->Current_Configuration != 0) {
+        if (Re != USB_SUCCESS || pInformation->USBwIndex1 != 0 || pInformation->USBwValue1 != 0)
+            return USB_UNSUPPORT;
+        pUser_Standard_Requests->User_SetInterface();
+        pInformation->Current_Interface = pInformation->USBwIndex0;
+        pInformation->Current_AlternateSetting = pInformation->USBwValue0;
+        return USB_SUCCESS;
+    }
+    return USB_UNSUPPORT;
+}
+
+static uint8* Standard_GetStatus(uint16 Length) {
+    if (Length == 0) {
+        pInformation->Ctrl_Info.Usb_wLength = 2;
+        return NULL;
+    }
+    StatusInfo.w = 0;
+    if (Type_Recipient == (STANDARD_REQUEST | DEVICE_RECIPIENT)) {
+        uint8 feature = pInformation->Current_Feature;
+        if (feature & (1 << 5))
+            StatusInfo.bw.bb1 |= 1 << 1; // remote wakeup enabled
+        if (feature & (1 << 6))
+            StatusInfo.bw.bb1 |= 1 << 0; // self-powered
+    }
+    else if (Type_Recipient == (STANDARD_REQUEST | INTERFACE_RECIPIENT)) {
+        return (uint8*)&StatusInfo;
+    }
+    else if (Type_Recipient == (STANDARD_REQUEST | ENDPOINT_RECIPIENT)) {
+        uint8 ep = pInformation->USBwIndex0 & 0x0F;
+        uint32 epr = usb_sim_regs.EP[ep];
+        if (pInformation->USBwIndex0 & 0x80) {
+            if ((epr & USB_EP_STAT_TX) == USB_EP_STAT_TX_STALL)
+                StatusInfo.bw.bb1 |= 1;
+        }
+        else if ((epr & USB_EP_STAT_RX) == USB_EP_STAT_RX_STALL) {
+            StatusInfo.bw.bb1 |= 1;
+        }
+    }
+    else {
+        return NULL;
+    }
+    pUser_Standard_Requests->User_GetStatus();
+    return (uint8*)&StatusInfo;
+}
+
+static RESULT Standard_ClearFeature(void) {
+    if (Type_Recipient == (STANDARD_REQUEST | DEVICE_RECIPIENT)) {
+        pInformation->Current_Feature &= ~(1 << 5);
+        return USB_SUCCESS;
+    }
+    if (Type_Recipient == (STANDARD_REQUEST | ENDPOINT_RECIPIENT)) {
+        if (pInformation->USBwValue != ENDPOINT_STALL || pInformation->USBwIndex1 != 0)
+            return USB_UNSUPPORT;
+        uint8 wIndex0 = pInformation->USBwIndex0;
+        uint8 ep = wIndex0 & 0x7F;
+        uint32 status = (wIndex0 & 0x80) ? usb_sim_regs.EP[ep & 7] & USB_EP_STAT_TX : usb_sim_regs.EP[ep & 7] & USB_EP_STAT_RX;
+        if (ep >= Device_Table.Total_Endpoint || status == 0 || pInformation->Current_Configuration == 0)
+            return USB_UNSUPPORT;
+        if (wIndex0 & 0x80) {
+            if (status == USB_EP_STAT_TX_STALL) {
+                usb_clear_ep_dtog_tx(ep);
+                usb_set_ep_tx_stat(ep, USB_EP_STAT_TX_VALID);
+            }
+        }
+        else if (status == USB_EP_STAT_RX_STALL) {
+            if (ep == USB_EP0) {
+                usb_set_ep_rx_count(ep, Device_Property.MaxPacketSize);
+                usb_set_ep_rx_stat(ep, USB_EP_STAT_RX_VALID);
+            }
+            else {
+                usb_clear_ep_dtog_rx(ep);
+                usb_set_ep_rx_stat(ep, USB_EP_STAT_RX_VALID);
+            }
+        }
+        pUser_Standard_Requests->User_ClearFeature();
+        return USB_SUCCESS;
+    }
+    return USB_UNSUPPORT;
+}
+
+static RESULT Standard_SetEndPointFeature(void) {
+    uint8 wIndex0 = pInformation->USBwIndex0;
+    uint8 ep = wIndex0 & 0x7F;
+    uint32 status = (wIndex0 & 0x80) ? usb_sim_regs.EP[ep & 7] & USB_EP_STAT_TX : usb_sim_regs.EP[ep & 7] & USB_EP_STAT_RX;
+    if (ep >= Device_Table.Total_Endpoint || pInformation->USBwValue != 0 || status == 0 ||
+            pInformation->Current_Configuration == 0)
+        return USB_UNSUPPORT;
+    if (wIndex0 & 0x80)
+        usb_set_ep_tx_stat(ep, USB_EP_STAT_TX_STALL);
+    else
+        usb_set_ep_rx_stat(ep, USB_EP_STAT_RX_STALL);
+    pUser_Standard_Requests->User_SetEndPointFeature();
+    return USB_SUCCESS;
+}
+
+static RESULT Standard_SetDeviceFeature(void) {
+    pInformation->Current_Feature |= 1 << 5;
+    pUser_Standard_Requests->User_SetDeviceFeature();
+    return USB_SUCCESS;
+}
+
+static void DataStageOut(void) {
+    ENDPOINT_INFO* pEPinfo = &pInformation->Ctrl_Info;
+    uint32 save_rLength = pEPinfo->Usb_wLength;
+
+    if (pEPinfo->CopyData && save_rLength) {
+        uint32 Length = pEPinfo->PacketSize;
+        if (Length > save_rLength)
+            Length = save_rLength;
+        uint8* Buffer = pEPinfo->CopyData(Length);
+        pEPinfo->Usb_wLength -= Length;
+        pEPinfo->Usb_wOffset += Length;
+        uint32 received = usb_get_ep_rx_count(USB_EP0);
+        if (received < Length)
+            Length = received;
+        if (Buffer != NULL)
+            pma_get(usb_get_ep_rx_addr(USB_EP0), Buffer, Length);
+    }
+
+    if (pEPinfo->Usb_wLength != 0) {
+        vSetEPRxStatus(USB_EP_STAT_RX_VALID);
+        usb_set_ep_tx_count(USB_EP0, 0);
+        vSetEPTxStatus(USB_EP_STAT_TX_VALID);
+    }
+
+    if (pEPinfo->Usb_wLength >= pEPinfo->PacketSize) {
+        pInformation->ControlState = OUT_DATA;
+    }
+    else if (pEPinfo->Usb_wLength > 0) {
+        pInformation->ControlState = LAST_OUT_DATA;
+    }
+    else {
+        pInformation->ControlState = WAIT_STATUS_IN;
+        Send0LengthData();
+    }
+}
+
+static void DataStageIn(void) {
+    ENDPOINT_INFO* pEPinfo = &pInformation->Ctrl_Info;
+    uint32 save_wLength = pEPinfo->Usb_wLength;
+    uint32 ControlState = pInformation->ControlState;
+
+    if (save_wLength == 0 && ControlState == LAST_IN_DATA) {
+        if (Data_Mul_MaxPacketSize) {
+            Send0LengthData();
+            ControlState = LAST_IN_DATA;
+            Data_Mul_MaxPacketSize = 0;
+        }
+        else {
+            ControlState = WAIT_STATUS_OUT;
+            vSetEPTxStatus(USB_EP_STAT_TX_STALL);
+        }
+        pInformation->ControlState = ControlState;
+        return;
+    }
+
+    uint32 Length = pEPinfo->PacketSize;
+    ControlState = save_wLength <= Length ? LAST_IN_DATA : IN_DATA;
+    if (Length > save_wLength)
+        Length = save_wLength;
+    uint8* DataBuffer = pEPinfo->CopyData(Length);
+    if (DataBuffer == NULL) {
+        sim_error("control IN: CopyData(%u) at offset %u returned NULL", (unsigned)Length, (unsigned)pEPinfo->Usb_wOffset);
+        Length = 0;
+    }
+    else {
+        pma_put(usb_get_ep_tx_addr(USB_EP0), DataBuffer, Length);
+    }
+    usb_set_ep_tx_count(USB_EP0, Length);
+    pEPinfo->Usb_wLength -= Length;
+    pEPinfo->Usb_wOffset += Length;
+    vSetEPTxStatus(USB_EP_STAT_TX_VALID);
+    vSetEPRxStatus(USB_EP_STAT_RX_VALID); // the host may end the data stage early
+    pInformation->ControlState = ControlState;
+}
+
+static void NoData_Setup0(void) {
+    RESULT Result = USB_UNSUPPORT;
+    uint32 RequestNo = pInformation->USBbRequest;
+
+    if (Type_Recipient == (STANDARD_REQUEST | DEVICE_RECIPIENT)) {
+        if (RequestNo == SET_CONFIGURATION) {
+            Result = Standard_SetConfiguration();
+        }
+        else if (RequestNo == SET_ADDRESS) {
+            if (pInformation->USBwValue0 > 127 || pInformation->USBwValue1 != 0 || pInformation->USBwIndex != 0 ||
+                    pInformation->Current_Configuration != 0) {
+                pInformation->ControlState = STALLED;
+                return;
+            }
+            Result = USB_SUCCESS;
+        }
+        else if (RequestNo == SET_FEATURE) {
+            if (pInformation->USBwValue0 == DEVICE_REMOTE_WAKEUP && pInformation->USBwIndex == 0)
+                Result = Standard_SetDeviceFeature();
+        }
+        else if (RequestNo == CLEAR_FEATURE) {
+            if (pInformation->USBwValue0 == DEVICE_REMOTE_WAKEUP && pInformation->USBwIndex == 0 &&
+                    (pInformation->Current_Feature & (1 << 5)))
+                Result = Standard_ClearFeature();
+        }
+    }
+    else if (Type_Recipient == (STANDARD_REQUEST | INTERFACE_RECIPIENT)) {
+        if (RequestNo == SET_INTERFACE)
+            Result = Standard_SetInterface();
+    }
+    else if (Type_Recipient == (STANDARD_REQUEST | ENDPOINT_RECIPIENT)) {
+        if (RequestNo == CLEAR_FEATURE)
+            Result = Standard_ClearFeature();
+        else if (RequestNo == SET_FEATURE)
+            Result = Standard_SetEndPointFeature();
+    }
+
+    if (Result != USB_SUCCESS) {
+        Result = pProperty->Class_NoData_Setup(RequestNo);
+        if (Result == USB_NOT_READY) {
+            pInformation->ControlState = PAUSE;
+            return;
+        }
+    }
+    if (Result != USB_SUCCESS) {
+        pInformation->ControlState = STALLED;
+        return;
+    }
+    pInformation->ControlState = WAIT_STATUS_IN;
+    Send0LengthData();
+}
+
+static void Data_Setup0(void) {
+    uint8* (*CopyRoutine)(uint16) = NULL;
+    RESULT Result;
+    uint32 Request_No = pInformation->USBbRequest;
+
+    if (Request_No == GET_DESCRIPTOR) {
+        if (Type_Recipient == (STANDARD_REQUEST | DEVICE_RECIPIENT)) {
+            uint8 wValue1 = pInformation->USBwValue1;
+            if (wValue1 == DEVICE_DESCRIPTOR)
+                CopyRoutine = pProperty->GetDeviceDescriptor;
+            else if (wValue1 == CONFIG_DESCRIPTOR)
+                CopyRoutine = pProperty->GetConfigDescriptor;
+            else if (wValue1 == STRING_DESCRIPTOR)
+                CopyRoutine = pProperty->GetStringDescriptor;
+        }
+    }
+    else if (Request_No == GET_STATUS && pInformation->USBwValue == 0 && pInformation->USBwLength == 2 &&
+            pInformation->USBwIndex1 == 0) {
+        if (Type_Recipient == (STANDARD_REQUEST | DEVICE_RECIPIENT) && pInformation->USBwIndex == 0) {
+            CopyRoutine = Standard_GetStatus;
+        }
+        else if (Type_Recipient == (STANDARD_REQUEST | INTERFACE_RECIPIENT)) {
+            if (pProperty->Class_Get_Interface_Setting(pInformation->USBwIndex0, 0) == USB_SUCCESS &&
+                    pInformation->Current_Configuration != 0)
+                CopyRoutine = Standard_GetStatus;
+        }
+        else if (Type_Recipient == (STANDARD_REQUEST | ENDPOINT_RECIPIENT)) {
+            uint8 ep = pInformation->USBwIndex0 & 0x0F;
+            uint32 status = (pInformation->USBwIndex0 & 0x80) ? usb_sim_regs.EP[ep & 7] & USB_EP_STAT_TX :
+                usb_sim_regs.EP[ep & 7] & USB_EP_STAT_RX;
+            if (ep < Device_Table.Total_Endpoint && (pInformation->USBwIndex0 & 0x70) == 0 && status != 0)
+                CopyRoutine = Standard_GetStatus;
+        }
+    }
+    else if (Request_No == GET_CONFIGURATION) {
+        if (Type_Recipient == (STANDARD_REQUEST | DEVICE_RECIPIENT))
+            CopyRoutine = Standard_GetConfiguration;
+    }
+    else if (Request_No == GET_INTERFACE) {
+        if (Type_Recipient == (STANDARD_REQUEST | INTERFACE_RECIPIENT) && pInformation->Current_Configuration != 0 &&
+                pInformation->USBwValue == 0 && pInformation->USBwIndex1 == 0 && pInformation->USBwLength == 1 &&
+                pProperty->Class_Get_Interface_Setting(pInformation->USBwIndex0, 0) == USB_SUCCESS)
+            CopyRoutine = Standard_GetInterface;
+    }
+
+    if (CopyRoutine) {
+        pInformation->Ctrl_Info.Usb_wOffset = 0;
+        pInformation->Ctrl_Info.CopyData = CopyRoutine;
+        CopyRoutine(0);
+        Result = USB_SUCCESS;
+    }
+    else {
+        Result = pProperty->Class_Data_Setup(pInformation->USBbRequest);
+        if (Result == USB_NOT_READY) {
+            pInformation->ControlState = PAUSE;
+            return;
+        }
+    }
+
+    if (pInformation->Ctrl_Info.Usb_wLength == 0xFFFF) {
+        pInformation->ControlState = PAUSE;
+        return;
+    }
+    if (Result == USB_UNSUPPORT || pInformation->Ctrl_Info.Usb_wLength == 0) {
+        pInformation->ControlState = STALLED;
+        return;
+    }
+
+    pInformation->Ctrl_Info.PacketSize = pProperty->MaxPacketSize;
+    if (pInformation->USBbmRequestType & 0x80) {
+        uint32 wLength = pInformation->USBwLength;
+        if (pInformation->Ctrl_Info.Usb_wLength > wLength) {
+            pInformation->Ctrl_Info.Usb_wLength = wLength;
+        }
+        else if (pInformation->Ctrl_Info.Usb_wLength < wLength) {
+            if (pInformation->Ctrl_Info.Usb_wLength < pProperty->MaxPacketSize)
+                Data_Mul_MaxPacketSize = 0;
+            else if (pInformation->Ctrl_Info.Usb_wLength % pProperty->MaxPacketSize == 0)
+                Data_Mul_MaxPacketSize = 1;
+        }
+        DataStageIn();
+    }
+    else {
+        pInformation->ControlState = OUT_DATA;
+        vSetEPRxStatus(USB_EP_STAT_RX_VALID);
+    }
+}
+
+static void Post0_Process(void) {
+    usb_set_ep_rx_count(USB_EP0, Device_Property.MaxPacketSize);
+    if (pInformation->ControlState == STALLED) {
+        vSetEPRxStatus(USB_EP_STAT_RX_STALL);
+        vSetEPTxStatus(USB_EP_STAT_TX_STALL);
+    }
+}
+
+static void Setup0_Process(void) {
+    uint8 setup[8];
+    if (pInformation->ControlState != PAUSE) {
+        pma_get(usb_get_ep_rx_addr(USB_EP0), setup, 8);
+        pInformation->USBbmRequestType = setup[0];
+        pInformation->USBbRequest = setup[1];
+        pInformation->USBwValue = setup[3] | setup[2] << 8; // byte-swapped, as ST stores them
+        pInformation->USBwIndex = setup[5] | setup[4] << 8;
+        pInformation->USBwLength = setup[6] | setup[7] << 8;
+    }
+    pInformation->ControlState = SETTING_UP;
+    if (pInformation->USBwLength == 0)
+        NoData_Setup0();
+    else
+        Data_Setup0();
+    Post0_Process();
+}
+
+static void In0_Process(void) {
+    uint32 ControlState = pInformation->ControlState;
+    if (ControlState == IN_DATA || ControlState == LAST_IN_DATA) {
+        DataStageIn();
+        ControlState = pInformation->ControlState;
+    }
+    else if (ControlState == WAIT_STATUS_IN) {
+        if (pInformation->USBbRequest == SET_ADDRESS && Type_Recipient == (STANDARD_REQUEST | DEVICE_RECIPIENT)) {
+            SetDeviceAddress(pInformation->USBwValue0);
+            pUser_Standard_Requests->User_SetDeviceAddress();
+        }
+        pProperty->Process_Status_IN();
+        ControlState = STALLED;
+    }
+    else {
+        ControlState = STALLED;
+    }
+    pInformation->ControlState = ControlState;
+    Post0_Process();
+}
+
+static void Out0_Process(void) {
+    uint32 ControlState = pInformation->ControlState;
+    if (ControlState == IN_DATA || ControlState == LAST_IN_DATA) {
+        ControlState = STALLED; // the host ended the data stage early
+    }
+    else if (ControlState == OUT_DATA || ControlState == LAST_OUT_DATA) {
+        DataStageOut();
+        ControlState = pInformation->ControlState;
+    }
+    else if (ControlState == WAIT_STATUS_OUT) {
+        pProperty->Process_Status_OUT();
+        ControlState = STALLED;
+    }
+    else {
+        ControlState = STALLED;
+    }
+    pInformation->ControlState = ControlState;
+    Post0_Process();
+}
+
+static void dispatch_endpt_zero(uint16 istr_dir) {
+    uint32 epr = (uint16)usb_sim_regs.EP[0];
+    if (! (epr & (USB_EP_CTR_TX | USB_EP_SETUP | USB_EP_CTR_RX)))
+        return;
+    SaveRState = epr & USB_EP_STAT_RX;
+    SaveTState = epr & USB_EP_STAT_TX;
+    usb_set_ep_rx_stat(USB_EP0, USB_EP_STAT_RX_NAK);
+    usb_set_ep_tx_stat(USB_EP0, USB_EP_STAT_TX_NAK);
+    if (istr_dir == 0) {
+        usb_clear_ctr_tx(USB_EP0);
+        In0_Process();
+    }
+    else if (epr & USB_EP_CTR_TX) {
+        usb_clear_ctr_tx(USB_EP0);
+        In0_Process();
+    }
+    else {
+        usb_clear_ctr_rx(USB_EP0);
+        if (epr & USB_EP_SETUP)
+            Setup0_Process();
+        else
+            Out0_Process();
+    }
+    usb_set_ep_rx_stat(USB_EP0, SaveRState);
+    usb_set_ep_tx_stat(USB_EP0, SaveTState);
+}
+
+static void dispatch_endpt(uint8 ep) {
+    uint32 epr = usb_sim_regs.EP[ep];
+    if (epr & USB_EP_CTR_RX) {
+        usb_clear_ctr_rx(ep);
+        USBLIB->ep_int_out[ep - 1]();
+    }
+    if (epr & USB_EP_CTR_TX) {
+        usb_clear_ctr_tx(ep);
+        USBLIB->ep_int_in[ep - 1]();
+    }
+}
+
+static void dispatch_ctr_lp(void) {
+    while (1) {
+        istr_update();
+        uint32 istr = usb_sim_regs.ISTR;
+        if (! (istr & USB_ISTR_CTR))
+            break;
+        istr_clear(USB_ISTR_CTR);
+        uint8 ep_id = istr & USB_ISTR_EP_ID;
+        if (ep_id == 0) {
+            dispatch_endpt_zero(istr & USB_ISTR_DIR);
+            return;
+        }
+        dispatch_endpt(ep_id);
+    }
+}
+
+void __irq_usb_lp_can_rx0(void) {
+    istr_update();
+    uint32 istr = usb_sim_regs.ISTR;
+    uint32 mask = USBLIB->irq_mask;
+
+    if (istr & USB_ISTR_RESET & mask) {
+        istr_clear(USB_ISTR_RESET);
+        pProperty->Reset();
+    }
+    if (istr & (USB_ISTR_PMAOVR | USB_ISTR_ERR | USB_ISTR_WKUP | USB_ISTR_SUSP | USB_ISTR_SOF | USB_ISTR_ESOF) & mask)
+        istr_clear(istr & (USB_ISTR_PMAOVR | USB_ISTR_ERR | USB_ISTR_WKUP | USB_ISTR_SUSP | USB_ISTR_SOF | USB_ISTR_ESOF) & mask);
+    if (istr & USB_ISTR_CTR & mask)
+        dispatch_ctr_lp();
+}
+
+/*
+ * The host
+ */
+
+static uint8 host_address;
+static uint8 host_ep0_size = 8;
+static uint8 toggle_in[16];
+static uint8 toggle_out[16];
+
+void usb_sim_power_on(void) {
+    memset(&usb_sim_regs, 0, sizeof usb_sim_regs);
+    usb_sim_regs.CNTR = USB_CNTR_FRES | USB_CNTR_PDWN;
+    istr_state = 0;
+    // packet memory isn't cleared at power-on
+    for (unsigned i = 0 ; i < USB_PMA_WORDS ; i++)
+        usb_sim_pma[i] = 0xA5A5 ^ i;
+    for (unsigned i = 0 ; i < SIM_VECTORS ; i++)
+        flash_vectors[i] = unexpected_vector;
+    flash_vectors[SIM_USB_LP_VECTOR] = __irq_usb_lp_can_rx0;
+    memset(&usb_sim_scb, 0, sizeof usb_sim_scb);
+    usb_sim_scb.VTOR = (uintptr_t)flash_vectors;
+    usb_sim_dwt_ctrl = 0;
+    usb_sim_scb_demcr = 0;
+    usb_sim_scb_shpr3 = 0;
+    usb_irq_enabled = 0;
+    irqs_masked = 0;
+    active_level = 0;
+    memset(&disc_port, 1, sizeof disc_port);
+    host_address = 0;
+    host_ep0_size = 8;
+    memset(toggle_in, 0, sizeof toggle_in);
+    memset(toggle_out, 0, sizeof toggle_out);
+}
+
+static uint8 peripheral_on(void) {
+    return usb_sim_pullup() && ! (usb_sim_regs.CNTR & (USB_CNTR_FRES | USB_CNTR_PDWN));
+}
+
+void usb_sim_bus_reset(void) {
+    if (! peripheral_on())
+        return;
+    for (unsigned i = 0 ; i < 8 ; i++)
+        usb_sim_regs.EP[i] &= USB_EP_CTR_RX | USB_EP_CTR_TX;
+    usb_sim_regs.DADDR = 0;
+    host_address = 0; // the host keeps bMaxPacketSize0 across the reset that follows reading it
+    memset(toggle_in, 0, sizeof toggle_in);
+    memset(toggle_out, 0, sizeof toggle_out);
+    istr_set(USB_ISTR_RESET);
+    take_interrupts();
+}
+
+void usb_sim_frame(void) {
+    now_micros = (now_micros / 1000 + 1) * 1000;
+    if (peripheral_on()) {
+        usb_sim_regs.FNR = (usb_sim_regs.FNR + 1) & USB_FNR_FN;
+        istr_set(USB_ISTR_SOF);
+    }
+    take_interrupts();
+}
+
+void usb_sim_advance(uint32 millis) {
+    while (millis-- > 0)
+        usb_sim_frame();
+}
+
+// the endpoint register that answers a token, or -1 if nothing does
+static int find_endpoint(uint8 ep) {
+    if (! peripheral_on() || ! (usb_sim_regs.DADDR & USB_DADDR_EF) || (usb_sim_regs.DADDR & USB_DADDR_ADD) != host_address)
+        return -1;
+    for (unsigned r = 0 ; r < 8 ; r++)
+        if ((usb_sim_regs.EP[r] & USB_EP_EA) == ep)
+            return r;
+    return -1;
+}
+
+static void store_count(uint8 r, unsigned field, uint32 length) {
+    btable_set(r, field, (btable_get(r, field) & ~0x3FF) | length);
+}
+
+int usb_sim_setup(const uint8 setup[8]) {
+    istr_update();
+    int r = find_endpoint(0);
+    if (r < 0 || (usb_sim_regs.EP[r] & USB_EP_EP_TYPE) != USB_EP_EP_TYPE_CONTROL)
+        return USB_SIM_TIMEOUT;
+    uint32 addr = btable_get(r, ADDR_RX);
+    if (rx_capacity(btable_get(r, COUNT_RX)) < 8)
+        sim_error("SETUP: the endpoint 0 RX buffer holds only %u bytes", (unsigned)rx_capacity(btable_get(r, COUNT_RX)));
+    if (! pma_check(addr, 8, "SETUP"))
+        return USB_SIM_TIMEOUT;
+    pma_put(addr, setup, 8);
+    store_count(r, COUNT_RX, 8);
+    // SETUP is always taken: both directions NAK, and the next data packets are DATA1
+    uint32 epr = usb_sim_regs.EP[r];
+    epr &= ~(USB_EP_STAT_RX | USB_EP_STAT_TX);
+    epr |= USB_EP_STAT_RX_NAK | USB_EP_STAT_TX_NAK | USB_EP_DTOG_RX | USB_EP_DTOG_TX | USB_EP_SETUP | USB_EP_CTR_RX;
+    usb_sim_regs.EP[r] = epr;
+    toggle_in[0] = 1;
+    toggle_out[0] = 1;
+    take_interrupts();
+    return USB_SIM_ACK;
+}
+
+static uint8 is_double_buffered(uint32 epr) {
+    return (epr & USB_EP_EP_TYPE) == USB_EP_EP_TYPE_ISO ||
+        ((epr & USB_EP_EP_TYPE) == USB_EP_EP_TYPE_BULK && (epr & USB_EP_EP_KIND));
+}
+
+int usb_sim_out(uint8 ep, const void* data, uint32 length) {
+    istr_update();
+    int r = find_endpoint(ep);
+    if (r < 0)
+        return USB_SIM_TIMEOUT;
+    uint32 epr = usb_sim_regs.EP[r];
+    uint32 stat = epr & USB_EP_STAT_RX;
+    uint8 iso = (epr & USB_EP_EP_TYPE) == USB_EP_EP_TYPE_ISO;
+    uint8 dbl = is_double_buffered(epr);
+    uint8 dtog = (epr & USB_EP_DTOG_RX) ? 1 : 0;
+
+    if (stat == USB_EP_STAT_RX_DISABLED)
+        return USB_SIM_TIMEOUT;
+    if (! iso) {
+        if (stat == USB_EP_STAT_RX_STALL)
+            return USB_SIM_STALL;
+        if (stat == USB_EP_STAT_RX_NAK)
+            return USB_SIM_NAK;
+        if (dbl && dtog == ((epr & USB_EP_DTOG_TX) ? 1 : 0))
+            return USB_SIM_NAK; // software still owns the buffer the hardware would fill
+        if (toggle_out[ep] != dtog)
+            sim_error("OUT to endpoint %u: host sent DATA%u, device expects DATA%u", ep, toggle_out[ep], dtog);
+    }
+
+    unsigned addrField = ADDR_RX, countField = COUNT_RX;
+    if (dbl && ! dtog) {
+        addrField = ADDR_TX;
+        countField = COUNT_TX;
+    }
+    uint32 addr = btable_get(r, addrField);
+    uint32 capacity = rx_capacity(btable_get(r, countField));
+    if (length > capacity) {
+        sim_error("OUT to endpoint %u: %u bytes, but the buffer holds %u", ep, (unsigned)length, (unsigned)capacity);
+        return USB_SIM_TIMEOUT;
+    }
+    if (! pma_check(addr, length, "OUT"))
+        return USB_SIM_TIMEOUT;
+    pma_put(addr, (const uint8*)data, length);
+    store_count(r, countField, length);
+
+    epr ^= USB_EP_DTOG_RX;
+    epr |= USB_EP_CTR_RX;
+    if (r == 0)
+        epr &= ~USB_EP_SETUP;
+    if (! dbl)
+        epr = (epr & ~USB_EP_STAT_RX) | USB_EP_STAT_RX_NAK;
+    usb_sim_regs.EP[r] = epr;
+    toggle_out[ep] ^= 1;
+    take_interrupts();
+    return USB_SIM_ACK;
+}
+
+int usb_sim_in(uint8 ep, void* data, uint32 maxLength) {
+    istr_update();
+    int r = find_endpoint(ep);
+    if (r < 0)
+        return USB_SIM_TIMEOUT;
+    uint32 epr = usb_sim_regs.EP[r];
+    uint32 stat = epr & USB_EP_STAT_TX;
+    uint8 iso = (epr & USB_EP_EP_TYPE) == USB_EP_EP_TYPE_ISO;
+    uint8 dbl = is_double_buffered(epr);
+    uint8 dtog = (epr & USB_EP_DTOG_TX) ? 1 : 0;
+
+    if (stat == USB_EP_STAT_TX_DISABLED)
+        return USB_SIM_TIMEOUT;
+    if (! iso) {
+        if (stat == USB_EP_STAT_TX_STALL)
+            return USB_SIM_STALL;
+        if (stat == USB_EP_STAT_TX_NAK)
+            return USB_SIM_NAK;
+        if (dbl && dtog == ((epr & USB_EP_DTOG_RX) ? 1 : 0))
+            return USB_SIM_NAK; // software hasn't handed the next buffer over
+    }
+
+    unsigned addrField = ADDR_TX, countField = COUNT_TX;
+    if (dbl && dtog) {
+        addrField = ADDR_RX;
+        countField = COUNT_RX;
+    }
+    uint32 addr = btable_get(r, addrField);
+    uint32 length = btable_get(r, countField) & 0x3FF;
+    if (length > maxLength) {
+        sim_error("IN from endpoint %u: %u bytes, more than the %u the host allows", ep, (unsigned)length, (unsigned)maxLength);
+        length = maxLength;
+    }
+    if (! pma_check(addr, length, "IN"))
+        return USB_SIM_TIMEOUT;
+    if (! iso && toggle_in[ep] != dtog)
+        sim_error("IN from endpoint %u: device sent DATA%u, host expects DATA%u", ep, dtog, toggle_in[ep]);
+    pma_get(addr, (uint8*)data, length);
+
+    epr ^= USB_EP_DTOG_TX;
+    epr |= USB_EP_CTR_TX;
+    if (! dbl)
+        epr = (epr & ~USB_EP_STAT_TX) | USB_EP_STAT_TX_NAK;
+    usb_sim_regs.EP[r] = epr;
+    toggle_in[ep] ^= 1;
+    take_interrupts();
+    return length;
+}
+
+#define WAIT_FRAMES 1000
+
+int usb_sim_out_wait(uint8 ep, const void* data, uint32 length) {
+    int result = USB_SIM_NAK;
+    for (unsigned i = 0 ; i < WAIT_FRAMES && result == USB_SIM_NAK ; i++) {
+        result = usb_sim_out(ep, data, length);
+        if (result == USB_SIM_NAK)
+            usb_sim_frame();
+    }
+    return result;
+}
+
+int usb_sim_in_wait(uint8 ep, void* data, uint32 maxLength) {
+    int result = USB_SIM_NAK;
+    for (unsigned i = 0 ; i < WAIT_FRAMES && result == USB_SIM_NAK ; i++) {
+        result = usb_sim_in(ep, data, maxLength);
+        if (result == USB_SIM_NAK)
+            usb_sim_frame();
+    }
+    return result;
+}
+
+void usb_sim_set_ep0_size(uint8 size) {
+    host_ep0_size = size;
+}
+
+uint8 usb_sim_get_address(void) {
+    return host_address;
+}
+
+int usb_sim_control(uint8 requestType, uint8 request, uint16 value, uint16 index, uint16 length, void* data) {
+    uint8 setup[8] = { requestType, request, value, value >> 8, index, index >> 8, length, length >> 8 };
+    uint8 packet[64];
+    uint8* p = (uint8*)data;
+    uint32 done = 0;
+    int result = usb_sim_setup(setup);
+    if (result != USB_SIM_ACK)
+        return result;
+
+    if (length > 0 && (requestType & 0x80)) {
+        while (done < length) {
+            result = usb_sim_in_wait(0, packet, host_ep0_size);
+            if (result < 0)
+                return result;
+            if (done + result > length) {
+                sim_error("control IN: %u bytes past wLength", (unsigned)(done + result - length));
+                result = length - done;
+            }
+            memcpy(p + done, packet, result);
+            done += result;
+            if (result < host_ep0_size)
+                break;
+        }
+        result = usb_sim_out_wait(0, NULL, 0);
+        if (result != USB_SIM_ACK)
+            return result;
+    }
+    else {
+        while (done < length) {
+            uint32 n = length - done < host_ep0_size ? length - done : host_ep0_size;
+            result = usb_sim_out_wait(0, p + done, n);
+            if (result != USB_SIM_ACK)
+                return result;
+            done += n;
+        }
+        result = usb_sim_in_wait(0, packet, host_ep0_size);
+        if (result < 0)
+            return result;
+        if (result > 0)
+            sim_error("control status stage: %d bytes instead of none", result);
+    }
+
+    // what the host stack keeps track of
+    if (requestType == 0x00 && request == SET_ADDRESS)
+        host_address = value;
+    if ((requestType == 0x00 && request == SET_CONFIGURATION) || (requestType == 0x01 && request == SET_INTERFACE)) {
+        memset(toggle_in + 1, 0, sizeof toggle_in - 1);
+        memset(toggle_out + 1, 0, sizeof toggle_out - 1);
+    }
+    if (requestType == 0x02 && request == CLEAR_FEATURE && value == ENDPOINT_STALL) {
+        if (index & 0x80)
+            toggle_in[index & 0x0F] = 0;
+        else
+            toggle_out[index & 0x0F] = 0;
+    }
+    return done;
+}
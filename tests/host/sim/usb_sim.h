@@ -0,0 +1,75 @@
+/*
+ * The host side of the simulated bus. Each call is one transaction (or, for
+ * usb_sim_control(), one whole control transfer) as a host controller would
+ * run it, with the device's interrupt taken before the call returns, so a test
+ * reads like a host driver talking to real hardware.
+ */
+
+#ifndef _USB_SIM_H_
+#define _USB_SIM_H_
+
+#include "usb_sim_board.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// handshakes; usb_sim_in() returns the packet length instead of USB_SIM_ACK
+#define USB_SIM_ACK 0
+#define USB_SIM_NAK (-1)
+#define USB_SIM_STALL (-2)
+#define USB_SIM_TIMEOUT (-3) // no response: endpoint disabled, wrong address, or the peripheral is off
+
+// power-on state of the peripheral, the NVIC and the clock
+void usb_sim_power_on(void);
+// host drives a bus reset: the RESET interrupt, then address 0 and DATA0 everywhere
+void usb_sim_bus_reset(void);
+// start of frame: the millisecond clock advances and FNR counts
+void usb_sim_frame(void);
+// runs frames for the given number of milliseconds
+void usb_sim_advance(uint32 millis);
+
+int usb_sim_setup(const uint8 setup[8]);
+int usb_sim_out(uint8 ep, const void* data, uint32 length);
+int usb_sim_in(uint8 ep, void* data, uint32 maxLength);
+
+// retries NAKed packets once per frame, up to a second, as a host controller would
+int usb_sim_out_wait(uint8 ep, const void* data, uint32 length);
+int usb_sim_in_wait(uint8 ep, void* data, uint32 maxLength);
+
+/*
+ * A whole control transfer. Returns the length of the data stage, or
+ * USB_SIM_STALL (or another handshake) if it failed. SET_ADDRESS,
+ * SET_CONFIGURATION, SET_INTERFACE and CLEAR_FEATURE(ENDPOINT_HALT) update the
+ * host's own address and data toggles as a host stack would.
+ */
+int usb_sim_control(uint8 requestType, uint8 request, uint16 value, uint16 index, uint16 length, void* data);
+void usb_sim_set_ep0_size(uint8 size); // bMaxPacketSize0, once the host has read it
+uint8 usb_sim_get_address(void);
+
+// where USBComposite would be told its D+ pull-up is on
+uint8 usb_sim_pullup(void);
+
+uint32 usb_sim_millis(void);
+/*
+ * Arduino's millis() is the simulated clock, and calls hook (unless it is
+ * NULL) each time, so that a sketch that waits in a loop on the clock gives
+ * the test a chance to play the host meanwhile, e.g., with usb_sim_frame().
+ */
+void usb_sim_set_wait_hook(void (*hook)(void));
+uint64 usb_sim_micros(void);
+void usb_sim_advance_micros(uint32 micros); // device-side time, e.g., to model work in the main loop
+
+/*
+ * Anything the hardware would have done differently from what the library
+ * expected: a data toggle out of step, a packet longer than its buffer, an
+ * access outside packet memory, an unexpected interrupt. Tests check this is
+ * 0 at the end.
+ */
+uint32 usb_sim_errors(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
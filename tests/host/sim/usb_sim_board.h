@@ -0,0 +1,516 @@
+/*
+ * Everything the library takes from the STM32F1 core (libmaple and ST's
+ * usb_lib), declared for a host build. The headers next to this one shadow
+ * the core's, so the library sources compile unchanged; usb_sim.c provides the
+ * USB peripheral, the control endpoint state machine, the NVIC and a clock.
+ */
+
+#ifndef _USB_SIM_BOARD_H_
+#define _USB_SIM_BOARD_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* libmaple/libmaple_types.h */
+
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef uint64_t uint64;
+typedef int8_t int8;
+typedef int16_t int16;
+typedef int32_t int32;
+typedef int64_t int64;
+typedef void (*voidFuncPtr)(void);
+
+#define __io volatile
+#define __attr_flash
+#define __packed __attribute__((packed))
+#define __weak __attribute__((weak))
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+#ifndef __unused
+#define __unused __attribute__((unused))
+#endif
+
+#ifndef __cplusplus
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#define ASSERT(x) ((void)0)
+#define ASSERT_FAULT(x) ((void)0)
+
+/* usb_type.h, usb_def.h, usb_core.h */
+
+typedef enum _RESULT {
+    USB_SUCCESS = 0,
+    USB_ERROR,
+    USB_UNSUPPORT,
+    USB_NOT_READY
+} RESULT;
+
+typedef enum _CONTROL_STATE {
+    WAIT_SETUP,
+    SETTING_UP,
+    IN_DATA,
+    OUT_DATA,
+    LAST_IN_DATA,
+    LAST_OUT_DATA,
+    WAIT_STATUS_IN,
+    WAIT_STATUS_OUT,
+    STALLED,
+    PAUSE
+} CONTROL_STATE;
+
+typedef enum _STANDARD_REQUESTS {
+    GET_STATUS = 0,
+    CLEAR_FEATURE,
+    RESERVED1,
+    SET_FEATURE,
+    RESERVED2,
+    SET_ADDRESS,
+    GET_DESCRIPTOR,
+    SET_DESCRIPTOR,
+    GET_CONFIGURATION,
+    SET_CONFIGURATION,
+    GET_INTERFACE,
+    SET_INTERFACE,
+    TOTAL_sREQUEST,
+    SYNCH_FRAME = 12
+} STANDARD_REQUESTS;
+
+typedef enum _DESCRIPTOR_TYPE {
+    DEVICE_DESCRIPTOR = 1,
+    CONFIG_DESCRIPTOR,
+    STRING_DESCRIPTOR,
+    INTERFACE_DESCRIPTOR,
+    ENDPOINT_DESCRIPTOR
+} DESCRIPTOR_TYPE;
+
+typedef enum _FEATURE_SELECTOR {
+    ENDPOINT_STALL,
+    DEVICE_REMOTE_WAKEUP
+} FEATURE_SELECTOR;
+
+#define REQUEST_TYPE 0x60
+#define STANDARD_REQUEST 0x00
+#define CLASS_REQUEST 0x20
+#define VENDOR_REQUEST 0x40
+#define RECIPIENT 0x1F
+#define DEVICE_RECIPIENT 0
+#define INTERFACE_RECIPIENT 1
+#define ENDPOINT_RECIPIENT 2
+#define OTHER_RECIPIENT 3
+
+typedef struct OneDescriptor {
+    uint8* Descriptor;
+    uint16 Descriptor_Size;
+} ONE_DESCRIPTOR, *PONE_DESCRIPTOR;
+
+typedef struct _ENDPOINT_INFO {
+    uint16 Usb_wLength;
+    uint16 Usb_wOffset;
+    uint16 PacketSize;
+    uint8* (*CopyData)(uint16 Length);
+} ENDPOINT_INFO;
+
+typedef struct _DEVICE {
+    uint8 Total_Endpoint;
+    uint8 Total_Configuration;
+} DEVICE;
+
+/* wValue and wIndex are stored byte-swapped, as ST's Setup0_Process() does */
+typedef union {
+    uint16 w;
+    struct BW {
+        uint8 bb1;
+        uint8 bb0;
+    } bw;
+} uint16_uint8;
+
+typedef struct _DEVICE_INFO {
+    uint8 USBbmRequestType;
+    uint8 USBbRequest;
+    uint16_uint8 USBwValues;
+    uint16_uint8 USBwIndexs;
+    uint16_uint8 USBwLengths;
+    uint8 ControlState;
+    uint8 Current_Feature;
+    uint8 Current_Configuration;
+    uint8 Current_Interface;
+    uint8 Current_AlternateSetting;
+    ENDPOINT_INFO Ctrl_Info;
+} DEVICE_INFO;
+
+typedef struct _DEVICE_PROP {
+    void (*Init)(void);
+    void (*Reset)(void);
+    void (*Process_Status_IN)(void);
+    void (*Process_Status_OUT)(void);
+    RESULT (*Class_Data_Setup)(uint8 RequestNo);
+    RESULT (*Class_NoData_Setup)(uint8 RequestNo);
+    RESULT (*Class_Get_Interface_Setting)(uint8 Interface, uint8 AlternateSetting);
+    uint8* (*GetDeviceDescriptor)(uint16 Length);
+    uint8* (*GetConfigDescriptor)(uint16 Length);
+    uint8* (*GetStringDescriptor)(uint16 Length);
+    void* RxEP_buffer;
+    uint8 MaxPacketSize;
+} DEVICE_PROP;
+
+typedef struct _USER_STANDARD_REQUESTS {
+    void (*User_GetConfiguration)(void);
+    void (*User_SetConfiguration)(void);
+    void (*User_GetInterface)(void);
+    void (*User_SetInterface)(void);
+    void (*User_GetStatus)(void);
+    void (*User_ClearFeature)(void);
+    void (*User_SetEndPointFeature)(void);
+    void (*User_SetDeviceFeature)(void);
+    void (*User_SetDeviceAddress)(void);
+} USER_STANDARD_REQUESTS;
+
+#define USBwValue USBwValues.w
+#define USBwValue0 USBwValues.bw.bb0
+#define USBwValue1 USBwValues.bw.bb1
+#define USBwIndex USBwIndexs.w
+#define USBwIndex0 USBwIndexs.bw.bb0
+#define USBwIndex1 USBwIndexs.bw.bb1
+#define USBwLength USBwLengths.w
+#define Type_Recipient (pInformation->USBbmRequestType & (REQUEST_TYPE | RECIPIENT))
+
+extern DEVICE_INFO* pInformation;
+extern DEVICE_PROP* pProperty;
+extern USER_STANDARD_REQUESTS* pUser_Standard_Requests;
+extern DEVICE Device_Table;
+extern DEVICE_PROP Device_Property;
+extern USER_STANDARD_REQUESTS User_Standard_Requests;
+
+void NOP_Process(void);
+uint8* Standard_GetDescriptorData(uint16 Length, ONE_DESCRIPTOR* pDesc);
+void SetDeviceAddress(uint8 Val);
+
+/* libmaple/usb.h */
+
+typedef enum usb_dev_state {
+    USB_UNCONNECTED,
+    USB_ATTACHED,
+    USB_POWERED,
+    USB_SUSPENDED,
+    USB_ADDRESSED,
+    USB_CONFIGURED
+} usb_dev_state;
+
+typedef struct usblib_dev {
+    uint32 irq_mask;
+    void (**ep_int_in)(void);
+    void (**ep_int_out)(void);
+    usb_dev_state state;
+    usb_dev_state prevState;
+    int clk_id;
+} usblib_dev;
+
+extern usblib_dev* USBLIB;
+
+void usb_init_usblib(usblib_dev* dev, void (**ep_int_in)(void), void (**ep_int_out)(void));
+
+static inline uint8 usb_is_connected(usblib_dev* dev) {
+    return dev->state != USB_UNCONNECTED;
+}
+
+static inline uint8 usb_is_configured(usblib_dev* dev) {
+    return dev->state == USB_CONFIGURED;
+}
+
+typedef struct usb_descriptor_device {
+    uint8 bLength;
+    uint8 bDescriptorType;
+    uint16 bcdUSB;
+    uint8 bDeviceClass;
+    uint8 bDeviceSubClass;
+    uint8 bDeviceProtocol;
+    uint8 bMaxPacketSize0;
+    uint16 idVendor;
+    uint16 idProduct;
+    uint16 bcdDevice;
+    uint8 iManufacturer;
+    uint8 iProduct;
+    uint8 iSerialNumber;
+    uint8 bNumConfigurations;
+} __packed usb_descriptor_device;
+
+typedef struct usb_descriptor_config_header {
+    uint8 bLength;
+    uint8 bDescriptorType;
+    uint16 wTotalLength;
+    uint8 bNumInterfaces;
+    uint8 bConfigurationValue;
+    uint8 iConfiguration;
+    uint8 bmAttributes;
+    uint8 bMaxPower;
+} __packed usb_descriptor_config_header;
+
+typedef struct usb_descriptor_interface {
+    uint8 bLength;
+    uint8 bDescriptorType;
+    uint8 bInterfaceNumber;
+    uint8 bAlternateSetting;
+    uint8 bNumEndpoints;
+    uint8 bInterfaceClass;
+    uint8 bInterfaceSubClass;
+    uint8 bInterfaceProtocol;
+    uint8 iInterface;
+} __packed usb_descriptor_interface;
+
+typedef struct usb_descriptor_endpoint {
+    uint8 bLength;
+    uint8 bDescriptorType;
+    uint8 bEndpointAddress;
+    uint8 bmAttributes;
+    uint16 wMaxPacketSize;
+    uint8 bInterval;
+} __packed usb_descriptor_endpoint;
+
+#define USB_DESCRIPTOR_STRING(len) \
+    struct { \
+        uint8 bLength; \
+        uint8 bDescriptorType; \
+        uint16 bString[len]; \
+    } __packed
+
+typedef struct usb_descriptor_string {
+    uint8 bLength;
+    uint8 bDescriptorType;
+    uint8 bString[];
+} usb_descriptor_string;
+
+#define USB_DESCRIPTOR_STRING_LEN(x) (2 + (x << 1))
+
+#define USB_DESCRIPTOR_TYPE_DEVICE 0x01
+#define USB_DESCRIPTOR_TYPE_CONFIGURATION 0x02
+#define USB_DESCRIPTOR_TYPE_STRING 0x03
+#define USB_DESCRIPTOR_TYPE_INTERFACE 0x04
+#define USB_DESCRIPTOR_TYPE_ENDPOINT 0x05
+#define USB_DESCRIPTOR_TYPE_CS_INTERFACE 0x24
+#define USB_DESCRIPTOR_TYPE_CS_ENDPOINT 0x25
+
+#define USB_DESCRIPTOR_ENDPOINT_IN 0x80
+#define USB_DESCRIPTOR_ENDPOINT_OUT 0x00
+
+#define USB_EP_TYPE_CONTROL 0x00
+#define USB_EP_TYPE_ISO 0x01
+#define USB_EP_TYPE_BULK 0x02
+#define USB_EP_TYPE_INTERRUPT 0x03
+
+#define USB_CONFIG_ATTR_BUSPOWERED 0x80
+#define USB_CONFIG_ATTR_SELF_POWERED 0xC0
+
+/* usb_reg_map.h: the peripheral is a plain struct, with EPnR and ISTR write semantics applied by usb_sim.c */
+
+typedef struct usb_reg_map {
+    __io uint32 EP[8];
+    const uint32 RESERVED[8];
+    __io uint32 CNTR;
+    __io uint32 ISTR;
+    __io uint32 FNR;
+    __io uint32 DADDR;
+    __io uint32 BTABLE;
+} usb_reg_map;
+
+#define USB_PMA_WORDS 256 // 512 bytes of packet memory, a halfword in each 32-bit slot
+
+extern usb_reg_map usb_sim_regs;
+extern uint32 usb_sim_pma[USB_PMA_WORDS];
+
+#define USB_BASE (&usb_sim_regs)
+#define USB_PMA_BASE ((__io void*)usb_sim_pma)
+
+#define USB_EP0 0
+
+#define USB_EP_CTR_RX 0x8000
+#define USB_EP_DTOG_RX 0x4000
+#define USB_EP_STAT_RX 0x3000
+#define USB_EP_SETUP 0x0800
+#define USB_EP_EP_TYPE 0x0600
+#define USB_EP_EP_KIND 0x0100
+#define USB_EP_CTR_TX 0x0080
+#define USB_EP_DTOG_TX 0x0040
+#define USB_EP_STAT_TX 0x0030
+#define USB_EP_EA 0x000F
+
+#define USB_EP_EP_TYPE_BULK 0x0000
+#define USB_EP_EP_TYPE_CONTROL 0x0200
+#define USB_EP_EP_TYPE_ISO 0x0400
+#define USB_EP_EP_TYPE_INTERRUPT 0x0600
+#define USB_EP_EP_KIND_DBL_BUF 0x0100
+
+#define USB_EP_STAT_RX_DISABLED 0x0000
+#define USB_EP_STAT_RX_STALL 0x1000
+#define USB_EP_STAT_RX_NAK 0x2000
+#define USB_EP_STAT_RX_VALID 0x3000
+#define USB_EP_STAT_TX_DISABLED 0x0000
+#define USB_EP_STAT_TX_STALL 0x0010
+#define USB_EP_STAT_TX_NAK 0x0020
+#define USB_EP_STAT_TX_VALID 0x0030
+
+#define USB_EP_ST_RX_VAL USB_EP_STAT_RX_VALID
+
+#define USB_CNTR_CTRM 0x8000
+#define USB_CNTR_PMAOVRM 0x4000
+#define USB_CNTR_ERRM 0x2000
+#define USB_CNTR_WKUPM 0x1000
+#define USB_CNTR_SUSPM 0x0800
+#define USB_CNTR_RESETM 0x0400
+#define USB_CNTR_SOFM 0x0200
+#define USB_CNTR_ESOFM 0x0100
+#define USB_CNTR_RESUME 0x0010
+#define USB_CNTR_FSUSP 0x0008
+#define USB_CNTR_LP_MODE 0x0004
+#define USB_CNTR_PDWN 0x0002
+#define USB_CNTR_FRES 0x0001
+
+#define USB_ISTR_CTR 0x8000
+#define USB_ISTR_PMAOVR 0x4000
+#define USB_ISTR_ERR 0x2000
+#define USB_ISTR_WKUP 0x1000
+#define USB_ISTR_SUSP 0x0800
+#define USB_ISTR_RESET 0x0400
+#define USB_ISTR_SOF 0x0200
+#define USB_ISTR_ESOF 0x0100
+#define USB_ISTR_DIR 0x0010
+#define USB_ISTR_EP_ID 0x000F
+
+#define USB_ISR_MSK (USB_ISTR_CTR | USB_ISTR_WKUP | USB_ISTR_SUSP | USB_ISTR_ERR | USB_ISTR_SOF | USB_ISTR_ESOF | USB_ISTR_RESET)
+
+#define USB_FNR_FN 0x07FF
+#define USB_DADDR_EF 0x0080
+#define USB_DADDR_ADD 0x007F
+
+static inline uint32* usb_pma_ptr(uint32 offset) {
+    return (uint32*)((uint8*)USB_PMA_BASE + 2*offset);
+}
+
+void usb_set_ep_type(uint8 ep, uint32 type);
+void usb_set_ep_kind(uint8 ep, uint32 kind);
+void usb_clear_status_out(uint8 ep);
+void usb_set_ep_rx_stat(uint8 ep, uint32 status);
+void usb_set_ep_tx_stat(uint8 ep, uint32 status);
+void usb_clear_ctr_rx(uint8 ep);
+void usb_clear_ctr_tx(uint8 ep);
+uint32 usb_get_ep_dtog_tx(uint8 ep);
+uint32 usb_get_ep_dtog_rx(uint8 ep);
+void usb_toggle_ep_dtog_tx(uint8 ep);
+void usb_toggle_ep_dtog_rx(uint8 ep);
+void usb_clear_ep_dtog_tx(uint8 ep);
+void usb_clear_ep_dtog_rx(uint8 ep);
+uint32 usb_get_ep_tx_sw_buf(uint8 ep);
+uint32 usb_get_ep_rx_sw_buf(uint8 ep);
+void usb_toggle_ep_tx_sw_buf(uint8 ep);
+void usb_toggle_ep_rx_sw_buf(uint8 ep);
+
+uint16 usb_get_ep_tx_addr(uint8 ep);
+uint16 usb_get_ep_rx_addr(uint8 ep);
+void usb_set_ep_tx_addr(uint8 ep, uint16 addr);
+void usb_set_ep_rx_addr(uint8 ep, uint16 addr);
+uint16 usb_get_ep_tx_count(uint8 ep);
+uint16 usb_get_ep_rx_count(uint8 ep);
+void usb_set_ep_tx_count(uint8 ep, uint16 count);
+void usb_set_ep_rx_count(uint8 ep, uint16 count);
+
+void usb_set_ep_tx_buf0_addr(uint8 ep, uint16 addr);
+void usb_set_ep_tx_buf1_addr(uint8 ep, uint16 addr);
+void usb_set_ep_rx_buf0_addr(uint8 ep, uint16 addr);
+void usb_set_ep_rx_buf1_addr(uint8 ep, uint16 addr);
+void usb_set_ep_tx_buf0_count(uint8 ep, uint16 count);
+void usb_set_ep_tx_buf1_count(uint8 ep, uint16 count);
+void usb_set_ep_rx_buf0_count(uint8 ep, uint16 count);
+void usb_set_ep_rx_buf1_count(uint8 ep, uint16 count);
+uint16 usb_get_ep_rx_buf0_count(uint8 ep);
+uint16 usb_get_ep_rx_buf1_count(uint8 ep);
+
+/* ST's names, used by a few class drivers */
+void SetEPRxStatus(uint8 bEpNum, uint16 wState);
+uint16 GetEPTxAddr(uint8 bEpNum);
+
+/* libmaple/nvic.h, scb.h, systick.h, delay.h */
+
+typedef enum nvic_irq_num {
+    NVIC_PENDSV = -2,
+    NVIC_USB_LP_CAN_RX0 = 20
+} nvic_irq_num;
+
+void nvic_irq_enable(nvic_irq_num irq_num);
+void nvic_irq_disable(nvic_irq_num irq_num);
+void nvic_globalirq_enable(void);
+void nvic_globalirq_disable(void);
+void nvic_sys_reset(void);
+
+/* libmaple/iwdg.h, bkp.h, for CompositeSerial's reset into the bootloader */
+
+typedef enum iwdg_prescaler {
+    IWDG_PRE_4 = 0
+} iwdg_prescaler;
+
+void iwdg_init(iwdg_prescaler prescaler, uint16 reload);
+void bkp_init(void);
+void bkp_enable_writes(void);
+void bkp_disable_writes(void);
+void bkp_write(uint8 reg, uint16 val);
+
+typedef struct scb_reg_map {
+    __io uint32 CPUID;
+    __io uint32 ICSR;
+    __io uintptr_t VTOR; // a pointer, so the vector table can live anywhere in a 64-bit process
+    __io uint32 AIRCR;
+    __io uint32 SCR;
+    __io uint32 CCR;
+} scb_reg_map;
+
+extern scb_reg_map usb_sim_scb;
+extern __io uint32 usb_sim_dwt_ctrl;
+extern __io uint32 usb_sim_scb_demcr;
+extern __io uint32 usb_sim_scb_shpr3;
+__io uint32* usb_sim_cycle_counter(void);
+
+#define SCB_BASE (&usb_sim_scb)
+#define DWT_CTRL usb_sim_dwt_ctrl
+#define DWT_CYCCNT (*usb_sim_cycle_counter())
+#define SCB_DEMCR usb_sim_scb_demcr
+#define SCB_SHPR3 usb_sim_scb_shpr3
+// usb_trace.h would read the real DWT_CYCCNT address
+#define USB_TRACE_TIMESTAMP() (*usb_sim_cycle_counter())
+#define USB_TRACE_TICKS_PER_SECOND ((uint32)F_CPU)
+#define USB_GENERIC_DSB() __sync_synchronize()
+#define USB_GENERIC_ISB() __sync_synchronize()
+
+uint32 systick_uptime(void);
+void delay_us(uint32 us);
+
+/* libmaple/gpio.h, board/board.h */
+
+typedef struct gpio_dev gpio_dev;
+extern gpio_dev* const GPIOA;
+
+typedef enum gpio_pin_mode {
+    GPIO_OUTPUT_PP,
+    GPIO_INPUT_FLOATING
+} gpio_pin_mode;
+
+void gpio_set_mode(gpio_dev* dev, uint8 pin, gpio_pin_mode mode);
+void gpio_write_bit(gpio_dev* dev, uint8 pin, uint8 val);
+
+extern gpio_dev* usb_sim_disc_port;
+#define BOARD_USB_DISC_DEV usb_sim_disc_port
+#define BOARD_USB_DISC_BIT 12
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
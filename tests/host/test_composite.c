@@ -0,0 +1,384 @@
+/*
+ * A composite device (vendor bulk, HID and CDC serial) enumerated by the
+ * simulated host, then the vendor bulk pipe run flat out in both directions
+ * with every byte checked. Prints the simulated throughput, and how long the
+ * host took to run it, as a benchmark of the driver's per-packet cost.
+ * Built with USB_GENERIC_STATS or USB_GENERIC_TRACE, it also checks the
+ * echo's endpoint statistics or the trace of an enumeration.
+ */
+
+#include <time.h>
+#include "test_util.h"
+#include "usb_generic.h"
+#include "usb_vendor_bulk.h"
+#include "usb_hid.h"
+#include "usb_composite_serial.h"
+
+static const uint8 reportDescriptor[] = {
+    0x06, 0x00, 0xFF, // USAGE_PAGE (vendor defined)
+    0x09, 0x01,       // USAGE (1)
+    0xA1, 0x01,       // COLLECTION (application)
+    0x15, 0x00,       //   LOGICAL_MINIMUM (0)
+    0x26, 0xFF, 0x00, //   LOGICAL_MAXIMUM (255)
+    0x75, 0x08,       //   REPORT_SIZE (8)
+    0x95, 0x08,       //   REPORT_COUNT (8)
+    0x09, 0x01,       //   USAGE (1)
+    0x81, 0x02,       //   INPUT (data, var, abs)
+    0xC0              // END_COLLECTION
+};
+
+static struct usb_chunk reportChunk = { sizeof(reportDescriptor), reportDescriptor, NULL };
+
+static uint8 bulkRx[1024];
+static uint8 bulkTx[1024];
+
+static USBCompositePart* parts[] = { &usbVendorBulkPart, &usbHIDPart, &usbSerialPart };
+
+static test_device dev;
+
+static void check_string(uint8 index, const char* expected) {
+    uint8 s[256];
+    int n = TEST_GET_DESCRIPTOR(3, index, 0x0409, 255, s);
+    CHECK_EQ(n, 2 + 2*strlen(expected));
+    CHECK_EQ(s[0], n);
+    CHECK_EQ(s[1], 3);
+    for (unsigned i = 0; i < strlen(expected) && 2 + 2*i + 1 < (unsigned)n; i++) {
+        CHECK_EQ(s[2+2*i], expected[i]);
+        CHECK_EQ(s[2+2*i+1], 0);
+    }
+}
+
+static void test_enumeration(void) {
+    CHECK(usb_sim_pullup());
+    CHECK_EQ(test_enumerate(&dev, 9), 0);
+    CHECK_EQ(usb_sim_get_address(), 9);
+    CHECK(usb_is_configured(USBLIB));
+
+    CHECK_EQ(dev.device[0], 18);
+    CHECK_EQ(dev.device[1], 1);
+    CHECK_EQ(dev.device[8] | (dev.device[9]<<8), 0x1EAF);
+    CHECK_EQ(dev.device[10] | (dev.device[11]<<8), 0x0029);
+
+    CHECK_EQ(dev.numInterfaces, 4); // vendor bulk, HID, CDC control and data
+    CHECK_EQ(dev.config[2] | (dev.config[3]<<8), dev.configLength);
+    CHECK_EQ(dev.numEndpoints, 2 + 1 + 3); // HID declares its OUT endpoint only with a dedicated RX buffer
+    for (unsigned i = 0; i < dev.numEndpoints; i++) {
+        CHECK((dev.endpoints[i].address & 0x0F) != 0);
+        CHECK(dev.endpoints[i].interface < dev.numInterfaces);
+        for (unsigned j = 0; j < i; j++)
+            CHECK(dev.endpoints[i].address != dev.endpoints[j].address);
+    }
+
+    uint8 langs[4];
+    CHECK_EQ(TEST_GET_DESCRIPTOR(3, 0, 0, 4, langs), 4);
+    CHECK_EQ(langs[2] | (langs[3]<<8), 0x0409);
+    check_string(dev.device[14], "Maker");
+    check_string(dev.device[15], "Composite");
+    check_string(dev.device[16], "0042");
+
+    // the HID report descriptor, asked of the HID interface
+    const test_endpoint* hid = test_find_endpoint(&dev, 3, 1, 3);
+    CHECK(hid != NULL);
+    if (hid != NULL) {
+        uint8 report[64];
+        int n = usb_sim_control(0x81, 0x06, 0x2200, hid->interface, sizeof(report), report);
+        CHECK_EQ(n, sizeof(reportDescriptor));
+        CHECK(n == sizeof(reportDescriptor) && !memcmp(report, reportDescriptor, n));
+    }
+
+    // unknown requests stall rather than hang
+    CHECK_EQ(usb_sim_control(0xC0, 0x77, 0, 0, 8, langs), USB_SIM_STALL);
+}
+
+// the Microsoft OS 2.0 descriptors Windows asks for to bind WinUSB to the vendor bulk interface
+static void test_winusb(void) {
+    CHECK_EQ(dev.device[2] | (dev.device[3]<<8), 0x0201); // BOS descriptors are only asked of USB 2.01 devices
+
+    uint8 bos[64];
+    CHECK_EQ(TEST_GET_DESCRIPTOR(0x0F, 0, 0, 5, bos), 5);
+    uint16 bosLength = bos[2] | (bos[3]<<8);
+    CHECK_EQ(bosLength, 33);
+    CHECK_EQ(TEST_GET_DESCRIPTOR(0x0F, 0, 0, bosLength, bos), bosLength);
+    CHECK_EQ(bos[5], 28); // platform capability
+    CHECK_EQ(bos[7], 0x05);
+    uint16 setLength = bos[5+24] | (bos[5+25]<<8);
+    uint8 vendorCode = bos[5+26];
+    CHECK_EQ(vendorCode, USB_GENERIC_MS_VENDOR_CODE);
+
+    static uint8 set[512];
+    CHECK(setLength <= sizeof(set));
+    if (setLength > sizeof(set))
+        return;
+    CHECK_EQ(usb_sim_control(0xC0, vendorCode, 0, 7, setLength, set), setLength);
+    CHECK_EQ(set[0], 10); // set header
+    CHECK_EQ(set[8] | (set[9]<<8), setLength);
+    CHECK_EQ(set[10+2], 1); // configuration subset header: the device is composite
+    const uint8* function = set + 10 + 8;
+    CHECK_EQ(function[2], 2); // function subset header
+    const test_endpoint* out = test_find_endpoint(&dev, 0xFF, 0, 2);
+    CHECK(out != NULL && function[4] == out->interface);
+    CHECK(!memcmp(function + 8 + 4, "WINUSB", 6));
+    const uint8* guid = function + 8 + 20 + 52;
+    CHECK(guid + 2*38 <= set + setLength);
+    for (unsigned i = 0; i < 38; i++)
+        CHECK_EQ(guid[2*i], USB_VENDOR_BULK_WINUSB_GUID[i]);
+
+    // any other index is not ours
+    CHECK_EQ(usb_sim_control(0xC0, vendorCode, 0, 0x0700, setLength, set), USB_SIM_STALL);
+}
+
+/*
+ * The host sends pattern bytes OUT and reads them back IN; the device's main
+ * loop echoes whatever arrived, in pieces of whatever size the rings allow. Up to 19 bulk packets per frame, about what a
+ * full-speed host controller fits around other traffic.
+ */
+#define ECHO_BYTES (256*1024)
+#define PACKETS_PER_FRAME 19
+
+static uint8 pattern(uint32 i) {
+    return (uint8)(i * 7 + (i >> 8));
+}
+
+// what the host saw of the echo, for the device's endpoint statistics to be checked against
+static struct {
+    uint32 outPackets, outShortPackets, outLeftFull, outNakRuns, inPackets, inShortPackets, inZeroLengthPackets;
+} echo;
+
+static void test_bulk_echo(void) {
+    const test_endpoint* out = test_find_endpoint(&dev, 0xFF, 0, 2);
+    const test_endpoint* in = test_find_endpoint(&dev, 0xFF, 1, 2);
+    CHECK(out != NULL && in != NULL);
+    if (out == NULL || in == NULL)
+        return;
+    uint8 outEp = out->address & 0x0F;
+    uint8 inEp = in->address & 0x0F;
+
+    uint32 sent = 0, received = 0, mismatches = 0;
+    int outNaking = 0;
+    const USBEndpointInfo* rxInfo = usbVendorBulkPart.endpoints[0].tx ? &usbVendorBulkPart.endpoints[1] : &usbVendorBulkPart.endpoints[0];
+    uint32 rxPacketRoom = rxInfo->pmaSize;
+    uint32 startMillis = usb_sim_millis();
+    clock_t startClock = clock();
+
+    while (received < ECHO_BYTES && usb_sim_millis() - startMillis < 10000) {
+        for (unsigned p = 0; p < PACKETS_PER_FRAME; p++) {
+            // alternate directions as the host's schedule would
+            if (p % 2 == 0 && sent < ECHO_BYTES) {
+                // mostly full packets, with short odd ones now and then so the rings wrap mid-halfword
+                uint8 packet[64];
+                uint32 n = (sent / 64) % 5 == 4 ? 1 + (sent * 37) % 63 : 64;
+                if (n > ECHO_BYTES - sent)
+                    n = ECHO_BYTES - sent;
+                for (uint32 i = 0; i < n; i++)
+                    packet[i] = pattern(sent + i);
+                int handshake = usb_sim_out(outEp, packet, n);
+                if (handshake == USB_SIM_ACK) {
+                    sent += n;
+                    echo.outPackets++;
+                    echo.outShortPackets += n < 64;
+                    // the packets after which the ring had no room for another
+                    echo.outLeftFull += sizeof(bulkRx) - 1 - vendor_bulk_data_available() < rxPacketRoom;
+                }
+                // a device with no room NAKs until the main loop reads, however often it's asked
+                else if (handshake == USB_SIM_NAK && !outNaking) {
+                    echo.outNakRuns++;
+                }
+                outNaking = handshake == USB_SIM_NAK;
+            }
+            else {
+                uint8 packet[64];
+                int n = usb_sim_in(inEp, packet, 64);
+                if (n >= 0) {
+                    echo.inPackets++;
+                    echo.inShortPackets += n < 64;
+                    echo.inZeroLengthPackets += n == 0;
+                }
+                for (int i = 0; i < n; i++)
+                    if (packet[i] != pattern(received + i))
+                        mismatches++;
+                if (n > 0)
+                    received += n;
+            }
+
+            // the device's main loop
+            uint8 buf[256];
+            uint32 room = vendor_bulk_tx_free();
+            uint32 n = vendor_bulk_rx(buf, room < sizeof(buf) ? room : sizeof(buf));
+            if (n > 0)
+                CHECK_EQ(vendor_bulk_tx(buf, n), n);
+        }
+        usb_sim_frame();
+    }
+
+    double seconds = (double)(clock() - startClock) / CLOCKS_PER_SEC;
+    uint32 millis = usb_sim_millis() - startMillis;
+    CHECK_EQ(sent, ECHO_BYTES);
+    CHECK_EQ(received, ECHO_BYTES);
+    CHECK_EQ(mismatches, 0);
+    CHECK(!vendor_bulk_is_transmitting());
+    printf("vendor bulk echo: %u bytes each way in %u simulated ms (%.0f KB/s), %.1f ms of host time\n",
+        (unsigned)received, (unsigned)millis, millis ? received / (double)millis : 0.0, seconds * 1000);
+}
+
+#if defined(USB_GENERIC_STATS) || defined(USB_GENERIC_TRACE)
+static uint32 get_32(const uint8* p) {
+    return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32)p[3]<<24);
+}
+#endif
+
+#ifdef USB_GENERIC_STATS
+/*
+ * The vendor bulk endpoints' counters against what the host saw of the echo,
+ * and serialized in the documented order.
+ */
+static void test_stats(void) {
+    USBEndpointStats stats[USB_GENERIC_MAX_ENDPOINTS];
+    CHECK_EQ(usb_generic_get_part_stats(&usbVendorBulkPart, stats, USB_GENERIC_MAX_ENDPOINTS), 2);
+    for (unsigned i = 0; i < 2; i++) {
+        const USBEndpointInfo* ep = &usbVendorBulkPart.endpoints[i];
+        const USBEndpointStats* st = &stats[i];
+        CHECK_EQ(st->bytes, ECHO_BYTES);
+        if (ep->tx) {
+            CHECK_EQ(st->packets, echo.inPackets);
+            CHECK_EQ(st->shortPackets, echo.inShortPackets);
+            CHECK_EQ(st->zeroLengthPackets, echo.inZeroLengthPackets);
+            CHECK_EQ(st->rxFull, 0);
+            CHECK(st->txEmpty > 0);
+            CHECK(st->ringHighWater <= sizeof(bulkTx));
+        }
+        else {
+            CHECK_EQ(st->packets, echo.outPackets);
+            CHECK_EQ(st->shortPackets, echo.outShortPackets);
+            CHECK_EQ(st->zeroLengthPackets, 0);
+            // the host was only NAKed when the main loop hadn't read from a full ring in time
+            CHECK_EQ(st->rxFull, echo.outLeftFull);
+            CHECK(echo.outNakRuns > 0 && echo.outNakRuns <= st->rxFull);
+            CHECK_EQ(st->txEmpty, 0);
+            CHECK(st->ringHighWater > sizeof(bulkRx) - ep->pmaSize && st->ringHighWater <= sizeof(bulkRx));
+        }
+        CHECK_EQ(st->stalls, 0);
+        CHECK_EQ(st->callbacks, st->packets);
+        CHECK(st->maxCallbackCycles <= st->callbackCycles);
+    }
+
+    uint8 out[USB_GENERIC_STATS_SERIALIZED_SIZE(2)];
+    CHECK_EQ(usb_generic_serialize_part_stats(&usbVendorBulkPart, out, sizeof(out) - 1), 0);
+    CHECK_EQ(usb_generic_serialize_part_stats(&usbVendorBulkPart, out, sizeof(out)), 2 + 43*2);
+    CHECK_EQ(out[0], 1);
+    CHECK_EQ(out[1], 2);
+    for (unsigned i = 0; i < 2; i++) {
+        const USBEndpointInfo* ep = &usbVendorBulkPart.endpoints[i];
+        const USBEndpointStats* st = &stats[i];
+        const uint8* p = out + 2 + 43*i;
+        CHECK_EQ(p[0], ep->address | (ep->tx ? 0x80 : 0));
+        const uint32 fields[10] = { st->packets, st->bytes, st->shortPackets, st->zeroLengthPackets, st->txEmpty,
+            st->rxFull, st->stalls, st->callbacks, st->callbackCycles, st->maxCallbackCycles };
+        for (unsigned j = 0; j < 10; j++)
+            CHECK_EQ(get_32(p + 1 + 4*j), fields[j]);
+        CHECK_EQ(p[41] | (p[42]<<8), st->ringHighWater);
+    }
+
+    usb_generic_reset_part_stats(&usbVendorBulkPart);
+    usb_generic_get_part_stats(&usbVendorBulkPart, stats, USB_GENERIC_MAX_ENDPOINTS);
+    CHECK_EQ(stats[0].packets + stats[1].packets, 0);
+}
+#endif
+
+#ifdef USB_GENERIC_TRACE
+/*
+ * One enumeration, serialized as it would be sent to the host, checked
+ * against what test_enumerate() asks for, and saved next to the test binary
+ * for scripts/usbtrace.py.
+ */
+static void test_trace(const char* dumpPath) {
+    usb_generic_clear_trace();
+    CHECK_EQ(test_enumerate(&dev, 9), 0);
+
+    static usb_trace_entry entries[USB_GENERIC_TRACE_SIZE];
+    static uint8 dump[USB_TRACE_SERIALIZED_SIZE(USB_GENERIC_TRACE_SIZE)];
+    uint32 count;
+    uint32 n = usb_generic_trace_snapshot(entries, USB_GENERIC_TRACE_SIZE, &count);
+    uint32 length = usb_trace_serialize(entries, n, count, dump, sizeof(dump));
+    CHECK_EQ(length, USB_TRACE_SERIALIZED_SIZE(n));
+    CHECK_EQ(usb_trace_serialize(entries, n, count, dump, USB_TRACE_SERIALIZED_SIZE(n) - 1), 0);
+
+    // the events test_enumerate() causes; the configuration descriptor goes in packets of bMaxPacketSize0
+    static struct { uint8 event, endpoint; uint16 length; } expected[32];
+    unsigned numExpected = 0;
+#define EXPECT(e, ep, len) do { \
+        expected[numExpected].event = (e); \
+        expected[numExpected].endpoint = (ep); \
+        expected[numExpected].length = (len); \
+        numExpected++; \
+    } while (0)
+    EXPECT(USB_TRACE_RESET, 0, 0);
+    EXPECT(USB_TRACE_GET_DESCRIPTOR, 1, 8);
+    EXPECT(USB_TRACE_CONTROL_TX, 0, 8);
+    EXPECT(USB_TRACE_RESET, 0, 0);
+    EXPECT(USB_TRACE_GET_DESCRIPTOR, 1, 18);
+    EXPECT(USB_TRACE_CONTROL_TX, 0, 18);
+    EXPECT(USB_TRACE_GET_DESCRIPTOR, 2, 9);
+    EXPECT(USB_TRACE_CONTROL_TX, 0, 9);
+    EXPECT(USB_TRACE_GET_DESCRIPTOR, 2, dev.configLength);
+    for (unsigned sent = 0; sent < dev.configLength; sent += dev.device[7])
+        EXPECT(USB_TRACE_CONTROL_TX, 0, dev.configLength - sent < dev.device[7] ? dev.configLength - sent : dev.device[7]);
+    EXPECT(USB_TRACE_SET_CONFIGURATION, 0, dev.config[5]);
+#undef EXPECT
+
+    CHECK_EQ(dump[0], 1);
+    CHECK_EQ(get_32(dump + 1), F_CPU);
+    CHECK_EQ(get_32(dump + 5), numExpected);
+    CHECK_EQ(dump[9], numExpected);
+    uint32 previous = 0;
+    for (unsigned i = 0; i < numExpected && 10 + 8*i + 8 <= length; i++) {
+        const uint8* e = dump + 10 + 8*i;
+        CHECK_EQ(e[4], expected[i].event);
+        CHECK_EQ(e[5], expected[i].endpoint);
+        CHECK_EQ(e[6] | (e[7]<<8), expected[i].length);
+        // cycles of simulated time, which test_enumerate() advances by 10 ms after each reset
+        if (i > 0)
+            CHECK((int32)(get_32(e) - previous) >= 0);
+        if (i == 3)
+            CHECK(get_32(e) - get_32(dump + 10) >= 10 * (F_CPU / 1000));
+        previous = get_32(e);
+    }
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s.dump", dumpPath);
+    FILE* f = fopen(path, "wb");
+    CHECK(f != NULL);
+    if (f != NULL) {
+        CHECK_EQ(fwrite(dump, 1, length, f), length);
+        fclose(f);
+    }
+}
+#endif
+
+int main(int argc, char** argv) {
+    usb_sim_power_on();
+    vendor_bulk_set_buffers(bulkRx, sizeof(bulkRx), bulkTx, sizeof(bulkTx));
+    usb_hid_set_report_descriptor(&reportChunk);
+    usb_generic_set_info(0x1EAF, 0x0029, "Maker", "Composite", "0042");
+    // small enough for all three parts to fit in packet memory next to the double-buffered bulk pipe
+    usb_generic_set_ep0_size(32);
+    usb_hid_setTXEPSize(16);
+    composite_cdcacm_setTXEPSize(16);
+    composite_cdcacm_setRXEPSize(16);
+    CHECK(usb_generic_set_parts(parts, sizeof(parts)/sizeof(*parts)));
+    CHECK_EQ(usb_generic_get_pma_layout()->status, USB_GENERIC_LAYOUT_OK);
+    usb_generic_enable();
+
+    test_enumeration();
+    test_winusb();
+    test_bulk_echo();
+#ifdef USB_GENERIC_STATS
+    test_stats();
+#endif
+#ifdef USB_GENERIC_TRACE
+    test_trace(argv[0]);
+#endif
+
+    usb_generic_disable();
+    CHECK(!usb_sim_pullup());
+    return test_finish("test_composite");
+}
@@ -0,0 +1,105 @@
+/*
+ * HIDDescriptorTable, the report descriptor parser worked at compile time:
+ * for every built-in profile, its tables against what usb_hid_parse_report_descriptor()
+ * makes of the same descriptor at run time, and a few descriptors with push and
+ * pop, arrays, repeated usages and errors, checked by the compiler.
+ */
+
+#include "USBComposite.h"
+#include "test_util.h"
+
+static_assert(HIDTableJoystick::numReports == 1, "");
+static_assert(HIDTableJoystick::numFields == 5, "");
+static_assert(HIDTableJoystick::reports[0].reportID == HID_JOYSTICK_REPORT_ID, "");
+static_assert(HIDTableJoystick::reports[0].size == sizeof(JoystickReport_t) - 1, "");
+static_assert(HIDTableJoystick::fields[1].usageMin == 0x39 && HIDTableJoystick::fields[1].bitOffset == 32, "");
+static_assert(HIDTableJoystick::fields[4].count == 2 && HIDTableJoystick::fields[4].logicalMax == 1023, "");
+
+// unsigned maxima, a push and pop around a usage page, a run that repeats its last usage, and an array
+constexpr uint8 mixed[] = {
+    0x05, 0x01, 0x09, 0x02, 0xA1, 0x01,
+    0x85, 0x09,
+    0x15, 0x00, 0x25, 0xFF, 0x75, 0x08, 0x95, 0x02,
+    0xA4, 0x05, 0x09, 0x19, 0x01, 0x29, 0x02, 0x81, 0x02, 0xB4, // buttons 1 and 2 as bytes
+    0x09, 0x30, 0x09, 0x31, 0x95, 0x04, 0x81, 0x02,             // X, Y, Y, Y
+    0x95, 0x01, 0x81, 0x01,                                     // padding
+    0x19, 0x04, 0x29, 0x08, 0x95, 0x03, 0x81, 0x00,             // an array of usages 4 to 8
+    0x09, 0x40, 0x91, 0x02,                                     // an output, with the count still 3
+    0xFE, 0x02, 0x00, 0x11, 0x22,                               // a long item
+    0xC0
+};
+typedef HIDDescriptorTable<mixed, sizeof(mixed)> MixedTable;
+static_assert(MixedTable::numReports == 2 && MixedTable::numFields == 4, "");
+static_assert(MixedTable::reports[0].bits == 80 && MixedTable::reports[0].size == 10, "");
+static_assert(MixedTable::reports[1].type == HID_REPORT_TYPE_OUTPUT && MixedTable::reports[1].size == 3, "");
+static_assert(MixedTable::fields[0].usagePage == 9 && MixedTable::fields[0].logicalMax == 255, "");
+static_assert(MixedTable::fields[1].usagePage == 1 && MixedTable::fields[1].count == 4, "");
+static_assert(MixedTable::fields[1].usageMax == 0x31 && MixedTable::fields[1].bitOffset == 16, "");
+static_assert(MixedTable::fields[2].bitOffset == 56 && MixedTable::fields[2].count == 3, "");
+static_assert(MixedTable::fields[2].usageMin == 4 && MixedTable::fields[2].usageMax == 8, "");
+static_assert(MixedTable::fields[3].report == 1 && MixedTable::fields[3].count == 3, "");
+
+constexpr uint8 truncated[] = { 0x05, 0x01, 0x26, 0xFF };
+constexpr uint8 unbalanced[] = { 0xA1, 0x01, 0xA4, 0xB4, 0xB4, 0xC0 };
+constexpr uint8 openCollection[] = { 0xA1, 0x01 };
+constexpr uint8 maxWithoutMin[] = { 0x29, 0x08, 0x81, 0x02 };
+constexpr uint8 tooLong[] = { 0x75, 0x10, 0x96, 0x00, 0x10, 0x81, 0x02 };
+static_assert(HIDDescriptorParser::status(truncated, sizeof(truncated)) == HID_PARSE_TRUNCATED, "");
+static_assert(HIDDescriptorParser::status(unbalanced, sizeof(unbalanced)) == HID_PARSE_BAD_NESTING, "");
+static_assert(HIDDescriptorParser::status(openCollection, sizeof(openCollection)) == HID_PARSE_BAD_NESTING, "");
+static_assert(HIDDescriptorParser::status(maxWithoutMin, sizeof(maxWithoutMin)) == HID_PARSE_BAD_ITEM, "");
+static_assert(HIDDescriptorParser::status(tooLong, sizeof(tooLong)) == HID_PARSE_BAD_ITEM, "");
+
+// the run-time parser gives the same status for the broken ones
+static void test_errors(void) {
+    HIDLayout<4, 16> layout;
+    CHECK_EQ(layout.parse(truncated, sizeof(truncated)), HID_PARSE_TRUNCATED);
+    CHECK_EQ(layout.parse(unbalanced, sizeof(unbalanced)), HID_PARSE_BAD_NESTING);
+    CHECK_EQ(layout.parse(openCollection, sizeof(openCollection)), HID_PARSE_BAD_NESTING);
+    CHECK_EQ(layout.parse(maxWithoutMin, sizeof(maxWithoutMin)), HID_PARSE_BAD_ITEM);
+    CHECK_EQ(layout.parse(tooLong, sizeof(tooLong)), HID_PARSE_BAD_ITEM);
+}
+
+template<class Table> static void check_table(const char* name, const uint8* descriptor, uint32 length) {
+    HIDLayout<8, 64> layout;
+    uint8 status = layout.parse(descriptor, length);
+    CHECK_EQ(status, HID_PARSE_OK);
+    CHECK_EQ(Table::numReports, layout.numReports);
+    CHECK_EQ(Table::numFields, layout.numFields);
+    if (status != HID_PARSE_OK || Table::numReports != layout.numReports || Table::numFields != layout.numFields) {
+        fprintf(stderr, "%s: the tables differ\n", name);
+        return;
+    }
+    for (unsigned i = 0; i < layout.numReports; i++)
+        CHECK(!memcmp(&Table::reports[i], &layout.reports[i], sizeof(HIDReportInfo_t)));
+    for (unsigned i = 0; i < layout.numFields; i++) {
+        const HIDField_t* a = Table::fields + i;
+        const HIDField_t* b = layout.fields + i;
+        if (a->report != b->report || a->flags != b->flags || a->bitSize != b->bitSize || a->count != b->count ||
+                a->bitOffset != b->bitOffset || a->usagePage != b->usagePage || a->usageMin != b->usageMin ||
+                a->usageMax != b->usageMax || a->logicalMin != b->logicalMin || a->logicalMax != b->logicalMax) {
+            fprintf(stderr, "%s: field %u differs\n", name, i);
+            testFailures++;
+        }
+    }
+}
+
+#define CHECK_TABLE(name) check_table<HIDTable ## name>(#name, hidDescriptor ## name, sizeof(hidDescriptor ## name))
+
+int main(void) {
+    CHECK_TABLE(KeyboardMouseJoystick);
+    CHECK_TABLE(KeyboardMouse);
+    CHECK_TABLE(Keyboard);
+    CHECK_TABLE(Mouse);
+    CHECK_TABLE(AbsMouse);
+    CHECK_TABLE(KeyboardJoystick);
+    CHECK_TABLE(Joystick);
+    CHECK_TABLE(BootKeyboard);
+    CHECK_TABLE(Consumer);
+    CHECK_TABLE(Desktop);
+    CHECK_TABLE(Digitizer);
+    CHECK_TABLE(SwitchController);
+    check_table<MixedTable>("mixed", mixed, sizeof(mixed));
+    test_errors();
+    return test_finish("test_descriptor_table");
+}
@@ -0,0 +1,349 @@
+/*
+ * HIDRawStream on the simulated device against a host side written out here
+ * from the protocol in HIDRawStream.h: the SYNC exchange, messages of several
+ * fragments each way, the device holding reports while a message waits to
+ * be read and then making the host wait, without acking any of them, a
+ * device that never sends more than the host's window, a lost report
+ * counted and its message dropped, and ACK_REQUEST/ACK_REPLY getting a
+ * device whose acks were lost going again.
+ */
+
+#include "USBComposite.h"
+#include "test_util.h"
+
+#define HELD 4 // the device's receive window
+#define HOST_RECEIVE_WINDOW 3
+#define HOST_SEND_WINDOW 8
+
+static USBHID HID;
+static HIDRawStream<1024, HELD> stream(HID);
+static const uint8 reportDescriptor[] = { HID_RAW_REPORT_DESCRIPTOR(HID_RAW_STREAM_REPORT_SIZE, HID_RAW_STREAM_REPORT_SIZE) };
+static test_device dev;
+static uint8 outEp, inEp;
+
+// the host's end of the protocol
+static struct {
+    uint8 txSeq;
+    uint8 rxExpected;
+    uint8 deviceAck; // the last ack the device sent
+    unsigned unacked; // data reports taken in since the host last acked
+    unsigned mostUnacked;
+    uint8 message[1024];
+    uint32 messageLength;
+    bool messageComplete;
+    uint8 lastControl[HID_RAW_STREAM_REPORT_SIZE];
+    bool haveControl;
+} host;
+
+static uint8 pattern(uint32 i) {
+    return (uint8)(i * 13 + (i >> 8));
+}
+
+static int send_report(uint8 seq, uint8 flags, const uint8* payload, uint8 length) {
+    uint8 report[HID_RAW_STREAM_REPORT_SIZE];
+    memset(report, 0, sizeof(report));
+    report[0] = seq;
+    report[1] = host.rxExpected;
+    report[2] = flags;
+    report[3] = length;
+    if (length > 0)
+        memcpy(report + HID_RAW_STREAM_HEADER_SIZE, payload, length);
+    return usb_sim_out(outEp, report, sizeof(report));
+}
+
+static void send_ack(void) {
+    CHECK_EQ(send_report(host.txSeq, 0, NULL, 0), USB_SIM_ACK);
+    host.unacked = 0;
+}
+
+static void send_control(uint8 code, const uint8* payload, uint8 length) {
+    CHECK_EQ(send_report(host.txSeq, HID_RAW_STREAM_CONTROL | code, payload, length), USB_SIM_ACK);
+}
+
+// each fragment must be taken by the device; the host's window is the caller's business
+static void send_message(const uint8* data, uint32 length) {
+    uint8 fragment = 0;
+    do {
+        uint8 n = length < HID_RAW_STREAM_PAYLOAD_SIZE ? length : HID_RAW_STREAM_PAYLOAD_SIZE;
+        CHECK_EQ(send_report(host.txSeq++, fragment | (n == length ? HID_RAW_STREAM_LAST : 0), data, n), USB_SIM_ACK);
+        data += n;
+        length -= n;
+        fragment++;
+    } while (length > 0);
+}
+
+// the next report from the device, past the zero-length packets that end each transfer; false if there is none
+static bool read_report(uint8* report) {
+    int n;
+    do {
+        n = usb_sim_in(inEp, report, HID_RAW_STREAM_REPORT_SIZE);
+    } while (n == 0);
+    CHECK(n == USB_SIM_NAK || n == HID_RAW_STREAM_REPORT_SIZE);
+    return n == HID_RAW_STREAM_REPORT_SIZE;
+}
+
+// takes in whatever the device has sent; returns the number of reports
+static unsigned read_all(void) {
+    uint8 report[HID_RAW_STREAM_REPORT_SIZE];
+    unsigned n = 0;
+    while (read_report(report)) {
+        n++;
+        host.deviceAck = report[1];
+        if (report[2] & HID_RAW_STREAM_CONTROL) {
+            memcpy(host.lastControl, report, sizeof(report));
+            host.haveControl = true;
+            continue;
+        }
+        if (report[3] == 0 && !(report[2] & HID_RAW_STREAM_LAST))
+            continue; // only an ack
+        CHECK_EQ(report[0], host.rxExpected);
+        host.rxExpected = report[0] + 1;
+        if (++host.unacked > host.mostUnacked)
+            host.mostUnacked = host.unacked;
+        if ((report[2] & HID_RAW_STREAM_FRAGMENT_MASK) == 0) {
+            host.messageLength = 0;
+            host.messageComplete = false;
+        }
+        CHECK(host.messageLength + report[3] <= sizeof(host.message));
+        if (host.messageLength + report[3] <= sizeof(host.message)) {
+            memcpy(host.message + host.messageLength, report + HID_RAW_STREAM_HEADER_SIZE, report[3]);
+            host.messageLength += report[3];
+        }
+        host.messageComplete = (report[2] & HID_RAW_STREAM_LAST) != 0;
+    }
+    return n;
+}
+
+// a control report of the given code must have come in since the last call
+static const uint8* expect_control(uint8 code) {
+    read_all();
+    CHECK(host.haveControl);
+    CHECK_EQ(host.lastControl[2], HID_RAW_STREAM_CONTROL | code);
+    host.haveControl = false;
+    return host.lastControl;
+}
+
+static void test_sync(void) {
+    // until the host has synced, the device won't send
+    uint8 byte = 1;
+    CHECK(!stream.isSynced());
+    CHECK(!stream.sendMessage(&byte, 1));
+    CHECK_EQ(read_all(), 0);
+
+    // near the end of the sequence numbers, so that they wrap below
+    host.txSeq = 250;
+    const uint8 windows[2] = { HOST_RECEIVE_WINDOW, HOST_SEND_WINDOW };
+    send_control(HID_RAW_STREAM_SYNC_REQUEST, windows, 2);
+    stream.poll();
+    const uint8* reply = expect_control(HID_RAW_STREAM_SYNC_REPLY);
+    CHECK_EQ(reply[1], 250);
+    CHECK_EQ(reply[3], 2);
+    CHECK_EQ(reply[4], HELD);
+    CHECK_EQ(reply[5], HID_RAW_STREAM_DEFAULT_WINDOW);
+    host.rxExpected = reply[0];
+    CHECK(stream.isSynced());
+
+    // a SYNC in the middle of a message makes the device forget the part it has
+    uint8 data[100];
+    for (unsigned i = 0; i < sizeof(data); i++)
+        data[i] = pattern(i);
+    CHECK_EQ(send_report(host.txSeq++, 0, data, HID_RAW_STREAM_PAYLOAD_SIZE), USB_SIM_ACK);
+    stream.poll();
+    send_control(HID_RAW_STREAM_SYNC_REQUEST, windows, 2);
+    stream.poll();
+    expect_control(HID_RAW_STREAM_SYNC_REPLY);
+    send_message(data, 10);
+    CHECK_EQ(stream.messageAvailable(), 10);
+    uint8 out[1024];
+    CHECK_EQ(stream.receiveMessage(out, sizeof(out)), 10);
+    CHECK(!memcmp(out, data, 10));
+    CHECK_EQ(stream.getLostReports(), 0);
+    CHECK_EQ(stream.getDroppedMessages(), 0);
+}
+
+static void test_host_to_device(void) {
+    uint8 data[150];
+    for (unsigned i = 0; i < sizeof(data); i++)
+        data[i] = pattern(i + 7);
+    send_message(data, sizeof(data));
+    CHECK_EQ(stream.messageAvailable(), (int)sizeof(data));
+    uint8 out[1024];
+    CHECK_EQ(stream.receiveMessage(out, sizeof(out)), (int)sizeof(data));
+    CHECK(!memcmp(out, data, sizeof(data)));
+    CHECK_EQ(stream.receiveMessage(out, sizeof(out)), -1);
+
+    // three fragments are past half of min(HOST_SEND_WINDOW, HELD), so the device has acked them
+    read_all();
+    CHECK_EQ(host.deviceAck, host.txSeq);
+}
+
+/*
+ * While the device waits for acks, the host reads what has come in, and acks
+ * every fifth time (a frame each); or, with acksLost, throws its acks away
+ * and only answers an ACK_REQUEST.
+ */
+static bool acksLost;
+static unsigned waits;
+
+static void host_while_device_waits(void) {
+    usb_sim_frame();
+    waits++;
+    read_all();
+    if (acksLost) {
+        if (host.haveControl && host.lastControl[2] == (HID_RAW_STREAM_CONTROL | HID_RAW_STREAM_ACK_REQUEST)) {
+            host.haveControl = false;
+            uint8 held = 0;
+            send_control(HID_RAW_STREAM_ACK_REPLY, &held, 1);
+            host.unacked = 0;
+        }
+    }
+    else if (waits % 5 == 0 && host.unacked > 0) {
+        send_ack();
+    }
+}
+
+static void device_to_host(uint32 length) {
+    uint8 data[1024];
+    for (uint32 i = 0; i < length; i++)
+        data[i] = pattern(i + length);
+    host.mostUnacked = 0;
+    host.unacked = 0;
+    waits = 0;
+    usb_sim_set_wait_hook(host_while_device_waits);
+    CHECK(stream.sendMessage(data, length));
+    usb_sim_set_wait_hook(NULL);
+    read_all();
+    CHECK(host.messageComplete);
+    CHECK_EQ(host.messageLength, length);
+    CHECK(!memcmp(host.message, data, length));
+    send_ack();
+    stream.poll();
+}
+
+static void test_device_to_host(void) {
+    // seven fragments through a window of three: the host had all three unacked, and never more
+    device_to_host(400);
+    CHECK(waits > 0);
+    CHECK_EQ(host.mostUnacked, HOST_RECEIVE_WINDOW);
+    CHECK_EQ(stream.getAckRequests(), 0);
+
+    // one that fits the window never finds it full: the clock is only read as each fragment starts
+    device_to_host(100);
+    CHECK_EQ(waits, 2);
+}
+
+// the host's acks go missing: after HID_RAW_STREAM_ACK_TIMEOUT the device asks, and the reply gets it going
+static void test_ack_request(void) {
+    uint32 start = usb_sim_millis();
+    acksLost = true;
+    device_to_host(200);
+    acksLost = false;
+    CHECK_EQ(stream.getAckRequests(), 1);
+    CHECK(usb_sim_millis() - start >= HID_RAW_STREAM_ACK_TIMEOUT);
+    CHECK(usb_sim_millis() - start < 2 * HID_RAW_STREAM_ACK_TIMEOUT);
+}
+
+/*
+ * A message the sketch hasn't read holds up the ones behind it: the device
+ * holds HELD reports without acking them, answers an ACK_REQUEST with how
+ * many it holds, and past that leaves reports in the endpoint's queue and
+ * then NAKs, so that nothing is lost.
+ */
+static void test_held(void) {
+    uint8 first[10], second[4*HID_RAW_STREAM_PAYLOAD_SIZE];
+    for (unsigned i = 0; i < sizeof(first); i++)
+        first[i] = pattern(i + 1);
+    for (unsigned i = 0; i < sizeof(second); i++)
+        second[i] = pattern(i + 2);
+    send_message(first, sizeof(first));
+    stream.poll();
+    uint8 ackAfterFirst = host.txSeq;
+    send_message(second, sizeof(second));
+    stream.poll();
+    CHECK_EQ(stream.messageAvailable(), (int)sizeof(first));
+
+    send_control(HID_RAW_STREAM_ACK_REQUEST, NULL, 0);
+    stream.poll();
+    const uint8* reply = expect_control(HID_RAW_STREAM_ACK_REPLY);
+    CHECK_EQ(reply[1], ackAfterFirst);
+    CHECK_EQ(reply[3], 1);
+    CHECK_EQ(reply[4], HELD);
+
+    // beyond the window: one-byte messages, until the device makes the host wait
+    unsigned extra = 0;
+    while (extra < 32) {
+        uint8 byte = pattern(extra);
+        if (send_report(host.txSeq, HID_RAW_STREAM_LAST, &byte, 1) != USB_SIM_ACK)
+            break;
+        host.txSeq++;
+        extra++;
+        stream.poll();
+    }
+    CHECK(extra >= HID_RAW_STREAM_RX_SLOTS);
+    CHECK(extra < 32);
+    read_all();
+    CHECK_EQ(host.deviceAck, ackAfterFirst);
+
+    // each message read lets more in, and the acks for them out, which the host reads as it goes
+    uint8 out[1024];
+    CHECK_EQ(stream.receiveMessage(out, sizeof(out)), (int)sizeof(first));
+    CHECK(!memcmp(out, first, sizeof(first)));
+    read_all();
+    CHECK_EQ(stream.receiveMessage(out, sizeof(out)), (int)sizeof(second));
+    CHECK(!memcmp(out, second, sizeof(second)));
+    read_all();
+    for (unsigned i = 0; i < extra; i++) {
+        CHECK_EQ(stream.receiveMessage(out, sizeof(out)), 1);
+        CHECK_EQ(out[0], pattern(i));
+        read_all();
+    }
+    CHECK_EQ(stream.receiveMessage(out, sizeof(out)), -1);
+    read_all();
+    // acked up to the last few, fewer than the half window that makes it ack
+    CHECK((uint8)(host.txSeq - host.deviceAck) < (HELD+1)/2);
+    CHECK_EQ(stream.getLostReports(), 0);
+    CHECK_EQ(stream.getDroppedMessages(), 0);
+}
+
+// a gap in the sequence numbers: counted, the message it was part of dropped, the next one unharmed
+static void test_lost_report(void) {
+    uint8 data[3*HID_RAW_STREAM_PAYLOAD_SIZE];
+    for (unsigned i = 0; i < sizeof(data); i++)
+        data[i] = pattern(i + 3);
+    CHECK_EQ(send_report(host.txSeq++, 0, data, HID_RAW_STREAM_PAYLOAD_SIZE), USB_SIM_ACK);
+    host.txSeq++; // the second fragment is lost
+    CHECK_EQ(send_report(host.txSeq++, 2 | HID_RAW_STREAM_LAST, data + 2*HID_RAW_STREAM_PAYLOAD_SIZE, HID_RAW_STREAM_PAYLOAD_SIZE), USB_SIM_ACK);
+    CHECK_EQ(stream.messageAvailable(), -1);
+    CHECK_EQ(stream.getLostReports(), 1);
+    CHECK_EQ(stream.getDroppedMessages(), 1);
+
+    send_message(data, 20);
+    uint8 out[1024];
+    CHECK_EQ(stream.receiveMessage(out, sizeof(out)), 20);
+    CHECK(!memcmp(out, data, 20));
+    CHECK_EQ(stream.getLostReports(), 1);
+    CHECK_EQ(stream.getDroppedMessages(), 1);
+}
+
+int main(void) {
+    usb_sim_power_on();
+    stream.begin();
+    HID.begin(reportDescriptor, sizeof(reportDescriptor));
+    CHECK_EQ(test_enumerate(&dev, 5), 0);
+    const test_endpoint* out = test_find_endpoint(&dev, 3, 0, 3);
+    const test_endpoint* in = test_find_endpoint(&dev, 3, 1, 3);
+    CHECK(out != NULL && in != NULL);
+    if (out == NULL || in == NULL)
+        return test_finish("test_hidrawstream");
+    outEp = out->address;
+    inEp = in->address & 0x7F;
+
+    test_sync();
+    test_host_to_device();
+    test_device_to_host();
+    test_ack_request();
+    test_held();
+    test_lost_report();
+    HID.end();
+    return test_finish("test_hidrawstream");
+}
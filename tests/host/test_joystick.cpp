@@ -0,0 +1,144 @@
+/*
+ * HIDJoystick, which packs its report through the descriptor's field table:
+ * the layout the parser finds for HID_JOYSTICK, every setter's bits against
+ * JoystickReport_t, the report IDs changing when USBHID hands them out,
+ * and the reports the host reads from the interrupt endpoint.
+ */
+
+#include "USBComposite.h"
+#include "test_util.h"
+
+// gets at the report the joystick fills in
+class TestJoystick : public HIDJoystick {
+public:
+    TestJoystick(USBHID& HID, uint8_t reportID=HID_JOYSTICK_REPORT_ID) : HIDJoystick(HID, reportID) {}
+    const JoystickReport_t& report() {
+        return joyReport;
+    }
+};
+
+static USBHID HID;
+static TestJoystick joystick(HID);
+static TestJoystick second(HID, 7);
+static test_device dev;
+
+static void test_layout(void) {
+    HIDLayout<1, 6> layout;
+    CHECK_EQ(layout.parse(HID_JOYSTICK), HID_PARSE_OK);
+    CHECK_EQ(layout.numReports, 1);
+    CHECK_EQ(layout.reports[0].reportID, HID_JOYSTICK_REPORT_ID);
+    CHECK_EQ(layout.reports[0].size, sizeof(JoystickReport_t) - 1);
+
+    // buttons, hat, X and Y, Rx and Ry, and the two sliders
+    static const struct { uint16 page, usageMin, usageMax, count, bitSize, bitOffset; } expected[] = {
+        { 0x09, 1, 32, 32, 1, 0 },
+        { 0x01, 0x39, 0x39, 1, 4, 32 },
+        { 0x01, 0x30, 0x31, 2, 10, 36 },
+        { 0x01, 0x33, 0x34, 2, 10, 56 },
+        { 0x01, 0x36, 0x36, 2, 10, 76 },
+    };
+    CHECK_EQ(layout.numFields, sizeof(expected)/sizeof(*expected));
+    for (unsigned i = 0; i < layout.numFields && i < sizeof(expected)/sizeof(*expected); i++) {
+        const HIDField_t* f = layout.fields + i;
+        CHECK_EQ(f->usagePage, expected[i].page);
+        CHECK_EQ(f->usageMin, expected[i].usageMin);
+        CHECK_EQ(f->usageMax, expected[i].usageMax);
+        CHECK_EQ(f->count, expected[i].count);
+        CHECK_EQ(f->bitSize, expected[i].bitSize);
+        CHECK_EQ(f->bitOffset, expected[i].bitOffset);
+    }
+    CHECK(layout.fields[1].flags & HID_FIELD_NULL_STATE);
+}
+
+// the setters against the bitfields they used to write
+static void test_setters(TestJoystick& j) {
+    JoystickReport_t expected;
+    j.setManualReportMode(true);
+    memcpy(&expected, &j.report(), sizeof(expected));
+    CHECK_EQ(expected.hat, 15);
+
+    j.X(100);
+    expected.x = 100;
+    j.Y(2000); // clamped to the logical maximum
+    expected.y = 1023;
+    j.Xrotate(5);
+    expected.rx = 5;
+    j.Yrotate(1022);
+    expected.ry = 1022;
+    j.sliderLeft(300);
+    expected.sliderLeft = 300;
+    j.sliderRight(301);
+    expected.sliderRight = 301;
+    j.button(1, true);
+    j.button(32, true);
+    j.button(5, true);
+    j.button(5, false);
+    j.button(0, true); // no such buttons
+    j.button(33, true);
+    expected.buttons = 0x80000001;
+    j.hat(90);
+    expected.hat = 2;
+    CHECK(!memcmp(&j.report(), &expected, sizeof(expected)));
+
+    j.hat(-1); // centered: the null state
+    expected.hat = 15;
+    j.hat(359);
+    j.buttons(0x12345678);
+    expected.buttons = 0x12345678;
+    j.slider(7);
+    expected.sliderLeft = 7;
+    expected.sliderRight = 7;
+    j.position(1, 2);
+    expected.x = 1;
+    expected.y = 2;
+    CHECK(!memcmp(&j.report(), &expected, sizeof(expected)));
+    j.setManualReportMode(false);
+}
+
+// the next report from the interrupt endpoint, past the zero-length packets that end each transfer
+static int read_report(const test_endpoint* in, uint8* packet) {
+    int n;
+    do {
+        n = usb_sim_in_wait(in->address & 0x7F, packet, 64);
+    } while (n == 0);
+    return n;
+}
+
+static void test_reports(void) {
+    const test_endpoint* in = test_find_endpoint(&dev, 3, 1, 3);
+    CHECK(in != NULL);
+    if (in == NULL)
+        return;
+    uint8 packet[64];
+    joystick.X(700);
+    CHECK_EQ(read_report(in, packet), sizeof(JoystickReport_t));
+    CHECK(!memcmp(packet, &joystick.report(), sizeof(JoystickReport_t)));
+    CHECK_EQ(joystick.report().x, 700);
+    second.hat(180);
+    CHECK_EQ(read_report(in, packet), sizeof(JoystickReport_t));
+    CHECK(!memcmp(packet, &second.report(), sizeof(JoystickReport_t)));
+    CHECK_EQ(second.report().hat, 4);
+}
+
+int main(void) {
+    usb_sim_power_on();
+    test_layout();
+
+    // before begin() the joystick still has the report ID it was constructed with
+    second.setManualReportMode(true);
+    second.X(10);
+    CHECK_EQ(second.report().reportID, 7);
+    CHECK_EQ(second.report().x, 10);
+    second.X(512);
+
+    // begin() hands out report IDs, and the joystick looks its fields up under the new one
+    HID.begin();
+    CHECK_EQ(test_enumerate(&dev, 4), 0);
+    CHECK(joystick.report().reportID != second.report().reportID);
+    CHECK(second.report().reportID != 7);
+    test_setters(joystick);
+    test_setters(second);
+    test_reports();
+    HID.end();
+    return test_finish("test_joystick");
+}
@@ -0,0 +1,322 @@
+/*
+ * The C++ host demultiplexer in scripts/usbmux/ against usb_mux.c on the
+ * simulated device: opening with a RESET, data both ways on several
+ * channels, each side running out of credit without anything being dropped
+ * or holding up the other channels, and resynchronizing with a RESET in the
+ * middle of a stream, before the sketch has read what came before it, and
+ * after a bus reset. Last, FdTransport over a
+ * socketpair, with the test playing the device.
+ */
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include "test_util.h"
+#include "usb_generic.h"
+#include "usb_mux.h"
+#include "../../scripts/usbmux/usbmux.h"
+
+#define CHANNELS 4
+#define DEVICE_BUFFER 128
+
+static uint8 muxBuffers[USB_MUX_BUFFERS_SIZE(CHANNELS, DEVICE_BUFFER)];
+static test_device dev;
+
+// bulk transfers on the simulated bus, split into packets as a host controller would
+class SimTransport : public usbmux::Transport {
+private:
+    uint8 outEndpoint;
+    uint8 inEndpoint;
+public:
+    SimTransport() : outEndpoint(0), inEndpoint(0) {}
+
+    void find(const test_device* d) {
+        outEndpoint = test_find_endpoint(d, 0xFF, 0, 2)->address;
+        inEndpoint = test_find_endpoint(d, 0xFF, 1, 2)->address & 0x7F;
+    }
+
+    int read(uint8_t* buf, size_t size, int timeoutMillis) {
+        for (int i = 0; i <= timeoutMillis; i++) {
+            int n = usb_sim_in(inEndpoint, buf, size < USB_MUX_PACKET_SIZE ? size : USB_MUX_PACKET_SIZE);
+            if (n > 0)
+                return n;
+            if (n != USB_SIM_NAK)
+                return -1;
+            usb_sim_frame();
+        }
+        return 0;
+    }
+
+    int write(const uint8_t* data, size_t len) {
+        for (size_t done = 0; done < len; done += USB_MUX_PACKET_SIZE) {
+            size_t n = len - done < USB_MUX_PACKET_SIZE ? len - done : USB_MUX_PACKET_SIZE;
+            if (usb_sim_out_wait(outEndpoint, data + done, n) != USB_SIM_ACK)
+                return -1;
+        }
+        return (int)len;
+    }
+};
+
+static SimTransport transport;
+
+static uint8 pattern(unsigned channel, uint32 i) {
+    return (uint8)(i * 7 + channel * 61 + (i >> 8));
+}
+
+// polls until nothing has arrived for a few milliseconds
+static void settle(usbmux::Mux& mux) {
+    while (mux.poll(5))
+        ;
+}
+
+// moves total bytes from the host to the device on a channel, the device reading as it goes
+static void host_to_device(usbmux::Mux& mux, unsigned channel, uint32 total) {
+    uint8 data[700];
+    uint32 sent = 0, received = 0, mismatches = 0;
+    for (unsigned round = 0; round < 2000 && received < total; round++) {
+        uint32 n = total - sent < sizeof(data) ? total - sent : sizeof(data);
+        for (uint32 i = 0; i < n; i++)
+            data[i] = pattern(channel, sent + i);
+        sent += mux.write(channel, data, n);
+        mux.poll(1);
+        n = usb_mux_rx(channel, data, sizeof(data));
+        for (uint32 i = 0; i < n; i++)
+            if (data[i] != pattern(channel, received + i))
+                mismatches++;
+        received += n;
+    }
+    CHECK_EQ(received, total);
+    CHECK_EQ(mismatches, 0);
+}
+
+// the other way round, the host reading as it goes
+static void device_to_host(usbmux::Mux& mux, unsigned channel, uint32 total) {
+    uint8 data[700];
+    uint32 sent = 0, received = 0, mismatches = 0;
+    for (unsigned round = 0; round < 2000 && received < total; round++) {
+        uint32 n = total - sent < sizeof(data) ? total - sent : sizeof(data);
+        for (uint32 i = 0; i < n; i++)
+            data[i] = pattern(channel, sent + i);
+        sent += usb_mux_tx(channel, data, n);
+        mux.poll(1);
+        n = mux.read(channel, data, sizeof(data));
+        for (uint32 i = 0; i < n; i++)
+            if (data[i] != pattern(channel, received + i))
+                mismatches++;
+        received += n;
+    }
+    CHECK_EQ(received, total);
+    CHECK_EQ(mismatches, 0);
+}
+
+static void test_open(usbmux::Mux& mux) {
+    CHECK(!usb_mux_is_open());
+    CHECK(mux.open());
+    settle(mux);
+    CHECK(usb_mux_is_open());
+    for (unsigned c = 0; c < CHANNELS; c++)
+        CHECK_EQ(mux.getTxCredit(c), DEVICE_BUFFER - 1); // a ring holds one byte less than its size
+}
+
+static void test_both_ways(usbmux::Mux& mux) {
+    for (unsigned c = 0; c < CHANNELS; c++) {
+        host_to_device(mux, c, 3000 + c);
+        device_to_host(mux, c, 5000 + c);
+    }
+}
+
+// the device stops reading one channel: the host holds back at the credit, and the other channels still flow
+static void test_device_credit(usbmux::Mux& mux) {
+    uint8 data[1000];
+    for (uint32 i = 0; i < sizeof(data); i++)
+        data[i] = pattern(2, i);
+    CHECK_EQ(mux.write(2, data, sizeof(data)), sizeof(data));
+    settle(mux);
+    CHECK_EQ(usb_mux_data_available(2), DEVICE_BUFFER - 1);
+    CHECK_EQ(mux.getTxCredit(2), 0);
+    CHECK_EQ(mux.pending(2), sizeof(data) - (DEVICE_BUFFER - 1));
+
+    host_to_device(mux, 3, 2000);
+    device_to_host(mux, 1, 2000);
+    CHECK_EQ(usb_mux_data_available(2), DEVICE_BUFFER - 1);
+
+    // the device catches up, and gets the rest in order
+    uint32 received = 0, mismatches = 0;
+    for (unsigned round = 0; round < 1000 && received < sizeof(data); round++) {
+        uint8 in[64];
+        uint32 n = usb_mux_rx(2, in, sizeof(in));
+        for (uint32 i = 0; i < n; i++)
+            if (in[i] != pattern(2, received + i))
+                mismatches++;
+        received += n;
+        mux.poll(1);
+    }
+    CHECK_EQ(received, sizeof(data));
+    CHECK_EQ(mismatches, 0);
+    CHECK_EQ(mux.pending(2), 0);
+    CHECK_EQ(usb_mux_get_dropped(), 0);
+}
+
+// the host stops reading one channel: the device holds back at the credit, and the other channels still flow
+static void test_host_credit(usbmux::Mux& mux, uint32 hostBuffer) {
+    uint8 data[1000];
+    uint32 queued = 0;
+    for (uint32 i = 0; i < sizeof(data); i++)
+        data[i] = pattern(1, i);
+    for (unsigned round = 0; round < 100 && queued < sizeof(data); round++) {
+        queued += usb_mux_tx(1, data + queued, sizeof(data) - queued);
+        settle(mux);
+    }
+    CHECK_EQ(mux.available(1), hostBuffer);
+    CHECK_EQ(usb_mux_get_pending(1) + hostBuffer, queued);
+
+    host_to_device(mux, 0, 1000);
+    device_to_host(mux, 3, 1000);
+    CHECK_EQ(mux.available(1), hostBuffer);
+
+    uint32 received = 0, mismatches = 0;
+    for (unsigned round = 0; round < 1000 && received < sizeof(data); round++) {
+        uint8 in[100];
+        uint32 n = mux.read(1, in, sizeof(in));
+        for (uint32 i = 0; i < n; i++)
+            if (in[i] != pattern(1, received + i))
+                mismatches++;
+        received += n;
+        if (queued < sizeof(data))
+            queued += usb_mux_tx(1, data + queued, sizeof(data) - queued);
+        mux.poll(1);
+    }
+    CHECK_EQ(received, sizeof(data));
+    CHECK_EQ(mismatches, 0);
+    CHECK_EQ(mux.getDropped(), 0);
+}
+
+// a RESET in the middle of streams: nothing from before it turns up after it, on either side
+static void test_resync(usbmux::Mux& mux) {
+    static const uint8 stale[40] = { 0xEE };
+    static const uint8 fresh[5] = { 'f', 'r', 'e', 's', 'h' };
+
+    usb_mux_tx(0, stale, sizeof(stale)); // in packet memory, waiting for the host
+    usb_mux_tx(1, stale, sizeof(stale));
+    mux.write(2, stale, sizeof(stale)); // with the device, unread
+    CHECK(usb_mux_data_available(2) > 0);
+
+    CHECK(mux.open());
+    for (unsigned c = 0; c < CHANNELS; c++) {
+        CHECK_EQ(mux.available(c), 0);
+        CHECK_EQ(usb_mux_data_available(c), 0);
+        CHECK_EQ(usb_mux_get_pending(c), 0);
+    }
+    settle(mux);
+
+    uint8 in[64];
+    CHECK_EQ(usb_mux_tx(0, fresh, sizeof(fresh)), sizeof(fresh));
+    settle(mux);
+    CHECK_EQ(mux.read(0, in, sizeof(in)), sizeof(fresh));
+    CHECK(!memcmp(in, fresh, sizeof(fresh)));
+    CHECK_EQ(mux.write(2, fresh, sizeof(fresh)), sizeof(fresh));
+    settle(mux);
+    CHECK_EQ(usb_mux_rx(2, in, sizeof(in)), sizeof(fresh));
+    CHECK(!memcmp(in, fresh, sizeof(fresh)));
+    CHECK_EQ(usb_mux_get_dropped(), 0);
+    CHECK_EQ(mux.getDropped(), 0);
+}
+
+/*
+ * RESETs while the sketch isn't looking: the interrupt leaves the receive
+ * buffers to the main program, which drops only what arrived before the last
+ * RESET, however many there were, and then gives credit for the room.
+ */
+static void test_reset_unread(usbmux::Mux& mux) {
+    static const uint8 stale[60] = { 0xEE };
+    static const uint8 fresh[5] = { 'f', 'r', 'e', 's', 'h' };
+    CHECK_EQ(mux.write(1, stale, sizeof(stale)), sizeof(stale));
+    settle(mux);
+
+    CHECK(mux.open());
+    CHECK(mux.open());
+    settle(mux);
+    CHECK_EQ(mux.getTxCredit(1), DEVICE_BUFFER - 1 - sizeof(stale)); // the stale bytes still take up room
+    CHECK_EQ(mux.write(1, fresh, sizeof(fresh)), sizeof(fresh));
+    settle(mux);
+
+    uint8 in[128];
+    CHECK_EQ(usb_mux_rx(1, in, sizeof(in)), sizeof(fresh));
+    CHECK(!memcmp(in, fresh, sizeof(fresh)));
+    settle(mux);
+    // credit for the stale bytes' room; the 5 just read are too few for a grant of their own
+    CHECK_EQ(mux.getTxCredit(1), DEVICE_BUFFER - 1 - sizeof(fresh));
+    CHECK_EQ(usb_mux_get_dropped(), 0);
+}
+
+// a loopback: the test is the device at the other end of a socketpair
+static void test_fd_transport(void) {
+    int fds[2];
+    CHECK_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    usbmux::FdTransport fd(fds[0], fds[0]);
+    usbmux::Mux mux(fd, 2, 64);
+
+    // the device's answer, queued ahead of the host's RESET: the RESET, then 10 bytes of credit on channel 1
+    static const uint8 answer[] = { 0xFF, 0, 0x41, 2, 10, 0, 0x01, 3, 'a', 'b', 'c' };
+    CHECK_EQ(write(fds[1], answer, sizeof(answer)), (ssize_t)sizeof(answer));
+    CHECK(mux.open(100));
+    settle(mux);
+    uint8 in[64];
+    CHECK_EQ(mux.read(1, in, sizeof(in)), 3);
+    CHECK(!memcmp(in, "abc", 3));
+    CHECK_EQ(mux.write(1, (const uint8*)"0123456789ABCDEF", 16), 16);
+
+    // the RESET, credit for both channels (less the 3 bytes already buffered on channel 1; reading them is
+    // too little for another grant), and exactly the 10 bytes there was credit for
+    static const uint8 expected[] = { 0xFF, 0, 0x40, 2, 64, 0, 0x41, 2, 61, 0,
+        0x01, 10, '0', '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+    uint8 out[64];
+    ssize_t n = read(fds[1], out, sizeof(out));
+    CHECK_EQ(n, sizeof(expected));
+    CHECK(!memcmp(out, expected, sizeof(expected)));
+    CHECK_EQ(mux.pending(1), 6);
+    CHECK_EQ(mux.getTxCredit(1), 0);
+
+    close(fds[1]);
+    CHECK(!mux.poll(10));
+    CHECK(mux.hadError());
+    close(fds[0]);
+}
+
+int main(void) {
+    static USBCompositePart* parts[] = { &usbMuxPart };
+    usb_sim_power_on();
+    usb_mux_initialize(CHANNELS, muxBuffers, DEVICE_BUFFER);
+    usb_generic_set_info(0x1EAF, 0x0031, NULL, NULL, NULL);
+    CHECK(usb_generic_set_parts(parts, 1));
+    usb_generic_enable();
+    CHECK_EQ(test_enumerate(&dev, 5), 0);
+    transport.find(&dev);
+
+    {
+        usbmux::Mux mux(transport, CHANNELS);
+        test_open(mux);
+        test_both_ways(mux);
+        test_device_credit(mux);
+        test_resync(mux);
+        test_reset_unread(mux);
+    }
+    {
+        // a new program on the host, with smaller buffers
+        usbmux::Mux mux(transport, CHANNELS, 256);
+        CHECK(mux.open());
+        settle(mux);
+        test_host_credit(mux, 256);
+
+        // after a bus reset the device waits for a RESET again
+        usb_mux_tx(0, (const uint8*)"stale", 5);
+        CHECK_EQ(test_enumerate(&dev, 6), 0);
+        CHECK(!usb_mux_is_open());
+        CHECK(mux.open());
+        settle(mux);
+        test_both_ways(mux);
+    }
+    test_fd_transport();
+
+    usb_generic_disable();
+    return test_finish("test_mux");
+}
@@ -0,0 +1,83 @@
+/*
+ * usb_copy_to_pma_ptr() and usb_copy_from_pma_ptr() against a byte-at-a-time
+ * reference, for every RAM alignment and every length up to a full packet
+ * and then some. Packet memory is mocked as an array of 32-bit slots with
+ * one halfword in each, as the CPU sees it; the other halfword of each slot
+ * is filled with garbage on reads and must come back as 0 from writes.
+ */
+
+#include <stdlib.h>
+#include "test_util.h"
+#include "usb_generic.h"
+
+#define MAX_LENGTH 130
+#define SLOTS (MAX_LENGTH/2 + 8)
+#define GUARD 8
+#define PMA_UNTOUCHED 0xDEADBEEFu
+
+static uint8 ram[MAX_LENGTH + 2*GUARD + 4] __attribute__((aligned(4)));
+static uint32 pma[SLOTS];
+
+static uint8 data_byte(unsigned i, unsigned length) {
+    return (uint8)(i * 131 + length * 7 + 1);
+}
+
+static void test_to_pma(unsigned align, unsigned length) {
+    uint8* buf = ram + GUARD + align;
+    for (unsigned i = 0; i < length; i++)
+        buf[i] = data_byte(i, length);
+    for (unsigned i = 0; i < SLOTS; i++)
+        pma[i] = PMA_UNTOUCHED;
+
+    usb_copy_to_pma_ptr(buf, length, pma);
+
+    unsigned errors = 0;
+    for (unsigned i = 0; i < (length + 1) / 2; i++) {
+        uint32 expected = buf[2*i];
+        if (2*i + 1 < length)
+            expected |= (uint32)buf[2*i+1] << 8;
+        if (pma[i] != expected)
+            errors++;
+    }
+    for (unsigned i = (length + 1) / 2; i < SLOTS; i++)
+        if (pma[i] != PMA_UNTOUCHED)
+            errors++;
+    if (errors) {
+        fprintf(stderr, "to PMA: alignment %u, length %u: %u slots wrong\n", align, length, errors);
+        testFailures++;
+    }
+}
+
+static void test_from_pma(unsigned align, unsigned length) {
+    uint8* buf = ram + GUARD + align;
+    memset(ram, 0x5A, sizeof(ram));
+    for (unsigned i = 0; i < SLOTS; i++)
+        pma[i] = 0xA5A50000u | data_byte(2*i, length) | (uint32)data_byte(2*i+1, length) << 8;
+
+    usb_copy_from_pma_ptr(buf, length, pma);
+
+    unsigned errors = 0;
+    for (unsigned i = 0; i < length; i++)
+        if (buf[i] != data_byte(i, length))
+            errors++;
+    for (uint8* p = ram; p < buf; p++)
+        if (*p != 0x5A)
+            errors++;
+    for (uint8* p = buf + length; p < ram + sizeof(ram); p++)
+        if (*p != 0x5A)
+            errors++;
+    if (errors) {
+        fprintf(stderr, "from PMA: alignment %u, length %u: %u bytes wrong\n", align, length, errors);
+        testFailures++;
+    }
+}
+
+int main(void) {
+    for (unsigned align = 0; align < 4; align++) {
+        for (unsigned length = 0; length <= MAX_LENGTH; length++) {
+            test_to_pma(align, length);
+            test_from_pma(align, length);
+        }
+    }
+    return test_finish("test_pma_copy");
+}
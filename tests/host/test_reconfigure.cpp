@@ -0,0 +1,144 @@
+/*
+ * USBComposite.reconfigure(): the device keeps serving the host with the parts
+ * it was started with while a new list is being registered, switches to the
+ * new list in reconfigure(), and when a new part fails to start, stops and
+ * clears every other part exactly once.
+ */
+
+#include "USBComposite.h"
+#include "test_util.h"
+
+#define NUM_PARTS 4
+enum { A, B, C, D };
+
+typedef struct {
+    unsigned inits, stops, clears, resets, configurations;
+} part_counts;
+
+static part_counts counts[NUM_PARTS];
+static USBCompositePart parts[NUM_PARTS];
+static bool initSucceeds[NUM_PARTS] = { true, true, true, true };
+static test_device dev;
+
+template<int n> static void usb_reset(void) {
+    counts[n].resets++;
+}
+
+template<int n> static void set_configuration(void) {
+    counts[n].configurations++;
+}
+
+template<int n> static void clear(void) {
+    counts[n].clears++;
+}
+
+// one vendor-specific interface with no endpoints, whose subclass tells the parts apart
+template<int n> static void get_descriptor(uint8* out) {
+    uint8 interface[9] = { 9, 4, parts[n].startInterface, 0, 0, 0xFF, (uint8)(0x10 + n), 0, 0 };
+    memcpy(out, interface, 9);
+}
+
+static bool init(void* plugin) {
+    unsigned n = (unsigned)(uintptr_t)plugin;
+    counts[n].inits++;
+    return initSucceeds[n];
+}
+
+static void stop(void* plugin) {
+    counts[(uintptr_t)plugin].stops++;
+}
+
+template<int n> static void make_part(void) {
+    USBCompositePart* p = &parts[n];
+    p->numInterfaces = 1;
+    p->numEndpoints = 0;
+    p->descriptorSize = 9;
+    p->getPartDescriptor = get_descriptor<n>;
+    p->usbReset = usb_reset<n>;
+    p->usbSetConfiguration = set_configuration<n>;
+    p->clear = clear<n>;
+}
+
+static void add(unsigned n) {
+    CHECK(USBComposite.add(&parts[n], (void*)(uintptr_t)n, init, stop));
+}
+
+// the subclasses of the interfaces the host sees, in order
+static unsigned enumerated_parts(void) {
+    unsigned found = 0;
+    for (unsigned i = 0; i + 1 < dev.configLength && dev.config[i] != 0; i += dev.config[i])
+        if (dev.config[i+1] == 4)
+            found = found * 16 + dev.config[i+6] - 0x10 + 1;
+    return found;
+}
+
+static void test_staging(void) {
+    memset(counts, 0, sizeof(counts));
+    USBComposite.clear();
+    add(A);
+    add(B);
+    CHECK(USBComposite.begin());
+    CHECK_EQ(test_enumerate(&dev, 3), 0);
+    CHECK_EQ(enumerated_parts(), 0x12);
+    CHECK_EQ(counts[A].configurations, 1);
+
+    // the new list is only registered: bus resets and requests still reach A and B
+    USBComposite.clear();
+    add(C);
+    add(B);
+    CHECK_EQ(test_enumerate(&dev, 4), 0);
+    CHECK_EQ(enumerated_parts(), 0x12);
+    CHECK_EQ(counts[A].configurations, 2);
+    CHECK_EQ(counts[B].configurations, 2);
+    CHECK_EQ(counts[C].resets, 0);
+    CHECK_EQ(counts[C].configurations, 0);
+    CHECK_EQ(counts[C].inits, 0);
+
+    CHECK(USBComposite.reconfigure());
+    usb_sim_advance(10);
+    CHECK_EQ(test_enumerate(&dev, 5), 0);
+    CHECK_EQ(enumerated_parts(), 0x32);
+    CHECK_EQ(counts[A].clears, 1);
+    CHECK_EQ(counts[A].stops, 1);
+    CHECK_EQ(counts[B].clears, 0);
+    CHECK_EQ(counts[B].inits, 1);
+    CHECK_EQ(counts[C].inits, 1);
+    CHECK_EQ(counts[C].configurations, 1);
+    CHECK_EQ(counts[A].configurations, 2);
+}
+
+// D won't start: C (going) and B (staying) are each stopped and cleared once, and D not at all
+static void test_failure(void) {
+    memset(counts, 0, sizeof(counts));
+    initSucceeds[D] = false;
+    USBComposite.clear();
+    add(B);
+    add(D);
+    CHECK(!USBComposite.reconfigure());
+    CHECK_EQ(counts[C].clears, 1);
+    CHECK_EQ(counts[C].stops, 1);
+    CHECK_EQ(counts[B].clears, 1);
+    CHECK_EQ(counts[B].stops, 1);
+    CHECK_EQ(counts[D].inits, 1);
+    CHECK_EQ(counts[D].clears, 0);
+    CHECK_EQ(counts[D].stops, 0);
+    CHECK(!usb_sim_pullup());
+
+    // and begin() starts over
+    initSucceeds[D] = true;
+    CHECK(USBComposite.begin());
+    CHECK_EQ(test_enumerate(&dev, 6), 0);
+    CHECK_EQ(enumerated_parts(), 0x24);
+    USBComposite.end();
+}
+
+int main(void) {
+    make_part<A>();
+    make_part<B>();
+    make_part<C>();
+    make_part<D>();
+    usb_sim_power_on();
+    test_staging();
+    test_failure();
+    return test_finish("test_reconfigure");
+}
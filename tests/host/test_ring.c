@@ -0,0 +1,203 @@
+/*
+ * usb_ring on its own: random pushes, pops, peeks and span operations
+ * checked against a byte-for-byte model, then a producer and a consumer
+ * thread streaming through small and large rings with every byte checked.
+ */
+
+#define USB_RING_HOST
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include "usb_ring.h"
+#include "test_util.h"
+
+static uint8 sequence_byte(uint32 i) {
+    return (uint8)(i ^ (i >> 8) ^ (i >> 16));
+}
+
+static uint32 rng = 1;
+
+static uint32 random_below(uint32 n) {
+    rng = rng * 1103515245 + 12345;
+    return (rng >> 8) % n;
+}
+
+// the model: bytes pushed and popped so far, so the ring holds sequence bytes [popped, pushed)
+static void test_single_thread(uint32 size) {
+    uint8 storage[1024 + 8];
+    uint8 data[1024 + 2];
+    usb_ring r;
+    uint32 pushed = 0, popped = 0;
+
+    memset(storage, 0xEE, sizeof(storage));
+    usb_ring_init(&r, storage, size);
+    CHECK_EQ(usb_ring_capacity(&r), size - 1);
+    CHECK_EQ(usb_ring_peek_byte(&r), -1);
+
+    for (unsigned step = 0; step < 20000; step++) {
+        uint32 held = pushed - popped;
+        CHECK_EQ(usb_ring_available(&r), held);
+        CHECK_EQ(usb_ring_free(&r), size - 1 - held);
+
+        uint32 len = random_below(size + 2);
+        uint32 n;
+        const uint8* span;
+        uint8* wspan;
+        switch (random_below(6)) {
+        case 0: // push
+            for (uint32 i = 0; i < len; i++)
+                data[i] = sequence_byte(pushed + i);
+            n = usb_ring_push(&r, data, len);
+            CHECK_EQ(n, len < size - 1 - held ? len : size - 1 - held);
+            pushed += n;
+            break;
+        case 1: // write span
+            wspan = usb_ring_write_span(&r, &n);
+            CHECK(n <= size - 1 - held);
+            CHECK(wspan + n <= storage + size);
+            if (n > len)
+                n = len;
+            for (uint32 i = 0; i < n; i++)
+                wspan[i] = sequence_byte(pushed + i);
+            usb_ring_commit_write(&r, n);
+            pushed += n;
+            break;
+        case 2: // pop
+            n = usb_ring_pop(&r, data, len);
+            CHECK_EQ(n, len < held ? len : held);
+            for (uint32 i = 0; i < n; i++)
+                CHECK_EQ(data[i], sequence_byte(popped + i));
+            popped += n;
+            break;
+        case 3: // read span
+            span = usb_ring_read_span(&r, &n);
+            CHECK(n <= held);
+            CHECK(span + n <= storage + size);
+            if (n > len)
+                n = len;
+            for (uint32 i = 0; i < n; i++)
+                CHECK_EQ(span[i], sequence_byte(popped + i));
+            usb_ring_commit_read(&r, n);
+            popped += n;
+            break;
+        case 4: { // peek at an offset, consuming nothing
+            uint32 offset = random_below(held + 2);
+            n = usb_ring_peek(&r, offset, data, len);
+            CHECK_EQ(n, offset >= held ? 0 : (len < held - offset ? len : held - offset));
+            for (uint32 i = 0; i < n; i++)
+                CHECK_EQ(data[i], sequence_byte(popped + offset + i));
+            CHECK_EQ(usb_ring_peek_byte(&r), held ? sequence_byte(popped) : -1);
+            break;
+        }
+        default: // fill to the brim, then drain completely
+            for (uint32 i = 0; i < size; i++)
+                data[i] = sequence_byte(pushed + i);
+            pushed += usb_ring_push(&r, data, size);
+            CHECK_EQ(usb_ring_free(&r), 0);
+            CHECK_EQ(usb_ring_push(&r, data, 1), 0);
+            if (random_below(2)) {
+                n = usb_ring_pop(&r, data, size);
+                CHECK_EQ(n, size - 1);
+                for (uint32 i = 0; i < n; i++)
+                    CHECK_EQ(data[i], sequence_byte(popped + i));
+                popped += n;
+            }
+            break;
+        }
+    }
+    for (uint32 i = size; i < sizeof(storage); i++)
+        CHECK_EQ(storage[i], 0xEE);
+
+    usb_ring_clear(&r);
+    CHECK_EQ(usb_ring_available(&r), 0);
+}
+
+#define STREAM_BYTES (8u << 20)
+
+typedef struct {
+    usb_ring ring;
+    uint32 errors;
+} stream;
+
+static void* producer(void* arg) {
+    stream* s = (stream*)arg;
+    uint8 data[300];
+    uint32 sent = 0, seed = 7;
+    while (sent < STREAM_BYTES) {
+        seed = seed * 1103515245 + 12345;
+        uint32 len = 1 + (seed >> 8) % sizeof(data);
+        if (len > STREAM_BYTES - sent)
+            len = STREAM_BYTES - sent;
+        if (seed & 0x80000000u) {
+            for (uint32 i = 0; i < len; i++)
+                data[i] = sequence_byte(sent + i);
+            sent += usb_ring_push(&s->ring, data, len);
+        }
+        else {
+            uint32 n;
+            uint8* span = usb_ring_write_span(&s->ring, &n);
+            if (n > len)
+                n = len;
+            for (uint32 i = 0; i < n; i++)
+                span[i] = sequence_byte(sent + i);
+            usb_ring_commit_write(&s->ring, n);
+            sent += n;
+        }
+        if (usb_ring_free(&s->ring) == 0)
+            sched_yield(); // let the consumer run, even on a single core
+    }
+    return NULL;
+}
+
+static void* consumer(void* arg) {
+    stream* s = (stream*)arg;
+    uint8 data[300];
+    uint32 received = 0, seed = 11;
+    while (received < STREAM_BYTES) {
+        seed = seed * 1103515245 + 12345;
+        uint32 len = 1 + (seed >> 8) % sizeof(data);
+        uint32 n;
+        if (seed & 0x80000000u) {
+            n = usb_ring_pop(&s->ring, data, len);
+            for (uint32 i = 0; i < n; i++)
+                if (data[i] != sequence_byte(received + i))
+                    s->errors++;
+        }
+        else {
+            const uint8* span = usb_ring_read_span(&s->ring, &n);
+            if (n > len)
+                n = len;
+            for (uint32 i = 0; i < n; i++)
+                if (span[i] != sequence_byte(received + i))
+                    s->errors++;
+            usb_ring_commit_read(&s->ring, n);
+        }
+        received += n;
+        if (usb_ring_available(&s->ring) == 0)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void test_threads(uint32 size) {
+    static volatile uint8 storage[4096];
+    stream s;
+    usb_ring_init(&s.ring, storage, size);
+    s.errors = 0;
+    pthread_t p, c;
+    CHECK_EQ(pthread_create(&p, NULL, producer, &s), 0);
+    CHECK_EQ(pthread_create(&c, NULL, consumer, &s), 0);
+    pthread_join(p, NULL);
+    pthread_join(c, NULL);
+    CHECK_EQ(s.errors, 0);
+    CHECK_EQ(usb_ring_available(&s.ring), 0);
+}
+
+int main(void) {
+    static const uint32 sizes[] = { 2, 4, 64, 256, 1024 };
+    for (unsigned i = 0; i < sizeof(sizes)/sizeof(*sizes); i++)
+        test_single_thread(sizes[i]);
+    test_threads(16);
+    test_threads(4096);
+    return test_finish("test_ring");
+}
@@ -0,0 +1,122 @@
+/*
+ * Shared by the host tests: checks that count failures instead of stopping,
+ * and the part of a host stack that enumerates the simulated device.
+ */
+
+#ifndef _TEST_UTIL_H_
+#define _TEST_UTIL_H_
+
+#include <stdio.h>
+#include <string.h>
+#include "usb_sim.h"
+
+static int testFailures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            testFailures++; \
+        } \
+    } while(0)
+
+#define CHECK_EQ(a, b) do { \
+        long long _a = (long long)(a), _b = (long long)(b); \
+        if (_a != _b) { \
+            fprintf(stderr, "%s:%d: check failed: %s == %s (%lld != %lld)\n", __FILE__, __LINE__, #a, #b, _a, _b); \
+            testFailures++; \
+        } \
+    } while(0)
+
+// exit status for main(): nonzero if a check failed or the simulator saw the library misuse the hardware
+static int test_finish(const char* name) {
+    if (usb_sim_errors() != 0) {
+        fprintf(stderr, "%s: %u simulator errors\n", name, (unsigned)usb_sim_errors());
+        testFailures++;
+    }
+    printf("%s: %s\n", name, testFailures ? "FAILED" : "ok");
+    return testFailures ? 1 : 0;
+}
+
+#define TEST_MAX_ENDPOINTS 16
+
+typedef struct {
+    uint8 address; // with bit 7 set for IN
+    uint8 attributes;
+    uint16 maxPacket;
+    uint8 interface;
+    uint8 interfaceClass;
+} test_endpoint;
+
+typedef struct {
+    uint8 device[18];
+    uint8 config[512];
+    uint16 configLength;
+    uint8 numInterfaces;
+    uint8 numEndpoints;
+    test_endpoint endpoints[TEST_MAX_ENDPOINTS];
+} test_device;
+
+#define TEST_GET_DESCRIPTOR(type, index, langID, length, data) \
+    usb_sim_control(0x80, 0x06, ((type)<<8)|(index), langID, length, data)
+
+/*
+ * What a host does after connection: reset, read the first 8 bytes of the
+ * device descriptor for bMaxPacketSize0, reset again, assign an address, read
+ * the device and configuration descriptors, and select the configuration.
+ * Returns 0 on success, with the endpoints the descriptors declared in d.
+ */
+static int test_enumerate(test_device* d, uint8 address) {
+    memset(d, 0, sizeof(*d));
+    usb_sim_bus_reset();
+    usb_sim_advance(10);
+    usb_sim_set_ep0_size(8);
+    if (TEST_GET_DESCRIPTOR(1, 0, 0, 8, d->device) != 8)
+        return -1;
+    usb_sim_set_ep0_size(d->device[7]);
+    usb_sim_bus_reset();
+    usb_sim_advance(10);
+    if (usb_sim_control(0x00, 0x05, address, 0, 0, NULL) != 0)
+        return -2;
+    usb_sim_advance(2);
+    if (TEST_GET_DESCRIPTOR(1, 0, 0, 18, d->device) != 18)
+        return -3;
+    uint8 header[9];
+    if (TEST_GET_DESCRIPTOR(2, 0, 0, 9, header) != 9)
+        return -4;
+    d->configLength = header[2] | (header[3]<<8);
+    if (d->configLength > sizeof(d->config) || TEST_GET_DESCRIPTOR(2, 0, 0, d->configLength, d->config) != d->configLength)
+        return -5;
+    d->numInterfaces = d->config[4];
+
+    uint8 interface = 0, interfaceClass = 0;
+    for (unsigned i = 0; i + 1 < d->configLength && d->config[i] != 0; i += d->config[i]) {
+        const uint8* desc = d->config + i;
+        if (desc[1] == 4) {
+            interface = desc[2];
+            interfaceClass = desc[5];
+        }
+        else if (desc[1] == 5 && d->numEndpoints < TEST_MAX_ENDPOINTS) {
+            test_endpoint* e = &d->endpoints[d->numEndpoints++];
+            e->address = desc[2];
+            e->attributes = desc[3];
+            e->maxPacket = desc[4] | (desc[5]<<8);
+            e->interface = interface;
+            e->interfaceClass = interfaceClass;
+        }
+    }
+    if (usb_sim_control(0x00, 0x09, d->config[5], 0, 0, NULL) != 0)
+        return -6;
+    return 0;
+}
+
+// the first endpoint of an interface of the given class in the given direction, or NULL
+static const test_endpoint* test_find_endpoint(const test_device* d, uint8 interfaceClass, uint8 in, uint8 attributes) {
+    for (unsigned i = 0; i < d->numEndpoints; i++) {
+        const test_endpoint* e = &d->endpoints[i];
+        if (e->interfaceClass == interfaceClass && (e->address >> 7) == in && (e->attributes & 3) == attributes)
+            return e;
+    }
+    return NULL;
+}
+
+#endif
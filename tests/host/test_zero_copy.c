@@ -0,0 +1,205 @@
+/*
+ * usb_generic_rx_reserve()/rx_commit() and tx_reserve()/tx_commit() on
+ * double-buffered and single-buffered bulk endpoints: packets echoed from
+ * one packet memory buffer to another with no RAM copy, and the endpoint
+ * NAKing while software holds on to its buffers. Double-buffered
+ * isochronous endpoints are refused.
+ */
+
+#include "test_util.h"
+#include "usb_generic.h"
+
+static void nothing(void) {
+}
+
+enum { DBL_TX, DBL_RX, ONE_TX, ONE_RX, ISO_TX, NUM_ENDPOINTS };
+
+static USBEndpointInfo endpoints[NUM_ENDPOINTS] = {
+    [DBL_TX] = { .callback = nothing, .pmaSize = 128, .type = USB_GENERIC_ENDPOINT_TYPE_BULK, .tx = 1, .doubleBuffer = 1 },
+    [DBL_RX] = { .callback = nothing, .pmaSize = 128, .type = USB_GENERIC_ENDPOINT_TYPE_BULK, .tx = 0, .doubleBuffer = 1 },
+    [ONE_TX] = { .callback = nothing, .pmaSize = 32, .type = USB_GENERIC_ENDPOINT_TYPE_BULK, .tx = 1 },
+    [ONE_RX] = { .callback = nothing, .pmaSize = 32, .type = USB_GENERIC_ENDPOINT_TYPE_BULK, .tx = 0 },
+    [ISO_TX] = { .callback = nothing, .pmaSize = 32, .type = USB_GENERIC_ENDPOINT_TYPE_ISO, .tx = 1, .doubleBuffer = 1 },
+};
+
+#define DESCRIPTOR_SIZE (9 + 7*NUM_ENDPOINTS)
+
+static void get_descriptor(uint8* out);
+
+static USBCompositePart part = {
+    .numInterfaces = 1,
+    .numEndpoints = NUM_ENDPOINTS,
+    .descriptorSize = DESCRIPTOR_SIZE,
+    .getPartDescriptor = get_descriptor,
+    .endpoints = endpoints,
+};
+
+static void get_descriptor(uint8* out) {
+    static const uint8 attributes[] = { [DBL_TX] = 2, [DBL_RX] = 2, [ONE_TX] = 2, [ONE_RX] = 2, [ISO_TX] = 1 };
+    uint8 interface[9] = { 9, 4, part.startInterface, 0, NUM_ENDPOINTS, 0xFF, 0, 0, 0 };
+    memcpy(out, interface, 9);
+    out += 9;
+    for (unsigned i = 0; i < NUM_ENDPOINTS; i++) {
+        uint16 packet = endpoints[i].doubleBuffer ? endpoints[i].pmaSize / 2 : endpoints[i].pmaSize;
+        uint8 e[7] = { 7, 5, endpoints[i].address | (endpoints[i].tx ? 0x80 : 0), attributes[i], packet, packet >> 8, 1 };
+        memcpy(out, e, 7);
+        out += 7;
+    }
+}
+
+static USBCompositePart* parts[] = { &part };
+
+static uint8 pattern(uint32 i) {
+    return (uint8)(i * 13 + (i >> 7));
+}
+
+// what the device's main loop does: move each received packet to the IN endpoint through packet memory
+static uint32 echo(USBEndpointInfo* rx, USBEndpointInfo* tx) {
+    uint32 moved = 0;
+    usb_generic_disable_interrupts_ep0();
+    for (;;) {
+        // only take a packet once there is somewhere to put it
+        uint32* out = usb_generic_tx_reserve(tx, tx->doubleBuffer ? tx->pmaSize / 2 : tx->pmaSize);
+        if (out == NULL)
+            break;
+        uint32 length;
+        uint32* in = usb_generic_rx_reserve(rx, &length);
+        if (in == NULL)
+            break;
+        for (uint32 i = 0; i < (length + 1) / 2; i++)
+            out[i] = in[i];
+        usb_generic_tx_commit(tx, length);
+        usb_generic_rx_commit(rx);
+        moved++;
+    }
+    usb_generic_enable_interrupts_ep0();
+    return moved;
+}
+
+static void test_echo(USBEndpointInfo* rx, USBEndpointInfo* tx) {
+    uint32 packetSize = rx->doubleBuffer ? rx->pmaSize / 2 : rx->pmaSize;
+    uint32 sent = 0, received = 0, mismatches = 0;
+    uint32 total = 64 * 1024;
+    uint32 startMillis = usb_sim_millis();
+
+    while (received < total && usb_sim_millis() - startMillis < 5000) {
+        for (unsigned p = 0; p < 19; p++) {
+            if (p % 2 == 0 && sent < total) {
+                uint8 packet[64];
+                uint32 n = (sent / packetSize) % 3 == 2 ? 1 + sent % packetSize : packetSize;
+                if (n > total - sent)
+                    n = total - sent;
+                for (uint32 i = 0; i < n; i++)
+                    packet[i] = pattern(sent + i);
+                if (usb_sim_out(rx->address, packet, n) == USB_SIM_ACK)
+                    sent += n;
+            }
+            else {
+                uint8 packet[64];
+                int n = usb_sim_in(tx->address, packet, packetSize);
+                for (int i = 0; i < n; i++)
+                    if (packet[i] != pattern(received + i))
+                        mismatches++;
+                if (n > 0)
+                    received += n;
+            }
+            echo(rx, tx);
+        }
+        usb_sim_frame();
+    }
+    CHECK_EQ(sent, total);
+    CHECK_EQ(received, total);
+    CHECK_EQ(mismatches, 0);
+}
+
+// the endpoint NAKs while software holds its buffers, and nothing is lost or repeated
+static void test_backpressure(void) {
+    USBEndpointInfo* rx = &endpoints[DBL_RX];
+    uint8 a[64], b[64];
+    uint32 length;
+    memset(a, 0xA1, sizeof(a));
+    memset(b, 0xB2, sizeof(b));
+
+    usb_generic_disable_interrupts_ep0();
+    CHECK(usb_generic_rx_reserve(rx, &length) == NULL);
+    usb_generic_enable_interrupts_ep0();
+
+    CHECK_EQ(usb_sim_out(rx->address, a, 40), USB_SIM_ACK);
+    CHECK_EQ(usb_sim_out(rx->address, b, 41), USB_SIM_NAK); // software hasn't taken the first yet
+
+    usb_generic_disable_interrupts_ep0();
+    uint32* first = usb_generic_rx_reserve(rx, &length);
+    CHECK(first != NULL);
+    CHECK_EQ(length, 40);
+    CHECK(usb_generic_rx_reserve(rx, &length) == NULL);
+    usb_generic_enable_interrupts_ep0();
+    CHECK_EQ(usb_sim_out(rx->address, b, 41), USB_SIM_NAK); // held until the commit
+
+    uint8 copy[64];
+    usb_copy_from_pma_ptr(copy, 40, first);
+    CHECK(!memcmp(copy, a, 40));
+
+    usb_generic_disable_interrupts_ep0();
+    usb_generic_rx_commit(rx);
+    usb_generic_enable_interrupts_ep0();
+    CHECK_EQ(usb_sim_out(rx->address, b, 41), USB_SIM_ACK);
+    CHECK_EQ(usb_sim_out(rx->address, a, 42), USB_SIM_NAK);
+
+    usb_generic_disable_interrupts_ep0();
+    uint32* second = usb_generic_rx_reserve(rx, &length);
+    CHECK(second != NULL && second != first);
+    CHECK_EQ(length, 41);
+    usb_copy_from_pma_ptr(copy, 41, second);
+    CHECK(!memcmp(copy, b, 41));
+    usb_generic_rx_commit(rx);
+    CHECK(usb_generic_rx_reserve(rx, &length) == NULL);
+    usb_generic_enable_interrupts_ep0();
+
+    // IN: one packet with the hardware, one queued behind it, then no buffer left
+    USBEndpointInfo* tx = &endpoints[DBL_TX];
+    usb_generic_disable_interrupts_ep0();
+    uint32* p = usb_generic_tx_reserve(tx, 10);
+    CHECK(p != NULL);
+    usb_copy_to_pma_ptr(a, 10, p);
+    usb_generic_tx_commit(tx, 10);
+    p = usb_generic_tx_reserve(tx, 11);
+    CHECK(p != NULL);
+    usb_copy_to_pma_ptr(b, 11, p);
+    usb_generic_tx_commit(tx, 11);
+    CHECK(usb_generic_tx_reserve(tx, 12) == NULL);
+    CHECK(usb_generic_tx_reserve(tx, 65) == NULL);
+    usb_generic_enable_interrupts_ep0();
+
+    CHECK_EQ(usb_sim_in(tx->address, copy, 64), 10);
+    CHECK(!memcmp(copy, a, 10));
+    usb_generic_disable_interrupts_ep0();
+    CHECK(usb_generic_tx_reserve(tx, 12) != NULL); // the second packet went to the hardware, freeing the first buffer
+    usb_generic_enable_interrupts_ep0();
+    CHECK_EQ(usb_sim_in(tx->address, copy, 64), 11);
+    CHECK(!memcmp(copy, b, 11));
+    CHECK_EQ(usb_sim_in(tx->address, copy, 64), USB_SIM_NAK);
+
+    // isochronous double buffering has no handshake to hold a buffer with
+    usb_generic_disable_interrupts_ep0();
+    CHECK(usb_generic_tx_reserve(&endpoints[ISO_TX], 8) == NULL);
+    usb_generic_enable_interrupts_ep0();
+}
+
+int main(void) {
+    test_device dev;
+    usb_sim_power_on();
+    usb_generic_set_info(0x1EAF, 0x0030, NULL, NULL, NULL);
+    usb_generic_set_ep0_size(32);
+    CHECK(usb_generic_set_parts(parts, 1));
+    CHECK_EQ(usb_generic_get_pma_layout()->status, USB_GENERIC_LAYOUT_OK);
+    usb_generic_enable();
+    CHECK_EQ(test_enumerate(&dev, 3), 0);
+    CHECK_EQ(dev.numEndpoints, NUM_ENDPOINTS);
+
+    test_backpressure();
+    test_echo(&endpoints[DBL_RX], &endpoints[DBL_TX]);
+    test_echo(&endpoints[ONE_RX], &endpoints[ONE_TX]);
+
+    usb_generic_disable();
+    return test_finish("test_zero_copy");
+}
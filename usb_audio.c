@@ -22,6 +22,7 @@
 #include <libmaple/gpio.h>
 
 #include "usb_audio.h"
+#include "usb_ring.h"
 
 
 
@@ -30,24 +31,15 @@
 #define CLOCK_SOURCE_ID            0x10
 #define AUDIO_INTERFACE_OFFSET     0x00
 #define IO_BUFFER_SIZE              256
-#define IO_BUFFER_SIZE_MASK         (IO_BUFFER_SIZE - 1)
 //#define AUDIO_INTERFACE_NUMBER     (AUDIO_INTERFACE_OFFSET + usbAUDIOPart.startInterface)
 #define AUDIO_ISO_EP_ENDPOINT_INFO (&usbAUDIOPart.endpoints[0])
 #define AUDIO_ISO_EP_ADDRESS       (usbAUDIOPart.endpoints[0].address)
 #define AUDIO_ISO_PMA_BUFFER_SIZE  (usbAUDIOPart.endpoints[0].pmaSize / 2)
 
 /* Tx data */
-static volatile uint8 audioBufferTx[IO_BUFFER_SIZE];
-/* Write index to audioBufferTx */
-static volatile uint32 audio_tx_head = 0;
-/* Read index from audioBufferTx */
-static volatile uint32 audio_tx_tail = 0;
+USB_RING(audioTx, IO_BUFFER_SIZE);
 /* Rx data */
-static volatile uint8 audioBufferRx[IO_BUFFER_SIZE];
-/* Write index to audioBufferRx */
-static volatile uint32 audio_rx_head = 0;
-/* Read index from audioBufferRx */
-static volatile uint32 audio_rx_tail = 0;
+USB_RING(audioRx, IO_BUFFER_SIZE);
 static uint8 usbAudioReceiving;
 
 static volatile int8 transmitting;
@@ -94,6 +86,7 @@ typedef struct {
     audio_iso_endpoint_descriptor              AUDIO_Iso_EP;
     audio_iso_ac_endpoint_descriptor           AUDIO_Iso_EP_AC;
 } __packed audio_part_config;
+USB_GENERIC_CHECK_DESCRIPTOR_SIZE(audio_part_config);
 
 typedef struct {
     audio_interface_association_descriptor     AUDIO_IAD;
@@ -110,6 +103,7 @@ typedef struct {
     audio_iso_endpoint_descriptor_2            AUDIO_Iso_EP;
     audio_iso_ac_endpoint_descriptor_2         AUDIO_Iso_EP_AC;
 } __packed audio_part_config_2;
+USB_GENERIC_CHECK_DESCRIPTOR_SIZE(audio_part_config_2);
 
 static const audio_part_config audioPartConfigData = {
     .AUDIO_IAD = {
@@ -515,28 +509,9 @@ uint32 usb_audio_write_tx_data(const uint8* buf, uint32 len)
     if (len == 0)
         return 0; /* no data to send */
 
-    while(transmitting >= 0);
-
-    uint32 head = audio_tx_head; /* load volatile variable */
-    uint32 tx_unsent = (head - audio_tx_tail) & IO_BUFFER_SIZE_MASK;
-
+    /* The isochronous endpoint drains the ring every frame, so there is nothing to start or wait for */
     /* We can only put bytes in the buffer if there is place */
-    if (len > (IO_BUFFER_SIZE - tx_unsent - 1) ) {
-        len = (IO_BUFFER_SIZE - tx_unsent - 1);
-    }
-
-    if (len == 0)
-        return 0; /* buffer full */
-
-    /* copy data from user buffer to USB Tx buffer */
-    uint16 i;
-    for (i = 0; i < len; i++) {
-        audioBufferTx[head] = buf[i];
-        head = (head + 1) & IO_BUFFER_SIZE_MASK;
-    }
-    audio_tx_head = head; /* store volatile variable */
-
-    return len;
+    return usb_ring_push(&audioTx, buf, len);
 }
 
 /* Non-blocking byte lookahead.
@@ -544,19 +519,7 @@ uint32 usb_audio_write_tx_data(const uint8* buf, uint32 len)
  * Looks at unread bytes without marking them as read. */
 uint32 audio_rx_peek(uint8* buf, uint32 len)
 {
-    unsigned i;
-    uint32 tail = audio_rx_tail;
-    uint32 rx_unread = (audio_rx_head - tail) & IO_BUFFER_SIZE_MASK;
-
-    if (len > rx_unread)
-        len = rx_unread;
-
-    for (i = 0; i < len; i++) {
-        buf[i] = audioBufferRx[tail];
-        tail = (tail + 1) & IO_BUFFER_SIZE_MASK;
-    }
-
-    return len;
+    return usb_ring_peek(&audioRx, 0, buf, len);
 }
 
 /* Non-blocking byte receive.
@@ -567,22 +530,14 @@ uint32 usb_audio_read_rx_data(uint8* buf, uint32 len)
 {
     while(usbAudioReceiving);
 
-    /* Copy bytes to buffer. */
-    uint32 n_copied = audio_rx_peek(buf, len);
-
-    /* Mark bytes as read. */
-    uint16 tail = audio_rx_tail; /* load volatile variable */
-    tail = (tail + n_copied) & IO_BUFFER_SIZE_MASK;
-    audio_rx_tail = tail; /* store volatile variable */
-
-    return n_copied;
+    return usb_ring_pop(&audioRx, buf, len);
 }
 
 /* Since we're USB FS, this function called once per millisecond */
 static void audioDataTxCb(void)
 {
     transmitting = 1;
-    usb_generic_send_from_circular_buffer_double_buffered(AUDIO_ISO_EP_ENDPOINT_INFO, audioBufferTx, IO_BUFFER_SIZE, buffer_size, &audio_tx_tail);
+    usb_generic_send_from_circular_buffer_double_buffered(AUDIO_ISO_EP_ENDPOINT_INFO, audioTx.buf, audioTx.size, buffer_size, &audioTx.tail);
     transmitting = -1;
 
     if (packet_callback)
@@ -592,8 +547,8 @@ static void audioDataTxCb(void)
 static void audioDataRxCb(void)
 {
     usbAudioReceiving = 1;
-    uint32 ep_rx_size = usb_generic_read_to_circular_buffer(usbAUDIOPart.endpoints+0, audioBufferRx, 
-                        IO_BUFFER_SIZE, &audio_rx_head);
+    uint32 ep_rx_size = usb_generic_read_to_circular_buffer(usbAUDIOPart.endpoints+0, audioRx.buf, 
+                        audioRx.size, &audioRx.head);
     usbAudioReceiving = 0;
 
     if (packet_callback)
@@ -602,10 +557,8 @@ static void audioDataRxCb(void)
 
 static void audioUSBReset(void) {
     /* Reset the RX/TX state */
-    audio_tx_head = 0;
-    audio_tx_tail = 0;
-    audio_rx_head = 0;
-    audio_rx_tail = 0;
+    usb_ring_clear(&audioTx);
+    usb_ring_clear(&audioRx);
     usbAudioReceiving = 0;
     transmitting = -1;
 
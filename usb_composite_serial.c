@@ -35,6 +35,7 @@
 
 #include "usb_composite_serial.h"
 #include "usb_generic.h"
+#include "usb_ring.h"
 #include <string.h>
 #include <libmaple/usb.h>
 #include <libmaple/delay.h>
@@ -92,6 +93,7 @@ typedef struct {
     usb_descriptor_endpoint      	DataOutEndpoint;
     usb_descriptor_endpoint      	DataInEndpoint;
 } __packed serial_part_config;
+USB_GENERIC_CHECK_DESCRIPTOR_SIZE(serial_part_config);
 
 
 static const serial_part_config serialPartConfigData = {
@@ -230,19 +232,31 @@ static void getSerialPartDescriptor(uint8* out) {
     OUT_16(serialPartConfigData, DataInEndpoint.wMaxPacketSize) = txEPSize;
 }
 
+// double-buffered data endpoints need room for two packets each
+static void setDataPMASizes(void) {
+    serialEndpoints[0].pmaSize = serialEndpoints[0].doubleBuffer ? (txEPSize+1)/2*2*2 : txEPSize;
+    serialEndpoints[2].pmaSize = serialEndpoints[2].doubleBuffer ? rxEPSize*2 : rxEPSize;
+}
+
 void composite_cdcacm_setTXEPSize(uint32_t size) {
     if (size == 0)
         size = 64;
-    serialEndpoints[0].pmaSize = size;
     txEPSize = size;
+    setDataPMASizes();
 }
 
 void composite_cdcacm_setRXEPSize(uint32_t size) {
     if (size == 0)
         size = 64; 
     size = usb_generic_roundUpToPowerOf2(size);
-    serialEndpoints[2].pmaSize = size;
     rxEPSize = size;
+    setDataPMASizes();
+}
+
+void composite_cdcacm_setDoubleBuffered(uint8 doubleBuffered) {
+    serialEndpoints[0].doubleBuffer = doubleBuffered ? 1 : 0;
+    serialEndpoints[2].doubleBuffer = doubleBuffered ? 1 : 0;
+    setDataPMASizes();
 }
 
 USBCompositePart usbSerialPart = {
@@ -258,25 +272,12 @@ USBCompositePart usbSerialPart = {
 };
 
 #define CDC_SERIAL_RX_BUFFER_SIZE	256 // must be power of 2
-#define CDC_SERIAL_RX_BUFFER_SIZE_MASK (CDC_SERIAL_RX_BUFFER_SIZE-1)
+#define CDC_SERIAL_TX_BUFFER_SIZE	256 // must be power of 2
 
 /* Received data */
-static volatile uint8 vcomBufferRx[CDC_SERIAL_RX_BUFFER_SIZE];
-/* Write index to vcomBufferRx */
-static volatile uint32 vcom_rx_head;
-/* Read index from vcomBufferRx */
-static volatile uint32 vcom_rx_tail;
-
-#define CDC_SERIAL_TX_BUFFER_SIZE	256 // must be power of 2
-#define CDC_SERIAL_TX_BUFFER_SIZE_MASK (CDC_SERIAL_TX_BUFFER_SIZE-1)
+USB_RING(vcomRx, CDC_SERIAL_RX_BUFFER_SIZE);
 // Tx data
-static volatile uint8 vcomBufferTx[CDC_SERIAL_TX_BUFFER_SIZE];
-// Write index to vcomBufferTx
-static volatile uint32 vcom_tx_head;
-// Read index from vcomBufferTx
-static volatile uint32 vcom_tx_tail;
-
-
+USB_RING(vcomTx, CDC_SERIAL_TX_BUFFER_SIZE);
 
 /* Other state (line coding, DTR/RTS) */
 
@@ -294,6 +295,7 @@ static volatile uint8 line_dtr_rts = 0;
 
 static void (*rx_hook)(unsigned, void*) = 0;
 static void (*iface_setup_hook)(unsigned, void*) = 0;
+static void (*tx_done_hook)(unsigned, void*) = 0;
 
 void composite_cdcacm_set_hooks(unsigned hook_flags, void (*hook)(unsigned, void*)) {
     if (hook_flags & USBHID_CDCACM_HOOK_RX) {
@@ -302,6 +304,9 @@ void composite_cdcacm_set_hooks(unsigned hook_flags, void (*hook)(unsigned, void
     if (hook_flags & USBHID_CDCACM_HOOK_IFACE_SETUP) {
         iface_setup_hook = hook;
     }
+    if (hook_flags & USBHID_CDCACM_HOOK_TX_DONE) {
+        tx_done_hook = hook;
+    }
 }
 
 /* This function is non-blocking.
@@ -312,28 +317,11 @@ uint32 composite_cdcacm_tx(const uint8* buf, uint32 len)
 {
 	if (len==0) return 0; // no data to send
 
-	uint32 head = vcom_tx_head; // load volatile variable
-	uint32 tx_unsent = (head - vcom_tx_tail) & CDC_SERIAL_TX_BUFFER_SIZE_MASK;
-
     // We can only put bytes in the buffer if there is place
-    if (len > (CDC_SERIAL_TX_BUFFER_SIZE-tx_unsent-1) ) {
-        len = (CDC_SERIAL_TX_BUFFER_SIZE-tx_unsent-1);
-    }
+    len = usb_ring_push(&vcomTx, buf, len);
 	if (len==0) return 0; // buffer full
-
-	uint16 i;
-	// copy data from user buffer to USB Tx buffer
-	for (i=0; i<len; i++) {
-		vcomBufferTx[head] = buf[i];
-		head = (head+1) & CDC_SERIAL_TX_BUFFER_SIZE_MASK;
-	}
-	vcom_tx_head = head; // store volatile variable
 	
-	while(transmitting >= 0);
-	
-	if (transmitting < 0) {
-		vcomDataTxCb(); // initiate data transmission
-	}
+	usb_generic_start_tx(vcomDataTxCb, &transmitting);
 
     return len;
 }
@@ -341,11 +329,16 @@ uint32 composite_cdcacm_tx(const uint8* buf, uint32 len)
 
 
 uint32 composite_cdcacm_data_available(void) {
-    return (vcom_rx_head - vcom_rx_tail) & CDC_SERIAL_RX_BUFFER_SIZE_MASK;
+    return usb_ring_available(&vcomRx);
 }
 
 uint16 composite_cdcacm_get_pending(void) {
-    return (vcom_tx_head - vcom_tx_tail) & CDC_SERIAL_TX_BUFFER_SIZE_MASK;
+    return usb_ring_available(&vcomTx);
+}
+
+/* 1 until everything queued has been taken by the host */
+uint8 composite_cdcacm_is_transmitting(void) {
+    return transmitting >= 0 || usb_ring_available(&vcomTx) > 0;
 }
 
 /* Non-blocking byte receive.
@@ -354,17 +347,10 @@ uint16 composite_cdcacm_get_pending(void) {
  * into buf and deq's the FIFO. */
 uint32 composite_cdcacm_rx(uint8* buf, uint32 len)
 {
-    /* Copy bytes to buffer. */
-    uint32 n_copied = composite_cdcacm_peek(buf, len);
+    uint32 n_copied = usb_ring_pop(&vcomRx, buf, len);
 
-    /* Mark bytes as read. */
-	uint16 tail = vcom_rx_tail; // load volatile variable
-	tail = (tail + n_copied) & CDC_SERIAL_RX_BUFFER_SIZE_MASK;
-	vcom_rx_tail = tail; // store volatile variable
-
-	uint32 rx_unread = (vcom_rx_head - tail) & CDC_SERIAL_RX_BUFFER_SIZE_MASK;
     // If buffer was emptied to a pre-set value, re-enable the RX endpoint
-    if ( rx_unread <= 64 ) { // experimental value, gives the best performance
+    if ( usb_ring_available(&vcomRx) <= 64 ) { // experimental value, gives the best performance
         usb_generic_enable_rx(USB_CDCACM_RX_ENDPOINT_INFO);
 	}
     return n_copied;
@@ -375,49 +361,18 @@ uint32 composite_cdcacm_rx(uint8* buf, uint32 len)
  * Looks at unread bytes without marking them as read. */
 uint32 composite_cdcacm_peek(uint8* buf, uint32 len)
 {
-    unsigned i;
-    uint32 tail = vcom_rx_tail;
-	uint32 rx_unread = (vcom_rx_head-tail) & CDC_SERIAL_RX_BUFFER_SIZE_MASK;
-
-    if (len > rx_unread) {
-        len = rx_unread;
-    }
-
-    for (i = 0; i < len; i++) {
-        buf[i] = vcomBufferRx[tail];
-        tail = (tail + 1) & CDC_SERIAL_RX_BUFFER_SIZE_MASK;
-    }
-
-    return len;
+    return usb_ring_peek(&vcomRx, 0, buf, len);
 }
 
 uint32 composite_cdcacm_peek_ex(uint8* buf, uint32 offset, uint32 len)
 {
-    unsigned i;
-    uint32 tail = (vcom_rx_tail + offset) & CDC_SERIAL_RX_BUFFER_SIZE_MASK ;
-	uint32 rx_unread = (vcom_rx_head-tail) & CDC_SERIAL_RX_BUFFER_SIZE_MASK;
-
-    if (len + offset > rx_unread) {
-        len = rx_unread - offset;
-    }
-
-    for (i = 0; i < len; i++) {
-        buf[i] = vcomBufferRx[tail];
-        tail = (tail + 1) & CDC_SERIAL_RX_BUFFER_SIZE_MASK;
-    }
-
-    return len;
+    return usb_ring_peek(&vcomRx, offset, buf, len);
 }
 
 /* Roger Clark. Added. for Arduino 1.0 API support of Serial.peek() */
 int composite_cdcacm_peek_char() 
 {
-    if (composite_cdcacm_data_available() == 0) 
-	{
-		return -1;
-    }
-
-    return vcomBufferRx[vcom_rx_tail];
+    return usb_ring_peek_byte(&vcomRx);
 }
 
 uint8 composite_cdcacm_get_dtr() {
@@ -456,23 +411,30 @@ int composite_cdcacm_get_n_data_bits(void) {
  */
 static void vcomDataTxCb(void)
 {
+    int8 wasTransmitting = transmitting;
     usb_generic_send_from_circular_buffer(USB_CDCACM_TX_ENDPOINT_INFO, 
-        vcomBufferTx, CDC_SERIAL_TX_BUFFER_SIZE, vcom_tx_head, &vcom_tx_tail, &transmitting);
+        vcomTx.buf, vcomTx.size, vcomTx.head, &vcomTx.tail, &transmitting);
+    
+    if (wasTransmitting >= 0 && transmitting < 0 && tx_done_hook) {
+        tx_done_hook(USBHID_CDCACM_HOOK_TX_DONE, 0);
+    }
 }
 
 
 static void vcomDataRxCb(void)
 {
-	uint32 head = vcom_rx_head;
     usb_generic_read_to_circular_buffer(USB_CDCACM_RX_ENDPOINT_INFO,
-                            vcomBufferRx, CDC_SERIAL_RX_BUFFER_SIZE, &head);
-	vcom_rx_head = head; // store volatile variable
+                            vcomRx.buf, vcomRx.size, &vcomRx.head);
 
-	uint32 rx_unread = (head - vcom_rx_tail) & CDC_SERIAL_RX_BUFFER_SIZE_MASK;
 	// only enable further Rx if there is enough room to receive one more packet
-	if ( rx_unread < (CDC_SERIAL_RX_BUFFER_SIZE-rxEPSize) ) {
+	// (two when double-buffered, as the next one may already be in the PMA)
+	if ( usb_ring_free(&vcomRx) >= USB_CDCACM_RX_ENDPOINT_INFO->pmaSize ) {
         usb_generic_enable_rx(USB_CDCACM_RX_ENDPOINT_INFO);
 	}
+    else {
+        USB_GENERIC_COUNT(USB_CDCACM_RX_ENDPOINT_INFO, rxFull);
+    }
+    USB_GENERIC_HIGH_WATER(USB_CDCACM_RX_ENDPOINT_INFO, usb_ring_available(&vcomRx));
 
     if (rx_hook) {
         rx_hook(USBHID_CDCACM_HOOK_RX, 0);
@@ -481,10 +443,8 @@ static void vcomDataRxCb(void)
 
 static void serialUSBReset(void) {
     //VCOM
-    vcom_rx_head = 0;
-    vcom_rx_tail = 0;
-    vcom_tx_head = 0;
-    vcom_tx_tail = 0;
+    usb_ring_clear(&vcomRx);
+    usb_ring_clear(&vcomTx);
     transmitting = -1;
 }
 
@@ -101,9 +101,11 @@ uint32 composite_cdcacm_peek(uint8* buf, uint32 len);
 uint32 composite_cdcacm_peek_ex(uint8* buf, uint32 offset, uint32 len);
 void composite_cdcacm_setTXEPSize(uint32_t size);
 void composite_cdcacm_setRXEPSize(uint32_t size);
+void composite_cdcacm_setDoubleBuffered(uint8 doubleBuffered);
 
 uint32 composite_cdcacm_data_available(void); /* in RX buffer */
 uint16 composite_cdcacm_get_pending(void);
+uint8 composite_cdcacm_is_transmitting(void);
 
 uint8 composite_cdcacm_get_dtr(void);
 uint8 composite_cdcacm_get_rts(void);
@@ -141,6 +143,7 @@ int composite_cdcacm_get_n_data_bits(void); /* bDataBits */
 
 #define USBHID_CDCACM_HOOK_RX 0x1
 #define USBHID_CDCACM_HOOK_IFACE_SETUP 0x2
+#define USBHID_CDCACM_HOOK_TX_DONE 0x4 // everything queued has been taken by the host
 
 void composite_cdcacm_set_hooks(unsigned hook_flags, void (*hook)(unsigned, void*));
 
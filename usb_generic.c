@@ -36,10 +36,13 @@
 //#define MATCHING_ENDPOINT_RANGES // make RX and TX endpoints fall in the same range for each part
 
 #include <string.h>
+#include <malloc.h>
 #include <libmaple/libmaple_types.h>
 #include <libmaple/usb.h>
 #include <libmaple/delay.h>
 #include <libmaple/gpio.h>
+#include <libmaple/scb.h>
+#include <libmaple/systick.h>
 #include <usb_lib_globals.h>
 #include <usb_reg_map.h>
 //#include <usb_core.h>
@@ -70,9 +73,16 @@ static uint8* usbGetConfigDescriptor(uint16 length);
 static uint8* usbGetDeviceDescriptor(uint16 length);
 static void usbSetConfiguration(void);
 static void usbSetDeviceAddress(void);
+static void set_winusb_functions(void);
 static uint32 disconnect_delay = 500; // in microseconds
+static uint32 reconfigure_start;
+static volatile uint32 reconfigure_millis = 0;
+static volatile uint8 reconfiguring = 0;
 
 static struct usb_chunk* control_tx_chunk_list = NULL;
+static struct usb_chunk* control_tx_chunk_cursor = NULL;
+static uint32 control_tx_chunk_cursor_offset = 0;
+static uint32 control_tx_chunk_length = 0;
 static uint8 control_tx_chunk_buffer[USB_EP0_BUFFER_SIZE];
 
 static volatile uint8* control_tx_buffer = NULL;
@@ -115,12 +125,15 @@ static usb_descriptor_device usbGenericDescriptor_Device =
       .bNumConfigurations = 0x01,                                       
 };
 
-typedef struct {
-    usb_descriptor_config_header Config_Header;
-    uint8 descriptorData[MAX_USB_DESCRIPTOR_DATA_SIZE];
-} __packed usb_descriptor_config;
-
-static usb_descriptor_config usbConfig;
+/*
+ * The configuration descriptor is not stored anywhere: GET_DESCRIPTOR
+ * generates each part's descriptor (or one block of it) on demand into
+ * descriptor_block_buffer and copies out the bytes the packet needs.
+ */
+static usb_descriptor_config_header usbConfigHeader;
+static uint8 descriptor_block_buffer[MAX_USB_DESCRIPTOR_BLOCK_SIZE];
+static uint8 descriptor_block_part = 0xFF; // part and block currently in descriptor_block_buffer
+static uint8 descriptor_block_index = 0;
 
 #define MAX_POWER (100 >> 1)
 
@@ -141,11 +154,6 @@ static ONE_DESCRIPTOR Device_Descriptor = {
     sizeof(usb_descriptor_device)
 };
 
-static ONE_DESCRIPTOR Config_Descriptor = {
-    (uint8*)&usbConfig,
-    0
-};
-
 static DEVICE my_Device_Table = {
     .Total_Endpoint      = 0,
     .Total_Configuration = 1
@@ -158,14 +166,6 @@ static const usb_descriptor_string usb_LangID = {
     .bString         = {0x09, 0x04},
 };
 
-static USB_DESCRIPTOR_STRING(USB_DESCRIPTOR_STRING_LEN(USB_MAX_STRING_DESCRIPTOR_LENGTH)) string_descriptor_buffer = {
-    .bDescriptorType = USB_DESCRIPTOR_TYPE_STRING
-};
-
-static ONE_DESCRIPTOR generic_string_descriptor = {
-    (uint8*)&string_descriptor_buffer, 0
-};
-
 #define MAX_PACKET_SIZE            0x40  /* 64B, maximum for USB FS Devices */
 static const DEVICE_PROP my_Device_Property = {
     .Init                        = usbInit,
@@ -194,18 +194,20 @@ static const USER_STANDARD_REQUESTS my_User_Standard_Requests = {
     .User_SetDeviceAddress   = usbSetDeviceAddress
 };
 
-static uint8 numStringDescriptors = 3;
-
-
-#define MAX_STRING_DESCRIPTORS 4
-static ONE_DESCRIPTOR String_Descriptor[MAX_STRING_DESCRIPTORS] = {
+/*
+ * String descriptors are converted to UTF-16LE once, when they are set, and
+ * kept in string_pool, so GET_DESCRIPTOR requests for them are served directly.
+ */
+static uint8 numStringDescriptors = 1;
+static ONE_DESCRIPTOR String_Descriptor[USB_MAX_STRING_DESCRIPTORS] = {
     {(uint8*)&usb_LangID,                  USB_DESCRIPTOR_STRING_LEN(1)},
-    {(uint8*)DEFAULT_MANUFACTURER,         0}, // a 0 in the length field indicates that we synthesize this from an asciiz string
-    {(uint8*)DEFAULT_PRODUCT,              0},
-    {NULL,                                 0},
 };
+static uint16 string_pool[USB_STRING_DESCRIPTOR_POOL_SIZE/2];
+static uint16 string_pool_used = 0; // in halfwords
+static const char* info_strings[3] = { DEFAULT_MANUFACTURER, DEFAULT_PRODUCT, NULL };
 
-static USBCompositePart** parts;
+// a copy of the caller's list, which it may rebuild while the interrupt still uses this one
+static USBCompositePart* parts[USB_GENERIC_MAX_PARTS];
 static uint32 numParts;
 static DEVICE saved_Device_Table;
 static DEVICE_PROP saved_Device_Property;
@@ -216,16 +218,107 @@ static void (*ep_int_out[7])(void);
 
 static uint8 minimum_address;
 
+#define BTABLE_ADDRESS 0x00
+
+static uint16 ep0_buffer_size = USB_EP0_BUFFER_SIZE;
+static uint16 ep0_tx_address = USB_EP0_TX_BUFFER_ADDRESS;
+static uint16 ep0_rx_address = USB_EP0_RX_BUFFER_ADDRESS;
+static USBPMALayout pmaLayout;
+static uint8 double_buffer_tx_ready = 0; // bit per endpoint address: software's buffer holds a packet
+
+#define MAX_INTERFACES 32
+
+// filled in by usb_generic_set_parts() so that dispatch doesn't need to scan the parts
+static uint8 numInterfacesTotal = 0;
+static uint8 interface_part[MAX_INTERFACES];
+static USBEndpointInfo* endpoint_by_address[2][8]; // [tx][address]
+
+// Cortex-M3 cycle counter (a host build can supply its own)
+#ifndef DWT_CTRL
+#define DWT_CTRL   (*(volatile uint32*)0xE0001000)
+#define DWT_CYCCNT (*(volatile uint32*)0xE0001004)
+#define SCB_DEMCR  (*(volatile uint32*)0xE000EDFC)
+#endif
+
+#ifndef USB_GENERIC_DSB
+#define USB_GENERIC_DSB() __asm__ volatile ("dsb" ::: "memory")
+#define USB_GENERIC_ISB() __asm__ volatile ("isb" ::: "memory")
+#endif
+
+static void enable_cycle_counter(void) {
+    SCB_DEMCR |= 1 << 24; // TRCENA
+    DWT_CTRL |= 1; // CYCCNTENA
+}
+
+#ifdef USB_GENERIC_TRACE
+USB_TRACE(trace, USB_GENERIC_TRACE_SIZE);
+#define TRACE(event, endpoint, length) usb_trace_record(&trace, (event), (endpoint), (length))
+#else
+#define TRACE(event, endpoint, length) ((void)0)
+#endif
+
+#if defined(USB_GENERIC_STATS) || defined(USB_GENERIC_TRACE)
+// endpoint callbacks go through these so that they can be timed and traced
+static void wrapped_callback(USBEndpointInfo* ep) {
+    TRACE(ep->tx ? USB_TRACE_IN : USB_TRACE_OUT, ep->address, 0);
+#ifdef USB_GENERIC_STATS
+    uint32 start = DWT_CYCCNT;
+    ep->callback();
+    uint32 cycles = DWT_CYCCNT - start;
+    ep->stats.callbacks++;
+    ep->stats.callbackCycles += cycles;
+    if (cycles > ep->stats.maxCallbackCycles)
+        ep->stats.maxCallbackCycles = cycles;
+#else
+    ep->callback();
+#endif
+}
+
+#define WRAPPED_CALLBACKS(n) \
+    static void wrapped_in_##n(void) { wrapped_callback(endpoint_by_address[1][n]); } \
+    static void wrapped_out_##n(void) { wrapped_callback(endpoint_by_address[0][n]); }
+WRAPPED_CALLBACKS(1)
+WRAPPED_CALLBACKS(2)
+WRAPPED_CALLBACKS(3)
+WRAPPED_CALLBACKS(4)
+WRAPPED_CALLBACKS(5)
+WRAPPED_CALLBACKS(6)
+WRAPPED_CALLBACKS(7)
+
+static void (*const wrapped_in[7])(void) = { wrapped_in_1, wrapped_in_2, wrapped_in_3, wrapped_in_4, wrapped_in_5, wrapped_in_6, wrapped_in_7 };
+static void (*const wrapped_out[7])(void) = { wrapped_out_1, wrapped_out_2, wrapped_out_3, wrapped_out_4, wrapped_out_5, wrapped_out_6, wrapped_out_7 };
+#endif
+
+#ifdef USB_GENERIC_STATS
+static void count_packet(USBEndpointInfo* ep, uint32 len) {
+    uint32 packetSize = ep->doubleBuffer ? ep->pmaSize / 2 : ep->pmaSize;
+    ep->stats.packets++;
+    ep->stats.bytes += len;
+    if (len < packetSize)
+        ep->stats.shortPackets++;
+    if (len == 0)
+        ep->stats.zeroLengthPackets++;
+}
+#else
+#define count_packet(ep, len) ((void)0)
+#endif
+
+// every packet handed to or taken from the hardware outside endpoint 0 goes through here
+static inline void note_packet(USBEndpointInfo* ep, uint32 len) {
+    (void)ep; // unused when neither statistics nor tracing is on
+    (void)len;
+    count_packet(ep, len);
+    TRACE(ep->tx ? USB_TRACE_TX_QUEUED : USB_TRACE_RX_READ, ep->address, len);
+}
+
 static uint8 acceptable_endpoint_number(unsigned partNum, unsigned endpointNum, uint8 address) {
     USBEndpointInfo* ep = &(parts[partNum]->endpoints[endpointNum]);
-    for (unsigned i = 0 ; i <= partNum ; i++)
-        for(unsigned j = 0 ; (i < partNum && j < parts[partNum]->numEndpoints) || (i == partNum && j < endpointNum) ; j++) {
-            USBEndpointInfo* ep1 = &(parts[i]->endpoints[j]);
-            if (ep1->address != address)
-                continue;
-            if (ep1->tx == ep->tx || ep->exclusive || ep1->exclusive || ep1->type != ep->type || ep1->doubleBuffer != ep->doubleBuffer)
-                return 0;
-        }
+    if (endpoint_by_address[ep->tx][address] != NULL)
+        return 0;
+    USBEndpointInfo* ep1 = endpoint_by_address[!ep->tx][address];
+    // double-buffered endpoints use both of the endpoint number's buffer descriptors
+    if (ep1 != NULL && (ep->exclusive || ep1->exclusive || ep1->type != ep->type || ep->doubleBuffer || ep1->doubleBuffer))
+        return 0;
     return 1;
 }
 
@@ -236,15 +329,66 @@ static int8 allocate_endpoint_address(unsigned partNum, unsigned endpointNum) {
     return -1;
 }
 
+/*
+ * Packet memory starts with the BTABLE, which only needs an entry for the
+ * endpoint numbers actually in use, followed by the endpoint 0 buffers and
+ * then the other endpoints. Buffer addresses only need to be even, so the
+ * only padding is the rounding of each buffer up to the hardware block size.
+ */
+static uint16 pma_allocation_size(USBEndpointInfo* ep) {
+    uint32 size = ep->pmaSize;
+    // rx has special length alignment issues
+    if (ep->doubleBuffer) {
+        if (size <= 124 || ep->tx) {
+            size = (size+3)/4*4;
+        }
+        else {
+            size = (size+63)/64*64;
+        }
+    }
+    else {
+        if (size <= 62 || ep->tx) {
+            size = (size+1)/2*2;
+        }
+        else {
+            size = (size+31)/32*32;
+        }
+    }
+    return size;
+}
+
+static uint16 part_descriptor_block_size(USBCompositePart* part) {
+    if (part->getPartDescriptorBlock != NULL && part->descriptorBlocks > 0)
+        return part->descriptorSize / part->descriptorBlocks;
+    else
+        return part->descriptorSize;
+}
+
+static uint8 layout_failed(uint8 status, unsigned partNum, unsigned endpointNum) {
+    pmaLayout.status = status;
+    pmaLayout.failedPart = partNum;
+    pmaLayout.failedEndpoint = endpointNum;
+    return 0;
+}
+
 uint8 usb_generic_set_parts(USBCompositePart** _parts, unsigned _numParts) {
-    parts = _parts;
+    if (_numParts > USB_GENERIC_MAX_PARTS) {
+        numParts = 0;
+        memset(&pmaLayout, 0, sizeof pmaLayout);
+        return layout_failed(USB_GENERIC_LAYOUT_TOO_MANY_PARTS, USB_GENERIC_MAX_PARTS, 0);
+    }
+    memcpy(parts, _parts, _numParts * sizeof(*parts));
     numParts = _numParts;
     unsigned numInterfaces = 0;
     minimum_address = 1;
     uint8 maxAddress = 0;
 
     uint16 usbDescriptorSize = 0;
-    uint16 pmaOffset = USB_EP0_RX_BUFFER_ADDRESS + USB_EP0_BUFFER_SIZE;
+    
+    memset(&pmaLayout, 0, sizeof pmaLayout);
+    pmaLayout.ep0Size = ep0_buffer_size;
+    memset(endpoint_by_address, 0, sizeof endpoint_by_address);
+    numInterfacesTotal = 0;
     
     for (unsigned i = 0 ; i < 7 ; i++) {
         ep_int_in[i] = NOP_Process;
@@ -256,68 +400,130 @@ uint8 usb_generic_set_parts(USBCompositePart** _parts, unsigned _numParts) {
         USBCompositePart* part = parts[i];
         part->startInterface = numInterfaces;
         numInterfaces += part->numInterfaces;
-        if (usbDescriptorSize + part->descriptorSize > MAX_USB_DESCRIPTOR_DATA_SIZE) {
-            return 0;
+        if (numInterfaces > MAX_INTERFACES) {
+            return layout_failed(USB_GENERIC_LAYOUT_TOO_MANY_INTERFACES, i, 0);
+        }
+        for (unsigned k = part->startInterface ; k < numInterfaces ; k++)
+            interface_part[k] = i;
+        if (part_descriptor_block_size(part) > MAX_USB_DESCRIPTOR_BLOCK_SIZE || 
+                usbDescriptorSize + part->descriptorSize + sizeof(Base_Header) > 0xFFFF) {
+            return layout_failed(USB_GENERIC_LAYOUT_DESCRIPTOR_TOO_LARGE, i, 0);
 		}
         USBEndpointInfo* ep = part->endpoints;
         for (unsigned j = 0 ; j < part->numEndpoints ; j++) {
             if (ep[j].align) 
                 minimum_address = maxAddress + 1;
             int8 address = allocate_endpoint_address(i, j);
-            if (address < 0)
-                return 0;
-
-            ep[j].pma = usb_pma_ptr(pmaOffset);
-            uint32 size = ep[j].pmaSize;
-            // rx has special length alignment issues
-            if (ep[j].doubleBuffer) {
-                if (size <= 124 || ep[j].tx) {
-                    size = (size+3)/4*4;
-                }
-                else {
-                    size = (size+63)/64*64;
-                }
-            }
-            else {
-                if (size <= 62 || ep[j].tx) {
-                    size = (size+1)/2*2;
-                }
-                else {
-                    size = (size+31)/32*32;
-                }
-            }
-            pmaOffset += size;
-            if (pmaOffset > PMA_MEMORY_SIZE)
-                return 0;
+            if (address < 0 || pmaLayout.numEndpoints >= USB_GENERIC_MAX_ENDPOINTS)
+                return layout_failed(USB_GENERIC_LAYOUT_NO_ENDPOINT_ADDRESS, i, j);
+
             if (ep[j].callback == NULL)
                 ep[j].callback = NOP_Process;
             ep[j].address = address;
+            endpoint_by_address[ep[j].tx][address] = &ep[j];
+#ifdef USB_GENERIC_STATS
+            memset(&ep[j].stats, 0, sizeof ep[j].stats);
+#endif
+#if defined(USB_GENERIC_STATS) || defined(USB_GENERIC_TRACE)
+            if (ep[j].tx) {
+                ep_int_in[address-1] = wrapped_in[address-1];
+            }
+            else {
+                ep_int_out[address-1] = wrapped_out[address-1];
+            }
+#else
             if (ep[j].tx) {
                 ep_int_in[address-1] = ep[j].callback;
             }
             else {
                 ep_int_out[address-1] = ep[j].callback;
             }
+#endif
             if (maxAddress < address)
                 maxAddress = address;
+            
+            USBEndpointLayout* l = &pmaLayout.endpoints[pmaLayout.numEndpoints++];
+            l->part = i;
+            l->endpoint = j;
+            l->address = address;
+            l->tx = ep[j].tx;
+            l->doubleBuffer = ep[j].doubleBuffer;
         }
-        part->getPartDescriptor(usbConfig.descriptorData + usbDescriptorSize);
         usbDescriptorSize += part->descriptorSize;
 #ifdef MATCHING_ENDPOINT_RANGES        
         minimum_address = maxAddress + 1;
 #endif
     }
     
-    usbConfig.Config_Header = Base_Header;    
-    usbConfig.Config_Header.bNumInterfaces = numInterfaces;
-    usbConfig.Config_Header.wTotalLength = usbDescriptorSize + sizeof(Base_Header);
-    Config_Descriptor.Descriptor_Size = usbConfig.Config_Header.wTotalLength;
+    pmaLayout.btableSize = (maxAddress + 1) * 8;
+    ep0_tx_address = BTABLE_ADDRESS + pmaLayout.btableSize;
+    ep0_rx_address = ep0_tx_address + ep0_buffer_size;
+    uint16 pmaOffset = ep0_rx_address + ep0_buffer_size;
+    
+    for (unsigned k = 0 ; k < pmaLayout.numEndpoints ; k++) {
+        USBEndpointLayout* l = &pmaLayout.endpoints[k];
+        USBEndpointInfo* ep = &(parts[l->part]->endpoints[l->endpoint]);
+        l->offset = pmaOffset;
+        l->size = pma_allocation_size(ep);
+        l->waste = l->size - ep->pmaSize;
+        // keep going past the end so the report says how much would be needed
+        if (pmaOffset + l->size > PMA_MEMORY_SIZE && pmaLayout.status == USB_GENERIC_LAYOUT_OK)
+            layout_failed(USB_GENERIC_LAYOUT_PMA_FULL, l->part, l->endpoint);
+        else
+            ep->pma = usb_pma_ptr(pmaOffset);
+        pmaOffset += l->size;
+    }
+    pmaLayout.used = pmaOffset;
+    
+    if (pmaLayout.status != USB_GENERIC_LAYOUT_OK)
+        return 0;
+    
+    usbGenericDescriptor_Device.bMaxPacketSize0 = ep0_buffer_size;
+    numInterfacesTotal = numInterfaces;
+    
+    usbConfigHeader = Base_Header;    
+    usbConfigHeader.bNumInterfaces = numInterfaces;
+    usbConfigHeader.wTotalLength = usbDescriptorSize + sizeof(Base_Header);
+    descriptor_block_part = 0xFF;
     
     my_Device_Table.Total_Endpoint = maxAddress + 1;
     
+    set_winusb_functions();
+    
     return 1;
 }
 
+const USBPMALayout* usb_generic_get_pma_layout(void) {
+    return &pmaLayout;
+}
+
+/* 
+ * The endpoint 0 packet size can be 8, 16, 32 or 64. Smaller sizes
+ * free up to 112 bytes of packet memory at the cost of more packets per
+ * control transfer. Takes effect at the next usb_generic_set_parts().
+ */
+void usb_generic_set_ep0_size(uint8 size) {
+    uint8 s = 8;
+    while (s < USB_EP0_BUFFER_SIZE && s * 2 <= size)
+        s *= 2;
+    ep0_buffer_size = s;
+}
+
+// start the table over; parts add their own strings after this
+static void reset_strings(void) {
+    numStringDescriptors = 1;
+    string_pool_used = 0;
+    usb_generic_add_string(info_strings[0]); // 1
+    usb_generic_add_string(info_strings[1]); // 2
+    
+    if (info_strings[2] == NULL) {
+        usbGenericDescriptor_Device.iSerialNumber = 0;
+    }
+    else {
+        usbGenericDescriptor_Device.iSerialNumber = usb_generic_add_string(info_strings[2]);
+    }
+}
+
 void usb_generic_set_info(uint16 idVendor, uint16 idProduct, const char* iManufacturer, const char* iProduct, const char* iSerialNumber) {
     if (idVendor != 0)
         usbGenericDescriptor_Device.idVendor = idVendor;
@@ -333,29 +539,243 @@ void usb_generic_set_info(uint16 idVendor, uint16 idProduct, const char* iManufa
         iManufacturer = DEFAULT_MANUFACTURER;
     }
            
-    String_Descriptor[1].Descriptor = (uint8*)iManufacturer;
-    String_Descriptor[1].Descriptor_Size = 0;
-     
     if (iProduct == NULL) {
         iProduct = DEFAULT_PRODUCT;
     }
-           
-    String_Descriptor[2].Descriptor = (uint8*)iProduct;
-    String_Descriptor[2].Descriptor_Size = 0;
     
-    if (iSerialNumber == NULL) {
-        numStringDescriptors = 3;
-        usbGenericDescriptor_Device.iSerialNumber = 0;
-    }
+    info_strings[0] = iManufacturer;
+    info_strings[1] = iProduct;
+    info_strings[2] = iSerialNumber;
+    reset_strings();
+}
+
+// decodes one UTF-8 character, substituting U+FFFD for malformed input
+static uint32 utf8_next(const uint8** sP) {
+    const uint8* s = *sP;
+    uint32 c = *s++;
+    unsigned extra;
+    
+    if (c < 0x80)
+        extra = 0;
+    else if (c >= 0xC2 && c < 0xE0)
+        extra = 1, c &= 0x1F;
+    else if (c >= 0xE0 && c < 0xF0)
+        extra = 2, c &= 0x0F;
+    else if (c >= 0xF0 && c < 0xF5)
+        extra = 3, c &= 0x07;
     else {
-        String_Descriptor[3].Descriptor = (uint8*)iSerialNumber;
-        String_Descriptor[3].Descriptor_Size = 0;
-        numStringDescriptors = 4;
-        usbGenericDescriptor_Device.iSerialNumber = 3;
+        *sP = s;
+        return 0xFFFD;
+    }
+    
+    for (; extra > 0 ; extra--) {
+        if ((*s & 0xC0) != 0x80) {
+            *sP = s;
+            return 0xFFFD;
+        }
+        c = (c << 6) | (*s++ & 0x3F);
+    }
+    
+    *sP = s;
+    if ((c >= 0xD800 && c < 0xE000) || c > 0x10FFFF)
+        return 0xFFFD;
+    return c;
+}
+
+/*
+ * Adds a UTF-8 string to the string descriptor table and returns its index,
+ * for use in iInterface and the like, or 0 if the table is full. Strings are
+ * truncated to USB_MAX_STRING_DESCRIPTOR_LENGTH UTF-16 units, or to what is
+ * left of the pool. The table is cleared by usb_generic_set_info(), so parts
+ * should add their strings from their usbInit callback.
+ */
+uint8 usb_generic_add_string(const char* string) {
+    if (numStringDescriptors >= USB_MAX_STRING_DESCRIPTORS || string_pool_used >= sizeof(string_pool)/2)
+        return 0;
+    
+    uint16* start = string_pool + string_pool_used;
+    uint32 room = sizeof(string_pool)/2 - string_pool_used - 1;
+    if (room > USB_MAX_STRING_DESCRIPTOR_LENGTH)
+        room = USB_MAX_STRING_DESCRIPTOR_LENGTH;
+    
+    const uint8* s = (const uint8*)string;
+    uint32 n = 0;
+    while (*s) {
+        uint32 c = utf8_next(&s);
+        if (c < 0x10000) {
+            if (n + 1 > room)
+                break;
+            start[1 + n++] = c;
+        }
+        else {
+            if (n + 2 > room)
+                break;
+            c -= 0x10000;
+            start[1 + n++] = 0xD800 | (c >> 10);
+            start[1 + n++] = 0xDC00 | (c & 0x3FF);
+        }
+    }
+    
+    start[0] = USB_DESCRIPTOR_STRING_LEN(n) | (USB_DESCRIPTOR_TYPE_STRING << 8); // bLength, bDescriptorType
+    string_pool_used += 1 + n;
+    String_Descriptor[numStringDescriptors].Descriptor = (uint8*)start;
+    String_Descriptor[numStringDescriptors].Descriptor_Size = USB_DESCRIPTOR_STRING_LEN(n);
+    return numStringDescriptors++;
+}
+
+/*
+ * Microsoft OS 2.0 descriptors, so that Windows (8.1 and later) binds WinUSB
+ * to parts that set winUSBGUID without any driver installation. The BOS
+ * descriptor announces a vendor request that returns the descriptor set,
+ * which has a function subset per such part, naming WinUSB as the compatible
+ * ID of the part's first interface and giving the interface GUID that host
+ * programs open it by. The set is sent as a chunk list; only the headers and
+ * the UTF-16 GUIDs need RAM.
+ */
+#define DESCRIPTOR_TYPE_BOS 0x0F
+#define MS_OS_20_DESCRIPTOR_INDEX 7
+#define MS_OS_20_WINDOWS_VERSION 0x06030000 // 8.1
+#define MS_OS_20_GUID_LENGTH 38 // {xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx}
+
+static struct {
+    uint8 bLength;
+    uint8 bDescriptorType;
+    uint16 wTotalLength;
+    uint8 bNumDeviceCaps;
+    // platform capability
+    uint8 bCapabilityLength;
+    uint8 bCapabilityDescriptorType;
+    uint8 bDevCapabilityType;
+    uint8 bReserved;
+    uint8 PlatformCapabilityUUID[16];
+    uint32 dwWindowsVersion;
+    uint16 wMSOSDescriptorSetTotalLength;
+    uint8 bMS_VendorCode;
+    uint8 bAltEnumCode;
+} __packed bos = {
+    .bLength = 5,
+    .bDescriptorType = DESCRIPTOR_TYPE_BOS,
+    .wTotalLength = 33,
+    .bNumDeviceCaps = 1,
+    .bCapabilityLength = 28,
+    .bCapabilityDescriptorType = 0x10, // device capability
+    .bDevCapabilityType = 0x05, // platform
+    // {D8DD60DF-4589-4CC7-9CD2-659D9E648A9F}
+    .PlatformCapabilityUUID = { 0xDF, 0x60, 0xDD, 0xD8, 0x89, 0x45, 0xC7, 0x4C, 0x9C, 0xD2, 0x65, 0x9D, 0x9E, 0x64, 0x8A, 0x9F },
+    .dwWindowsVersion = MS_OS_20_WINDOWS_VERSION,
+    .wMSOSDescriptorSetTotalLength = 0, // filled in by set_winusb_functions()
+    .bMS_VendorCode = USB_GENERIC_MS_VENDOR_CODE,
+    .bAltEnumCode = 0,
+};
+
+static struct {
+    // set header
+    uint16 wLength;
+    uint16 wDescriptorType;
+    uint32 dwWindowsVersion;
+    uint16 wTotalLength;
+    // configuration subset header, only for composite devices
+    uint16 wConfigLength;
+    uint16 wConfigDescriptorType;
+    uint8 bConfigurationValue;
+    uint8 bConfigReserved;
+    uint16 wConfigTotalLength;
+} __packed ms_os_20_header = {
+    .wLength = 10,
+    .wDescriptorType = 0, // set header
+    .dwWindowsVersion = MS_OS_20_WINDOWS_VERSION,
+    .wConfigLength = 8,
+    .wConfigDescriptorType = 1, // configuration subset header
+    .bConfigurationValue = 0, // index of the only configuration
+};
+
+static const uint8 ms_os_20_compatible_id[20] = {
+    20, 0, 3, 0, // wLength, wDescriptorType: compatible ID
+    'W', 'I', 'N', 'U', 'S', 'B', 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, // no sub-compatible ID
+};
+
+#define U16(c) (c), 0
+static const uint8 ms_os_20_guid_property_header[52] = {
+    132, 0, 4, 0, // wLength, wDescriptorType: registry property
+    7, 0, // wPropertyDataType: REG_MULTI_SZ
+    42, 0, // wPropertyNameLength
+    U16('D'), U16('e'), U16('v'), U16('i'), U16('c'), U16('e'), U16('I'), U16('n'), U16('t'), U16('e'), U16('r'), 
+    U16('f'), U16('a'), U16('c'), U16('e'), U16('G'), U16('U'), U16('I'), U16('D'), U16('s'), U16(0),
+    80, 0, // wPropertyDataLength
+};
+#undef U16
+
+#define MS_OS_20_FUNCTION_LENGTH (8 + sizeof(ms_os_20_compatible_id) + sizeof(ms_os_20_guid_property_header) + 80)
+
+static struct winusb_function {
+    struct {
+        uint16 wLength;
+        uint16 wDescriptorType;
+        uint8 bFirstInterface;
+        uint8 bReserved;
+        uint16 wSubsetLength;
+    } __packed header;
+    uint16 guid[MS_OS_20_GUID_LENGTH + 2]; // UTF-16, with the two terminators of a REG_MULTI_SZ
+    struct usb_chunk chunks[4];
+} winusb_functions[USB_GENERIC_MAX_WINUSB_FUNCTIONS];
+static uint8 numWinUSBFunctions = 0;
+static struct usb_chunk ms_os_20_header_chunk;
+
+// called once the parts have their interface numbers
+static void set_winusb_functions(void) {
+    // a device with a single interface isn't composite, and then Windows wants the descriptors without subsets
+    uint8 composite = numInterfacesTotal > 1;
+    struct usb_chunk* last = &ms_os_20_header_chunk;
+    
+    numWinUSBFunctions = 0;
+    for (unsigned i = 0 ; i < numParts && numWinUSBFunctions < USB_GENERIC_MAX_WINUSB_FUNCTIONS ; i++) {
+        const char* guid = parts[i]->winUSBGUID;
+        if (guid == NULL || parts[i]->numInterfaces == 0)
+            continue;
+        struct winusb_function* f = &winusb_functions[numWinUSBFunctions++];
+        f->header.wLength = 8;
+        f->header.wDescriptorType = 2; // function subset header
+        f->header.bFirstInterface = parts[i]->startInterface;
+        f->header.bReserved = 0;
+        f->header.wSubsetLength = MS_OS_20_FUNCTION_LENGTH;
+        unsigned k;
+        for (k = 0 ; k < MS_OS_20_GUID_LENGTH && guid[k] ; k++)
+            f->guid[k] = (uint8)guid[k];
+        for (; k < MS_OS_20_GUID_LENGTH + 2 ; k++)
+            f->guid[k] = 0;
+        
+        f->chunks[0].data = (const uint8*)&f->header;
+        f->chunks[0].dataLength = sizeof(f->header);
+        f->chunks[1].data = ms_os_20_compatible_id;
+        f->chunks[1].dataLength = sizeof(ms_os_20_compatible_id);
+        f->chunks[2].data = ms_os_20_guid_property_header;
+        f->chunks[2].dataLength = sizeof(ms_os_20_guid_property_header);
+        f->chunks[3].data = (const uint8*)f->guid;
+        f->chunks[3].dataLength = sizeof(f->guid);
+        f->chunks[0].next = composite ? &f->chunks[1] : NULL;
+        f->chunks[1].next = &f->chunks[2];
+        f->chunks[2].next = &f->chunks[3];
+        f->chunks[3].next = NULL;
+        last->next = composite ? &f->chunks[0] : &f->chunks[1];
+        last = &f->chunks[3];
+        if (!composite)
+            break;
     }
+    
+    last->next = NULL;
+    ms_os_20_header_chunk.data = (const uint8*)&ms_os_20_header;
+    ms_os_20_header_chunk.dataLength = composite ? sizeof(ms_os_20_header) : 10;
+    ms_os_20_header.wConfigTotalLength = 8 + numWinUSBFunctions * MS_OS_20_FUNCTION_LENGTH;
+    ms_os_20_header.wTotalLength = composite ? 10 + ms_os_20_header.wConfigTotalLength : (uint16)(10 + MS_OS_20_FUNCTION_LENGTH - 8);
+    bos.wMSOSDescriptorSetTotalLength = ms_os_20_header.wTotalLength;
+    
+    // BOS descriptors are only requested from USB 2.01 devices
+    usbGenericDescriptor_Device.bcdUSB = numWinUSBFunctions > 0 ? 0x0201 : 0x0200;
 }
+
  
-void usb_generic_enable(void) {
+static void usb_connect(void) {
     /* Present ourselves to the host. Writing 0 to "disc" pin must
      * pull USB_DP pin up while leaving USB_DM pulled down by the
      * transceiver. See USB 2.0 spec, section 7.1.7.3. */
@@ -373,14 +793,23 @@ void usb_generic_enable(void) {
         gpio_set_mode(BOARD_USB_DISC_DEV, (uint8)(uint32)BOARD_USB_DISC_BIT, GPIO_OUTPUT_PP);
         gpio_write_bit(BOARD_USB_DISC_DEV, (uint8)(uint32)BOARD_USB_DISC_BIT, 0);
     }
+}
+
+void usb_generic_enable(void) {
+    usb_connect();
 
     saved_Device_Table = Device_Table;
     saved_Device_Property = Device_Property;
     saved_User_Standard_Requests = User_Standard_Requests;
     Device_Table = my_Device_Table;
     Device_Property = my_Device_Property;
+    Device_Property.MaxPacketSize = ep0_buffer_size;
     User_Standard_Requests = my_User_Standard_Requests;
     
+#if defined(USB_GENERIC_STATS) || defined(USB_GENERIC_TRACE)
+    enable_cycle_counter();
+#endif
+
     /* Initialize the USB peripheral. */
     usb_init_usblib(USBLIB, ep_int_in, ep_int_out); 
 }
@@ -401,7 +830,7 @@ static void usbInit(void) {
     USB_BASE->CNTR = USBLIB->irq_mask;
 
     USB_BASE->ISTR = 0;
-    USBLIB->irq_mask = USB_ISR_MSK;
+    USBLIB->irq_mask = USB_ISR_MSK; // includes SOFM, which drives the frame scheduler
     USB_BASE->CNTR = USBLIB->irq_mask;
 
     usb_generic_enable_interrupts_ep0();
@@ -413,13 +842,12 @@ static void usbInit(void) {
     USBLIB->state = USB_UNCONNECTED;
 }
 
-#define BTABLE_ADDRESS 0x00
-
 static inline uint16 pma_ptr_to_offset(uint32* p) {
     return (uint16)(((uint32*)p-(uint32*)USB_PMA_BASE) * 2);
 }
 
 static void usbReset(void) {
+    TRACE(USB_TRACE_RESET, 0, 0);
     pInformation->Current_Configuration = 0;
 
     /* current feature is current bmAttributes */
@@ -431,11 +859,11 @@ static void usbReset(void) {
     /* setup control endpoint 0 */
     usb_set_ep_type(USB_EP0, USB_EP_EP_TYPE_CONTROL);
     usb_set_ep_tx_stat(USB_EP0, USB_EP_STAT_TX_STALL);
-    usb_set_ep_rx_addr(USB_EP0, USB_EP0_RX_BUFFER_ADDRESS);
-    usb_set_ep_tx_addr(USB_EP0, USB_EP0_TX_BUFFER_ADDRESS);
+    usb_set_ep_rx_addr(USB_EP0, ep0_rx_address);
+    usb_set_ep_tx_addr(USB_EP0, ep0_tx_address);
     usb_clear_status_out(USB_EP0);
 
-    usb_set_ep_rx_count(USB_EP0, USB_EP0_BUFFER_SIZE);
+    usb_set_ep_rx_count(USB_EP0, ep0_buffer_size);
     usb_set_ep_rx_stat(USB_EP0, USB_EP_STAT_RX_VALID);
     
     for (unsigned i = 1 ; i < 8 ; i++) {
@@ -467,6 +895,14 @@ static void usbReset(void) {
 				if (! e->doubleBuffer) {
 					usb_set_ep_rx_count(address, e->pmaSize);
 				}
+                else if (e->type == USB_GENERIC_ENDPOINT_TYPE_BULK) {
+                    usb_set_ep_rx_buf0_addr(address, pmaOffset);
+                    usb_set_ep_rx_buf1_addr(address, pmaOffset+e->pmaSize/2);
+                    usb_set_ep_rx_buf0_count(address, e->pmaSize/2);
+                    usb_set_ep_rx_buf1_count(address, e->pmaSize/2);
+                    // SW_BUF = 1 and DTOG_RX = 0, so the hardware can fill buffer 0 right away
+                    usb_toggle_ep_dtog_tx(address);
+                }
 				usb_set_ep_rx_stat(address, USB_EP_STAT_RX_VALID);
             }
         }
@@ -476,6 +912,7 @@ static void usbReset(void) {
     
     control_rx_length = 0;
     control_tx_length = 0;
+    double_buffer_tx_ready = 0;
     
     USBLIB->state = USB_ATTACHED;
     SetDeviceAddress(0);
@@ -488,7 +925,57 @@ static void usb_power_down(void) {
     USB_BASE->CNTR = USB_CNTR_FRES + USB_CNTR_PDWN;
 }
 
-void usb_generic_disable(void) {
+/*
+ * Switches to a new set of parts while enabled, without going through
+ * usb_generic_disable() and usb_generic_enable(). The caller is responsible
+ * for the parts' own state: parts that are no longer present should have been
+ * cleared, and parts that stay are left alone apart from the bus reset the
+ * host will do. The transceiver is powered down just long enough for the host
+ * to see a disconnect and then the device enumerates again with the new
+ * descriptors. Returns 0, leaving the device disabled, if the new parts don't
+ * fit.
+ */
+uint8 usb_generic_reconfigure(USBCompositePart** _parts, unsigned _numParts) {
+    reconfigure_start = systick_uptime();
+    reconfigure_millis = 0;
+    reconfiguring = 1;
+    
+    usb_generic_disable_interrupts_ep0();
+    if (usb_generic_get_defer_mode() == USB_GENERIC_DEFER_POLL)
+        usb_generic_run_deferred(); // anything still queued for the old parts
+    
+    if (BOARD_USB_DISC_DEV != NULL) {
+        gpio_write_bit(BOARD_USB_DISC_DEV, (uint8)(uint32)BOARD_USB_DISC_BIT, 1);
+    }
+    usb_power_down();
+    
+    if (! usb_generic_set_parts(_parts, _numParts)) {
+        reconfiguring = 0;
+        Device_Table = saved_Device_Table;
+        Device_Property = saved_Device_Property;
+        User_Standard_Requests = saved_User_Standard_Requests;    
+        return 0;
+    }
+    reset_strings();
+    Device_Table = my_Device_Table;
+    Device_Property.MaxPacketSize = ep0_buffer_size;
+
+#ifndef GENERIC_BOOTLOADER
+    // usb_connect() makes its own pulse on generic boards
+    if (BOARD_USB_DISC_DEV != NULL)
+        delay_us(disconnect_delay);
+#endif
+    usb_connect();
+    usb_init_usblib(USBLIB, ep_int_in, ep_int_out); 
+    return 1;
+}
+
+// milliseconds from the last usb_generic_reconfigure() to the host configuring the device, or 0 if that hasn't happened
+uint32 usb_generic_get_reconfigure_millis(void) {
+    return reconfiguring ? 0 : reconfigure_millis;
+}
+
+void usb_generic_disconnect(void) {
     /* Turn off the interrupt and signal disconnect (see e.g. USB 2.0
      * spec, section 7.1.7.3). */
     usb_generic_disable_interrupts_ep0();
@@ -502,7 +989,10 @@ void usb_generic_disable(void) {
     Device_Table = saved_Device_Table;
     Device_Property = saved_Device_Property;
     User_Standard_Requests = saved_User_Standard_Requests;    
-    
+}
+
+void usb_generic_disable(void) {
+    usb_generic_disconnect();
     for (uint32 i=0; i < numParts; i++)
         if (parts[i]->clear)
             parts[i]->clear();
@@ -516,6 +1006,8 @@ static uint8* control_data_tx(uint16 length) {
         return NULL;
     }
 
+    TRACE(USB_TRACE_CONTROL_TX, 0, length);
+
     if (control_tx_done && pInformation->USBwLengths.w <= wOffset + pInformation->Ctrl_Info.PacketSize) {
         *control_tx_done = USB_CONTROL_DONE; // this may be a bit premature, but it's our best try
     }
@@ -546,59 +1038,82 @@ uint32 usb_generic_chunks_length(struct usb_chunk* chunk) {
     return l;
 }
 
+/*
+ * Chunked control transfers keep a cursor (the chunk holding the next byte
+ * to send and that chunk's offset in the whole transfer), so each packet
+ * resumes where the previous one stopped instead of rescanning the list.
+ */
 static uint8* control_data_chunk_tx(uint16 length) {
     unsigned wOffset = pInformation->Ctrl_Info.Usb_wOffset;
     
     if (length == 0) {
-        pInformation->Ctrl_Info.Usb_wLength = usb_generic_chunks_length(control_tx_chunk_list) - wOffset;
+        pInformation->Ctrl_Info.Usb_wLength = control_tx_chunk_length - wOffset;
         
         return NULL;
     }
 
+    TRACE(USB_TRACE_CONTROL_TX, 0, length);
+
     if (control_tx_chunk_list == NULL) {
         return NULL;
     }
-    else {
-        uint32 chunks_offset = 0;
-        uint32 buf_offset = 0;
+
+    if (control_tx_chunk_cursor == NULL || wOffset < control_tx_chunk_cursor_offset) {
+        // host went back (e.g., a retried transfer): start over
+        control_tx_chunk_cursor = control_tx_chunk_list;
+        control_tx_chunk_cursor_offset = 0;
+    }
+    
+    struct usb_chunk* chunk = control_tx_chunk_cursor;
+    uint32 chunk_offset = control_tx_chunk_cursor_offset;
+    
+    while (chunk != NULL && chunk_offset + chunk->dataLength <= wOffset) {
+        chunk_offset += chunk->dataLength;
+        chunk = chunk->next;
+    }
+    
+    control_tx_chunk_cursor = chunk;
+    control_tx_chunk_cursor_offset = chunk_offset;
+
+    if (chunk == NULL)
+        return NULL;
+    
+    uint32 start = wOffset - chunk_offset;
+    
+    if (start + length <= chunk->dataLength) {
+        /* the whole packet lies in one chunk, so no need to gather */
+        return (uint8*)chunk->data + start;
+    }
+    
+    uint32 buf_offset = 0;
+    
+    while (chunk != NULL && buf_offset < length) {
+        uint32 to_copy = chunk->dataLength - start;
+        if (to_copy > length - buf_offset)
+            to_copy = length - buf_offset;
         
-        for (struct usb_chunk* chunk = control_tx_chunk_list ; chunk != NULL && chunks_offset < wOffset + length ; chunk = chunk->next ) {
-            uint32 len = chunk->dataLength;
-            
-            if (len == 0)
-                continue;
-            
-            if (wOffset < chunks_offset + len) {
-                /* need to copy some data from this chunk */
-                uint32 start;
-                if (wOffset <= chunks_offset) {
-                    start = 0;
-                }
-                else {
-                    start = wOffset - chunks_offset;
-                }
-                
-                uint32 to_copy;
-                if (wOffset + length <= chunks_offset + len) {
-                    to_copy = wOffset + length - chunks_offset - start;
-                }
-                else {
-                    to_copy = len - start;
-                }
-                
-                memcpy(control_tx_chunk_buffer + buf_offset, chunk->data + start, to_copy);
-                buf_offset += to_copy;
-            }
-            
-            chunks_offset += len;
-        }
+        memcpy(control_tx_chunk_buffer + buf_offset, chunk->data + start, to_copy);
+        buf_offset += to_copy;
+        
+        if (start + to_copy < chunk->dataLength)
+            break;
         
-        return (uint8*)control_tx_chunk_buffer;
+        chunk_offset += chunk->dataLength;
+        chunk = chunk->next;
+        start = 0;
     }
+    
+    control_tx_chunk_cursor = chunk;
+    control_tx_chunk_cursor_offset = chunk_offset;
+    
+    return (uint8*)control_tx_chunk_buffer;
 }
 
 void usb_generic_control_tx_chunk_setup(struct usb_chunk* chunk) {
     control_tx_chunk_list = chunk;
+    control_tx_chunk_cursor = chunk;
+    control_tx_chunk_cursor_offset = 0;
+    control_tx_chunk_length = usb_generic_chunks_length(chunk);
     pInformation->Ctrl_Info.CopyData = control_data_chunk_tx;
     pInformation->Ctrl_Info.Usb_wOffset = 0;
     control_data_chunk_tx(0);
@@ -622,6 +1137,7 @@ static uint8* control_data_rx(uint16 length) {
         return NULL;
     }
     
+    TRACE(USB_TRACE_CONTROL_RX, 0, length);
     if (control_rx_done && pInformation->USBwLengths.w <= wOffset + pInformation->Ctrl_Info.PacketSize) {
         *control_rx_done = USB_CONTROL_DONE; // this may be a bit premature, but it's our best try
     }
@@ -646,41 +1162,69 @@ void usb_generic_control_descriptor_tx(ONE_DESCRIPTOR* d) {
 }
 
 static RESULT usbDataSetup(uint8 request) {
-    if ((Type_Recipient & REQUEST_RECIPIENT) == INTERFACE_RECIPIENT) {
+    RESULT result = USB_UNSUPPORT;
+    
+    TRACE(USB_TRACE_DATA_SETUP, request, pInformation->USBwLength);
+    if (numWinUSBFunctions > 0 && Type_Recipient == (STANDARD_REQUEST | DEVICE_RECIPIENT) && 
+            request == GET_DESCRIPTOR && pInformation->USBwValue1 == DESCRIPTOR_TYPE_BOS) {
+        TRACE(USB_TRACE_GET_DESCRIPTOR, DESCRIPTOR_TYPE_BOS, pInformation->USBwLength);
+        usb_generic_control_tx_setup(&bos, sizeof(bos), NULL);
+        result = USB_SUCCESS;
+    }
+    else if (numWinUSBFunctions > 0 && Type_Recipient == (VENDOR_REQUEST | DEVICE_RECIPIENT) && 
+            request == USB_GENERIC_MS_VENDOR_CODE && 
+            pInformation->USBwIndex0 == MS_OS_20_DESCRIPTOR_INDEX && pInformation->USBwIndex1 == 0) { // USBwIndex is byte-swapped
+        usb_generic_control_tx_chunk_setup(&ms_os_20_header_chunk);
+        result = USB_SUCCESS;
+    }
+    else if ((Type_Recipient & REQUEST_RECIPIENT) == INTERFACE_RECIPIENT) {
         uint8 interface  = pInformation->USBwIndex0;
-        for (unsigned i = 0 ; i < numParts ; i++) {
-            USBCompositePart* p = parts[i];
-            if (p->usbDataSetup && p->startInterface <= interface && interface < p->startInterface + p->numInterfaces) {
+        if (interface < numInterfacesTotal) {
+            USBCompositePart* p = parts[interface_part[interface]];
+            if (p->usbDataSetup) {
                 // uint8 request, uint8 interface, uint8 requestType, uint8 wValue0, uint8 wValue1, uint16 wIndex, uint16 wLength
-                return parts[i]->usbDataSetup(request, interface - p->startInterface, pInformation->USBbmRequestType, pInformation->USBwValue0, 
+                result = p->usbDataSetup(request, interface - p->startInterface, pInformation->USBbmRequestType, pInformation->USBwValue0, 
                     pInformation->USBwValue1, pInformation->USBwIndex, pInformation->USBwLength);
             }
         }
     }
 
-    return USB_UNSUPPORT;
-    
+    if (result == USB_UNSUPPORT)
+        TRACE(USB_TRACE_SETUP_REJECTED, request, 0);
+    return result;
 }
 
 static RESULT usbNoDataSetup(uint8 request) {
+    RESULT result = USB_UNSUPPORT;
+    
+    TRACE(USB_TRACE_NO_DATA_SETUP, request, pInformation->USBwValue);
     if ((Type_Recipient & REQUEST_RECIPIENT) == INTERFACE_RECIPIENT) {
         uint8 interface  = pInformation->USBwIndex0;
         
-        for (unsigned i = 0 ; i < numParts ; i++) {
-            USBCompositePart* p = parts[i];
+        if (interface < numInterfacesTotal) {
+            USBCompositePart* p = parts[interface_part[interface]];
             // uint8 request, uint8 interface, uint8 requestType, uint8 wValue0, uint8 wValue1, uint16 wIndex, uint16 wLength
-            if (p->usbNoDataSetup && p->startInterface <= interface && interface < p->startInterface + p->numInterfaces)
-                return parts[i]->usbNoDataSetup(request, interface - p->startInterface, pInformation->USBbmRequestType, pInformation->USBwValue0, 
+            if (p->usbNoDataSetup)
+                result = p->usbNoDataSetup(request, interface - p->startInterface, pInformation->USBbmRequestType, pInformation->USBwValue0, 
                     pInformation->USBwValue1, pInformation->USBwIndex);
         }
     }
 
-    return USB_UNSUPPORT;
+    if (result == USB_UNSUPPORT)
+        TRACE(USB_TRACE_SETUP_REJECTED, request, 0);
+    return result;
 }
 
 static void usbSetConfiguration(void) {
+    TRACE(USB_TRACE_SET_CONFIGURATION, 0, pInformation->Current_Configuration);
     if (pInformation->Current_Configuration != 0) {
         USBLIB->state = USB_CONFIGURED;
+        if (reconfiguring) {
+            reconfigure_millis = systick_uptime() - reconfigure_start;
+            if (reconfigure_millis == 0)
+                reconfigure_millis = 1;
+            reconfiguring = 0;
+        }
     }
     for (unsigned i = 0 ; i < numParts ; i++) {
         if (parts[i]->usbSetConfiguration != NULL)
@@ -699,101 +1243,653 @@ static void usbSetDeviceAddress(void) {
     USBLIB->state = USB_ADDRESSED;
 }
 
+/*
+ * The core asks for the length of a descriptor (length == 0, at offset 0)
+ * when the request arrives, and then for each packet of it.
+ */
+static inline void trace_descriptor(uint16 length) {
+    if (length != 0)
+        TRACE(USB_TRACE_CONTROL_TX, 0, length);
+    else if (pInformation->Ctrl_Info.Usb_wOffset == 0)
+        TRACE(USB_TRACE_GET_DESCRIPTOR, pInformation->USBwValue1, pInformation->USBwLength);
+}
+
 static uint8* usbGetDeviceDescriptor(uint16 length) {
+    trace_descriptor(length);
     return Standard_GetDescriptorData(length, &Device_Descriptor);
 }
 
+/* 
+ * Returns a pointer to the configuration descriptor byte at offset, and
+ * sets *availableP to the number of bytes that follow it contiguously.
+ */
+static const uint8* config_descriptor_at(uint32 offset, uint32* availableP) {
+    if (offset < sizeof(usbConfigHeader)) {
+        *availableP = sizeof(usbConfigHeader) - offset;
+        return (const uint8*)&usbConfigHeader + offset;
+    }
+    offset -= sizeof(usbConfigHeader);
+    
+    for (unsigned i = 0 ; i < numParts ; i++) {
+        USBCompositePart* part = parts[i];
+        if (offset >= part->descriptorSize) {
+            offset -= part->descriptorSize;
+            continue;
+        }
+        uint16 blockSize = part_descriptor_block_size(part);
+        uint8 block = offset / blockSize;
+        if (descriptor_block_part != i || descriptor_block_index != block) {
+            if (part->getPartDescriptorBlock != NULL)
+                part->getPartDescriptorBlock(descriptor_block_buffer, block);
+            else
+                part->getPartDescriptor(descriptor_block_buffer);
+            descriptor_block_part = i;
+            descriptor_block_index = block;
+        }
+        offset -= block * blockSize;
+        *availableP = blockSize - offset;
+        return descriptor_block_buffer + offset;
+    }
+    
+    return NULL;
+}
+
 static uint8* usbGetConfigDescriptor(uint16 length) {
-    return Standard_GetDescriptorData(length, &Config_Descriptor);
+    unsigned wOffset = pInformation->Ctrl_Info.Usb_wOffset;
+    
+    trace_descriptor(length);
+
+    if (length == 0) {
+        pInformation->Ctrl_Info.Usb_wLength = usbConfigHeader.wTotalLength - wOffset;
+        return NULL;
+    }
+    
+    uint32 copied = 0;
+    while (copied < length) {
+        uint32 available;
+        const uint8* p = config_descriptor_at(wOffset + copied, &available);
+        if (p == NULL)
+            break;
+        if (copied == 0 && available >= length)
+            return (uint8*)p;
+        if (available > length - copied)
+            available = length - copied;
+        memcpy(control_tx_chunk_buffer + copied, p, available);
+        copied += available;
+    }
+    
+    return control_tx_chunk_buffer;
 }
 
 static uint8* usbGetStringDescriptor(uint16 length) {    
     uint8 wValue0 = pInformation->USBwValue0;
     
+    trace_descriptor(length);
+    
     if (wValue0 >= numStringDescriptors) {
         return NULL;
     }
     
-    ONE_DESCRIPTOR* d = &String_Descriptor[wValue0];
-    if (d->Descriptor_Size != 0) {
-        return Standard_GetDescriptorData(length, &String_Descriptor[wValue0]);
-    }
-    else {
-        const char* s = (char*)d->Descriptor;
-        
-        uint32 i = 0;
-        
-        while(*s && i < USB_MAX_STRING_DESCRIPTOR_LENGTH) {
-            string_descriptor_buffer.bString[i] = (uint8)*s;
-            s++;
-            i++;
-        }
-        
-        string_descriptor_buffer.bLength = USB_DESCRIPTOR_STRING_LEN(i);
-        generic_string_descriptor.Descriptor_Size = string_descriptor_buffer.bLength;
-        if (length > string_descriptor_buffer.bLength)
-            length = string_descriptor_buffer.bLength;
-        return Standard_GetDescriptorData(length, &generic_string_descriptor);
-    }            
+    return Standard_GetDescriptorData(length, &String_Descriptor[wValue0]);
 }
 
 
 static RESULT usbGetInterfaceSetting(uint8 interface, uint8 alt_setting) {
     if (alt_setting > 1) {
         return USB_UNSUPPORT;
-    } else if (interface >= usbConfig.Config_Header.bNumInterfaces) {
+    } else if (interface >= usbConfigHeader.bNumInterfaces) {
         return USB_UNSUPPORT;
     }
 
     return USB_SUCCESS;
 }
 
-void usb_copy_to_pma_ptr(volatile const uint8 *buf, uint16 len, uint32* dst) {
-    uint16 n = len >> 1;
-    uint16 i;
-    for (i = 0; i < n; i++) {
-        *(uint16*)dst = (uint16)(*buf) | *(buf + 1) << 8;
-        buf += 2;
-        dst++;
+/*
+ * PMA copy kernels.
+ *
+ * The PMA is 16 bits wide, and each halfword occupies a 32-bit slot in the
+ * CPU address space. The kernels below move n halfwords between RAM and PMA.
+ * The fast kernels are used when the RAM side is suitably aligned, and the
+ * bytewise kernels are the fallback for odd addresses.
+ */
+
+static inline void pma_write_halfwords(const uint16* src, uint32 n, volatile uint32* dst) {
+    while (n >= 8) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = src[3];
+        dst[4] = src[4];
+        dst[5] = src[5];
+        dst[6] = src[6];
+        dst[7] = src[7];
+        src += 8;
+        dst += 8;
+        n -= 8;
     }
-    if (len & 1) {
-        *dst = *buf;
+    while (n--)
+        *dst++ = *src++;
+}
+
+static inline void pma_write_bytes(const uint8* src, uint32 n, volatile uint32* dst) {
+    while (n >= 4) {
+        dst[0] = src[0] | (uint16)src[1] << 8;
+        dst[1] = src[2] | (uint16)src[3] << 8;
+        dst[2] = src[4] | (uint16)src[5] << 8;
+        dst[3] = src[6] | (uint16)src[7] << 8;
+        src += 8;
+        dst += 4;
+        n -= 4;
+    }
+    while (n--) {
+        *dst++ = src[0] | (uint16)src[1] << 8;
+        src += 2;
     }
 }
 
-void usb_copy_from_pma_ptr(volatile uint8 *buf, uint16 len, uint32* src) {
-    uint16 *dst = (uint16*)buf;
-    uint16 n = len >> 1;
-    uint16 i;
-    for (i = 0; i < n; i++) {
+// dst must be 32-bit aligned
+static inline void pma_read_words(uint32* dst, uint32 n, volatile uint32* src) {
+    while (n >= 8) {
+        dst[0] = (uint16)src[0] | (uint32)(uint16)src[1] << 16;
+        dst[1] = (uint16)src[2] | (uint32)(uint16)src[3] << 16;
+        dst[2] = (uint16)src[4] | (uint32)(uint16)src[5] << 16;
+        dst[3] = (uint16)src[6] | (uint32)(uint16)src[7] << 16;
+        src += 8;
+        dst += 4;
+        n -= 8;
+    }
+    uint16* dst16 = (uint16*)dst;
+    while (n--)
+        *dst16++ = *src++;
+}
+
+static inline void pma_read_halfwords(uint16* dst, uint32 n, volatile uint32* src) {
+    while (n >= 8) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = src[3];
+        dst[4] = src[4];
+        dst[5] = src[5];
+        dst[6] = src[6];
+        dst[7] = src[7];
+        src += 8;
+        dst += 8;
+        n -= 8;
+    }
+    while (n--)
         *dst++ = *src++;
+}
+
+static inline void pma_read_bytes(uint8* dst, uint32 n, volatile uint32* src) {
+    while (n--) {
+        uint16 w = *src++;
+        dst[0] = (uint8)w;
+        dst[1] = (uint8)(w >> 8);
+        dst += 2;
+    }
+}
+
+void usb_copy_to_pma_ptr(volatile const uint8 *buf, uint16 len, uint32* dst) {
+    uint32 n = len >> 1;
+
+    if (((uintptr_t)buf & 1) == 0)
+        pma_write_halfwords((const uint16*)buf, n, dst);
+    else
+        pma_write_bytes((const uint8*)buf, n, dst);
+
+    if (len & 1) {
+        dst[n] = buf[len-1];
     }
+}
+
+void usb_copy_from_pma_ptr(volatile uint8 *buf, uint16 len, uint32* src) {
+    uint32 n = len >> 1;
+
+    if (((uintptr_t)buf & 3) == 0)
+        pma_read_words((uint32*)buf, n, src);
+    else if (((uintptr_t)buf & 1) == 0)
+        pma_read_halfwords((uint16*)buf, n, src);
+    else
+        pma_read_bytes((uint8*)buf, n, src);
+
     if (len & 1) {
-        *dst = *src & 0xFF;
+        buf[len-1] = src[n] & 0xFF;
+    }
+}
+
+/*
+ * Circular buffer transfers.
+ *
+ * A packet's worth of data in a circular buffer occupies at most two
+ * contiguous spans: one running up to the end of the buffer and one
+ * starting again at index 0. Each span is moved with the PMA copy
+ * kernels; only a halfword straddling the wrap point needs special care.
+ */
+
+static inline uint32 circular_advance(uint32 index, uint32 n, uint32 circularBufferSize) {
+    if ((circularBufferSize & (circularBufferSize - 1)) == 0)
+        return (index + n) & (circularBufferSize - 1);
+    index += n;
+    if (index >= circularBufferSize)
+        index -= circularBufferSize;
+    return index;
+}
+
+static void copy_spans_to_pma(volatile const uint8* a, uint32 aLength, volatile const uint8* b, uint32 bLength, uint32* dst) {
+    if ((aLength & 1) == 0) {
+        usb_copy_to_pma_ptr(a, aLength, dst);
+        if (bLength)
+            usb_copy_to_pma_ptr(b, bLength, dst + aLength / 2);
+        return;
+    }
+    
+    usb_copy_to_pma_ptr(a, aLength - 1, dst);
+    dst += aLength / 2;
+    if (bLength == 0) {
+        *dst = a[aLength - 1];
+        return;
+    }
+    *dst++ = a[aLength - 1] | (uint16)b[0] << 8;
+    if (bLength > 1)
+        usb_copy_to_pma_ptr(b + 1, bLength - 1, dst);
+}
+
+static void copy_spans_from_pma(volatile uint8* a, uint32 aLength, volatile uint8* b, uint32 bLength, uint32* src) {
+    if ((aLength & 1) == 0) {
+        usb_copy_from_pma_ptr(a, aLength, src);
+        if (bLength)
+            usb_copy_from_pma_ptr(b, bLength, src + aLength / 2);
+        return;
+    }
+    
+    usb_copy_from_pma_ptr(a, aLength - 1, src);
+    src += aLength / 2;
+    uint16 straddle = *src++;
+    a[aLength - 1] = (uint8)straddle;
+    if (bLength == 0)
+        return;
+    b[0] = (uint8)(straddle >> 8);
+    if (bLength > 1)
+        usb_copy_from_pma_ptr(b + 1, bLength - 1, src);
+}
+
+// copies amount bytes starting at tail; returns new tail
+static uint32 circular_buffer_to_pma(volatile const uint8* buf, uint32 circularBufferSize, uint32 tail, uint32 amount, uint32* dst) {
+    uint32 span = circularBufferSize - tail;
+    if (span > amount)
+        span = amount;
+    copy_spans_to_pma(buf + tail, span, buf, amount - span, dst);
+    return circular_advance(tail, amount, circularBufferSize);
+}
+
+/*
+ * Called from the main program after queueing data in the circular buffer
+ * that txCallback sends from with usb_generic_send_from_circular_buffer().
+ * If the endpoint is idle, this starts the transmission; otherwise the next
+ * completion interrupt will pick the data up, so there is no need to wait.
+ * The interrupt is masked meanwhile so that the two can't race.
+ */
+void usb_generic_start_tx(void (*txCallback)(void), volatile int8* transmittingP) {
+    usb_generic_disable_interrupts_ep0();
+    if (*transmittingP < 0)
+        txCallback();
+    usb_generic_enable_interrupts_ep0();
+}
+
+/*
+ * Some handlers can't be hooked through libmaple, so the vector table is
+ * copied to RAM the first time one of them is needed, and entries are replaced
+ * there. The copy is only allocated then, so sketches that don't use the frame
+ * scheduler or PendSV deferral don't pay for it.
+ */
+
+#define VECTOR_TABLE_ENTRIES (16+68) // system exceptions and the most interrupts any STM32F1 has
+#define VECTOR_TABLE_ALIGNMENT 512 // VTOR needs the table size rounded up to a power of 2
+#define PENDSV_VECTOR 14
+#define USB_LP_VECTOR (16+NVIC_USB_LP_CAN_RX0)
+
+static void (**ram_vectors)(void) = NULL;
+
+// returns 0 if there is no memory for the RAM vector table
+static uint8 set_vector(unsigned n, void (*handler)(void)) {
+    if (ram_vectors == NULL) {
+        ram_vectors = memalign(VECTOR_TABLE_ALIGNMENT, VECTOR_TABLE_ENTRIES * sizeof *ram_vectors);
+        if (ram_vectors == NULL)
+            return 0;
+    }
+    if (SCB_BASE->VTOR != (uintptr_t)ram_vectors) {
+        memcpy(ram_vectors, (void*)SCB_BASE->VTOR, VECTOR_TABLE_ENTRIES * sizeof *ram_vectors);
+        USB_GENERIC_DSB();
+        SCB_BASE->VTOR = (uintptr_t)ram_vectors;
+    }
+    ram_vectors[n] = handler;
+    USB_GENERIC_DSB();
+    USB_GENERIC_ISB();
+    return 1;
+}
+
+/*
+ * Frame scheduler: callbacks run from the start-of-frame interrupt, every
+ * period frames, so that periodic work can be done once per frame just before
+ * the host polls.
+ *
+ * libmaple's USB interrupt handler ignores SOF, so when the first callback is
+ * added, the USB vector is pointed at sof_irq_handler(), which handles SOF and
+ * then calls libmaple's handler.
+ */
+
+void __irq_usb_lp_can_rx0(void); // libmaple's USB interrupt handler
+
+static struct {
+    void (*callback)(uint32 frame, void* data);
+    void* data;
+    uint16 period;
+    uint16 phase;
+} frame_callbacks[USB_GENERIC_MAX_FRAME_CALLBACKS];
+static volatile uint8 numFrameCallbacks = 0;
+static volatile uint32 frame_count = 0; // SOFs seen
+static volatile uint32 frame_start_cycles; // cycle counter at the last SOF
+
+static void sof_irq_handler(void) {
+    if (USB_BASE->ISTR & USB_ISTR_SOF) {
+        USB_BASE->ISTR = ~USB_ISTR_SOF;
+        frame_start_cycles = DWT_CYCCNT;
+        uint32 frame = ++frame_count;
+        for (unsigned i = 0 ; i < numFrameCallbacks ; i++)
+            if ((frame + frame_callbacks[i].phase) % frame_callbacks[i].period == 0)
+                frame_callbacks[i].callback(frame, frame_callbacks[i].data);
+    }
+    __irq_usb_lp_can_rx0();
+}
+
+static uint8 install_sof_handler(void) {
+    if (ram_vectors != NULL && SCB_BASE->VTOR == (uintptr_t)ram_vectors && ram_vectors[USB_LP_VECTOR] == sof_irq_handler)
+        return 1;
+    enable_cycle_counter();
+    return set_vector(USB_LP_VECTOR, sof_irq_handler);
+}
+
+/*
+ * Calls callback(frame, data) from the interrupt on every frame where
+ * (frame + phase) % period == 0, frame counting SOFs since the scheduler
+ * started. Returns 0 if USB_GENERIC_MAX_FRAME_CALLBACKS are already in use or
+ * there is no memory for the RAM vector table.
+ */
+uint8 usb_generic_add_frame_callback(void (*callback)(uint32 frame, void* data), void* data, uint16 period, uint16 phase) {
+    if (numFrameCallbacks >= USB_GENERIC_MAX_FRAME_CALLBACKS || callback == NULL)
+        return 0;
+    if (period == 0)
+        period = 1;
+    if (! install_sof_handler())
+        return 0;
+    usb_generic_disable_interrupts_ep0();
+    unsigned i = numFrameCallbacks;
+    frame_callbacks[i].callback = callback;
+    frame_callbacks[i].data = data;
+    frame_callbacks[i].period = period;
+    frame_callbacks[i].phase = phase % period;
+    numFrameCallbacks = i + 1;
+    usb_generic_enable_interrupts_ep0();
+    return 1;
+}
+
+void usb_generic_remove_frame_callback(void (*callback)(uint32 frame, void* data), void* data) {
+    usb_generic_disable_interrupts_ep0();
+    for (unsigned i = 0 ; i < numFrameCallbacks ; i++) {
+        if (frame_callbacks[i].callback == callback && frame_callbacks[i].data == data) {
+            numFrameCallbacks--;
+            memmove(&frame_callbacks[i], &frame_callbacks[i+1], (numFrameCallbacks - i) * sizeof *frame_callbacks);
+            break;
+        }
+    }
+    usb_generic_enable_interrupts_ep0();
+}
+
+// the 11-bit frame number sent by the host in the last SOF
+uint16 usb_generic_get_frame_number(void) {
+    return USB_BASE->FNR & USB_FNR_FN;
+}
+
+// SOFs seen since the scheduler started
+uint32 usb_generic_get_frame_count(void) {
+    return frame_count;
+}
+
+/*
+ * Microseconds of bus time: a millisecond per frame, plus the time since the
+ * last SOF from the cycle counter. This starts the scheduler if necessary,
+ * and returns 0 if it can't be started.
+ */
+uint32 usb_generic_get_bus_micros(void) {
+    if (! install_sof_handler())
+        return 0;
+    uint32 frame;
+    uint32 cycles;
+    do {
+        frame = frame_count;
+        cycles = DWT_CYCCNT - frame_start_cycles;
+    } while (frame != frame_count);
+    uint32 micros = cycles / (F_CPU / 1000000);
+    if (micros > 999)
+        micros = 999; // SOF late or missed, e.g., while suspended
+    return frame * 1000 + micros;
+}
+
+/*
+ * Deferred work. Class drivers hand the parts of their interrupt handling that
+ * can take a while (user callbacks, sysex parsing, mass storage commands) to
+ * usb_generic_defer(). By default it just calls them, as before. In the
+ * other modes, the interrupt only queues them, to be run by
+ * usb_generic_run_deferred() (USBComposite.poll()) or from PendSV at the
+ * lowest interrupt priority, which keeps the time spent in the USB interrupt
+ * short. Endpoints whose data is still waiting to be handled keep NAKing.
+ *
+ * The queue has a single producer, the USB interrupt (or code running with it
+ * masked), and a single consumer, so no locking is needed.
+ */
+
+#define SCB_ICSR_PENDSVSET (1u << 28)
+#ifndef SCB_SHPR3
+#define SCB_SHPR3 (*(volatile uint32*)0xE000ED20)
+#endif
+
+static struct {
+    void (*work)(void* data);
+    void* data;
+} deferred_queue[USB_GENERIC_DEFERRED_QUEUE_SIZE];
+static volatile uint32 deferred_head = 0;
+static volatile uint32 deferred_tail = 0;
+static uint8 defer_mode = USB_GENERIC_DEFER_NONE;
+
+void usb_generic_run_deferred(void) {
+    uint32 tail = deferred_tail;
+    while (tail != deferred_head) {
+        void (*work)(void*) = deferred_queue[tail].work;
+        void* data = deferred_queue[tail].data;
+        tail = (tail + 1) % USB_GENERIC_DEFERRED_QUEUE_SIZE;
+        deferred_tail = tail;
+        work(data);
     }
 }
 
+static void pendsv_handler(void) {
+    usb_generic_run_deferred();
+}
+
+/*
+ * USB_GENERIC_DEFER_NONE, USB_GENERIC_DEFER_POLL or USB_GENERIC_DEFER_PENDSV.
+ * Work still queued is run before switching, with the USB interrupt masked as
+ * if the interrupt had done it, so none is left behind. (PendSV has the lowest
+ * priority, so it can't be running at the same time.) USB_GENERIC_DEFER_PENDSV replaces the PendSV
+ * handler, so it can't be used with an RTOS that needs PendSV (e.g., FreeRTOS).
+ * Returns 0, leaving the mode unchanged, if there is no memory for the RAM
+ * vector table.
+ */
+uint8 usb_generic_set_defer_mode(uint8 mode) {
+    if (mode == USB_GENERIC_DEFER_PENDSV && defer_mode != USB_GENERIC_DEFER_PENDSV) {
+        if (! set_vector(PENDSV_VECTOR, pendsv_handler))
+            return 0;
+        SCB_SHPR3 |= 0xFFu << 16; // PendSV at the lowest priority
+    }
+    usb_generic_disable_interrupts_ep0();
+    if (defer_mode != USB_GENERIC_DEFER_NONE && mode != defer_mode)
+        usb_generic_run_deferred();
+    defer_mode = mode;
+    usb_generic_enable_interrupts_ep0();
+    return 1;
+}
+
+uint8 usb_generic_get_defer_mode(void) {
+    return defer_mode;
+}
+
+/*
+ * Runs work(data) now or later, depending on the mode. If the queue is full,
+ * the work is done right away rather than lost.
+ */
+void usb_generic_defer(void (*work)(void* data), void* data) {
+    uint32 head = deferred_head;
+    uint32 next = (head + 1) % USB_GENERIC_DEFERRED_QUEUE_SIZE;
+    
+    if (defer_mode == USB_GENERIC_DEFER_NONE || next == deferred_tail) {
+        work(data);
+        return;
+    }
+    
+    deferred_queue[head].work = work;
+    deferred_queue[head].data = data;
+    __asm__ volatile ("" ::: "memory");
+    deferred_head = next;
+    
+    if (defer_mode == USB_GENERIC_DEFER_PENDSV)
+        SCB_BASE->ICSR = SCB_ICSR_PENDSVSET;
+}
+
+/*
+ * Double-buffered bulk endpoints. The hardware works on the buffer selected
+ * by its DTOG bit and software on the one selected by SW_BUF, which is the
+ * DTOG bit of the opposite direction. Whenever the two point at the same
+ * buffer, the hardware NAKs, so software hands a buffer over (or takes a
+ * filled one back) by toggling SW_BUF. That lets the next packet go over
+ * the bus while the completion interrupt is still copying the previous one.
+ *
+ * Isochronous double buffering, as used by usb_audio.c, works differently
+ * and doesn't go through here.
+ */
+
+static inline uint8 is_double_buffered_bulk(USBEndpointInfo* ep) {
+    return ep->doubleBuffer && ep->type == USB_GENERIC_ENDPOINT_TYPE_BULK;
+}
+
+static inline uint32* double_buffer_ptr(USBEndpointInfo* ep, uint32 which) {
+    return which ? PMA_PTR_BUF1(ep) : PMA_PTR_BUF0(ep);
+}
+
+static inline uint32 double_buffer_tx_sw_buf(uint8 address) {
+    return usb_get_ep_dtog_rx(address) ? 1 : 0;
+}
+
+static inline uint8 double_buffer_tx_hw_idle(uint8 address) {
+    return (usb_get_ep_dtog_tx(address) ? 1 : 0) == double_buffer_tx_sw_buf(address);
+}
+
+static void double_buffer_tx_handover(USBEndpointInfo* ep) {
+    uint8 mask = 1 << ep->address;
+    if ((double_buffer_tx_ready & mask) && double_buffer_tx_hw_idle(ep->address)) {
+        usb_toggle_ep_dtog_rx(ep->address);
+        double_buffer_tx_ready &= ~mask;
+        usb_generic_enable_tx(ep);
+    }
+}
+
+// the packet has been written to software's buffer
+static void double_buffer_tx_queue(USBEndpointInfo* ep, uint32 len) {
+    if (double_buffer_tx_sw_buf(ep->address))
+        usb_set_ep_tx_buf1_count(ep->address, len);
+    else
+        usb_set_ep_tx_buf0_count(ep->address, len);
+    note_packet(ep, len);
+    double_buffer_tx_ready |= 1 << ep->address;
+    double_buffer_tx_handover(ep);
+}
+
+static uint32 send_from_circular_buffer_double_buffered_bulk(USBEndpointInfo* ep, volatile uint8* buf, uint32 circularBufferSize, uint32 head, volatile uint32* tailP, volatile int8* transmittingP) {
+    uint8 mask = 1 << ep->address;
+    uint32 queued = 0;
+    
+    double_buffer_tx_handover(ep);
+    
+    while (! (double_buffer_tx_ready & mask)) {
+        uint32 tail = *tailP;
+        uint32 amount = head >= tail ? head - tail : head + circularBufferSize - tail;
+        USB_GENERIC_HIGH_WATER(ep, amount);
+        
+        if (amount == 0) {
+            USB_GENERIC_COUNT(ep, txEmpty);
+            if (! double_buffer_tx_hw_idle(ep->address))
+                break; // the completion interrupt will bring us back
+            if (*transmittingP <= 0) {
+                *transmittingP = -1;
+                break;
+            }
+            *transmittingP = 0;
+            double_buffer_tx_queue(ep, 0); // flush
+            break;
+        }
+        
+        *transmittingP = 1;
+        
+        if (amount > ep->pmaSize / 2)
+            amount = ep->pmaSize / 2;
+        
+        *tailP = circular_buffer_to_pma(buf, circularBufferSize, tail, amount, 
+                    double_buffer_ptr(ep, double_buffer_tx_sw_buf(ep->address))); /* store volatile variable */
+        double_buffer_tx_queue(ep, amount);
+        queued += amount;
+    }
+    
+    return queued;
+}
+
+/* 
+ * Takes the filled buffer from the hardware and gives it the other one, so it
+ * can receive while we copy. As with a single buffer, the endpoint is then
+ * left NAKing until the class re-enables it, but one more packet may already
+ * be on its way, so classes should only re-enable with room for two.
+ */
+static uint32* double_buffer_rx_take(USBEndpointInfo* ep, uint32* lenP) {
+    // SW_BUF set means buffer 0 holds the packet
+    uint32 which = usb_get_ep_dtog_tx(ep->address) ? 0 : 1;
+    usb_toggle_ep_dtog_tx(ep->address);
+    *lenP = which ? usb_get_ep_rx_buf1_count(ep->address) : usb_get_ep_rx_buf0_count(ep->address);
+    note_packet(ep, *lenP);
+    return double_buffer_ptr(ep, which);
+}
+
 // return bytes read
 uint32 usb_generic_read_to_circular_buffer(USBEndpointInfo* ep, volatile uint8* buf, uint32 circularBufferSize, volatile uint32* headP) {
     uint32 head = *headP;
-    uint32 ep_rx_size = usb_get_ep_rx_count(ep->address);
+    uint32 ep_rx_size;
+    uint32* src;
+    if (is_double_buffered_bulk(ep)) {
+        src = double_buffer_rx_take(ep, &ep_rx_size);
+    }
+    else {
+        ep_rx_size = usb_get_ep_rx_count(ep->address);
+        src = ep->pma;
+        note_packet(ep, ep_rx_size);
+    }
     /* This copy won't overwrite unread bytes as long as there is
      * enough room in the USB Rx buffer for next packet */
-    volatile uint32 *src = ep->pma;
-
-    for (uint32 i = 0; i < ep_rx_size; i++) {
-        uint16 tmp = *src++;
-        buf[head] = (uint8)tmp;
-        head = (head + 1) % circularBufferSize;
-        i++;
-        if (i >= ep_rx_size) {
-            break;
-        }
-        buf[head] = (uint8)(tmp>>8);
-        head = (head + 1) % circularBufferSize;
-    }
-
-    *headP = head;
+    uint32 span = circularBufferSize - head;
+    if (span > ep_rx_size)
+        span = ep_rx_size;
+    copy_spans_from_pma(buf + head, span, buf, ep_rx_size - span, src);
+    if (is_double_buffered_bulk(ep))
+        usb_generic_pause_rx(ep);
+
+    *headP = circular_advance(head, ep_rx_size, circularBufferSize);
     
     return ep_rx_size;
 }
@@ -801,7 +1897,17 @@ uint32 usb_generic_read_to_circular_buffer(USBEndpointInfo* ep, volatile uint8*
 // returns number of bytes read
 // buf should be uint16-aligned
 uint32 usb_generic_read_to_buffer(USBEndpointInfo* ep, volatile uint8* buf, uint32 bufferSize) {
-    uint32 ep_rx_size = usb_get_ep_rx_count(ep->address);
+    uint32 ep_rx_size;
+    if (is_double_buffered_bulk(ep)) {
+        uint32* src = double_buffer_rx_take(ep, &ep_rx_size);
+        if (ep_rx_size > bufferSize)
+            ep_rx_size = bufferSize;
+        usb_copy_from_pma_ptr(buf, ep_rx_size, src);
+        usb_generic_pause_rx(ep);
+        return ep_rx_size;
+    }
+    ep_rx_size = usb_get_ep_rx_count(ep->address);
+    note_packet(ep, ep_rx_size);
     if (ep_rx_size > bufferSize)
         ep_rx_size = bufferSize;
     usb_copy_from_pma_ptr(buf, ep_rx_size, ep->pma);
@@ -809,26 +1915,112 @@ uint32 usb_generic_read_to_buffer(USBEndpointInfo* ep, volatile uint8* buf, uint
 }
 
 uint32 usb_generic_send_from_buffer(USBEndpointInfo* ep, volatile uint8* buf, uint32 amount) {
+    if (is_double_buffered_bulk(ep)) {
+        uint32* dst = usb_generic_tx_reserve(ep, amount < ep->pmaSize / 2 ? amount : ep->pmaSize / 2);
+        if (dst == NULL)
+            return 0;
+        if (amount > ep->pmaSize / 2)
+            amount = ep->pmaSize / 2;
+        usb_copy_to_pma_ptr(buf, amount, dst);
+        double_buffer_tx_queue(ep, amount);
+        return amount;
+    }
+    
     if (amount > ep->pmaSize)
         amount = ep->pmaSize;
     
     usb_copy_to_pma_ptr(buf, amount, ep->pma);
+    note_packet(ep, amount);
     usb_set_ep_tx_count(ep->address, amount);
     usb_generic_enable_tx(ep);
     
     return amount;
 }
 
+/*
+ * Zero-copy packet access: instead of staging a packet in RAM, the producer
+ * writes it straight into the endpoint's packet memory (e.g., with
+ * usb_copy_to_pma_ptr()) between a reserve and a commit, and the consumer
+ * reads it from there.
+ *
+ * usb_generic_tx_reserve() returns the PMA buffer for a packet of len bytes,
+ * or NULL if the packet doesn't fit or there is no buffer the hardware isn't
+ * using: for a single buffer, while the last packet is still waiting to go
+ * out; for a double-buffered bulk endpoint, while a packet is already queued
+ * behind the one going out. usb_generic_tx_commit() hands the packet to the
+ * hardware.
+ *
+ * Isochronous double buffering (see usb_audio.c) has no handshake to hold a
+ * buffer back with, so these functions return NULL for such endpoints.
+ *
+ * Call them from the endpoint's callback, or from the main program with
+ * usb_generic_disable_interrupts_ep0() in effect.
+ */
+uint32* usb_generic_tx_reserve(USBEndpointInfo* ep, uint32 len) {
+    if (is_double_buffered_bulk(ep)) {
+        double_buffer_tx_handover(ep); // the queued packet may be able to go now
+        if (len > ep->pmaSize / 2 || (double_buffer_tx_ready & (1 << ep->address)))
+            return NULL;
+        return double_buffer_ptr(ep, double_buffer_tx_sw_buf(ep->address));
+    }
+    if (ep->doubleBuffer || len > ep->pmaSize || usb_generic_tx_busy(ep))
+        return NULL;
+    return ep->pma;
+}
+
+void usb_generic_tx_commit(USBEndpointInfo* ep, uint32 len) {
+    if (is_double_buffered_bulk(ep)) {
+        double_buffer_tx_queue(ep, len);
+    }
+    else if (! ep->doubleBuffer) {
+        note_packet(ep, len);
+        usb_generic_set_tx(ep, len);
+    }
+}
+
+/*
+ * usb_generic_rx_reserve() returns the PMA buffer holding the oldest received
+ * packet that hasn't been reserved yet and stores its length in *lenP, or
+ * returns NULL if there is none. The endpoint then NAKs until
+ * usb_generic_rx_commit() says the buffer has been read; commits go in the
+ * same order as the reserves.
+ *
+ * A double-buffered bulk endpoint has a packet waiting when the hardware has
+ * caught up with software's buffer. Reserving it gives the hardware the other
+ * buffer, so a second packet may still arrive before the endpoint NAKs, and
+ * can be reserved before the first is committed.
+ */
+uint32* usb_generic_rx_reserve(USBEndpointInfo* ep, uint32* lenP) {
+    if (is_double_buffered_bulk(ep)) {
+        if ((usb_get_ep_dtog_rx(ep->address) ? 1 : 0) != (usb_get_ep_dtog_tx(ep->address) ? 1 : 0))
+            return NULL;
+        uint32* pma = double_buffer_rx_take(ep, lenP);
+        usb_generic_pause_rx(ep);
+        return pma;
+    }
+    if (ep->doubleBuffer || usb_generic_rx_waiting(ep))
+        return NULL;
+    *lenP = usb_get_ep_rx_count(ep->address);
+    note_packet(ep, *lenP);
+    return ep->pma;
+}
+
+void usb_generic_rx_commit(USBEndpointInfo* ep) {
+    if (! ep->doubleBuffer || is_double_buffered_bulk(ep))
+        usb_generic_enable_rx(ep);
+}
+
 // transmitting = 1 when transmitting, 0 when done but not flushed, negative when done and flushed
 uint32 usb_generic_send_from_circular_buffer(USBEndpointInfo* ep, volatile uint8* buf, uint32 circularBufferSize, uint32 head, volatile uint32* tailP, volatile int8* transmittingP) {
+    if (is_double_buffered_bulk(ep))
+        return send_from_circular_buffer_double_buffered_bulk(ep, buf, circularBufferSize, head, tailP, transmittingP);
+    
     uint32 tail = *tailP;
-	int32 amount = (head - tail) % circularBufferSize;
-    if (amount < 0) {
-        // wish we could count on % returning a non-negative answer
-        amount += circularBufferSize;
-    }
+    uint32 amount = head >= tail ? head - tail : head + circularBufferSize - tail;
+    USB_GENERIC_HIGH_WATER(ep, amount);
     
 	if (amount==0) {
+        USB_GENERIC_COUNT(ep, txEmpty);
         if (*transmittingP <= 0) {
             *transmittingP = -1;
             return 0; // it was already flushed, keep Tx endpoint disabled
@@ -844,23 +2036,10 @@ uint32 usb_generic_send_from_circular_buffer(USBEndpointInfo* ep, volatile uint8
     }
     
 	// copy the bytes from USB Tx buffer to PMA buffer
-	uint32 *dst = ep->pma;
-
-    for (int32 i = 0; i < amount; i++) {
-        uint16 low = buf[tail];
-        tail = (tail + 1) % circularBufferSize;
-        i++;
-        if (i >= amount) {
-            *dst = low;
-            break;
-        }
-        *dst++ = ((uint16)buf[tail] << 8) | low;
-        tail = (tail + 1) % circularBufferSize;
-    }
-
-    *tailP = tail; /* store volatile variable */
+    *tailP = circular_buffer_to_pma(buf, circularBufferSize, tail, amount, ep->pma); /* store volatile variable */
     
 flush:
+    note_packet(ep, amount);
 	// enable Tx endpoint
     usb_set_ep_tx_count(ep->address, amount);
     usb_generic_enable_tx(ep);
@@ -870,8 +2049,6 @@ flush:
 
 
 uint32 usb_generic_send_from_circular_buffer_double_buffered(USBEndpointInfo* ep, volatile uint8* buf, uint32 circularBufferSize, uint32 amount, volatile uint32* tailP) {
-    uint32 tail = *tailP; /* load volatile variable */
-
     uint32 dtog_tx = usb_get_ep_dtog_tx(ep->address);
 
     /* copy the bytes from USB Tx buffer to PMA buffer */
@@ -884,19 +2061,8 @@ uint32 usb_generic_send_from_circular_buffer_double_buffered(USBEndpointInfo* ep
     if (amount > ep->pmaSize / 2)
         amount = ep->pmaSize / 2;
 
-    for (uint32 i = 0; i < amount; i++) {
-        uint16 low = buf[tail];
-        tail = (tail + 1) % circularBufferSize;
-        i++;
-        if (i >= amount) {
-            *dst = low;
-            break;
-        }
-        *dst++ = ((uint16)buf[tail] << 8) | low;
-        tail = (tail + 1) % circularBufferSize;
-    }
-
-    *tailP = tail; /* store volatile variable */
+    *tailP = circular_buffer_to_pma(buf, circularBufferSize, *tailP, amount, dst); /* store volatile variable */
+    note_packet(ep, amount);
 
     if (dtog_tx)
         usb_set_ep_tx_buf1_count(ep->address, amount);
@@ -915,3 +2081,90 @@ uint16_t usb_generic_roundUpToPowerOf2(uint16_t x) {
     else
         return xx;
 }
+
+#ifdef USB_GENERIC_STATS
+// copies up to maxEndpoints endpoints' counters, in the order of part->endpoints; returns how many
+unsigned usb_generic_get_part_stats(USBCompositePart* part, USBEndpointStats* out, unsigned maxEndpoints) {
+    unsigned n = part->numEndpoints < maxEndpoints ? part->numEndpoints : maxEndpoints;
+    usb_generic_disable_interrupts_ep0();
+    for (unsigned i = 0 ; i < n ; i++)
+        out[i] = part->endpoints[i].stats;
+    usb_generic_enable_interrupts_ep0();
+    return n;
+}
+
+void usb_generic_reset_part_stats(USBCompositePart* part) {
+    usb_generic_disable_interrupts_ep0();
+    for (unsigned i = 0 ; i < part->numEndpoints ; i++)
+        memset(&part->endpoints[i].stats, 0, sizeof part->endpoints[i].stats);
+    usb_generic_enable_interrupts_ep0();
+}
+
+static uint8* put_32(uint8* out, uint32 x) {
+    out[0] = x;
+    out[1] = x >> 8;
+    out[2] = x >> 16;
+    out[3] = x >> 24;
+    return out + 4;
+}
+
+/*
+ * Packs a snapshot of the part's counters for sending to the host, e.g., with
+ * CompositeSerial.write() or in a HID feature report. Little-endian:
+ *   uint8 version (1), uint8 numEndpoints, then for each endpoint:
+ *   uint8 address (bit 7 set for IN), uint32 packets, bytes, shortPackets,
+ *   zeroLengthPackets, txEmpty, rxFull, stalls, callbacks, callbackCycles,
+ *   maxCallbackCycles, uint16 ringHighWater
+ * Returns the number of bytes written, or 0 if maxLength is less than
+ * USB_GENERIC_STATS_SERIALIZED_SIZE(part->numEndpoints).
+ */
+uint32 usb_generic_serialize_part_stats(USBCompositePart* part, uint8* out, uint32 maxLength) {
+    USBEndpointStats stats[USB_GENERIC_MAX_ENDPOINTS];
+    unsigned n = usb_generic_get_part_stats(part, stats, USB_GENERIC_MAX_ENDPOINTS);
+    if (maxLength < USB_GENERIC_STATS_SERIALIZED_SIZE(n))
+        return 0;
+    
+    uint8* p = out;
+    *p++ = 1;
+    *p++ = n;
+    for (unsigned i = 0 ; i < n ; i++) {
+        USBEndpointStats* s = &stats[i];
+        *p++ = part->endpoints[i].address | (part->endpoints[i].tx ? 0x80 : 0);
+        p = put_32(p, s->packets);
+        p = put_32(p, s->bytes);
+        p = put_32(p, s->shortPackets);
+        p = put_32(p, s->zeroLengthPackets);
+        p = put_32(p, s->txEmpty);
+        p = put_32(p, s->rxFull);
+        p = put_32(p, s->stalls);
+        p = put_32(p, s->callbacks);
+        p = put_32(p, s->callbackCycles);
+        p = put_32(p, s->maxCallbackCycles);
+        *p++ = s->ringHighWater;
+        *p++ = s->ringHighWater >> 8;
+    }
+    return p - out;
+}
+#endif
+
+#ifdef USB_GENERIC_TRACE
+// for the application's own markers (USB_TRACE_USER and up)
+void usb_generic_trace(uint8 event, uint8 endpoint, uint16 length) {
+    TRACE(event, endpoint, length);
+}
+
+/*
+ * Copies the newest entries, oldest first, and the number of events ever
+ * recorded. Pass the result to usb_trace_serialize() to send it to the host.
+ */
+uint32 usb_generic_trace_snapshot(usb_trace_entry* out, uint32 maxEntries, uint32* countP) {
+    usb_generic_disable_interrupts_ep0();
+    uint32 n = usb_trace_snapshot(&trace, out, maxEntries, countP);
+    usb_generic_enable_interrupts_ep0();
+    return n;
+}
+
+void usb_generic_clear_trace(void) {
+    usb_trace_clear(&trace);
+}
+#endif
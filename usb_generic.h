@@ -12,9 +12,21 @@ typedef unsigned char u8;
 
 #define USB_CONTROL_DONE 1
 
+//#define USB_GENERIC_STATS // per-endpoint counters, see usb_generic_get_part_stats(); costs RAM and a few cycles per packet
+//#define USB_GENERIC_TRACE // timestamped record of USB interrupt activity, see usb_trace.h; costs 8 bytes of RAM per entry
+#define USB_GENERIC_TRACE_SIZE 128 // entries, power of 2
+#ifdef USB_GENERIC_TRACE
+#include "usb_trace.h"
+#endif
+
 #define PMA_MEMORY_SIZE 512
-#define MAX_USB_DESCRIPTOR_DATA_SIZE 200
-#define USB_MAX_STRING_DESCRIPTOR_LENGTH 36
+#define MAX_USB_DESCRIPTOR_BLOCK_SIZE 132 // largest piece of a part's descriptor generated at once
+// fails to compile if a part's descriptor type (or the type of one block of it) would overrun the buffer it is generated into
+#define USB_GENERIC_CHECK_DESCRIPTOR_SIZE(type) \
+    typedef char type##_too_large_for_descriptor_buffer[sizeof(type) <= MAX_USB_DESCRIPTOR_BLOCK_SIZE ? 1 : -1]
+#define USB_MAX_STRING_DESCRIPTOR_LENGTH 126 // UTF-16 units per string; 126 is the most a descriptor can hold
+#define USB_MAX_STRING_DESCRIPTORS 16 // including the language IDs at index 0
+#define USB_STRING_DESCRIPTOR_POOL_SIZE 384 // bytes shared by all the UTF-16 string descriptors
 
 #define USB_EP0_BUFFER_SIZE       0x40
 #define USB_EP0_TX_BUFFER_ADDRESS 0x40
@@ -31,9 +43,48 @@ enum USB_ENDPOINT_TYPES {
     USB_GENERIC_ENDPOINT_TYPE_INTERRUPT
 };
 
+enum USB_GENERIC_DEFER_MODES {
+    USB_GENERIC_DEFER_NONE = 0, // class drivers do all their work in the USB interrupt
+    USB_GENERIC_DEFER_POLL, // longer work waits for usb_generic_run_deferred(), e.g., from USBComposite.poll()
+    USB_GENERIC_DEFER_PENDSV // longer work runs from PendSV, after the USB interrupt and any other interrupts
+};
+
+enum USB_GENERIC_LAYOUT_STATUS {
+    USB_GENERIC_LAYOUT_OK = 0,
+    USB_GENERIC_LAYOUT_DESCRIPTOR_TOO_LARGE,
+    USB_GENERIC_LAYOUT_NO_ENDPOINT_ADDRESS,
+    USB_GENERIC_LAYOUT_PMA_FULL,
+    USB_GENERIC_LAYOUT_TOO_MANY_INTERFACES,
+    USB_GENERIC_LAYOUT_TOO_MANY_PARTS
+};
+
+#define USB_GENERIC_MAX_PARTS 16
+
 extern const usb_descriptor_string usb_generic_default_iManufacturer;
 extern const usb_descriptor_string usb_generic_default_iProduct;
 
+#ifdef USB_GENERIC_STATS
+typedef struct USBEndpointStats {
+    uint32 packets;
+    uint32 bytes;
+    uint32 shortPackets; // shorter than the buffer, including zero-length ones
+    uint32 zeroLengthPackets;
+    uint32 txEmpty; // TX completions that found nothing queued, after which the host gets NAKs
+    uint32 rxFull; // RX left NAKing because the class had no room for another packet
+    uint32 stalls;
+    uint32 callbacks;
+    uint32 callbackCycles; // total CPU cycles spent in the completion callback
+    uint32 maxCallbackCycles;
+    uint16 ringHighWater; // most bytes seen waiting in the class's ring buffer
+} USBEndpointStats;
+
+#define USB_GENERIC_COUNT(ep, field) ((ep)->stats.field++)
+#define USB_GENERIC_HIGH_WATER(ep, level) do { if ((level) > (ep)->stats.ringHighWater) (ep)->stats.ringHighWater = (level); } while(0)
+#else
+#define USB_GENERIC_COUNT(ep, field) ((void)0)
+#define USB_GENERIC_HIGH_WATER(ep, level) ((void)0)
+#endif
+
 typedef struct USBEndpointInfo {
     void (*callback)(void);
     void* pma;
@@ -44,6 +95,9 @@ typedef struct USBEndpointInfo {
     uint8 tx:1; // 1 if TX, 0 if RX
     uint8 exclusive:1; // 1 if cannot use the same endpoint number for both rx and tx
     uint8 align:1; // 1 if next endpoint of the opposite type shares the same endpoint number as this
+#ifdef USB_GENERIC_STATS
+    USBEndpointStats stats;
+#endif
 } USBEndpointInfo;
 
 typedef struct USBCompositePart {
@@ -52,6 +106,10 @@ typedef struct USBCompositePart {
 	uint8 startInterface;
     uint16 descriptorSize;
     void (*getPartDescriptor)(uint8* out);
+    // optional, instead of getPartDescriptor: parts with repeated descriptors can generate them
+    // piecewise, descriptorSize/descriptorBlocks bytes at a time
+    uint8 descriptorBlocks;
+    void (*getPartDescriptorBlock)(uint8* out, unsigned block);
     void (*usbInit)(void);
     void (*usbReset)(void);
     void (*usbSetConfiguration)(void);
@@ -60,8 +118,40 @@ typedef struct USBCompositePart {
     RESULT (*usbDataSetup)(uint8 request, uint8 interface, uint8 requestType, uint8 wValue0, uint8 wValue1, uint16 wIndex, uint16 wLength );
     RESULT (*usbNoDataSetup)(uint8 request, uint8 interface, uint8 requestType, uint8 wValue0, uint8 wValue1, uint16 wIndex);
     USBEndpointInfo* endpoints;
+    // optional: Windows binds WinUSB to the part's first interface, which host programs find by this "{...}" GUID
+    const char* winUSBGUID;
 } USBCompositePart;
 
+#define USB_GENERIC_MAX_FRAME_CALLBACKS 4
+#define USB_GENERIC_DEFERRED_QUEUE_SIZE 16
+#define USB_GENERIC_MAX_WINUSB_FUNCTIONS 2
+#define USB_GENERIC_MS_VENDOR_CODE 0x4D // vendor request for the Microsoft OS 2.0 descriptors
+#define USB_GENERIC_MAX_ENDPOINTS 14 // seven endpoint numbers, each usable in both directions
+
+// where one endpoint's buffer ended up in packet memory
+typedef struct USBEndpointLayout {
+    uint8 part;
+    uint8 endpoint; // index in the part's endpoints array
+    uint8 address;
+    uint8 tx:1;
+    uint8 doubleBuffer:1;
+    uint16 offset; // PMA offset of the buffer
+    uint16 size; // bytes allocated
+    uint16 waste; // bytes allocated beyond pmaSize because of hardware block sizes
+} USBEndpointLayout;
+
+// filled in by usb_generic_set_parts(), whether it succeeds or not
+typedef struct USBPMALayout {
+    uint8 status; // USB_GENERIC_LAYOUT_STATUS
+    uint8 failedPart; // on failure: the part (and endpoint) that did not fit
+    uint8 failedEndpoint;
+    uint8 numEndpoints;
+    uint16 btableSize;
+    uint16 ep0Size; // per direction
+    uint16 used; // bytes needed in total, including the BTABLE and endpoint 0; may exceed PMA_MEMORY_SIZE on failure
+    USBEndpointLayout endpoints[USB_GENERIC_MAX_ENDPOINTS];
+} USBPMALayout;
+
 struct usb_chunk {
     uint32 dataLength;
     const uint8* data;
@@ -79,10 +169,12 @@ static inline void usb_generic_enable_tx(USBEndpointInfo* ep) {
 }
 
 static inline void usb_generic_stall_rx(USBEndpointInfo* ep) {
+    USB_GENERIC_COUNT(ep, stalls);
     usb_set_ep_rx_stat(ep->address, USB_EP_STAT_RX_STALL);
 }
 
 static inline void usb_generic_stall_tx(USBEndpointInfo* ep) {
+    USB_GENERIC_COUNT(ep, stalls);
     usb_set_ep_tx_stat(ep->address, USB_EP_STAT_TX_STALL);
 }
 
@@ -98,6 +190,16 @@ static inline void usb_generic_disable_tx(USBEndpointInfo* ep) {
     usb_set_ep_tx_stat(ep->address, USB_EP_STAT_TX_DISABLED);
 }
 
+// 1 while a packet is waiting to go out
+static inline uint8 usb_generic_tx_busy(USBEndpointInfo* ep) {
+    return (USB_BASE->EP[ep->address] & USB_EP_STAT_TX) == USB_EP_STAT_TX_VALID;
+}
+
+// 1 while the endpoint is ready for a packet that hasn't arrived yet
+static inline uint8 usb_generic_rx_waiting(USBEndpointInfo* ep) {
+    return (USB_BASE->EP[ep->address] & USB_EP_STAT_RX) == USB_EP_STAT_RX_VALID;
+}
+
 static inline void usb_generic_enable_rx_ep0(void) {
     usb_set_ep_rx_stat(USB_EP0, USB_EP_STAT_RX_VALID);
 }
@@ -130,12 +232,18 @@ static inline void usb_generic_set_tx(USBEndpointInfo* ep, uint32 length) {
 uint32 usb_generic_send_from_circular_buffer_double_buffered(USBEndpointInfo* ep, volatile uint8* buf, uint32 circularBufferSize, uint32 amount, volatile uint32* tailP);
 void usb_generic_set_disconnect_delay(uint32 delay);
 void usb_generic_set_info(uint16 idVendor, uint16 idProduct, const char* iManufacturer, const char* iProduct, const char* iSerialNumber);
+uint8 usb_generic_add_string(const char* string);
 uint8 usb_generic_set_parts(USBCompositePart** _parts, unsigned _numParts);
+const USBPMALayout* usb_generic_get_pma_layout(void);
+void usb_generic_set_ep0_size(uint8 size);
 void usb_generic_control_rx_setup(volatile void* buffer, uint16 length, volatile uint8* done);
 void usb_generic_control_tx_setup(volatile void* buffer, uint16 length, volatile uint8* done);
 void usb_generic_control_tx_chunk_setup(struct usb_chunk* chunk);
 void usb_generic_control_descriptor_tx(ONE_DESCRIPTOR* d);
 void usb_generic_disable(void);
+void usb_generic_disconnect(void); // usb_generic_disable() without clearing the parts, for callers that clear them
+uint8 usb_generic_reconfigure(USBCompositePart** _parts, unsigned _numParts);
+uint32 usb_generic_get_reconfigure_millis(void);
 void usb_generic_enable(void);
 void usb_copy_from_pma_ptr(volatile uint8 *buf, uint16 len, uint32* pma);
 void usb_copy_to_pma_ptr(volatile const uint8 *buf, uint16 len, uint32* pma);
@@ -144,7 +252,32 @@ uint32 usb_generic_read_to_circular_buffer(USBEndpointInfo* ep, volatile uint8*
 uint32 usb_generic_read_to_buffer(USBEndpointInfo* ep, volatile uint8* buf, uint32 bufferSize);
 uint32 usb_generic_send_from_circular_buffer(USBEndpointInfo* ep, volatile uint8* buf, uint32 bufferSize, uint32 head, volatile uint32* tailP, volatile int8* transmittingP);
 uint32 usb_generic_send_from_buffer(USBEndpointInfo* ep, volatile uint8* buf, uint32 amount);
+void usb_generic_start_tx(void (*txCallback)(void), volatile int8* transmittingP);
+uint32* usb_generic_tx_reserve(USBEndpointInfo* ep, uint32 len);
+void usb_generic_tx_commit(USBEndpointInfo* ep, uint32 len);
+uint32* usb_generic_rx_reserve(USBEndpointInfo* ep, uint32* lenP);
+void usb_generic_rx_commit(USBEndpointInfo* ep);
 uint16_t usb_generic_roundUpToPowerOf2(uint16_t x);
+uint8 usb_generic_add_frame_callback(void (*callback)(uint32 frame, void* data), void* data, uint16 period, uint16 phase);
+void usb_generic_remove_frame_callback(void (*callback)(uint32 frame, void* data), void* data);
+uint16 usb_generic_get_frame_number(void);
+uint32 usb_generic_get_frame_count(void);
+uint32 usb_generic_get_bus_micros(void);
+uint8 usb_generic_set_defer_mode(uint8 mode);
+uint8 usb_generic_get_defer_mode(void);
+void usb_generic_defer(void (*work)(void* data), void* data);
+void usb_generic_run_deferred(void);
+#ifdef USB_GENERIC_STATS
+#define USB_GENERIC_STATS_SERIALIZED_SIZE(numEndpoints) (2+(numEndpoints)*43)
+unsigned usb_generic_get_part_stats(USBCompositePart* part, USBEndpointStats* out, unsigned maxEndpoints);
+void usb_generic_reset_part_stats(USBCompositePart* part);
+uint32 usb_generic_serialize_part_stats(USBCompositePart* part, uint8* out, uint32 maxLength);
+#endif
+#ifdef USB_GENERIC_TRACE
+void usb_generic_trace(uint8 event, uint8 endpoint, uint16 length);
+uint32 usb_generic_trace_snapshot(usb_trace_entry* out, uint32 maxEntries, uint32* countP);
+void usb_generic_clear_trace(void);
+#endif
 
 #ifdef __cplusplus
 }
@@ -34,6 +34,7 @@
  */
 
 #include "usb_generic.h"
+#include "usb_ring.h"
 #include "usb_hid.h"
 #include <string.h>
 
@@ -68,7 +69,28 @@ static RESULT hidUSBNoDataSetup(uint8 request, uint8 interface, uint8 requestTyp
 static USBHIDOutputEndpointReceiver rxReceiver = NULL;
 static void* rxReceiverExtra = NULL;
 static volatile HIDBuffer_t hidBuffers[MAX_HID_BUFFERS] = {{ 0 }};
+#if MAX_HID_BUFFERS > 32
+#error "MAX_HID_BUFFERS can be at most 32"
+#endif
+/* 
+ * Direct-mapped lookup by output/feature and reportID: each entry is 1 + the index
+ * of the only buffer whose report ID maps there, 0 if there is none, or
+ * LOOKUP_SHARED if there are several and they have to be searched.
+ */
+#define LOOKUP_SHARED 0xFF
+static uint8 hidBufferLookup[2][HID_BUFFER_LOOKUP_SIZE];
+/* buffers that have had a SET_REPORT since they were last read */
+static volatile uint32 hidBuffersUnread = 0;
 static volatile uint8* hidBufferRx = NULL;
+static volatile uint8* rxQueue = NULL;
+static uint32 rxQueueSlots;
+// head and tail count modulo 2*rxQueueSlots, so that a full queue can be told from an empty one
+static volatile uint32 rxQueueHead; // written only by the interrupt
+static volatile uint32 rxQueueTail; // written only by the reader
+static volatile uint8 rxQueueFull; // the endpoint is left NAKing until a slot is freed
+static HIDMailbox_t* mailboxes = NULL;
+static HIDMailbox_t* nextMailbox = NULL; // where the round-robin search starts
+static uint8 mailboxTurn = 0;
 
 #define HID_INTERFACE_OFFSET 	0x00
 #define HID_INTERFACE_NUMBER (HID_INTERFACE_OFFSET+usbHIDPart.startInterface)
@@ -93,6 +115,7 @@ typedef struct {
     usb_descriptor_endpoint      	HIDDataInEndpoint;
     usb_descriptor_endpoint      	HIDDataOutEndpoint;
 } __packed hid_part_config;
+USB_GENERIC_CHECK_DESCRIPTOR_SIZE(hid_part_config);
 
 static const hid_part_config hidPartConfigData = {
 	.HID_Interface = {
@@ -210,6 +233,7 @@ USBCompositePart usbHIDPart = {
 };
 
 void usb_hid_setDedicatedRXEndpoint(void* buffer, uint16_t size, USBHIDOutputEndpointReceiver receiver, void* extra) {
+    rxQueue = NULL;
     if (buffer != NULL) {
         numEndpoints = 2;
         usbHIDPart.descriptorSize = SIZE_hidPartConfigData_TWO_ENDPOINTS;
@@ -229,22 +253,103 @@ void usb_hid_setDedicatedRXEndpoint(void* buffer, uint16_t size, USBHIDOutputEnd
 }
 
 
+/*
+ * Queued mode: instead of one buffer handed to a receiver in the interrupt,
+ * OUT packets go into a queue of numSlots packets, which the program takes out
+ * with usb_hid_rx_packet(). While the queue is full, the endpoint NAKs, so
+ * the host holds off rather than data being lost. buffer must hold
+ * HID_RX_QUEUE_BUFFER_SIZE(packetSize, numSlots) bytes, and packetSize can be
+ * at most 64.
+ */
+void usb_hid_setDedicatedRXQueue(void* buffer, uint16_t packetSize, uint32_t numSlots) {
+    if (buffer == NULL || numSlots == 0) {
+        usb_hid_setDedicatedRXEndpoint(NULL, 0, NULL, NULL);
+        return;
+    }
+    usb_hid_setDedicatedRXEndpoint(buffer, packetSize, NULL, NULL);
+    rxQueueSlots = numSlots;
+    rxQueueHead = 0;
+    rxQueueTail = 0;
+    rxQueueFull = 0;
+    rxQueue = buffer;
+}
+
+#define RX_QUEUE_SLOT(i) (rxQueue + ((i) < rxQueueSlots ? (i) : (i) - rxQueueSlots) * HID_RX_QUEUE_SLOT_SIZE(rxEPSize))
+#define RX_QUEUE_LENGTH(slot) ((slot)[HID_RX_QUEUE_SLOT_SIZE(rxEPSize)-4])
+
+static inline uint32 rx_queue_next(uint32 i) {
+    return i + 1 < 2 * rxQueueSlots ? i + 1 : 0;
+}
+
+static inline uint32 rx_queue_count(uint32 head, uint32 tail) {
+    return head >= tail ? head - tail : head + 2 * rxQueueSlots - tail;
+}
+
+uint32 usb_hid_rx_packets_available(void) {
+    if (rxQueue == NULL)
+        return 0;
+    return rx_queue_count(rxQueueHead, rxQueueTail);
+}
+
+/* copies the oldest packet into buf, cut off at len bytes, and returns its length, or 0 if none is queued */
+uint32 usb_hid_rx_packet(uint8* buf, uint32 len) {
+    uint32 tail = rxQueueTail;
+    
+    if (rxQueue == NULL || tail == rxQueueHead)
+        return 0;
+    
+    volatile uint8* slot = RX_QUEUE_SLOT(tail);
+    uint32 n = RX_QUEUE_LENGTH(slot);
+    if (n > len)
+        n = len;
+    memcpy(buf, (uint8*)slot, n);
+    usb_ring_barrier(); // finish reading before the slot is given back
+    rxQueueTail = rx_queue_next(tail);
+    
+    // the interrupt doesn't come again while the endpoint NAKs, so there is no race here
+    if (rxQueueFull) {
+        rxQueueFull = 0;
+        usb_generic_enable_rx(USB_HID_RX_ENDPOINT_INFO);
+    }
+    return n;
+}
+
 #define HID_TX_BUFFER_SIZE	256 // must be power of 2
-#define HID_TX_BUFFER_SIZE_MASK (HID_TX_BUFFER_SIZE-1)
 // Tx data
-static volatile uint8 hidBufferTx[HID_TX_BUFFER_SIZE];
-// Write index to hidBufferTx
-static volatile uint32 hid_tx_head = 0;
-// Read index from hidBufferTx
-static volatile uint32 hid_tx_tail = 0;
+USB_RING(hidTx, HID_TX_BUFFER_SIZE);
 
 void usb_hid_set_report_descriptor(struct usb_chunk* chunks) {
     reportDescriptorChunks = chunks;
 }
 
     
+// built aside and then copied, so that a lookup from the interrupt meanwhile sees each entry either old or new
+static void update_buffer_lookup(void) {
+    uint8 lookup[2][HID_BUFFER_LOOKUP_SIZE];
+    memset(lookup, 0, sizeof lookup);
+    for (int i=0; i<MAX_HID_BUFFERS; i++) {
+        if (hidBuffers[i].buffer != NULL) {
+            uint8* entry = &lookup[( hidBuffers[i].mode & HID_BUFFER_MODE_OUTPUT ) != 0][hidBuffers[i].reportID & (HID_BUFFER_LOOKUP_SIZE-1)];
+            *entry = *entry == 0 ? i+1 : LOOKUP_SHARED;
+        }
+    }
+    memcpy(hidBufferLookup, lookup, sizeof lookup);
+}
+    
 static volatile HIDBuffer_t* usb_hid_find_buffer(uint8 type, uint8 reportID) {
     uint8 typeTest = type == HID_REPORT_TYPE_OUTPUT ? HID_BUFFER_MODE_OUTPUT : 0;
+    uint8 entry = hidBufferLookup[typeTest != 0][reportID & (HID_BUFFER_LOOKUP_SIZE-1)];
+    
+    if (entry == 0)
+        return NULL;
+    
+    if (entry != LOOKUP_SHARED) {
+        volatile HIDBuffer_t* buffer = hidBuffers + entry - 1;
+        if (buffer->buffer != NULL && ( buffer->mode & HID_BUFFER_MODE_OUTPUT ) == typeTest && buffer->reportID == reportID)
+            return buffer;
+        return NULL;
+    }
+    
     for (int i=0; i<MAX_HID_BUFFERS; i++) {
         if ( hidBuffers[i].buffer != NULL &&
              ( hidBuffers[i].mode & HID_BUFFER_MODE_OUTPUT ) == typeTest && 
@@ -264,15 +369,20 @@ void usb_hid_set_feature(uint8 reportID, uint8* data) {
         if (reportID)
             buffer->buffer[0] = reportID;
         buffer->state = HID_BUFFER_READ;
+        hidBuffersUnread &= ~(1ul << (buffer - hidBuffers));
         usb_generic_enable_rx_ep0();
         return;
     }
 }
 
 static uint8 have_unread_data_in_hid_buffer() {
-    for (int i=0;i<MAX_HID_BUFFERS; i++) {
+    // only the buffers that have had a SET_REPORT need checking, as the data stage may still be under way
+    uint32 unread = hidBuffersUnread;
+    while (unread) {
+        int i = __builtin_ctz(unread);
         if (hidBuffers[i].buffer != NULL && hidBuffers[i].state == HID_BUFFER_UNREAD)
             return 1;
+        unread &= unread - 1;
     }
     return 0;
 }
@@ -296,6 +406,7 @@ uint16_t usb_hid_get_data(uint8 type, uint8 reportID, uint8* out, uint8 poll) {
         
         if (poll) {
             buffer->state = HID_BUFFER_READ;
+            hidBuffersUnread &= ~(1ul << (buffer - hidBuffers));
         }
 
         ret = buffer->bufferSize-delta;
@@ -315,8 +426,10 @@ void usb_hid_clear_buffers(uint8 type) {
     for (int i=0; i<MAX_HID_BUFFERS; i++) {
         if (( hidBuffers[i].mode & HID_BUFFER_MODE_OUTPUT ) == typeTest) {
             hidBuffers[i].buffer = NULL;
+            hidBuffersUnread &= ~(1ul << i);
         }
     }
+    update_buffer_lookup();
 }
 
 static void usb_hid_clear(void) {
@@ -338,12 +451,15 @@ uint8 usb_hid_add_buffer(uint8 type, volatile HIDBuffer_t* buf) {
 
     if (buffer != NULL) {
         *buffer = *buf;
+        hidBuffersUnread &= ~(1ul << (buffer - hidBuffers));
         return 1;
     }
     else {
         for (int i=0; i<MAX_HID_BUFFERS; i++) {
             if (hidBuffers[i].buffer == NULL) {
                 hidBuffers[i] = *buf;
+                hidBuffersUnread &= ~(1ul << i);
+                update_buffer_lookup();
                 return 1;
             }
         }
@@ -369,28 +485,26 @@ uint32 usb_hid_tx(const uint8* buf, uint32 len)
 {
 	if (len==0) return 0; // no data to send
 
-	uint32 head = hid_tx_head; // load volatile variable
-	uint32 tx_unsent = (head - hid_tx_tail) & HID_TX_BUFFER_SIZE_MASK;
+    // nothing queued or in flight, so skip the ring buffer and go straight to packet memory; the interrupt is
+    // masked so that a mailbox or the completion callback can't claim the buffer between the check and the commit
+    usb_generic_disable_interrupts_ep0();
+    if (transmitting < 0 && usb_ring_available(&hidTx) == 0) {
+        uint32* pma = usb_generic_tx_reserve(USB_HID_TX_ENDPOINT_INFO, len);
+        if (pma != NULL) {
+            usb_copy_to_pma_ptr(buf, len, pma);
+            transmitting = 1;
+            usb_generic_tx_commit(USB_HID_TX_ENDPOINT_INFO, len);
+            usb_generic_enable_interrupts_ep0();
+            return len;
+        }
+    }
+    usb_generic_enable_interrupts_ep0();
 
     // We can only put bytes in the buffer if there is place
-    if (len > (HID_TX_BUFFER_SIZE-tx_unsent-1) ) {
-        len = (HID_TX_BUFFER_SIZE-tx_unsent-1);
-    }
+    len = usb_ring_push(&hidTx, buf, len);
 	if (len==0) return 0; // buffer full
 
-	uint16 i;
-	// copy data from user buffer to USB Tx buffer
-	for (i=0; i<len; i++) {
-		hidBufferTx[head] = buf[i];
-		head = (head+1) & HID_TX_BUFFER_SIZE_MASK;
-	}
-	hid_tx_head = head; // store volatile variable
-
-	while(transmitting >= 0);
-	
-	if (transmitting<0) {
-		hidDataTxCb(); // initiate data transmission
-	}
+	usb_generic_start_tx(hidDataTxCb, &transmitting);
 
     return len;
 }
@@ -398,39 +512,171 @@ uint32 usb_hid_tx(const uint8* buf, uint32 len)
 
 
 uint32 usb_hid_get_pending(void) {
-    return (hid_tx_head - hid_tx_tail) & HID_TX_BUFFER_SIZE_MASK;
+    return usb_ring_available(&hidTx);
+}
+
+static uint8 have_dirty_mailbox(void) {
+    for (HIDMailbox_t* m = mailboxes; m != NULL; m = m->next)
+        if (m->dirty)
+            return 1;
+    return 0;
+}
+
+/* 1 until everything queued has been taken by the host */
+uint8 usb_hid_is_transmitting(void) {
+    return transmitting >= 0 || usb_ring_available(&hidTx) > 0 || have_dirty_mailbox();
+}
+
+/*
+ * Mailboxes: a reporter with a mailbox keeps only its newest report instead
+ * of queuing every one, and the IN endpoint sends the dirty mailboxes
+ * round-robin as the host polls, so no report is more than a poll interval
+ * old however often it is updated. Queued reports and mailboxes take turns.
+ */
+
+void usb_hid_add_mailbox(HIDMailbox_t* mailbox) {
+    usb_generic_disable_interrupts_ep0();
+    HIDMailbox_t** p = &mailboxes;
+    while (*p != NULL && *p != mailbox)
+        p = &(*p)->next;
+    if (*p == NULL) {
+        mailbox->dirty = 0;
+        mailbox->next = NULL;
+        *p = mailbox;
+    }
+    if (nextMailbox == NULL)
+        nextMailbox = mailboxes;
+    usb_generic_enable_interrupts_ep0();
+}
+
+void usb_hid_remove_mailbox(HIDMailbox_t* mailbox) {
+    usb_generic_disable_interrupts_ep0();
+    for (HIDMailbox_t** p = &mailboxes; *p != NULL; p = &(*p)->next) {
+        if (*p == mailbox) {
+            *p = mailbox->next;
+            break;
+        }
+    }
+    if (nextMailbox == mailbox)
+        nextMailbox = mailbox->next != NULL ? mailbox->next : mailboxes;
+    mailbox->dirty = 0;
+    usb_generic_enable_interrupts_ep0();
+}
+
+/* overwrites the mailbox with report; returns 0 if the report doesn't fit in a packet */
+uint8 usb_hid_post_mailbox(HIDMailbox_t* mailbox, const uint8* report) {
+    if (mailbox->length == 0 || mailbox->length > txEPSize)
+        return 0;
+    usb_generic_disable_interrupts_ep0();
+    memcpy((uint8*)mailbox->slot, report, mailbox->length);
+    mailbox->dirty = 1;
+    if (transmitting < 0)
+        hidDataTxCb();
+    usb_generic_enable_interrupts_ep0();
+    return 1;
+}
+
+// sends the next dirty mailbox, if any
+static uint8 hidSendMailbox(void) {
+    HIDMailbox_t* m = nextMailbox;
+    if (m == NULL)
+        return 0;
+    do {
+        HIDMailbox_t* after = m->next != NULL ? m->next : mailboxes;
+        if (m->dirty) {
+            uint32* pma = usb_generic_tx_reserve(USB_HID_TX_ENDPOINT_INFO, m->length);
+            if (pma == NULL)
+                return 0;
+            usb_copy_to_pma_ptr((const uint8*)m->slot, m->length, pma);
+            m->dirty = 0;
+            nextMailbox = after;
+            transmitting = 0; // a whole report, so no flush is needed
+            usb_generic_tx_commit(USB_HID_TX_ENDPOINT_INFO, m->length);
+            return 1;
+        }
+        m = after;
+    } while (m != nextMailbox);
+    return 0;
+}
+
+static void (*txDoneCallback)(void) = NULL;
+
+/* called from the USB interrupt whenever everything queued has been taken */
+void usb_hid_set_tx_done_callback(void (*callback)(void)) {
+    txDoneCallback = callback;
 }
 
 
 static void hidDataTxCb(void)
 {
+    int8 wasTransmitting = transmitting;
+    
+    if (mailboxTurn || usb_ring_available(&hidTx) == 0) {
+        mailboxTurn = 0;
+        if (hidSendMailbox())
+            return;
+    }
+    else if (mailboxes != NULL) {
+        mailboxTurn = 1;
+    }
+    
     usb_generic_send_from_circular_buffer(USB_HID_TX_ENDPOINT_INFO, 
-        hidBufferTx, HID_TX_BUFFER_SIZE, hid_tx_head, &hid_tx_tail, &transmitting);
+        hidTx.buf, hidTx.size, hidTx.head, &hidTx.tail, &transmitting);
+    
+    if (wasTransmitting >= 0 && transmitting < 0 && txDoneCallback != NULL)
+        txDoneCallback();
+}
+
+static uint32 rxLength;
+
+// the endpoint stays NAKing until the receiver has had the packet
+static void hidDeliverRx(void* unused) {
+    (void)unused;
+    if (rxLength > 0 && rxReceiver != NULL)
+        rxReceiver(rxReceiverExtra, hidBufferRx, rxLength);
+    usb_generic_enable_rx(USB_HID_RX_ENDPOINT_INFO);
 }
 
 static void hidDataRxCb(void)
 {
     USBEndpointInfo* ep = USB_HID_RX_ENDPOINT_INFO; 
     
-    if (hidBufferRx != NULL) {
-        uint32 didRead = usb_generic_read_to_buffer(ep, hidBufferRx, rxEPSize);
-
-        if (didRead > 0) {
-            if (rxReceiver != NULL)
-                rxReceiver(rxReceiverExtra, hidBufferRx, didRead);
-        }
+    if (rxQueue != NULL) {
+        uint32 head = rxQueueHead;
+        volatile uint8* slot = RX_QUEUE_SLOT(head);
+        RX_QUEUE_LENGTH(slot) = usb_generic_read_to_buffer(ep, slot, rxEPSize);
+        usb_ring_barrier(); // packet before index
+        head = rx_queue_next(head);
+        rxQueueHead = head;
+        if (rx_queue_count(head, rxQueueTail) < rxQueueSlots)
+            usb_generic_enable_rx(ep);
+        else
+            rxQueueFull = 1;
+    }
+    else if (hidBufferRx != NULL) {
+        rxLength = usb_generic_read_to_buffer(ep, hidBufferRx, rxEPSize);
+        usb_generic_defer(hidDeliverRx, NULL);
+    }
+    else {
+        usb_generic_enable_rx(ep);
     }
-    
-    usb_generic_enable_rx(ep);
 }
 
 
 
 static void hidUSBReset(void) {
     /* Reset the RX/TX state */
-	hid_tx_head = 0;
-	hid_tx_tail = 0;
+    usb_ring_clear(&hidTx);
     transmitting = -1;
+    // the reset has made the RX endpoint VALID, but a full queue has to keep it NAKing
+    rxQueueFull = 0;
+    if (rxQueue != NULL && rx_queue_count(rxQueueHead, rxQueueTail) >= rxQueueSlots) {
+        rxQueueFull = 1;
+        usb_generic_pause_rx(USB_HID_RX_ENDPOINT_INFO);
+    }
+    mailboxTurn = 0;
+    for (HIDMailbox_t* m = mailboxes; m != NULL; m = m->next)
+        m->dirty = 0;
 }
 
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -453,6 +699,7 @@ static RESULT hidUSBDataSetup(uint8 request, uint8 interface, uint8 requestType,
 				else 
 				{
                     buffer->state = HID_BUFFER_EMPTY;
+                    hidBuffersUnread |= 1ul << (buffer - hidBuffers);
                     usb_generic_control_rx_setup(buffer->buffer, buffer->bufferSize, &(buffer->state));
 				}
                 return USB_SUCCESS;
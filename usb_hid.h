@@ -38,7 +38,10 @@
 #include <libmaple/usb.h>
 #include "usb_generic.h"
 
-#define MAX_HID_BUFFERS 8
+#ifndef MAX_HID_BUFFERS
+#define MAX_HID_BUFFERS 8 // feature and output buffers together; at most 32
+#endif
+#define HID_BUFFER_LOOKUP_SIZE 32 // power of 2; buffers are looked up by report ID modulo this
 #define HID_BUFFER_SIZE(n,reportID) ((n)+((reportID)!=0))
 #define HID_BUFFER_ALLOCATE_SIZE(n,reportID) ((HID_BUFFER_SIZE((n),(reportID))+1)/2*2)
 
@@ -53,6 +56,10 @@ extern USBCompositePart usbHIDPart;
 
 typedef void (*USBHIDOutputEndpointReceiver)(void* extra, volatile void* buffer, uint16_t size);
 
+/* each queue slot holds a packet and its length, padded so that packets stay word-aligned */
+#define HID_RX_QUEUE_SLOT_SIZE(packetSize) (((packetSize)+3)/4*4+4)
+#define HID_RX_QUEUE_BUFFER_SIZE(packetSize, numSlots) ((numSlots)*HID_RX_QUEUE_SLOT_SIZE(packetSize))
+
 typedef struct HIDBuffer_t {
     volatile uint8_t* buffer; // use HID_BUFFER_ALLOCATE_SIZE() to calculate amount of memory to allocate                            
     uint16_t bufferSize; // this should match HID_BUFFER_SIZE
@@ -69,6 +76,14 @@ typedef struct HIDBuffer_t {
 #endif
 } HIDBuffer_t;
 
+/* latest-state slot for a report that is sent by the IN endpoint instead of being queued */
+typedef struct HIDMailbox_t {
+    volatile uint8_t* slot; // the newest report, length bytes
+    uint16_t length;
+    volatile uint8_t dirty; // slot has not been sent yet
+    struct HIDMailbox_t* next;
+} HIDMailbox_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -81,7 +96,15 @@ uint16_t usb_hid_get_data(uint8_t type, uint8_t reportID, uint8_t* out, uint8_t
 void usb_hid_set_feature(uint8_t reportID, uint8_t* data);
 void usb_hid_setTXEPSize(uint32_t size); 
 uint32 usb_hid_get_pending(void);
+uint8 usb_hid_is_transmitting(void);
+void usb_hid_set_tx_done_callback(void (*callback)(void));
 void usb_hid_setDedicatedRXEndpoint(void* buffer, uint16_t size, USBHIDOutputEndpointReceiver receiver, void* extra);
+void usb_hid_setDedicatedRXQueue(void* buffer, uint16_t packetSize, uint32_t numSlots);
+uint32 usb_hid_rx_packet(uint8* buf, uint32 len);
+uint32 usb_hid_rx_packets_available(void);
+void usb_hid_add_mailbox(HIDMailbox_t* mailbox);
+void usb_hid_remove_mailbox(HIDMailbox_t* mailbox);
+uint8 usb_hid_post_mailbox(HIDMailbox_t* mailbox, const uint8* report);
 void usb_hid_setTXInterval(uint8_t t);
 void usb_hid_setRXInterval(uint8_t t);
 
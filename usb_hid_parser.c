@@ -0,0 +1,394 @@
+#include "usb_hid_parser.h"
+#include "usb_hid.h"
+#include <string.h>
+
+/*
+ * Items are read a byte at a time through a chunk list, so that a reporter's
+ * descriptor can be parsed with its report ID patched in, the way the host
+ * sees it.
+ */
+
+#define ITEM_MASK 0xFC // tag and type, without the size
+
+#define ITEM_INPUT 0x80
+#define ITEM_OUTPUT 0x90
+#define ITEM_FEATURE 0xB0
+#define ITEM_COLLECTION 0xA0
+#define ITEM_END_COLLECTION 0xC0
+
+#define ITEM_USAGE_PAGE 0x04
+#define ITEM_LOGICAL_MINIMUM 0x14
+#define ITEM_LOGICAL_MAXIMUM 0x24
+#define ITEM_REPORT_SIZE 0x74
+#define ITEM_REPORT_ID 0x84
+#define ITEM_REPORT_COUNT 0x94
+#define ITEM_PUSH 0xA4
+#define ITEM_POP 0xB4
+
+#define ITEM_USAGE 0x08
+#define ITEM_USAGE_MINIMUM 0x18
+#define ITEM_USAGE_MAXIMUM 0x28
+
+#define LONG_ITEM 0xFE
+
+#define MAX_COLLECTION_DEPTH 16
+
+typedef struct {
+    uint16 usagePage;
+    uint8 reportID;
+    uint8 logicalMaxSize; // bytes, so that the maximum can be read as unsigned when the minimum isn't negative
+    int32 logicalMin;
+    int32 logicalMax;
+    uint32 reportSize;
+    uint32 reportCount;
+} hid_globals;
+
+typedef struct {
+    uint32 min; // usage page in the top 16 bits
+    uint32 max;
+} hid_usage_range;
+
+typedef struct {
+    struct usb_chunk* chunk;
+    uint32 pos;
+} chunk_reader;
+
+static int read_byte(chunk_reader* r) {
+    while (r->chunk != NULL && r->pos >= r->chunk->dataLength) {
+        r->chunk = r->chunk->next;
+        r->pos = 0;
+    }
+    if (r->chunk == NULL)
+        return -1;
+    return r->chunk->data[r->pos++];
+}
+
+uint32 usb_hid_item_length(const uint8* d, uint32 remaining) {
+    uint32 length;
+
+    if (remaining == 0)
+        return 0;
+    if (d[0] == LONG_ITEM) {
+        if (remaining < 2)
+            return 0;
+        length = 3 + d[1];
+    }
+    else {
+        length = (d[0] & 3) == 3 ? 5 : 1 + (d[0] & 3);
+    }
+    return length <= remaining ? length : 0;
+}
+
+int32 usb_hid_find_report_id(const uint8* descriptor, uint32 length) {
+    uint32 i = 0;
+
+    while (i < length) {
+        uint32 n = usb_hid_item_length(descriptor+i, length-i);
+        if (n == 0)
+            break;
+        if (descriptor[i] == (ITEM_REPORT_ID | 1))
+            return i+1;
+        i += n;
+    }
+    return -1;
+}
+
+static HIDReportInfo_t* add_report(HIDLayout_t* layout, uint8 reportID, uint8 type) {
+    for (uint32 i=0; i<layout->numReports; i++)
+        if (layout->reports[i].reportID == reportID && layout->reports[i].type == type)
+            return layout->reports+i;
+    if (layout->numReports >= layout->maxReports)
+        return NULL;
+    HIDReportInfo_t* r = layout->reports + layout->numReports++;
+    r->reportID = reportID;
+    r->type = type;
+    r->size = 0;
+    r->bits = 0;
+    return r;
+}
+
+static HIDField_t* add_field(HIDLayout_t* layout, HIDReportInfo_t* report, const hid_globals* g, uint8 flags, uint32 bitOffset, uint32 count, uint32 usageMin, uint32 usageMax) {
+    if (layout->numFields >= layout->maxFields)
+        return NULL;
+    HIDField_t* f = layout->fields + layout->numFields++;
+    f->report = report - layout->reports;
+    f->flags = flags;
+    f->bitSize = g->reportSize;
+    f->count = count;
+    f->bitOffset = bitOffset;
+    f->usagePage = usageMin >> 16;
+    f->usageMin = (uint16)usageMin;
+    f->usageMax = (uint16)usageMax;
+    f->logicalMin = g->logicalMin;
+    f->logicalMax = g->logicalMax;
+    if (g->logicalMin >= 0 && g->logicalMax < 0 && g->logicalMaxSize < 4)
+        f->logicalMax = g->logicalMax & ((1ul << (8*g->logicalMaxSize)) - 1);
+    return f;
+}
+
+// usage of element i: the usages and ranges in order, with the last one repeated for any elements left over
+static uint32 usage_at(const hid_usage_range* usages, uint32 numUsages, uint32 i) {
+    for (uint32 j=0; j<numUsages; j++) {
+        uint32 n = usages[j].max - usages[j].min + 1;
+        if (i < n)
+            return usages[j].min + i;
+        i -= n;
+    }
+    return numUsages > 0 ? usages[numUsages-1].max : 0;
+}
+
+static uint8 add_main_item(HIDLayout_t* layout, const hid_globals* g, uint8 type, uint8 flags, const hid_usage_range* usages, uint32 numUsages) {
+    HIDReportInfo_t* report = add_report(layout, g->reportID, type);
+    if (report == NULL)
+        return HID_PARSE_TOO_MANY_REPORTS;
+
+    uint32 offset = report->bits;
+    uint32 bits = g->reportSize * g->reportCount;
+    if (g->reportSize > 0xFFFF || g->reportCount > 0xFFFF || offset + bits > 0xFFFF)
+        return HID_PARSE_BAD_ITEM;
+    report->bits = offset + bits;
+
+    if ((flags & HID_FIELD_CONSTANT) || bits == 0)
+        return HID_PARSE_OK;
+
+    if (! (flags & HID_FIELD_VARIABLE)) {
+        uint32 min = numUsages > 0 ? usages[0].min : 0;
+        uint32 max = numUsages > 0 ? usages[numUsages-1].max : 0;
+        if (add_field(layout, report, g, flags, offset, g->reportCount, min, max) == NULL)
+            return HID_PARSE_TOO_MANY_FIELDS;
+        return HID_PARSE_OK;
+    }
+
+    // split the elements into runs of consecutive usages, each possibly followed by repeats of its last usage
+    uint32 i = 0;
+    while (i < g->reportCount) {
+        uint32 min = usage_at(usages, numUsages, i);
+        uint32 max = min;
+        uint32 j = i + 1;
+        uint8 repeating = 0;
+        while (j < g->reportCount) {
+            uint32 u = usage_at(usages, numUsages, j);
+            if (u == max)
+                repeating = 1;
+            else if (u == max + 1 && ! repeating && (u >> 16) == (min >> 16))
+                max = u;
+            else
+                break;
+            j++;
+        }
+        if (add_field(layout, report, g, flags, offset + i * g->reportSize, j - i, min, max) == NULL)
+            return HID_PARSE_TOO_MANY_FIELDS;
+        i = j;
+    }
+    return HID_PARSE_OK;
+}
+
+uint8 usb_hid_parse_report_chunks(struct usb_chunk* chunks, HIDLayout_t* layout) {
+    chunk_reader r = { chunks, 0 };
+    hid_globals g;
+    hid_globals stack[HID_PARSE_MAX_PUSH];
+    uint32 stackDepth = 0;
+    uint32 collectionDepth = 0;
+    hid_usage_range usages[HID_PARSE_MAX_USAGE_RANGES];
+    uint32 numUsages = 0;
+    uint32 usageMin = 0;
+    uint8 haveUsageMin = 0;
+
+    memset(&g, 0, sizeof g);
+    layout->numReports = 0;
+    layout->numFields = 0;
+
+    int b;
+    while ((b = read_byte(&r)) >= 0) {
+        if (b == LONG_ITEM) {
+            int size = read_byte(&r);
+            if (size < 0 || read_byte(&r) < 0)
+                return HID_PARSE_TRUNCATED;
+            while (size-- > 0)
+                if (read_byte(&r) < 0)
+                    return HID_PARSE_TRUNCATED;
+            continue;
+        }
+
+        uint32 size = (b & 3) == 3 ? 4 : (b & 3);
+        uint32 value = 0;
+        for (uint32 i=0; i<size; i++) {
+            int d = read_byte(&r);
+            if (d < 0)
+                return HID_PARSE_TRUNCATED;
+            value |= (uint32)d << (8*i);
+        }
+        int32 signedValue = value;
+        if (size > 0 && size < 4 && (value & (1ul << (8*size-1))))
+            signedValue = value - (1l << (8*size));
+
+        uint8 result = HID_PARSE_OK;
+        uint8 clearLocals = 0;
+
+        switch (b & ITEM_MASK) {
+            case ITEM_INPUT:
+                result = add_main_item(layout, &g, HID_REPORT_TYPE_INPUT, value, usages, numUsages);
+                clearLocals = 1;
+                break;
+            case ITEM_OUTPUT:
+                result = add_main_item(layout, &g, HID_REPORT_TYPE_OUTPUT, value, usages, numUsages);
+                clearLocals = 1;
+                break;
+            case ITEM_FEATURE:
+                result = add_main_item(layout, &g, HID_REPORT_TYPE_FEATURE, value, usages, numUsages);
+                clearLocals = 1;
+                break;
+            case ITEM_COLLECTION:
+                if (++collectionDepth > MAX_COLLECTION_DEPTH)
+                    return HID_PARSE_BAD_NESTING;
+                clearLocals = 1;
+                break;
+            case ITEM_END_COLLECTION:
+                if (collectionDepth == 0)
+                    return HID_PARSE_BAD_NESTING;
+                collectionDepth--;
+                clearLocals = 1;
+                break;
+
+            case ITEM_USAGE_PAGE:
+                g.usagePage = value;
+                break;
+            case ITEM_LOGICAL_MINIMUM:
+                g.logicalMin = signedValue;
+                break;
+            case ITEM_LOGICAL_MAXIMUM:
+                g.logicalMax = signedValue;
+                g.logicalMaxSize = size;
+                break;
+            case ITEM_REPORT_SIZE:
+                g.reportSize = value;
+                break;
+            case ITEM_REPORT_ID:
+                g.reportID = value;
+                break;
+            case ITEM_REPORT_COUNT:
+                g.reportCount = value;
+                break;
+            case ITEM_PUSH:
+                if (stackDepth >= HID_PARSE_MAX_PUSH)
+                    return HID_PARSE_BAD_NESTING;
+                stack[stackDepth++] = g;
+                break;
+            case ITEM_POP:
+                if (stackDepth == 0)
+                    return HID_PARSE_BAD_NESTING;
+                g = stack[--stackDepth];
+                break;
+
+            case ITEM_USAGE:
+            case ITEM_USAGE_MINIMUM:
+            case ITEM_USAGE_MAXIMUM:
+                if (size < 4)
+                    value |= (uint32)g.usagePage << 16;
+                if ((b & ITEM_MASK) == ITEM_USAGE_MINIMUM) {
+                    usageMin = value;
+                    haveUsageMin = 1;
+                    break;
+                }
+                if (numUsages >= HID_PARSE_MAX_USAGE_RANGES)
+                    return HID_PARSE_BAD_ITEM;
+                if ((b & ITEM_MASK) == ITEM_USAGE_MAXIMUM) {
+                    if (! haveUsageMin || value < usageMin)
+                        return HID_PARSE_BAD_ITEM;
+                    usages[numUsages].min = usageMin;
+                    haveUsageMin = 0;
+                }
+                else {
+                    usages[numUsages].min = value;
+                }
+                usages[numUsages++].max = value;
+                break;
+        }
+
+        if (result != HID_PARSE_OK)
+            return result;
+        if (clearLocals) {
+            numUsages = 0;
+            haveUsageMin = 0;
+        }
+    }
+
+    if (collectionDepth != 0)
+        return HID_PARSE_BAD_NESTING;
+
+    for (uint32 i=0; i<layout->numReports; i++)
+        layout->reports[i].size = (layout->reports[i].bits + 7) / 8;
+
+    return HID_PARSE_OK;
+}
+
+uint8 usb_hid_parse_report_descriptor(const uint8* descriptor, uint32 length, HIDLayout_t* layout) {
+    struct usb_chunk chunk = { length, descriptor, NULL };
+    return usb_hid_parse_report_chunks(&chunk, layout);
+}
+
+const HIDReportInfo_t* usb_hid_find_report(const HIDLayout_t* layout, uint8 reportID, uint8 type) {
+    for (uint32 i=0; i<layout->numReports; i++)
+        if (layout->reports[i].reportID == reportID && layout->reports[i].type == type)
+            return layout->reports+i;
+    return NULL;
+}
+
+const HIDField_t* usb_hid_find_field(const HIDLayout_t* layout, uint8 reportID, uint8 type, uint16 usagePage, uint16 usage, uint16* index) {
+    for (uint32 i=0; i<layout->numFields; i++) {
+        const HIDField_t* f = layout->fields+i;
+        const HIDReportInfo_t* r = layout->reports + f->report;
+        if (r->reportID != reportID || r->type != type || f->usagePage != usagePage ||
+            usage < f->usageMin || usage > f->usageMax)
+            continue;
+        if (index != NULL)
+            *index = (f->flags & HID_FIELD_VARIABLE) ? usage - f->usageMin : 0;
+        return f;
+    }
+    return NULL;
+}
+
+uint8 usb_hid_set_field(uint8* report, const HIDField_t* field, uint16 index, int32 value) {
+    if (index >= field->count || field->bitSize > 32 || field->bitSize == 0)
+        return 0;
+    // a field with a null state takes anything outside its range to mean "no value"
+    if (field->logicalMin <= field->logicalMax && (value < field->logicalMin || value > field->logicalMax) &&
+            ! (field->flags & HID_FIELD_NULL_STATE))
+        return 0;
+
+    uint32 bit = field->bitOffset + index * field->bitSize;
+    uint32 v = value;
+    uint32 left = field->bitSize;
+
+    while (left > 0) {
+        uint32 shift = bit & 7;
+        uint32 n = 8 - shift < left ? 8 - shift : left;
+        uint8 mask = ((1u << n) - 1) << shift;
+        report[bit >> 3] = (report[bit >> 3] & ~mask) | ((v << shift) & mask);
+        v >>= n;
+        bit += n;
+        left -= n;
+    }
+    return 1;
+}
+
+int32 usb_hid_get_field(const uint8* report, const HIDField_t* field, uint16 index) {
+    if (index >= field->count || field->bitSize > 32 || field->bitSize == 0)
+        return 0;
+
+    uint32 bit = field->bitOffset + index * field->bitSize;
+    uint32 v = 0;
+    uint32 done = 0;
+
+    while (done < field->bitSize) {
+        uint32 shift = bit & 7;
+        uint32 n = 8 - shift < field->bitSize - done ? 8 - shift : field->bitSize - done;
+        v |= (uint32)((report[bit >> 3] >> shift) & ((1u << n) - 1)) << done;
+        bit += n;
+        done += n;
+    }
+
+    if (field->logicalMin < 0 && field->bitSize < 32 && (v & (1ul << (field->bitSize-1))))
+        v |= ~0ul << field->bitSize;
+    return v;
+}
@@ -0,0 +1,93 @@
+#ifndef _USB_HID_PARSER_H_
+#define _USB_HID_PARSER_H_
+
+/*
+ * HID report descriptor parser.
+ *
+ * Turns a report descriptor into a table of the reports it declares (report
+ * ID, type and size) and of their fields. A field is a run of elements of one
+ * main item: for variable items, elements with consecutive usages, so that
+ * element i has usage usageMin+i, sits at bitOffset+i*bitSize and holds a value
+ * between logicalMin and logicalMax; for array items, count elements each
+ * holding a usage between usageMin and usageMax (e.g., key codes). Constant
+ * (padding) items take up room in the report but get no field.
+ *
+ * Offsets are from the start of the report data, after the report ID byte if
+ * the report has one.
+ */
+
+#include <libmaple/libmaple_types.h>
+#include "usb_generic.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HID_FIELD_CONSTANT 0x01 // the data bits of the main item
+#define HID_FIELD_VARIABLE 0x02
+#define HID_FIELD_RELATIVE 0x04
+#define HID_FIELD_NULL_STATE 0x40
+
+#define HID_PARSE_OK 0
+#define HID_PARSE_TRUNCATED 1 // an item runs past the end of the descriptor
+#define HID_PARSE_TOO_MANY_REPORTS 2
+#define HID_PARSE_TOO_MANY_FIELDS 3
+#define HID_PARSE_BAD_NESTING 4 // unbalanced push/pop or collections, or nested too deep
+#define HID_PARSE_BAD_ITEM 5 // e.g., a report too large or a field without a report size
+
+#define HID_PARSE_MAX_USAGE_RANGES 16 // usages and usage ranges before one main item
+#define HID_PARSE_MAX_PUSH 4
+
+typedef struct {
+    uint8 reportID; // 0 if the descriptor has no report IDs
+    uint8 type; // HID_REPORT_TYPE_INPUT, HID_REPORT_TYPE_OUTPUT or HID_REPORT_TYPE_FEATURE
+    uint16 size; // bytes, without the report ID
+    uint16 bits;
+} HIDReportInfo_t;
+
+typedef struct {
+    uint8 report; // index into the reports table
+    uint8 flags; // HID_FIELD_*
+    uint16 bitSize; // of each element
+    uint16 count;
+    uint16 bitOffset; // of the first element
+    uint16 usagePage;
+    uint16 usageMin;
+    uint16 usageMax;
+    int32 logicalMin;
+    int32 logicalMax;
+} HIDField_t;
+
+typedef struct {
+    HIDReportInfo_t* reports;
+    HIDField_t* fields;
+    uint8 maxReports;
+    uint8 numReports;
+    uint16 maxFields;
+    uint16 numFields;
+} HIDLayout_t;
+
+/* length of the item starting at d, or 0 if it runs past the end */
+uint32 usb_hid_item_length(const uint8* d, uint32 remaining);
+/* offset of the data byte of the first one-byte Report ID item, or -1 if there is none */
+int32 usb_hid_find_report_id(const uint8* descriptor, uint32 length);
+
+uint8 usb_hid_parse_report_descriptor(const uint8* descriptor, uint32 length, HIDLayout_t* layout);
+uint8 usb_hid_parse_report_chunks(struct usb_chunk* chunks, HIDLayout_t* layout);
+
+const HIDReportInfo_t* usb_hid_find_report(const HIDLayout_t* layout, uint8 reportID, uint8 type);
+/* the field holding usage, and which of its elements does (always 0 for an array field) */
+const HIDField_t* usb_hid_find_field(const HIDLayout_t* layout, uint8 reportID, uint8 type, uint16 usagePage, uint16 usage, uint16* index);
+
+/*
+ * report points at the report data, after any report ID byte; set returns 0 if value is out of the logical
+ * range, unless the field has a null state
+ */
+uint8 usb_hid_set_field(uint8* report, const HIDField_t* field, uint16 index, int32 value);
+int32 usb_hid_get_field(const uint8* report, const HIDField_t* field, uint16 index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
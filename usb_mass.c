@@ -52,6 +52,7 @@ typedef struct mass_descriptor_config {
     usb_descriptor_endpoint DataInEndpoint;
     usb_descriptor_endpoint DataOutEndpoint;
 } __packed mass_descriptor_config;
+USB_GENERIC_CHECK_DESCRIPTOR_SIZE(mass_descriptor_config);
 
 
 #define MAX_POWER (500 >> 1)
@@ -271,11 +272,18 @@ void usb_mass_loop() {
   }
 }
 
+static void usb_mass_deferred_loop(void* unused) {
+  (void)unused;
+  usb_mass_loop();
+}
+
 /*
  *  IN
  */
 static void usb_mass_in(void) {
   inRequestPending = 1;
+  if (usb_generic_get_defer_mode() != USB_GENERIC_DEFER_NONE)
+    usb_generic_defer(usb_mass_deferred_loop, NULL);
 }
 
 /*
@@ -284,6 +292,8 @@ static void usb_mass_in(void) {
 static void usb_mass_out(void) {
   usb_mass_dataLength = usb_mass_sil_read(usb_mass_bulkDataBuff);
   outRequestPending = 1;
+  if (usb_generic_get_defer_mode() != USB_GENERIC_DEFER_NONE)
+    usb_generic_defer(usb_mass_deferred_loop, NULL);
 }
 
 static void usb_mass_bot_cbw_decode() {
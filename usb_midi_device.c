@@ -37,6 +37,7 @@
 #include <string.h>
 
 #include "usb_generic.h"
+#include "usb_ring.h"
 #include "usb_midi_device.h"
 #include <MidiSpecs.h>
 #include <MinSysex.h>
@@ -88,6 +89,7 @@ typedef struct {
     usb_descriptor_endpoint            DataInEndpoint;
     MS_CS_BULK_ENDPOINT_DESCRIPTOR(1)  MS_CS_DataInEndpoint;
 } __packed usb_descriptor_config;
+USB_GENERIC_CHECK_DESCRIPTOR_SIZE(usb_descriptor_config);
 
 static const usb_descriptor_config usbMIDIDescriptor_Config = {
     /* .Config_Header = {
@@ -239,14 +241,12 @@ static const usb_descriptor_config usbMIDIDescriptor_Config = {
 static volatile uint32 midiBufferRx[64/4];
 /* Read index into midiBufferRx */
 static volatile uint32 rx_offset = 0;
-/* Transmit data */
-static volatile uint32 midiBufferTx[64/4];
-/* Write index into midiBufferTx */
-static volatile uint32 tx_offset = 0;
-/* Number of bytes left to transmit */
-static volatile uint32 n_unsent_packets = 0;
+/* Transmit data, in whole 4-byte packets */
+#define MIDI_TX_BUFFER_SIZE 256 // must be power of 2
+USB_RING(midiTx, MIDI_TX_BUFFER_SIZE);
 /* Are we currently sending an IN packet? */
-static volatile uint8 transmitting = 0;
+static volatile int8 transmitting = -1;
+static void (*txDoneCallback)(void) = NULL;
 /* Number of unread bytes */
 static volatile uint32 n_unread_packets = 0;
 
@@ -328,30 +328,18 @@ void usb_midi_setRXEPSize(uint32_t size) {
  * It copies data from a usercode buffer into the USB peripheral TX
  * buffer, and returns the number of bytes copied. */
 uint32 usb_midi_tx(const uint32* buf, uint32 packets) {
-    uint32 bytes=packets*4;
-    /* Last transmission hasn't finished, so abort. */
-    if (usb_midi_is_transmitting()) {
-		/* Copy to TxBuffer */
-		
-        return 0;  /* return len */
-    }
-
-    /* We can only put usb_midi_txEPSize bytes in the buffer. */
-    if (bytes > usb_midi_txEPSize) {
-        bytes = usb_midi_txEPSize;
-        packets=bytes/4;
-    }
-
-    /* Queue bytes for sending. */
-    if (packets) {
-        usb_copy_to_pma_ptr((uint8 *)buf, bytes, USB_MIDI_TX_PMA_PTR);
-    }
-    // We still need to wait for the interrupt, even if we're sending
-    // zero bytes. (Sending zero-size packets is useful for flushing
-    // host-side buffers.)
-    n_unsent_packets = packets;
-    transmitting = 1;
-    usb_generic_set_tx(USB_MIDI_TX_ENDPOINT_INFO, bytes);
+    uint32 free = usb_ring_free(&midiTx) / 4;
+    
+    /* We can only put whole packets in the buffer if there is place. */
+    if (packets > free)
+        packets = free;
+    if (packets == 0)
+        return 0;
+    
+    usb_ring_push(&midiTx, (const uint8*)buf, packets * 4);
+    
+    /* Full USB packets are followed by a zero-size one to flush host-side buffers. */
+    usb_generic_start_tx(midiDataTxCb, &transmitting);
 
     return packets;
 }
@@ -360,12 +348,18 @@ uint32 usb_midi_data_available(void) {
     return n_unread_packets;
 }
 
+/* 1 until everything queued has been taken by the host */
 uint8 usb_midi_is_transmitting(void) {
-    return transmitting;
+    return transmitting >= 0 || usb_ring_available(&midiTx) > 0;
 }
 
 uint16 usb_midi_get_pending(void) {
-    return n_unsent_packets;
+    return usb_ring_available(&midiTx) / 4;
+}
+
+/* called from the USB interrupt whenever everything queued has been taken */
+void usb_midi_set_tx_done_callback(void (*callback)(void)) {
+    txDoneCallback = callback;
 }
 
 /* Nonblocking byte receive.
@@ -411,19 +405,21 @@ uint32 usb_midi_peek(uint32* buf, uint32 packets) {
  */
 
 static void midiDataTxCb(void) {
-    n_unsent_packets = 0;
-    transmitting = 0;
+    int8 wasTransmitting = transmitting;
+    // usb_midi_txEPSize is a multiple of 4, so packets are never split
+    usb_generic_send_from_circular_buffer(USB_MIDI_TX_ENDPOINT_INFO,
+        midiTx.buf, midiTx.size, midiTx.head, &midiTx.tail, &transmitting);
+    
+    if (wasTransmitting >= 0 && transmitting < 0 && txDoneCallback != NULL)
+        txDoneCallback();
 }
 
-static void midiDataRxCb(void) {
-    usb_generic_pause_rx(USB_MIDI_RX_ENDPOINT_INFO);
-    n_unread_packets = usb_get_ep_rx_count(USB_MIDI_RX_ENDP) / 4;
-    /* This copy won't overwrite unread bytes, since we've set the RX
-     * endpoint to NAK, and will only set it to VALID when all bytes
-     * have been read. */
-    
-    usb_copy_from_pma_ptr((uint8*)midiBufferRx, n_unread_packets * 4,
-                      USB_MIDI_RX_PMA_PTR);
+static uint32 n_received_packets;
+
+// packets only become readable once the sysex handler has been through them
+static void midiHandleRx(void* unused) {
+    (void)unused;
+    n_unread_packets = n_received_packets;
     
     // discard volatile
     LglSysexHandler((uint32*)midiBufferRx,(uint32*)&rx_offset,(uint32*)&n_unread_packets);
@@ -432,13 +428,29 @@ static void midiDataRxCb(void) {
         usb_generic_enable_rx(USB_MIDI_RX_ENDPOINT_INFO);
         rx_offset = 0;
     }
+    else {
+        USB_GENERIC_COUNT(USB_MIDI_RX_ENDPOINT_INFO, rxFull);
+    }
+}
 
+static void midiDataRxCb(void) {
+    usb_generic_pause_rx(USB_MIDI_RX_ENDPOINT_INFO);
+    n_received_packets = usb_get_ep_rx_count(USB_MIDI_RX_ENDP) / 4;
+    /* This copy won't overwrite unread bytes, since we've set the RX
+     * endpoint to NAK, and will only set it to VALID when all bytes
+     * have been read. */
+    
+    usb_copy_from_pma_ptr((uint8*)midiBufferRx, n_received_packets * 4,
+                      USB_MIDI_RX_PMA_PTR);
+    
+    usb_generic_defer(midiHandleRx, NULL);
 }
 
 static void usbMIDIReset(void) {
     /* Reset the RX/TX state */
     n_unread_packets = 0;
-    n_unsent_packets = 0;
+    usb_ring_clear(&midiTx);
+    transmitting = -1;
     rx_offset = 0;
 }
 
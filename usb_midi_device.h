@@ -176,6 +176,7 @@ uint32 usb_midi_peek(uint32* buf, uint32 len);
 uint32 usb_midi_data_available(void); /* in RX buffer */
 uint16 usb_midi_get_pending(void);
 uint8 usb_midi_is_transmitting(void);
+void usb_midi_set_tx_done_callback(void (*callback)(void));
 
 void sendThroughSysex(char *printbuffer, int bufferlength);
 
@@ -35,6 +35,7 @@
 
 #include "usb_multi_serial.h"
 #include "usb_generic.h"
+#include "usb_ring.h"
 #include <string.h>
 #include <libmaple/usb.h>
 #include <libmaple/delay.h>
@@ -54,9 +55,7 @@
 #define SERIAL_MANAGEMENT_INTERFACE_NUMBER(i) (usbMultiSerialPart.startInterface+CCI_INTERFACE_OFFSET+(port)*NUM_INTERFACES)
 
 #define CDC_SERIAL_RX_BUFFER_SIZE	256 // must be power of 2
-#define CDC_SERIAL_RX_BUFFER_SIZE_MASK (CDC_SERIAL_RX_BUFFER_SIZE-1)
 #define CDC_SERIAL_TX_BUFFER_SIZE	256 // must be power of 2
-#define CDC_SERIAL_TX_BUFFER_SIZE_MASK (CDC_SERIAL_TX_BUFFER_SIZE-1)
 
 #define USB_CDCACM_MANAGEMENT_ENDP(port)    (serialEndpoints[NUM_SERIAL_ENDPOINTS*(port)+CDCACM_ENDPOINT_MANAGEMENT].address)
 #define USB_CDCACM_MANAGEMENT_ENDPOINT_INFO(port)   (&serialEndpoints[NUM_SERIAL_ENDPOINTS*(port)+CDCACM_ENDPOINT_MANAGEMENT])
@@ -72,6 +71,7 @@
 #include "usb_core.h"
 #include "usb_def.h"
 
+static void serialUSBInit(void);
 static void serialUSBReset(void);
 static RESULT serialUSBDataSetup(uint8 request, uint8 interface, uint8 requestType, uint8 wValue0, uint8 wValue1, uint16 wIndex, uint16 wLength);
 static RESULT serialUSBNoDataSetup(uint8 request, uint8 interface, uint8 requestType, uint8 wValue0, uint8 wValue1, uint16 wIndex);
@@ -82,28 +82,22 @@ static void vcomDataRxCb1(void);
 static void vcomDataTxCb2(void);
 static void vcomDataRxCb2(void);
 
-static volatile struct port_data {
+static struct port_data {
     /* Received data */
-    uint8* vcomBufferRx;
-    /* Write index to vcomBufferRx */
-    uint32 vcom_rx_head;
-    /* Read index from vcomBufferRx */
-    uint32 vcom_rx_tail;
-
+    usb_ring rx;
     // Tx data
-    uint8* vcomBufferTx;
-    // Write index to vcomBufferTx
-    uint32 vcom_tx_head;
-    // Read index from vcomBufferTx
-    uint32 vcom_tx_tail;
-    composite_cdcacm_line_coding line_coding;
-    uint8 line_dtr_rts;
-    int8 transmitting;
+    usb_ring tx;
+    volatile composite_cdcacm_line_coding line_coding;
+    volatile uint8 line_dtr_rts;
+    volatile int8 transmitting;
     void (*rx_hook)(unsigned, void*);
     void (*iface_setup_hook)(unsigned, void*);
+    void (*tx_done_hook)(unsigned, void*);
     uint32_t txEPSize;
     uint32_t rxEPSize;
-} ports[USB_MULTI_SERIAL_MAX_PORTS] = {{0}};
+    const char* name;
+    uint8 nameIndex; // string descriptor index of name, or 0
+} ports[USB_MULTI_SERIAL_MAX_PORTS];
 
 static void vcomDataTxCb(uint32 port);
 static void vcomDataRxCb(uint32 port);
@@ -158,6 +152,7 @@ typedef struct {
     usb_descriptor_endpoint      	DataOutEndpoint;
     usb_descriptor_endpoint      	DataInEndpoint;
 } __packed serial_part_config;
+USB_GENERIC_CHECK_DESCRIPTOR_SIZE(serial_part_config);
 
 
 static const serial_part_config serialPartConfigData = {
@@ -313,29 +308,28 @@ static USBEndpointInfo serialEndpoints[NUM_SERIAL_ENDPOINTS*USB_MULTI_SERIAL_MAX
 #define OUT_BYTE(s,v) out[(uint8*)&(s.v)-(uint8*)&s]
 #define OUT_16(s,v) *(uint16_t*)&OUT_BYTE(s,v) // OK on Cortex which can handle unaligned writes
 
-static void getSerialPartDescriptor(uint8* _out) {
-    uint8* out = _out;
-    uint16 interface = usbMultiSerialPart.startInterface;
-    for (uint32 i=0; i<numPorts; i++) {
-        memcpy(out, &serialPartConfigData, sizeof(serial_part_config));
-
-        // patch to reflect where the part goes in the descriptor
-        OUT_BYTE(serialPartConfigData, ManagementEndpoint.bEndpointAddress) += USB_CDCACM_MANAGEMENT_ENDP(i);
-        OUT_BYTE(serialPartConfigData, DataOutEndpoint.bEndpointAddress) += USB_CDCACM_RX_ENDP(i);
-        OUT_BYTE(serialPartConfigData, DataInEndpoint.bEndpointAddress) += USB_CDCACM_TX_ENDP(i);
-
-        OUT_BYTE(serialPartConfigData, IAD.bFirstInterface) += interface;
-        OUT_BYTE(serialPartConfigData, CCI_Interface.bInterfaceNumber) += interface;
-        OUT_BYTE(serialPartConfigData, DCI_Interface.bInterfaceNumber) += interface;
-        OUT_BYTE(serialPartConfigData, CDC_Functional_CallManagement.Data[1]) += interface;
-        OUT_BYTE(serialPartConfigData, CDC_Functional_Union.Data[0]) += interface;
-        OUT_BYTE(serialPartConfigData, CDC_Functional_Union.Data[1]) += interface;
-        
-        OUT_16(serialPartConfigData, DataOutEndpoint.wMaxPacketSize) = ports[i].rxEPSize;
-        OUT_16(serialPartConfigData, DataInEndpoint.wMaxPacketSize) = ports[i].txEPSize;
-        
-        out += sizeof(serial_part_config);
-        interface += NUM_INTERFACES;
+static void getSerialPartDescriptorBlock(uint8* out, unsigned port) {
+    uint16 interface = usbMultiSerialPart.startInterface + NUM_INTERFACES * port;
+    memcpy(out, &serialPartConfigData, sizeof(serial_part_config));
+
+    // patch to reflect where the part goes in the descriptor
+    OUT_BYTE(serialPartConfigData, ManagementEndpoint.bEndpointAddress) += USB_CDCACM_MANAGEMENT_ENDP(port);
+    OUT_BYTE(serialPartConfigData, DataOutEndpoint.bEndpointAddress) += USB_CDCACM_RX_ENDP(port);
+    OUT_BYTE(serialPartConfigData, DataInEndpoint.bEndpointAddress) += USB_CDCACM_TX_ENDP(port);
+
+    OUT_BYTE(serialPartConfigData, IAD.bFirstInterface) += interface;
+    OUT_BYTE(serialPartConfigData, CCI_Interface.bInterfaceNumber) += interface;
+    OUT_BYTE(serialPartConfigData, DCI_Interface.bInterfaceNumber) += interface;
+    OUT_BYTE(serialPartConfigData, CDC_Functional_CallManagement.Data[1]) += interface;
+    OUT_BYTE(serialPartConfigData, CDC_Functional_Union.Data[0]) += interface;
+    OUT_BYTE(serialPartConfigData, CDC_Functional_Union.Data[1]) += interface;
+    
+    OUT_16(serialPartConfigData, DataOutEndpoint.wMaxPacketSize) = ports[port].rxEPSize;
+    OUT_16(serialPartConfigData, DataInEndpoint.wMaxPacketSize) = ports[port].txEPSize;
+    
+    if (ports[port].nameIndex != 0) {
+        OUT_BYTE(serialPartConfigData, IAD.iFunction) = ports[port].nameIndex;
+        OUT_BYTE(serialPartConfigData, CCI_Interface.iInterface) = ports[port].nameIndex;
     }
 }
 
@@ -358,8 +352,9 @@ USBCompositePart usbMultiSerialPart = {
     .numInterfaces = 6,
     .numEndpoints = sizeof(serialEndpoints)/sizeof(*serialEndpoints),
     .descriptorSize = sizeof(serial_part_config)*3,
-    .getPartDescriptor = getSerialPartDescriptor,
-    .usbInit = NULL,
+    .descriptorBlocks = 3,
+    .getPartDescriptorBlock = getSerialPartDescriptorBlock,
+    .usbInit = serialUSBInit,
     .usbReset = serialUSBReset,
     .usbDataSetup = serialUSBDataSetup,
     .usbNoDataSetup = serialUSBNoDataSetup,
@@ -372,14 +367,14 @@ void multi_serial_initialize_port_data(uint32 _numPorts, uint8* buffers) {
     numPorts = _numPorts;
     
     for (uint32 i=0; i<numPorts; i++) {
-        volatile struct port_data* p = &ports[i];
+        struct port_data* p = &ports[i];
         p->line_coding.dwDTERate = 115200;
         p->line_coding.bCharFormat = USBHID_CDCACM_STOP_BITS_1;
         p->line_coding.bParityType = USBHID_CDCACM_PARITY_NONE;
         p->line_coding.bDataBits = 8;
-        p->vcomBufferTx = buffers;
+        usb_ring_init(&p->tx, buffers, CDC_SERIAL_TX_BUFFER_SIZE);
         buffers += CDC_SERIAL_TX_BUFFER_SIZE;
-        p->vcomBufferRx = buffers;
+        usb_ring_init(&p->rx, buffers, CDC_SERIAL_RX_BUFFER_SIZE);
         p->rxEPSize = USB_MULTI_SERIAL_DEFAULT_RX_SIZE;
         p->txEPSize = USB_MULTI_SERIAL_DEFAULT_TX_SIZE;
         buffers += CDC_SERIAL_RX_BUFFER_SIZE;
@@ -387,21 +382,30 @@ void multi_serial_initialize_port_data(uint32 _numPorts, uint8* buffers) {
     
     usbMultiSerialPart.numInterfaces = NUM_INTERFACES * numPorts;
     usbMultiSerialPart.descriptorSize = sizeof(serial_part_config) * numPorts;
+    usbMultiSerialPart.descriptorBlocks = numPorts;
     usbMultiSerialPart.numEndpoints = NUM_SERIAL_ENDPOINTS * numPorts;
 }
 
+// name shown by the host for the port (UTF-8); must stay valid, and be set before the device is enabled
+void multi_serial_set_port_name(uint32 port, const char* name) {
+    ports[port].name = name;
+}
+
 /* Other state (line coding, DTR/RTS) */
 
 /* DTR in bit 0, RTS in bit 1. */
 
 void multi_serial_set_hooks(uint32 port, unsigned hook_flags, void (*hook)(unsigned, void*)) {
-    volatile struct port_data* p = &ports[port];
+    struct port_data* p = &ports[port];
     if (hook_flags & USBHID_CDCACM_HOOK_RX) {
         p->rx_hook = hook;
     }
     if (hook_flags & USBHID_CDCACM_HOOK_IFACE_SETUP) {
         p->iface_setup_hook = hook;
     }
+    if (hook_flags & USBHID_CDCACM_HOOK_TX_DONE) {
+        p->tx_done_hook = hook;
+    }
 }
 
 /* This function is non-blocking.
@@ -412,30 +416,13 @@ uint32 multi_serial_tx(uint32 port, const uint8* buf, uint32 len)
 {
 	if (len==0) return 0; // no data to send
     
-    volatile struct port_data* p = &ports[port];
-
-	uint32 head = p->vcom_tx_head; // load volatile variable
-	uint32 tx_unsent = (head - p->vcom_tx_tail) & CDC_SERIAL_TX_BUFFER_SIZE_MASK;
+    struct port_data* p = &ports[port];
 
     // We can only put bytes in the buffer if there is place
-    if (len > (CDC_SERIAL_TX_BUFFER_SIZE-tx_unsent-1) ) {
-        len = (CDC_SERIAL_TX_BUFFER_SIZE-tx_unsent-1);
-    }
+    len = usb_ring_push(&p->tx, buf, len);
 	if (len==0) return 0; // buffer full
-
-	uint16 i;
-	// copy data from user buffer to USB Tx buffer
-	for (i=0; i<len; i++) {
-		p->vcomBufferTx[head] = buf[i];
-		head = (head+1) & CDC_SERIAL_TX_BUFFER_SIZE_MASK;
-	}
-	p->vcom_tx_head = head; // store volatile variable
-	
-	while(p->transmitting >= 0);
 	
-	if (p->transmitting < 0) {
-		vcomDataTxCb(port); // initiate data transmission
-	}
+	usb_generic_start_tx(USB_CDCACM_TX_ENDPOINT_INFO(port)->callback, &p->transmitting);
 
     return len;
 }
@@ -443,13 +430,19 @@ uint32 multi_serial_tx(uint32 port, const uint8* buf, uint32 len)
 
 
 uint32 multi_serial_data_available(uint32 port) {
-    volatile struct port_data* p = &ports[port];
-    return (p->vcom_rx_head - p->vcom_rx_tail) & CDC_SERIAL_RX_BUFFER_SIZE_MASK;
+    struct port_data* p = &ports[port];
+    return usb_ring_available(&p->rx);
 }
 
 uint16 multi_serial_get_pending(uint32 port) {
-    volatile struct port_data* p = &ports[port];
-    return (p->vcom_tx_head - p->vcom_tx_tail) & CDC_SERIAL_TX_BUFFER_SIZE_MASK;
+    struct port_data* p = &ports[port];
+    return usb_ring_available(&p->tx);
+}
+
+/* 1 until everything queued has been taken by the host */
+uint8 multi_serial_is_transmitting(uint32 port) {
+    struct port_data* p = &ports[port];
+    return p->transmitting >= 0 || usb_ring_available(&p->tx) > 0;
 }
 
 /* Non-blocking byte receive.
@@ -458,18 +451,11 @@ uint16 multi_serial_get_pending(uint32 port) {
  * into buf and deq's the FIFO. */
 uint32 multi_serial_rx(uint32 port, uint8* buf, uint32 len)
 {
-    volatile struct port_data* p = &ports[port];
-    /* Copy bytes to buffer. */
-    uint32 n_copied = multi_serial_peek(port, buf, len);
-
-    /* Mark bytes as read. */
-	uint16 tail = p->vcom_rx_tail; // load volatile variable
-	tail = (tail + n_copied) & CDC_SERIAL_RX_BUFFER_SIZE_MASK;
-	p->vcom_rx_tail = tail; // store volatile variable
+    struct port_data* p = &ports[port];
+    uint32 n_copied = usb_ring_pop(&p->rx, buf, len);
 
-	uint32 rx_unread = (p->vcom_rx_head - tail) & CDC_SERIAL_RX_BUFFER_SIZE_MASK;
     // If buffer was emptied to a pre-set value, re-enable the RX endpoint
-    if ( rx_unread <= 64 ) { // experimental value, gives the best performance
+    if ( usb_ring_available(&p->rx) <= 64 ) { // experimental value, gives the best performance
         usb_generic_enable_rx(USB_CDCACM_RX_ENDPOINT_INFO(port));
 	}
     return n_copied;
@@ -480,51 +466,18 @@ uint32 multi_serial_rx(uint32 port, uint8* buf, uint32 len)
  * Looks at unread bytes without marking them as read. */
 uint32 multi_serial_peek(uint32 port, uint8* buf, uint32 len)
 {
-    volatile struct port_data* p = &ports[port];
-    unsigned i;
-    uint32 tail = p->vcom_rx_tail;
-	uint32 rx_unread = (p->vcom_rx_head-tail) & CDC_SERIAL_RX_BUFFER_SIZE_MASK;
-
-    if (len > rx_unread) {
-        len = rx_unread;
-    }
-
-    for (i = 0; i < len; i++) {
-        buf[i] = p->vcomBufferRx[tail];
-        tail = (tail + 1) & CDC_SERIAL_RX_BUFFER_SIZE_MASK;
-    }
-
-    return len;
+    return usb_ring_peek(&ports[port].rx, 0, buf, len);
 }
 
 uint32 multi_serial_peek_ex(uint32 port, uint8* buf, uint32 offset, uint32 len)
 {
-    volatile struct port_data* p = &ports[port];
-    unsigned i;
-    uint32 tail = (p->vcom_rx_tail + offset) & CDC_SERIAL_RX_BUFFER_SIZE_MASK ;
-	uint32 rx_unread = (p->vcom_rx_head-tail) & CDC_SERIAL_RX_BUFFER_SIZE_MASK;
-
-    if (len + offset > rx_unread) {
-        len = rx_unread - offset;
-    }
-
-    for (i = 0; i < len; i++) {
-        buf[i] = p->vcomBufferRx[tail];
-        tail = (tail + 1) & CDC_SERIAL_RX_BUFFER_SIZE_MASK;
-    }
-
-    return len;
+    return usb_ring_peek(&ports[port].rx, offset, buf, len);
 }
 
 /* Roger Clark. Added. for Arduino 1.0 API support of Serial.peek() */
 int multi_serial_peek_char(uint32 port) 
 {
-    if (multi_serial_data_available(port) == 0) 
-	{
-		return -1;
-    }
-
-    return ports[port].vcomBufferRx[ports[port].vcom_rx_tail];
+    return usb_ring_peek_byte(&ports[port].rx);
 }
 
 uint8 multi_serial_get_dtr(uint32 port) {
@@ -536,7 +489,7 @@ uint8 multi_serial_get_rts(uint32 port) {
 }
 
 void multi_serial_get_line_coding(uint32 port, composite_cdcacm_line_coding *ret) {
-    volatile struct port_data* p = &ports[port];
+    struct port_data* p = &ports[port];
     ret->dwDTERate = p->line_coding.dwDTERate;
     ret->bCharFormat = p->line_coding.bCharFormat;
     ret->bParityType = p->line_coding.bParityType;
@@ -564,39 +517,48 @@ int multi_serial_get_n_data_bits(uint32 port) {
  */
 static void vcomDataTxCb(uint32 port)
 {
-    volatile struct port_data* p = &ports[port];
+    struct port_data* p = &ports[port];
+    int8 wasTransmitting = p->transmitting;
     usb_generic_send_from_circular_buffer(USB_CDCACM_TX_ENDPOINT_INFO(port),
-        p->vcomBufferTx, CDC_SERIAL_TX_BUFFER_SIZE, p->vcom_tx_head, &(p->vcom_tx_tail), &(p->transmitting));
+        p->tx.buf, p->tx.size, p->tx.head, &p->tx.tail, &p->transmitting);
+    
+    if (wasTransmitting >= 0 && p->transmitting < 0 && p->tx_done_hook) {
+        p->tx_done_hook(USBHID_CDCACM_HOOK_TX_DONE, 0);
+    }
 }
 
 
 static void vcomDataRxCb(uint32 port)
 {
-    volatile struct port_data* p = &ports[port];
-	uint32 head = p->vcom_rx_head;
+    struct port_data* p = &ports[port];
     usb_generic_read_to_circular_buffer(USB_CDCACM_RX_ENDPOINT_INFO(port),
-                    p->vcomBufferRx, CDC_SERIAL_RX_BUFFER_SIZE, &head);
-	p->vcom_rx_head = head; // store volatile variable
+                    p->rx.buf, p->rx.size, &p->rx.head);
 
-	uint32 rx_unread = (head - p->vcom_rx_tail) & CDC_SERIAL_RX_BUFFER_SIZE_MASK;
 	// only enable further Rx if there is enough room to receive one more packet
-	if ( rx_unread < (CDC_SERIAL_RX_BUFFER_SIZE-p->rxEPSize) ) {
+	if ( usb_ring_free(&p->rx) >= p->rxEPSize ) {
         usb_generic_enable_rx(USB_CDCACM_RX_ENDPOINT_INFO(port));
 	}
+    else {
+        USB_GENERIC_COUNT(USB_CDCACM_RX_ENDPOINT_INFO(port), rxFull);
+    }
+    USB_GENERIC_HIGH_WATER(USB_CDCACM_RX_ENDPOINT_INFO(port), usb_ring_available(&p->rx));
 
     if (p->rx_hook) {
         p->rx_hook(USBHID_CDCACM_HOOK_RX, 0);
     }
 }
 
+static void serialUSBInit(void) {
+    for (uint32 i=0; i<numPorts; i++)
+        ports[i].nameIndex = ports[i].name != NULL ? usb_generic_add_string(ports[i].name) : 0;
+}
+
 static void serialUSBReset(void) {
     //VCOM
     for (uint32 port = 0; port<numPorts; port++) {
-        volatile struct port_data* p = &ports[port];
-        p->vcom_rx_head = 0;
-        p->vcom_rx_tail = 0;
-        p->vcom_tx_head = 0;
-        p->vcom_tx_tail = 0;
+        struct port_data* p = &ports[port];
+        usb_ring_clear(&p->rx);
+        usb_ring_clear(&p->tx);
         p->transmitting = -1;
     }
 }
@@ -633,7 +595,7 @@ static RESULT serialUSBNoDataSetup(uint8 request, uint8 interface, uint8 request
     RESULT ret = USB_UNSUPPORT;
     
 	if ((requestType & (REQUEST_TYPE | RECIPIENT)) == (CLASS_REQUEST | INTERFACE_RECIPIENT) && interface % NUM_INTERFACES == CCI_INTERFACE_OFFSET) {
-            volatile struct port_data* p = &ports[interface / NUM_INTERFACES];
+            struct port_data* p = &ports[interface / NUM_INTERFACES];
             switch(request) {
                 case USBHID_CDCACM_SET_COMM_FEATURE:
                     /* We support set comm. feature, but don't handle it. */
@@ -63,9 +63,11 @@ uint32 multi_serial_peek(uint32 port, uint8* buf, uint32 len);
 uint32 multi_serial_peek_ex(uint32 port, uint8* buf, uint32 offset, uint32 len);
 void multi_serial_setTXEPSize(uint32 port, uint16_t size);
 void multi_serial_setRXEPSize(uint32 port, uint16_t size);
+void multi_serial_set_port_name(uint32 port, const char* name);
 
 uint32 multi_serial_data_available(uint32 port); /* in RX buffer */
 uint16 multi_serial_get_pending(uint32 port);
+uint8 multi_serial_is_transmitting(uint32 port);
 
 uint8 multi_serial_get_dtr(uint32 port);
 uint8 multi_serial_get_rts(uint32 port);
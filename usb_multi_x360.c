@@ -181,6 +181,7 @@ typedef struct {
     usb_descriptor_endpoint      DataInEndpoint;
     usb_descriptor_endpoint      DataOutEndpoint;
 } __packed usb_descriptor_config;
+USB_GENERIC_CHECK_DESCRIPTOR_SIZE(usb_descriptor_config);
 
 
 #define MAX_POWER (100 >> 1)
@@ -238,23 +239,21 @@ static const usb_descriptor_config X360Descriptor_Config =
 #define OUT_BYTE(s,v) out[(uint8*)&(s.v)-(uint8*)&s]
 #define OUT_16(s,v) *(uint16_t*)&OUT_BYTE(s,v) // OK on Cortex which can handle unaligned writes
 
-static void getMultiX360PartDescriptor(uint8* out) {
-    for(uint32 i=0; i<x360_num_controllers; i++) {
-        memcpy(out, &X360Descriptor_Config, sizeof(X360Descriptor_Config));
-        // patch to reflect where the part goes in the descriptor
-        OUT_BYTE(X360Descriptor_Config, HID_Interface.bInterfaceNumber) += usbX360Part.startInterface+NUM_INTERFACES*i;
-        uint8 rx_endp = USB_X360_RX_ENDP(i);
-        uint8 tx_endp = USB_X360_TX_ENDP(i);
-        OUT_BYTE(X360Descriptor_Config, DataOutEndpoint.bEndpointAddress) += rx_endp;
-        OUT_BYTE(X360Descriptor_Config, DataInEndpoint.bEndpointAddress) += tx_endp;
-        OUT_BYTE(X360Descriptor_Config, unknown_descriptor1[6]) = 0x80 | tx_endp;
-        OUT_BYTE(X360Descriptor_Config, unknown_descriptor1[13]) = rx_endp;
-        out += sizeof(X360Descriptor_Config);
-    }
+static void getMultiX360PartDescriptorBlock(uint8* out, unsigned controller) {
+    memcpy(out, &X360Descriptor_Config, sizeof(X360Descriptor_Config));
+    // patch to reflect where the part goes in the descriptor
+    OUT_BYTE(X360Descriptor_Config, HID_Interface.bInterfaceNumber) += usbX360Part.startInterface+NUM_INTERFACES*controller;
+    uint8 rx_endp = USB_X360_RX_ENDP(controller);
+    uint8 tx_endp = USB_X360_TX_ENDP(controller);
+    OUT_BYTE(X360Descriptor_Config, DataOutEndpoint.bEndpointAddress) += rx_endp;
+    OUT_BYTE(X360Descriptor_Config, DataInEndpoint.bEndpointAddress) += tx_endp;
+    OUT_BYTE(X360Descriptor_Config, unknown_descriptor1[6]) = 0x80 | tx_endp;
+    OUT_BYTE(X360Descriptor_Config, unknown_descriptor1[13]) = rx_endp;
 }
 
 void usb_multi_x360_initialize_controller_data(uint32 _numControllers, uint8* buffers) {
     x360_generic_initialize_controller_data(_numControllers, buffers);
-    usbX360Part.getPartDescriptor = getMultiX360PartDescriptor;
+    usbX360Part.getPartDescriptorBlock = getMultiX360PartDescriptorBlock;
+    usbX360Part.descriptorBlocks = x360_num_controllers;
     usbX360Part.descriptorSize = sizeof(X360Descriptor_Config) * x360_num_controllers;
 }
@@ -0,0 +1,417 @@
+/*
+ * Channel multiplexer over one bulk endpoint pair; see usb_mux.h for the
+ * framing.
+ */
+
+#include "usb_mux.h"
+#include "usb_generic.h"
+#include "usb_ring.h"
+#include <string.h>
+#include <libmaple/usb.h>
+
+/* Private headers */
+#include "usb_lib_globals.h"
+#include "usb_reg_map.h"
+
+/* usb_lib headers */
+#include "usb_type.h"
+#include "usb_core.h"
+#include "usb_def.h"
+
+#define MUX_ENDPOINT_TX 0
+#define MUX_ENDPOINT_RX 1
+#define USB_MUX_TX_ENDPOINT_INFO (&muxEndpoints[MUX_ENDPOINT_TX])
+#define USB_MUX_RX_ENDPOINT_INFO (&muxEndpoints[MUX_ENDPOINT_RX])
+
+#define RESET_CHANNEL USB_MUX_CHANNEL_MASK
+#define FRAME_HEADER_SIZE 2
+#define MAX_FRAME_PAYLOAD 255
+
+static void muxUSBInit(void);
+static void muxUSBReset(void);
+static void muxDataTxCb(void);
+static void muxDataRxCb(void);
+
+typedef struct {
+    usb_descriptor_interface     	Data_Interface;
+    usb_descriptor_endpoint      	DataOutEndpoint;
+    usb_descriptor_endpoint      	DataInEndpoint;
+} __packed mux_part_config;
+USB_GENERIC_CHECK_DESCRIPTOR_SIZE(mux_part_config);
+
+static const mux_part_config muxPartConfigData = {
+    .Data_Interface = {
+        .bLength            = sizeof(usb_descriptor_interface),
+        .bDescriptorType    = USB_DESCRIPTOR_TYPE_INTERFACE,
+        .bInterfaceNumber   = 0x00, // PATCH
+        .bAlternateSetting  = 0x00,
+        .bNumEndpoints      = 0x02,
+        .bInterfaceClass    = 0xFF, // vendor specific
+        .bInterfaceSubClass = USB_MUX_INTERFACE_SUBCLASS,
+        .bInterfaceProtocol = USB_MUX_INTERFACE_PROTOCOL,
+        .iInterface         = 0x00, // PATCH
+    },
+
+    .DataOutEndpoint = {
+        .bLength          = sizeof(usb_descriptor_endpoint),
+        .bDescriptorType  = USB_DESCRIPTOR_TYPE_ENDPOINT,
+        .bEndpointAddress = (USB_DESCRIPTOR_ENDPOINT_OUT | 0), // PATCH
+        .bmAttributes     = USB_EP_TYPE_BULK,
+        .wMaxPacketSize   = USB_MUX_PACKET_SIZE,
+        .bInterval        = 0x00,
+    },
+
+    .DataInEndpoint = {
+        .bLength          = sizeof(usb_descriptor_endpoint),
+        .bDescriptorType  = USB_DESCRIPTOR_TYPE_ENDPOINT,
+        .bEndpointAddress = (USB_DESCRIPTOR_ENDPOINT_IN | 0), // PATCH
+        .bmAttributes     = USB_EP_TYPE_BULK,
+        .wMaxPacketSize   = USB_MUX_PACKET_SIZE,
+        .bInterval        = 0x00,
+    }
+};
+
+static USBEndpointInfo muxEndpoints[2] = {
+    {
+        .callback = muxDataTxCb,
+        .pmaSize = USB_MUX_PACKET_SIZE,
+        .type = USB_GENERIC_ENDPOINT_TYPE_BULK,
+        .tx = 1,
+    },
+    {
+        .callback = muxDataRxCb,
+        .pmaSize = USB_MUX_PACKET_SIZE,
+        .type = USB_GENERIC_ENDPOINT_TYPE_BULK,
+        .tx = 0,
+    },
+};
+
+static const char* muxName = "USB Mux";
+static uint8 muxNameIndex = 0;
+
+#define OUT_BYTE(s,v) out[(uint8*)&(s.v)-(uint8*)&s]
+
+static void getMuxPartDescriptor(uint8* out) {
+    memcpy(out, &muxPartConfigData, sizeof(mux_part_config));
+
+    // patch to reflect where the part goes in the descriptor
+    OUT_BYTE(muxPartConfigData, Data_Interface.bInterfaceNumber) += usbMuxPart.startInterface;
+    OUT_BYTE(muxPartConfigData, Data_Interface.iInterface) = muxNameIndex;
+    OUT_BYTE(muxPartConfigData, DataOutEndpoint.bEndpointAddress) += USB_MUX_RX_ENDPOINT_INFO->address;
+    OUT_BYTE(muxPartConfigData, DataInEndpoint.bEndpointAddress) += USB_MUX_TX_ENDPOINT_INFO->address;
+}
+
+USBCompositePart usbMuxPart = {
+    .numInterfaces = 1,
+    .numEndpoints = sizeof(muxEndpoints)/sizeof(*muxEndpoints),
+    .descriptorSize = sizeof(mux_part_config),
+    .getPartDescriptor = getMuxPartDescriptor,
+    .usbInit = muxUSBInit,
+    .usbReset = muxUSBReset,
+    .endpoints = muxEndpoints,
+    .winUSBGUID = USB_MUX_WINUSB_GUID
+};
+
+/*
+ * Channel state. The rings are written by the main program on one side and
+ * the USB interrupt on the other, as usual; the credit counts are only
+ * touched by the interrupt. A RESET can arrive while the main program is in
+ * the middle of a push or a pop, so the interrupt only discards from the side
+ * of each ring it owns: it empties tx by moving its tail up to the head, and
+ * asks the main program to move rx's tail up to where the head was.
+ */
+struct channel_data {
+    usb_ring rx;
+    usb_ring tx;
+    uint32 txCredit; // bytes the host will still take on this channel
+    uint32 rxOutstanding; // credit given to the host and not yet used
+    volatile uint32 rxFlushTo; // rx head at the last reset; older bytes are stale
+    volatile uint8 rxResets; // counted by the interrupt
+    uint8 rxResetsSeen; // by the main program
+};
+
+static struct channel_data channels[USB_MUX_MAX_CHANNELS];
+static uint32 numChannels = 0;
+static uint32 creditThreshold = 1;
+static uint32 nextChannel = 0; // where the round-robin resumes
+static volatile int8 transmitting = -1;
+static volatile uint8 muxOpen = 0;
+static volatile uint8 resetPending = 0; // owe the host a RESET frame
+static volatile uint32 dropped = 0;
+
+// OUT frame parser state, which carries over between packets
+static uint8 rxHeader;
+static uint8 rxLength;
+static uint8 rxPos; // 0: expecting a header, 1: expecting a length, 2+: in the payload
+static uint8 rxCredit[2];
+
+void usb_mux_initialize(uint32 _numChannels, uint8* buffers, uint32 bufferSize) {
+    if (_numChannels > USB_MUX_MAX_CHANNELS)
+        _numChannels = USB_MUX_MAX_CHANNELS;
+    numChannels = _numChannels;
+    for (uint32 i = 0 ; i < numChannels ; i++) {
+        usb_ring_init(&channels[i].tx, buffers, bufferSize);
+        buffers += bufferSize;
+        usb_ring_init(&channels[i].rx, buffers, bufferSize);
+        buffers += bufferSize;
+        channels[i].rxResets = 0;
+        channels[i].rxResetsSeen = 0;
+    }
+    // fewer, larger grants, without letting the host run dry
+    creditThreshold = bufferSize / 4;
+}
+
+// interface name shown by the host (UTF-8); must stay valid, and be set before the device is enabled
+void usb_mux_set_name(const char* name) {
+    muxName = name;
+}
+
+static void muxUSBInit(void) {
+    muxNameIndex = muxName != NULL ? usb_generic_add_string(muxName) : 0;
+}
+
+// the host has (re)started: whatever was buffered on either side is stale
+static void reset_channels(void) {
+    for (uint32 i = 0 ; i < numChannels ; i++) {
+        struct channel_data* c = &channels[i];
+        c->tx.tail = c->tx.head;
+        c->rxFlushTo = c->rx.head;
+        usb_ring_barrier();
+        c->rxResets++;
+        c->txCredit = 0;
+        c->rxOutstanding = 0;
+    }
+    nextChannel = 0;
+    rxPos = 0;
+}
+
+static void muxUSBReset(void) {
+    reset_channels();
+    transmitting = -1;
+    muxOpen = 0;
+    resetPending = 0;
+}
+
+// main program: drops what was received before the last reset, if it hasn't yet
+static void flush_stale_rx(struct channel_data* c) {
+    uint8 resets = c->rxResets;
+    if (resets == c->rxResetsSeen)
+        return;
+    uint32 flushTo;
+    do { // the interrupt may reset again while this reads
+        resets = c->rxResets;
+        usb_ring_barrier();
+        flushTo = c->rxFlushTo;
+        usb_ring_barrier();
+    } while (resets != c->rxResets);
+    c->rx.tail = flushTo;
+    c->rxResetsSeen = resets;
+    // the room may be worth a credit grant
+    usb_generic_start_tx(muxDataTxCb, &transmitting);
+}
+
+static inline uint32 credit_to_grant(struct channel_data* c) {
+    uint32 free = usb_ring_free(&c->rx);
+    return free > c->rxOutstanding ? free - c->rxOutstanding : 0;
+}
+
+/*
+ * Fills an IN packet with whole frames: a pending RESET first, then credit
+ * grants, then at most one DATA frame per channel, starting after the last
+ * channel served.
+ */
+static uint32 build_packet(uint8* p) {
+    uint32 n = 0;
+
+    if (resetPending) {
+        p[n++] = USB_MUX_FRAME_RESET | RESET_CHANNEL;
+        p[n++] = 0;
+        resetPending = 0;
+    }
+
+    if (!muxOpen)
+        return n;
+
+    for (uint32 i = 0 ; i < numChannels && n + FRAME_HEADER_SIZE + 2 <= USB_MUX_PACKET_SIZE ; i++) {
+        struct channel_data* c = &channels[i];
+        uint32 grant = credit_to_grant(c);
+        if (grant >= creditThreshold || (grant > 0 && c->rxOutstanding == 0)) {
+            if (grant > 0xFFFF)
+                grant = 0xFFFF;
+            p[n++] = USB_MUX_FRAME_CREDIT | i;
+            p[n++] = 2;
+            p[n++] = (uint8)grant;
+            p[n++] = (uint8)(grant >> 8);
+            c->rxOutstanding += grant;
+        }
+    }
+
+    uint32 channel = nextChannel;
+    for (uint32 i = 0 ; i < numChannels && n + FRAME_HEADER_SIZE < USB_MUX_PACKET_SIZE ; i++) {
+        struct channel_data* c = &channels[channel];
+        uint32 amount = usb_ring_available(&c->tx);
+        if (amount > c->txCredit)
+            amount = c->txCredit;
+        if (amount > USB_MUX_PACKET_SIZE - FRAME_HEADER_SIZE - n)
+            amount = USB_MUX_PACKET_SIZE - FRAME_HEADER_SIZE - n;
+        if (amount > MAX_FRAME_PAYLOAD)
+            amount = MAX_FRAME_PAYLOAD;
+        if (amount > 0) {
+            p[n++] = USB_MUX_FRAME_DATA | channel;
+            p[n++] = amount;
+            usb_ring_pop(&c->tx, p + n, amount);
+            n += amount;
+            c->txCredit -= amount;
+            nextChannel = channel + 1 < numChannels ? channel + 1 : 0;
+        }
+        channel = channel + 1 < numChannels ? channel + 1 : 0;
+    }
+
+    return n;
+}
+
+static void muxDataTxCb(void) {
+    uint8 packet[USB_MUX_PACKET_SIZE];
+    uint32 n = build_packet(packet);
+
+    if (n == 0) {
+        transmitting = -1;
+        return;
+    }
+    transmitting = 1;
+    usb_generic_send_from_buffer(USB_MUX_TX_ENDPOINT_INFO, packet, n);
+}
+
+static void end_frame(void) {
+    uint8 type = rxHeader & USB_MUX_FRAME_TYPE_MASK;
+    uint8 channel = rxHeader & USB_MUX_CHANNEL_MASK;
+
+    rxPos = 0;
+    if (type == USB_MUX_FRAME_RESET) {
+        reset_channels();
+        muxOpen = 1;
+        resetPending = 1;
+    }
+    else if (type == USB_MUX_FRAME_CREDIT && channel < numChannels && rxLength == 2) {
+        channels[channel].txCredit += rxCredit[0] | (rxCredit[1] << 8);
+    }
+}
+
+static void parse_rx(const uint8* p, uint32 len) {
+    while (len > 0) {
+        if (rxPos == 0) {
+            rxHeader = *p++;
+            len--;
+            rxPos = 1;
+        }
+        else if (rxPos == 1) {
+            rxLength = *p++;
+            len--;
+            rxPos = 2;
+            if (rxLength == 0)
+                end_frame();
+        }
+        else {
+            uint32 take = rxLength + 2 - rxPos;
+            if (take > len)
+                take = len;
+            uint8 channel = rxHeader & USB_MUX_CHANNEL_MASK;
+            if ((rxHeader & USB_MUX_FRAME_TYPE_MASK) == USB_MUX_FRAME_DATA) {
+                if (muxOpen && channel < numChannels) {
+                    struct channel_data* c = &channels[channel];
+                    uint32 pushed = usb_ring_push(&c->rx, p, take);
+                    dropped += take - pushed;
+                    c->rxOutstanding = c->rxOutstanding > take ? c->rxOutstanding - take : 0;
+                }
+                else {
+                    dropped += take;
+                }
+            }
+            else {
+                for (uint32 i = 0 ; i < take ; i++)
+                    if (rxPos - 2 + i < sizeof(rxCredit))
+                        rxCredit[rxPos - 2 + i] = p[i];
+            }
+            p += take;
+            len -= take;
+            rxPos += take;
+            if (rxPos == rxLength + 2)
+                end_frame();
+        }
+    }
+}
+
+static void muxDataRxCb(void) {
+    uint8 packet[USB_MUX_PACKET_SIZE];
+    uint32 len = usb_generic_read_to_buffer(USB_MUX_RX_ENDPOINT_INFO, packet, sizeof(packet));
+
+    // the host never sends more than it has credit for, so there is always room
+    parse_rx(packet, len);
+    usb_generic_enable_rx(USB_MUX_RX_ENDPOINT_INFO);
+
+    if (transmitting < 0)
+        muxDataTxCb();
+}
+
+/* Non-blocking: queues as much of buf as fits and returns the number of bytes queued. */
+uint32 usb_mux_tx(uint32 channel, const uint8* buf, uint32 len) {
+    if (channel >= numChannels || len == 0)
+        return 0;
+    len = usb_ring_push(&channels[channel].tx, buf, len);
+    if (len > 0)
+        usb_generic_start_tx(muxDataTxCb, &transmitting);
+    return len;
+}
+
+uint32 usb_mux_rx(uint32 channel, uint8* buf, uint32 len) {
+    if (channel >= numChannels)
+        return 0;
+    struct channel_data* c = &channels[channel];
+    flush_stale_rx(c);
+    len = usb_ring_pop(&c->rx, buf, len);
+    // let the host know about the room, if it's enough to be worth a frame
+    if (len > 0 && usb_ring_free(&c->rx) >= c->rxOutstanding + creditThreshold)
+        usb_generic_start_tx(muxDataTxCb, &transmitting);
+    return len;
+}
+
+uint32 usb_mux_peek(uint32 channel, uint8* buf, uint32 len) {
+    if (channel >= numChannels)
+        return 0;
+    flush_stale_rx(&channels[channel]);
+    return usb_ring_peek(&channels[channel].rx, 0, buf, len);
+}
+
+int usb_mux_peek_char(uint32 channel) {
+    if (channel >= numChannels)
+        return -1;
+    flush_stale_rx(&channels[channel]);
+    return usb_ring_peek_byte(&channels[channel].rx);
+}
+
+uint32 usb_mux_data_available(uint32 channel) {
+    if (channel >= numChannels)
+        return 0;
+    flush_stale_rx(&channels[channel]);
+    return usb_ring_available(&channels[channel].rx);
+}
+
+uint32 usb_mux_tx_free(uint32 channel) {
+    if (channel >= numChannels)
+        return 0;
+    return usb_ring_free(&channels[channel].tx);
+}
+
+uint32 usb_mux_get_pending(uint32 channel) {
+    if (channel >= numChannels)
+        return 0;
+    return usb_ring_available(&channels[channel].tx);
+}
+
+uint8 usb_mux_is_open(void) {
+    return muxOpen;
+}
+
+uint32 usb_mux_get_dropped(void) {
+    return dropped;
+}
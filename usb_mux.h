@@ -0,0 +1,73 @@
+#ifndef _USB_MUX_H_
+#define _USB_MUX_H_
+
+/*
+ * Many logical byte streams ("channels") carried over one vendor-specific
+ * interface with a single pair of bulk endpoints.
+ *
+ * Both directions carry a stream of frames, each a header byte with the frame
+ * type in the top two bits and the channel in the bottom six, a length byte
+ * and that many bytes of payload. Frames never straddle an IN packet, but
+ * may straddle OUT packets.
+ *
+ *   DATA   (0x00|channel) length 1-255, the channel's bytes
+ *   CREDIT (0x40|channel) length 2, a little-endian count of further bytes the
+ *          sender of the frame is ready to accept on the channel
+ *   RESET  (0xC0|0x3F)    length 0
+ *
+ * Nothing may be sent on a channel beyond the credit granted by the other
+ * side, so a channel whose reader is slow never holds up the others. The host
+ * opens the connection with a RESET, which makes the device drop all of its
+ * buffered data, answer with a RESET of its own (so the host can discard
+ * anything before it) and grant credit for its receive buffers. The host then
+ * grants credit for whichever channels it wants to receive. IN packets are
+ * filled round-robin, one frame per channel at a time.
+ *
+ * scripts/usbmux/ is a host-side implementation in C++, and scripts/usbmux.py
+ * one in Python.
+ */
+
+#include <libmaple/libmaple_types.h>
+#include <libmaple/usb.h>
+#include "usb_generic.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USB_MUX_MAX_CHANNELS 16 // the framing allows up to 63
+#define USB_MUX_DEFAULT_BUFFER_SIZE 128 // per channel and direction; must be a power of 2
+#define USB_MUX_BUFFERS_SIZE(numChannels, bufferSize) ((numChannels)*2*(bufferSize))
+#define USB_MUX_PACKET_SIZE 64
+
+#define USB_MUX_INTERFACE_SUBCLASS 0x4D
+#define USB_MUX_INTERFACE_PROTOCOL 0x01
+#define USB_MUX_WINUSB_GUID "{497F6E09-371D-4449-A31F-E2FE91D7B2EB}"
+
+#define USB_MUX_FRAME_DATA   0x00
+#define USB_MUX_FRAME_CREDIT 0x40
+#define USB_MUX_FRAME_RESET  0xC0
+#define USB_MUX_FRAME_TYPE_MASK 0xC0
+#define USB_MUX_CHANNEL_MASK 0x3F
+
+extern USBCompositePart usbMuxPart;
+
+// buffers must hold USB_MUX_BUFFERS_SIZE(numChannels, bufferSize) bytes
+void usb_mux_initialize(uint32 numChannels, uint8* buffers, uint32 bufferSize);
+void usb_mux_set_name(const char* name);
+
+uint32 usb_mux_tx(uint32 channel, const uint8* buf, uint32 len);
+uint32 usb_mux_rx(uint32 channel, uint8* buf, uint32 len);
+uint32 usb_mux_peek(uint32 channel, uint8* buf, uint32 len);
+int usb_mux_peek_char(uint32 channel);
+uint32 usb_mux_data_available(uint32 channel); /* in RX buffer */
+uint32 usb_mux_tx_free(uint32 channel);
+uint32 usb_mux_get_pending(uint32 channel);
+uint8 usb_mux_is_open(void); /* 1 once the host has sent a RESET */
+uint32 usb_mux_get_dropped(void); /* bytes received beyond the credit given */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef _USB_RING_H
+#define _USB_RING_H
+
+/*
+ * Single-producer, single-consumer byte ring shared by the class drivers.
+ *
+ * One side runs in the USB interrupt and the other in the main program. The
+ * producer only ever writes head and the consumer only ever writes tail, so no
+ * locking is needed. The Cortex-M3 is a single in-order core, so all that's
+ * needed for ordering is a compiler barrier between reading the other side's
+ * index and touching the data, and between touching the data and publishing
+ * the new index.
+ *
+ * The size must be a power of 2, and one byte is always left free to tell a
+ * full ring from an empty one. head and tail can be handed directly to
+ * usb_generic_send_from_circular_buffer() and
+ * usb_generic_read_to_circular_buffer().
+ *
+ * Apart from the libmaple integer types, this only depends on the C library,
+ * so it can be tested and benchmarked on a host by defining USB_RING_HOST.
+ */
+
+#ifdef USB_RING_HOST
+#include <stdint.h>
+typedef uint8_t uint8;
+typedef uint32_t uint32;
+#else
+#include <libmaple/libmaple_types.h>
+#endif
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct usb_ring {
+    volatile uint8* buf;
+    uint32 size; // power of 2
+    volatile uint32 head; // written only by the producer
+    volatile uint32 tail; // written only by the consumer
+} usb_ring;
+
+// define a static ring with its own storage; size must be a constant power of 2
+#define USB_RING(name, size) \
+    typedef char name##_size_must_be_power_of_2[((size) & ((size)-1)) == 0 && (size) > 1 ? 1 : -1]; \
+    static volatile uint8 name##_buffer[size]; \
+    static usb_ring name = { name##_buffer, (size), 0, 0 }
+
+#ifdef USB_RING_HOST
+// a host may run the two sides on different cores, and its memory model may be weaker than x86's
+#define usb_ring_barrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+#define usb_ring_barrier() __asm__ volatile ("" ::: "memory")
+#endif
+
+static inline void usb_ring_init(usb_ring* r, volatile uint8* buf, uint32 size) {
+    r->buf = buf;
+    r->size = size;
+    r->head = 0;
+    r->tail = 0;
+}
+
+// only when neither side is active, e.g., on USB reset
+static inline void usb_ring_clear(usb_ring* r) {
+    r->head = 0;
+    r->tail = 0;
+}
+
+static inline uint32 usb_ring_available(const usb_ring* r) {
+    return (r->head - r->tail) & (r->size - 1);
+}
+
+static inline uint32 usb_ring_free(const usb_ring* r) {
+    return r->size - 1 - usb_ring_available(r);
+}
+
+static inline uint32 usb_ring_capacity(const usb_ring* r) {
+    return r->size - 1;
+}
+
+/*
+ * Contiguous regions for zero-copy use: usb_ring_write_span() returns where the
+ * producer can write up to *lenP bytes without wrapping, and
+ * usb_ring_commit_write() publishes them. Likewise for the consumer.
+ */
+static inline uint8* usb_ring_write_span(const usb_ring* r, uint32* lenP) {
+    uint32 head = r->head;
+    uint32 free = usb_ring_free(r);
+    usb_ring_barrier(); // index before data
+    uint32 span = r->size - head;
+    *lenP = span < free ? span : free;
+    return (uint8*)r->buf + head;
+}
+
+static inline void usb_ring_commit_write(usb_ring* r, uint32 len) {
+    usb_ring_barrier(); // data before index
+    r->head = (r->head + len) & (r->size - 1);
+}
+
+static inline const uint8* usb_ring_read_span(const usb_ring* r, uint32* lenP) {
+    uint32 tail = r->tail;
+    uint32 available = usb_ring_available(r);
+    usb_ring_barrier(); // index before data
+    uint32 span = r->size - tail;
+    *lenP = span < available ? span : available;
+    return (const uint8*)r->buf + tail;
+}
+
+static inline void usb_ring_commit_read(usb_ring* r, uint32 len) {
+    usb_ring_barrier(); // finish reading before the producer may overwrite
+    r->tail = (r->tail + len) & (r->size - 1);
+}
+
+// returns the number of bytes actually pushed
+static inline uint32 usb_ring_push(usb_ring* r, const uint8* data, uint32 len) {
+    uint32 head = r->head;
+    uint32 free = usb_ring_free(r);
+    usb_ring_barrier(); // index before data
+    if (len > free)
+        len = free;
+    uint32 span = r->size - head;
+    if (span > len)
+        span = len;
+    memcpy((uint8*)r->buf + head, data, span);
+    memcpy((uint8*)r->buf, data + span, len - span);
+    usb_ring_commit_write(r, len);
+    return len;
+}
+
+// copies up to len bytes starting offset bytes past the tail, without consuming them
+static inline uint32 usb_ring_peek(const usb_ring* r, uint32 offset, uint8* data, uint32 len) {
+    uint32 available = usb_ring_available(r);
+    usb_ring_barrier(); // index before data
+    if (offset >= available)
+        return 0;
+    if (len > available - offset)
+        len = available - offset;
+    uint32 start = (r->tail + offset) & (r->size - 1);
+    uint32 span = r->size - start;
+    if (span > len)
+        span = len;
+    memcpy(data, (const uint8*)r->buf + start, span);
+    memcpy(data + span, (const uint8*)r->buf, len - span);
+    usb_ring_barrier();
+    return len;
+}
+
+// -1 if empty
+static inline int usb_ring_peek_byte(const usb_ring* r) {
+    if (usb_ring_available(r) == 0)
+        return -1;
+    usb_ring_barrier(); // index before data
+    return r->buf[r->tail];
+}
+
+static inline uint32 usb_ring_pop(usb_ring* r, uint8* data, uint32 len) {
+    len = usb_ring_peek(r, 0, data, len);
+    usb_ring_commit_read(r, len);
+    return len;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
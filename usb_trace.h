@@ -0,0 +1,152 @@
+#ifndef _USB_TRACE_H
+#define _USB_TRACE_H
+
+/*
+ * Fixed-size trace of what the USB interrupt saw, for when enumeration or a
+ * transfer hangs.
+ *
+ * Each event claims the next slot with an atomic increment (LDREX/STREX on
+ * the Cortex-M3), so the interrupt and main program code can both record
+ * without locks or masking interrupts. Once the ring is full, the oldest
+ * entries are overwritten. A snapshot should be taken with the writers held
+ * off (usb_generic_trace_snapshot() masks the USB interrupt), since an entry
+ * that is being written when it is copied may come out torn.
+ *
+ * On the board, timestamps are Cortex-M3 cycle counts. Like usb_ring.h, this
+ * only depends on the C library otherwise, so it can be used on a host by
+ * defining USB_TRACE_HOST, in which case timestamps are in microseconds.
+ * Either can be overridden by defining USB_TRACE_TIMESTAMP() and
+ * USB_TRACE_TICKS_PER_SECOND before including this.
+ *
+ * scripts/usbtrace.py turns a serialized snapshot into a timeline and
+ * latency histograms.
+ */
+
+#ifdef USB_TRACE_HOST
+#include <stdint.h>
+#include <time.h>
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+#ifndef USB_TRACE_TIMESTAMP
+static inline uint32 usb_trace_host_microseconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint32)(t.tv_sec * 1000000u + t.tv_nsec / 1000);
+}
+#define USB_TRACE_TIMESTAMP() usb_trace_host_microseconds()
+#define USB_TRACE_TICKS_PER_SECOND 1000000u
+#endif
+#else
+#include <libmaple/libmaple_types.h>
+#ifndef USB_TRACE_TIMESTAMP
+#define USB_TRACE_TIMESTAMP() (*(volatile uint32*)0xE0001004) // DWT_CYCCNT
+#define USB_TRACE_TICKS_PER_SECOND ((uint32)F_CPU) // set by the board definitions
+#endif
+#endif
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// must stay in sync with scripts/usbtrace.py
+enum USB_TRACE_EVENTS {
+    USB_TRACE_RESET = 1,
+    USB_TRACE_DATA_SETUP,       // endpoint = bRequest, length = wLength
+    USB_TRACE_NO_DATA_SETUP,    // endpoint = bRequest, length = wValue
+    USB_TRACE_SETUP_REJECTED,   // the class didn't support the preceding setup request
+    USB_TRACE_GET_DESCRIPTOR,   // endpoint = descriptor type, length = wLength
+    USB_TRACE_CONTROL_TX,       // an endpoint 0 data packet of length bytes being sent
+    USB_TRACE_CONTROL_RX,       // an endpoint 0 data packet of length bytes received
+    USB_TRACE_SET_CONFIGURATION, // length = configuration
+    USB_TRACE_IN,               // TX completion callback on endpoint
+    USB_TRACE_OUT,              // RX callback on endpoint
+    USB_TRACE_TX_QUEUED,        // length bytes handed to the hardware for sending
+    USB_TRACE_RX_READ,          // length bytes taken from a received packet
+    USB_TRACE_USER = 0x80       // and above: free for the application
+};
+
+typedef struct usb_trace_entry {
+    uint32 timestamp;
+    uint8 event;
+    uint8 endpoint;
+    uint16 length;
+} usb_trace_entry;
+
+typedef struct usb_trace {
+    usb_trace_entry* entries;
+    uint32 size; // power of 2
+    volatile uint32 count; // events ever recorded; the next one goes to count % size
+} usb_trace;
+
+// define a static trace with its own storage; size must be a constant power of 2
+#define USB_TRACE(name, size) \
+    typedef char name##_size_must_be_power_of_2[((size) & ((size)-1)) == 0 && (size) > 1 ? 1 : -1]; \
+    static usb_trace_entry name##_entries[size]; \
+    static usb_trace name = { name##_entries, (size), 0 }
+
+static inline void usb_trace_record(usb_trace* t, uint8 event, uint8 endpoint, uint16 length) {
+    uint32 timestamp = USB_TRACE_TIMESTAMP();
+    usb_trace_entry* e = &t->entries[__atomic_fetch_add(&t->count, 1, __ATOMIC_RELAXED) & (t->size - 1)];
+    e->timestamp = timestamp;
+    e->event = event;
+    e->endpoint = endpoint;
+    e->length = length;
+}
+
+static inline void usb_trace_clear(usb_trace* t) {
+    t->count = 0;
+}
+
+// copies up to maxEntries of the newest entries, oldest first; returns the number copied
+static inline uint32 usb_trace_snapshot(const usb_trace* t, usb_trace_entry* out, uint32 maxEntries, uint32* countP) {
+    uint32 count = t->count;
+    uint32 n = count < t->size ? count : t->size;
+    if (n > maxEntries)
+        n = maxEntries;
+    for (uint32 i = 0 ; i < n ; i++)
+        out[i] = t->entries[(count - n + i) & (t->size - 1)];
+    if (countP != NULL)
+        *countP = count;
+    return n;
+}
+
+#define USB_TRACE_SERIALIZED_SIZE(numEntries) (10+(numEntries)*8)
+
+/*
+ * Serialized form, all little-endian: a version byte (1), u32 ticks per
+ * second, u32 events ever recorded (so lost ones can be counted), a byte
+ * with the number of entries that follow (up to 255) and then for each
+ * entry a u32 timestamp, event byte, endpoint byte and u16 length.
+ * Returns the number of bytes written, or 0 if maxLength is too small.
+ */
+static inline uint32 usb_trace_serialize(const usb_trace_entry* entries, uint32 n, uint32 count, uint8* out, uint32 maxLength) {
+    if (n > 255)
+        n = 255;
+    if (maxLength < USB_TRACE_SERIALIZED_SIZE(n))
+        return 0;
+    uint32 header[2] = { USB_TRACE_TICKS_PER_SECOND, count };
+    uint8* p = out;
+    *p++ = 1;
+    for (uint32 i = 0 ; i < 2 ; i++) {
+        for (uint32 j = 0 ; j < 4 ; j++)
+            *p++ = (uint8)(header[i] >> (8*j));
+    }
+    *p++ = (uint8)n;
+    for (uint32 i = 0 ; i < n ; i++) {
+        for (uint32 j = 0 ; j < 4 ; j++)
+            *p++ = (uint8)(entries[i].timestamp >> (8*j));
+        *p++ = entries[i].event;
+        *p++ = entries[i].endpoint;
+        *p++ = (uint8)entries[i].length;
+        *p++ = (uint8)(entries[i].length >> 8);
+    }
+    return p - out;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
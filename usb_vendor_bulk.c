@@ -0,0 +1,211 @@
+/*
+ * Vendor-specific bulk pipe; see usb_vendor_bulk.h.
+ */
+
+#include "usb_vendor_bulk.h"
+#include "usb_generic.h"
+#include "usb_ring.h"
+#include <string.h>
+#include <libmaple/usb.h>
+
+/* Private headers */
+#include "usb_lib_globals.h"
+#include "usb_reg_map.h"
+
+/* usb_lib headers */
+#include "usb_type.h"
+#include "usb_core.h"
+#include "usb_def.h"
+
+#define VENDOR_BULK_ENDPOINT_TX 0
+#define VENDOR_BULK_ENDPOINT_RX 1
+#define USB_VENDOR_BULK_TX_ENDPOINT_INFO (&vendorBulkEndpoints[VENDOR_BULK_ENDPOINT_TX])
+#define USB_VENDOR_BULK_RX_ENDPOINT_INFO (&vendorBulkEndpoints[VENDOR_BULK_ENDPOINT_RX])
+
+static void vendorBulkUSBInit(void);
+static void vendorBulkUSBReset(void);
+static void vendorBulkDataTxCb(void);
+static void vendorBulkDataRxCb(void);
+
+typedef struct {
+    usb_descriptor_interface     	Data_Interface;
+    usb_descriptor_endpoint      	DataOutEndpoint;
+    usb_descriptor_endpoint      	DataInEndpoint;
+} __packed vendor_bulk_part_config;
+USB_GENERIC_CHECK_DESCRIPTOR_SIZE(vendor_bulk_part_config);
+
+static const vendor_bulk_part_config vendorBulkPartConfigData = {
+    .Data_Interface = {
+        .bLength            = sizeof(usb_descriptor_interface),
+        .bDescriptorType    = USB_DESCRIPTOR_TYPE_INTERFACE,
+        .bInterfaceNumber   = 0x00, // PATCH
+        .bAlternateSetting  = 0x00,
+        .bNumEndpoints      = 0x02,
+        .bInterfaceClass    = 0xFF, // vendor specific
+        .bInterfaceSubClass = 0x00,
+        .bInterfaceProtocol = 0x00,
+        .iInterface         = 0x00, // PATCH
+    },
+
+    .DataOutEndpoint = {
+        .bLength          = sizeof(usb_descriptor_endpoint),
+        .bDescriptorType  = USB_DESCRIPTOR_TYPE_ENDPOINT,
+        .bEndpointAddress = (USB_DESCRIPTOR_ENDPOINT_OUT | 0), // PATCH
+        .bmAttributes     = USB_EP_TYPE_BULK,
+        .wMaxPacketSize   = USB_VENDOR_BULK_PACKET_SIZE,
+        .bInterval        = 0x00,
+    },
+
+    .DataInEndpoint = {
+        .bLength          = sizeof(usb_descriptor_endpoint),
+        .bDescriptorType  = USB_DESCRIPTOR_TYPE_ENDPOINT,
+        .bEndpointAddress = (USB_DESCRIPTOR_ENDPOINT_IN | 0), // PATCH
+        .bmAttributes     = USB_EP_TYPE_BULK,
+        .wMaxPacketSize   = USB_VENDOR_BULK_PACKET_SIZE,
+        .bInterval        = 0x00,
+    }
+};
+
+// double-buffered, so the hardware can take a packet while software fills or drains the other one
+static USBEndpointInfo vendorBulkEndpoints[2] = {
+    {
+        .callback = vendorBulkDataTxCb,
+        .pmaSize = 2*USB_VENDOR_BULK_PACKET_SIZE,
+        .type = USB_GENERIC_ENDPOINT_TYPE_BULK,
+        .tx = 1,
+        .doubleBuffer = 1,
+    },
+    {
+        .callback = vendorBulkDataRxCb,
+        .pmaSize = 2*USB_VENDOR_BULK_PACKET_SIZE,
+        .type = USB_GENERIC_ENDPOINT_TYPE_BULK,
+        .tx = 0,
+        .doubleBuffer = 1,
+    },
+};
+
+static const char* vendorBulkName = NULL;
+static uint8 vendorBulkNameIndex = 0;
+
+#define OUT_BYTE(s,v) out[(uint8*)&(s.v)-(uint8*)&s]
+
+static void getVendorBulkPartDescriptor(uint8* out) {
+    memcpy(out, &vendorBulkPartConfigData, sizeof(vendor_bulk_part_config));
+
+    // patch to reflect where the part goes in the descriptor
+    OUT_BYTE(vendorBulkPartConfigData, Data_Interface.bInterfaceNumber) += usbVendorBulkPart.startInterface;
+    OUT_BYTE(vendorBulkPartConfigData, Data_Interface.iInterface) = vendorBulkNameIndex;
+    OUT_BYTE(vendorBulkPartConfigData, DataOutEndpoint.bEndpointAddress) += USB_VENDOR_BULK_RX_ENDPOINT_INFO->address;
+    OUT_BYTE(vendorBulkPartConfigData, DataInEndpoint.bEndpointAddress) += USB_VENDOR_BULK_TX_ENDPOINT_INFO->address;
+}
+
+USBCompositePart usbVendorBulkPart = {
+    .numInterfaces = 1,
+    .numEndpoints = sizeof(vendorBulkEndpoints)/sizeof(*vendorBulkEndpoints),
+    .descriptorSize = sizeof(vendor_bulk_part_config),
+    .getPartDescriptor = getVendorBulkPartDescriptor,
+    .usbInit = vendorBulkUSBInit,
+    .usbReset = vendorBulkUSBReset,
+    .endpoints = vendorBulkEndpoints,
+    .winUSBGUID = USB_VENDOR_BULK_WINUSB_GUID
+};
+
+static usb_ring vendorBulkRx;
+static usb_ring vendorBulkTx;
+static volatile int8 transmitting = -1;
+static void (*txDoneCallback)(void) = NULL;
+
+void vendor_bulk_set_buffers(uint8* rxBuffer, uint32 rxSize, uint8* txBuffer, uint32 txSize) {
+    usb_ring_init(&vendorBulkRx, rxBuffer, rxSize);
+    usb_ring_init(&vendorBulkTx, txBuffer, txSize);
+}
+
+// interface name shown by the host (UTF-8); must stay valid, and be set before the device is enabled
+void vendor_bulk_set_name(const char* name) {
+    vendorBulkName = name;
+}
+
+// the "{...}" interface GUID host programs look for; set before the device is enabled
+void vendor_bulk_set_guid(const char* guid) {
+    usbVendorBulkPart.winUSBGUID = guid != NULL ? guid : USB_VENDOR_BULK_WINUSB_GUID;
+}
+
+// called from the USB interrupt whenever everything queued has been taken by the host
+void vendor_bulk_set_tx_done_callback(void (*callback)(void)) {
+    txDoneCallback = callback;
+}
+
+static void vendorBulkUSBInit(void) {
+    vendorBulkNameIndex = vendorBulkName != NULL ? usb_generic_add_string(vendorBulkName) : 0;
+}
+
+static void vendorBulkUSBReset(void) {
+    usb_ring_clear(&vendorBulkRx);
+    usb_ring_clear(&vendorBulkTx);
+    transmitting = -1;
+}
+
+/* Non-blocking: queues as much of buf as fits and returns the number of bytes queued. */
+uint32 vendor_bulk_tx(const uint8* buf, uint32 len) {
+    if (len == 0)
+        return 0;
+    len = usb_ring_push(&vendorBulkTx, buf, len);
+    if (len > 0)
+        usb_generic_start_tx(vendorBulkDataTxCb, &transmitting);
+    return len;
+}
+
+uint32 vendor_bulk_rx(uint8* buf, uint32 len) {
+    len = usb_ring_pop(&vendorBulkRx, buf, len);
+    // the endpoint NAKs while the ring can't take both of its buffers
+    if (usb_ring_free(&vendorBulkRx) >= USB_VENDOR_BULK_RX_ENDPOINT_INFO->pmaSize)
+        usb_generic_enable_rx(USB_VENDOR_BULK_RX_ENDPOINT_INFO);
+    return len;
+}
+
+uint32 vendor_bulk_peek(uint8* buf, uint32 len) {
+    return usb_ring_peek(&vendorBulkRx, 0, buf, len);
+}
+
+int vendor_bulk_peek_char(void) {
+    return usb_ring_peek_byte(&vendorBulkRx);
+}
+
+uint32 vendor_bulk_data_available(void) {
+    return usb_ring_available(&vendorBulkRx);
+}
+
+uint32 vendor_bulk_tx_free(void) {
+    return usb_ring_free(&vendorBulkTx);
+}
+
+uint32 vendor_bulk_get_pending(void) {
+    return usb_ring_available(&vendorBulkTx);
+}
+
+/* 1 until everything queued has been taken by the host */
+uint8 vendor_bulk_is_transmitting(void) {
+    return transmitting >= 0 || usb_ring_available(&vendorBulkTx) > 0;
+}
+
+static void vendorBulkDataTxCb(void) {
+    int8 wasTransmitting = transmitting;
+    usb_generic_send_from_circular_buffer(USB_VENDOR_BULK_TX_ENDPOINT_INFO,
+        vendorBulkTx.buf, vendorBulkTx.size, vendorBulkTx.head, &vendorBulkTx.tail, &transmitting);
+
+    if (wasTransmitting >= 0 && transmitting < 0 && txDoneCallback != NULL)
+        txDoneCallback();
+}
+
+static void vendorBulkDataRxCb(void) {
+    usb_generic_read_to_circular_buffer(USB_VENDOR_BULK_RX_ENDPOINT_INFO,
+        vendorBulkRx.buf, vendorBulkRx.size, &vendorBulkRx.head);
+
+    if (usb_ring_free(&vendorBulkRx) >= USB_VENDOR_BULK_RX_ENDPOINT_INFO->pmaSize) {
+        usb_generic_enable_rx(USB_VENDOR_BULK_RX_ENDPOINT_INFO);
+    }
+    else {
+        USB_GENERIC_COUNT(USB_VENDOR_BULK_RX_ENDPOINT_INFO, rxFull);
+    }
+    USB_GENERIC_HIGH_WATER(USB_VENDOR_BULK_RX_ENDPOINT_INFO, usb_ring_available(&vendorBulkRx));
+}
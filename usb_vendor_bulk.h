@@ -0,0 +1,44 @@
+#ifndef _USB_VENDOR_BULK_H_
+#define _USB_VENDOR_BULK_H_
+
+/*
+ * A vendor-specific interface with one double-buffered bulk endpoint in each
+ * direction and nothing else: no class requests, no line coding, just bytes.
+ * It carries Microsoft OS 2.0 descriptors, so Windows binds WinUSB to it, and
+ * elsewhere libusb can open it directly.
+ */
+
+#include <libmaple/libmaple_types.h>
+#include <libmaple/usb.h>
+#include "usb_generic.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USB_VENDOR_BULK_PACKET_SIZE 64
+#define USB_VENDOR_BULK_DEFAULT_BUFFER_SIZE 1024 // must be a power of 2
+#define USB_VENDOR_BULK_WINUSB_GUID "{E845B45A-0F3C-4EFC-A890-8A23CC69F3B7}"
+
+extern USBCompositePart usbVendorBulkPart;
+
+// the buffers must stay valid, with sizes powers of 2 greater than 2*USB_VENDOR_BULK_PACKET_SIZE
+void vendor_bulk_set_buffers(uint8* rxBuffer, uint32 rxSize, uint8* txBuffer, uint32 txSize);
+void vendor_bulk_set_name(const char* name);
+void vendor_bulk_set_guid(const char* guid);
+
+uint32 vendor_bulk_tx(const uint8* buf, uint32 len);
+uint32 vendor_bulk_rx(uint8* buf, uint32 len);
+uint32 vendor_bulk_peek(uint8* buf, uint32 len);
+int vendor_bulk_peek_char(void);
+uint32 vendor_bulk_data_available(void); /* in RX buffer */
+uint32 vendor_bulk_tx_free(void);
+uint32 vendor_bulk_get_pending(void);
+uint8 vendor_bulk_is_transmitting(void);
+void vendor_bulk_set_tx_done_callback(void (*callback)(void));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
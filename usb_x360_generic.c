@@ -289,8 +289,14 @@ static volatile struct controller_data {
     uint8* hidBufferRx;
     uint32 n_unsent_bytes;
     uint8 transmitting;
+    // one report can wait behind the one being sent
+    uint8 pendingReport[USB_X360_TX_EPSIZE];
+    uint8 pendingLength;
+    uint8 hasPending;
     void (*rumble_callback)(uint8 left, uint8 right);
     void (*led_callback)(uint8 pattern);
+    void (*tx_done_callback)(void);
+    uint32 rxLength;
 } controllers[USB_X360_MAX_CONTROLLERS] = {{0}};
 
 static void x360_clear(void) {
@@ -307,6 +313,7 @@ void x360_generic_initialize_controller_data(uint32 _numControllers, uint8* buff
         buffers += USB_X360_RX_EPSIZE;
         c->rumble_callback = NULL;
         c->led_callback = NULL;
+        c->tx_done_callback = NULL;
     }
     
     usbX360Part.numInterfaces = NUM_INTERFACES * x360_num_controllers;
@@ -330,45 +337,79 @@ uint8 x360_is_transmitting(uint32 controller) {
     return controllers[controller].transmitting;
 }
 
-/* This function is non-blocking.
- *
- * It copies data from a usercode buffer into the USB peripheral TX
- * buffer, and returns the number of bytes copied. */
-uint32 x360_tx(uint32 controller, const uint8* buf, uint32 len) {
+/* 1 if x360_tx() can't take another report until the host catches up */
+uint8 x360_tx_queue_full(uint32 controller) {
+    return controllers[controller].hasPending;
+}
+
+/* called from the USB interrupt whenever everything queued has been taken */
+void x360_set_tx_done_callback(uint32 controller, void (*callback)(void)) {
+    controllers[controller].tx_done_callback = callback;
+}
+
+static uint32 x360_send_now(uint32 controller, const uint8* buf, uint32 len) {
     volatile struct controller_data* c = &controllers[controller];
     
-    /* Last transmission hasn't finished, so abort. */
-    if (x360_is_transmitting(controller)) {
+    uint32* pma = usb_generic_tx_reserve(USB_X360_TX_ENDPOINT_INFO(controller), len);
+    if (pma == NULL) {
         return 0;
     }
 
-    /* We can only put USB_X360_TX_EPSIZE bytes in the buffer. */
-    if (len > USB_X360_TX_EPSIZE) {
-        len = USB_X360_TX_EPSIZE;
-    }
-
     /* Queue bytes for sending. */
     if (len) {
-        usb_copy_to_pma_ptr(buf, len, USB_X360_TX_PMA_PTR(controller));
+        usb_copy_to_pma_ptr(buf, len, pma);
     }
     // We still need to wait for the interrupt, even if we're sending
     // zero bytes. (Sending zero-size packets is useful for flushing
     // host-side buffers.)
     c->n_unsent_bytes = len;
     c->transmitting = 1;
-    usb_generic_set_tx(USB_X360_TX_ENDPOINT_INFO(controller), len);
+    usb_generic_tx_commit(USB_X360_TX_ENDPOINT_INFO(controller), len);
 
     return len;
 }
 
-static void x360DataRxCb(uint32 controller)
-{
+/* This function is non-blocking.
+ *
+ * It copies data from a usercode buffer into the USB peripheral TX
+ * buffer, or queues it behind the report being sent, and returns the
+ * number of bytes copied (0 if the queue is full). */
+uint32 x360_tx(uint32 controller, const uint8* buf, uint32 len) {
     volatile struct controller_data* c = &controllers[controller];
-    USBEndpointInfo* ep = USB_X360_RX_ENDPOINT_INFO(controller);
     
-    volatile uint8* hidBufferRx = c->hidBufferRx;
+    /* We can only put USB_X360_TX_EPSIZE bytes in the buffer. */
+    if (len > USB_X360_TX_EPSIZE) {
+        len = USB_X360_TX_EPSIZE;
+    }
+
+    usb_generic_disable_interrupts_ep0();
+    
+    if (! c->transmitting) {
+        len = x360_send_now(controller, buf, len);
+    }
+    else if (! c->hasPending) {
+        /* Sent from the completion interrupt of the current report. */
+        if (len)
+            memcpy((void*)c->pendingReport, buf, len);
+        c->pendingLength = len;
+        c->hasPending = 1;
+    }
+    else {
+        len = 0;
+    }
     
-    uint32 ep_rx_size = usb_generic_read_to_buffer(ep, hidBufferRx, USB_X360_RX_EPSIZE);
+    usb_generic_enable_interrupts_ep0();
+
+    return len;
+}
+
+// the endpoint stays NAKing until the callbacks have seen the packet
+static void x360HandleRx(void* data)
+{
+    uint32 controller = (uint32)data;
+    volatile struct controller_data* c = &controllers[controller];
+    volatile uint8* hidBufferRx = c->hidBufferRx;
+    uint32 ep_rx_size = c->rxLength;
 
     if (ep_rx_size == 3) { // wired
         if (c->led_callback != NULL && hidBufferRx[0] == 1 && hidBufferRx[1] == 3)
@@ -385,7 +426,15 @@ static void x360DataRxCb(uint32 controller)
             c->rumble_callback(hidBufferRx[5],hidBufferRx[6]);
     } 
     
-    usb_generic_enable_rx(ep);
+    usb_generic_enable_rx(USB_X360_RX_ENDPOINT_INFO(controller));
+}
+
+static void x360DataRxCb(uint32 controller)
+{
+    volatile struct controller_data* c = &controllers[controller];
+    
+    c->rxLength = usb_generic_read_to_buffer(USB_X360_RX_ENDPOINT_INFO(controller), c->hidBufferRx, USB_X360_RX_EPSIZE);
+    usb_generic_defer(x360HandleRx, (void*)controller);
 }
 
 /*
@@ -397,6 +446,14 @@ static void x360DataTxCb(uint32 controller) {
     
     c->n_unsent_bytes = 0;
     c->transmitting = 0;
+    
+    if (c->hasPending) {
+        x360_send_now(controller, (const uint8*)c->pendingReport, c->pendingLength);
+        c->hasPending = 0;
+    }
+    else if (c->tx_done_callback != NULL) {
+        c->tx_done_callback();
+    }
 }
 
 
@@ -406,6 +463,7 @@ static void x360Reset(void) {
         volatile struct controller_data* c = &controllers[i];
         c->n_unsent_bytes = 0;
         c->transmitting = 0;
+        c->hasPending = 0;
     }
 }
 
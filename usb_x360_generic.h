@@ -60,6 +60,8 @@ extern USBCompositePart usbX360Part;
 
 uint32 x360_tx(uint32 controller, const uint8* buf, uint32 len);
 uint8 x360_is_transmitting(uint32 controller);
+uint8 x360_tx_queue_full(uint32 controller);
+void x360_set_tx_done_callback(uint32 controller, void (*callback)(void));
 void x360_set_rumble_callback(uint32 controller, void (*callback)(uint8 left, uint8 right));
 void x360_set_led_callback(uint32 controller, void (*callback)(uint8 pattern));
 void x360_generic_initialize_controller_data(uint32 _numControllers, uint8* buffers);